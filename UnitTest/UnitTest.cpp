@@ -193,6 +193,18 @@ namespace UnitTest
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(datagram_index) {
+			int ret = quicrq_datagram_index_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(stream_index) {
+			int ret = quicrq_stream_index_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(twomedia)
 		{
 			int ret = quicrq_twomedia_test();
@@ -262,6 +274,18 @@ namespace UnitTest
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(proto_datagram_header) {
+			int ret = proto_datagram_header_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(proto_source_lookup) {
+			int ret = proto_source_lookup_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(relay_basic) {
 			int ret = quicrq_relay_basic_test();
 
@@ -328,6 +352,18 @@ namespace UnitTest
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(subscribe_prefix_trie) {
+			int ret = quicrq_subscribe_prefix_trie_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(subscribe_relay_unsubscribe) {
+			int ret = quicrq_subscribe_relay_unsubscribe_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(triangle_basic) {
 			int ret = quicrq_triangle_basic_test();
 
@@ -548,6 +584,30 @@ namespace UnitTest
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(twoways_warp) {
+			int ret = quicrq_twoways_warp_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(twoways_warp_loss) {
+			int ret = quicrq_twoways_warp_loss_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(twoways_rush) {
+			int ret = quicrq_twoways_rush_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(twoways_rush_loss) {
+			int ret = quicrq_twoways_rush_loss_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(threelegs_basic) {
 			int ret = quicrq_threelegs_basic_test();
 
@@ -601,6 +661,127 @@ namespace UnitTest
 
 			Assert::AreEqual(ret, 0);
 		}
+
+		TEST_METHOD(fragment_cache_bench) {
+			int ret = quicrq_fragment_cache_bench_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_slab) {
+			int ret = quicrq_fragment_cache_slab_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_purge) {
+			int ret = quicrq_fragment_cache_purge_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_deferred_release) {
+			int ret = quicrq_fragment_cache_deferred_release_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_memory_limit) {
+			int ret = quicrq_fragment_cache_memory_limit_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_source_delete) {
+			int ret = quicrq_fragment_cache_source_delete_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_stream_send_bench) {
+			int ret = quicrq_fragment_stream_send_bench_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_stream_send) {
+			int ret = quicrq_fragment_stream_send_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_append) {
+			int ret = quicrq_fragment_cache_append_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_ranges) {
+			int ret = quicrq_fragment_cache_ranges_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fragment_cache_readers) {
+			int ret = quicrq_fragment_cache_readers_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(datagram_scheduler) {
+			int ret = quicrq_datagram_scheduler_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(datagram_fec) {
+			int ret = quicrq_datagram_fec_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(datagram_bundle) {
+			int ret = quicrq_datagram_bundle_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(extra_repeat_heap) {
+			int ret = quicrq_extra_repeat_heap_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(track_set) {
+			int ret = quicrq_track_set_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(latency_budget) {
+			int ret = quicrq_latency_budget_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(group_truncated) {
+			int ret = quicrq_group_truncated_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(object_ttl) {
+			int ret = quicrq_object_ttl_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(repair_request) {
+			int ret = quicrq_repair_request_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(get_addr) {
 			int ret = quicrq_get_addr_test();
 
@@ -687,6 +868,18 @@ namespace UnitTest
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(rush_relay) {
+			int ret = quicrq_rush_relay_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(rush_relay_loss) {
+			int ret = quicrq_rush_relay_loss_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
 		TEST_METHOD(rush_triangle) {
 			int ret = quicrq_triangle_rush_test();
 
@@ -716,5 +909,11 @@ namespace UnitTest
 
 			Assert::AreEqual(ret, 0);
 		}
+
+		TEST_METHOD(congestion_epoch) {
+			int ret = quicrq_congestion_epoch_test();
+
+			Assert::AreEqual(ret, 0);
+		}
     };
 }
@@ -14,7 +14,7 @@ extern "C" {
  * The minor version is updated when the protocol changes
  * Only the letter is updated if the code changes without changing the protocol
  */
-#define QUICRQ_VERSION "0.30"
+#define QUICRQ_VERSION "0.31"
 
 /* QUICR ALPN and QUICR port
  * For version zero, the ALPN is set to "quicr-h<minor>", where <minor> is
@@ -22,13 +22,15 @@ extern "C" {
  * different protocol versions will not be compatible, and connections attempts
  * between such binaries will fail, forcing deployments of compatible versions.
  */
-#define QUICRQ_ALPN "quicr-h30"
+#define QUICRQ_ALPN "quicr-h31"
 #define QUICRQ_PORT 853
 
 /* QUICR error codes */
 #define QUICRQ_ERROR_NO_ERROR 0x00
 #define QUICRQ_ERROR_INTERNAL 0x01
 #define QUICRQ_ERROR_PROTOCOL 0x02
+#define QUICRQ_ERROR_GROUP_TRUNCATED 0x03 /* Warp group stream reset because its last objects were dropped */
+#define QUICRQ_ERROR_OBJECT_EXPIRED 0x04 /* Rush object stream reset because the object TTL expired */
 
 /* Media close error codes. */
 typedef enum {
@@ -90,6 +92,19 @@ void quicrq_init_transport_parameters(picoquic_tp_t* tp, int client_mode);
 #define QUICRQ_CACHE_INITIAL_DURATION 30000000
 
 void quicrq_set_cache_duration(quicrq_ctx_t* qr_ctx, uint64_t cache_duration_max);
+
+/* Cache memory budget.
+ * The memory used by all the media caches of a context is accounted for,
+ * and can be limited using `quicrq_set_cache_memory_limit`. If the value is
+ * set to zero, there is no limit. When the memory reserved by the caches grows
+ * above the budget, `quicrq_time_check` evicts whole groups of objects from
+ * all the caches of the context: first from the least recently read cache,
+ * oldest group first, never evicting the group that a subscriber is currently
+ * reading. If nothing can be evicted, the next attempt waits until the
+ * reserved memory grows again.
+ */
+void quicrq_set_cache_memory_limit(quicrq_ctx_t* qr_ctx, size_t cache_memory_limit);
+size_t quicrq_get_cache_memory_used(quicrq_ctx_t* qr_ctx);
 uint64_t quicrq_time_check(quicrq_ctx_t* qr_ctx, uint64_t current_time);
 
 quicrq_cnx_ctx_t* quicrq_create_cnx_context(quicrq_ctx_t* qr_ctx, picoquic_cnx_t* cnx);
@@ -143,16 +158,30 @@ typedef struct st_quicrq_media_object_header_t {
  *       object ID MUST be set to 0.
  *     * if the group_id matches the previous value, the
  *       object ID MUST be set to previous value + 1.
+ *
+ * The latency budget, in microseconds, applies to all the peers to which the
+ * source sends the media. If an object has been waiting for longer than the
+ * budget, counting the queue delay accumulated in previous relays and the time
+ * spent in the local cache, it is skipped instead of sent. The budget is sent
+ * with the media with a granularity of milliseconds, so relays apply it too.
+ * A value of 0 means no budget.
+ *
+ * The TTL of an object, in microseconds, sets a deadline for sending it in
+ * rush mode. An object that is not yet started when the deadline passes is
+ * skipped, and the stream of an object still being sent is reset, so the
+ * object is treated as skipped by the receivers. A value of 0 means no TTL.
  */
 
 typedef struct st_quicrq_media_object_source_properties_t {
     unsigned int use_real_time_caching : 1;
     uint64_t start_group_id;
     uint64_t start_object_id;
+    uint64_t latency_budget;
 } quicrq_media_object_source_properties_t;
 
 typedef struct st_quicrq_media_object_properties_t {
     uint8_t flags;
+    uint64_t ttl;
 } quicrq_media_object_properties_t;
 
 typedef struct st_quicrq_media_object_source_ctx_t quicrq_media_object_source_ctx_t;
@@ -205,7 +234,10 @@ typedef enum {
     quicrq_media_start_point,
     quicrq_media_final_object_id,
     quicrq_media_real_time_cache,
-    quicrq_media_close
+    quicrq_media_close,
+    quicrq_media_group_truncated,
+    quicrq_media_object_expired,
+    quicrq_media_latency_budget
 } quicrq_media_consumer_enum;
 
 typedef struct st_quicrq_object_stream_consumer_properties_t {
@@ -239,10 +271,16 @@ typedef enum {
     quicrq_subscribe_intent_start_point = 2
 } quicrq_subscribe_intent_enum;
 
+/* The latency budget, in microseconds, asks the sender to skip the objects that
+ * have been waiting for longer than the budget, instead of sending them late.
+ * It is sent with the request with a granularity of milliseconds. A value of 0
+ * means no budget.
+ */
 typedef struct st_quicrq_subscribe_intent_t {
     quicrq_subscribe_intent_enum intent_mode;
     uint64_t start_group_id;
     uint64_t start_object_id;
+    uint64_t latency_budget;
 } quicrq_subscribe_intent_t;
 
 quicrq_object_stream_consumer_ctx* quicrq_subscribe_object_stream(quicrq_cnx_ctx_t* cnx_ctx,
@@ -319,6 +357,42 @@ void quicrq_set_extra_repeat(quicrq_ctx_t* qr, int on_nack, int after_delayed);
 void quicrq_set_extra_repeat_delay(quicrq_ctx_t* qr, uint64_t delay_in_microseconds);
 uint64_t quicrq_handle_extra_repeat(quicrq_ctx_t* qr, uint64_t current_time);
 
+/* Forward error correction for datagrams
+ *
+ * Instead of repeating individual fragments, a sender can protect the
+ * media sent as datagrams with repair datagrams. Each repair datagram
+ * protects a window of up to `nb_sources_per_repair` fragments of the
+ * same group, and lets the receiver rebuild one lost fragment in that
+ * window without waiting for a retransmission. The overhead is about
+ * one datagram per window, i.e., 25% if the window is set to 4.
+ * The window is limited to 16 fragments. Setting it to 0 disables
+ * FEC (this is the default.) Receivers always process repair datagrams.
+ * When FEC is enabled, it replaces the extra repeats: the sender does not
+ * schedule extra copies of the fragments, whatever the setting of
+ * `quicrq_set_extra_repeat`.
+ */
+void quicrq_set_datagram_fec(quicrq_ctx_t* qr, size_t nb_sources_per_repair);
+
+/* Datagram bundling
+ *
+ * Small objects, such as audio frames, cost a full datagram each. When
+ * bundling is enabled, a sender packs several fragments, possibly from
+ * different media on the same connection, in a single datagram if the
+ * space allows. This reduces the number of packets sent per second.
+ * Bundling is disabled by default. Receivers always process bundles.
+ */
+void quicrq_set_datagram_bundling(quicrq_ctx_t* qr, int enable);
+
+/* Compact datagram headers
+ *
+ * The full datagram header repeats the group ID and the object length in
+ * every datagram. When compression is enabled, receivers of datagram media
+ * ask the sender to use a compact header, and senders accept to use it
+ * when asked. Compression is only used if enabled at both ends, and is
+ * negotiated separately for each media stream. It is disabled by default.
+ */
+void quicrq_set_datagram_header_compression(quicrq_ctx_t* qr, int enable);
+
 /* Different modes of congestion control:
  * - None(0)
  * - Delay based(1): skip packets if a queue of more than 5 packets is detected.
@@ -346,6 +420,28 @@ typedef enum {
 
 void quicrq_enable_congestion_control(quicrq_ctx_t* qr, quicrq_congestion_control_enum congestion_control_mode);
 
+/* Congestion trace.
+ * When enabled, delay based congestion control records for each epoch the priority
+ * threshold, the largest queue delay and the number of objects dropped. This is
+ * mostly used in tests. Returns -1 if the trace cannot be allocated.
+ */
+int quicrq_enable_congestion_trace(quicrq_ctx_t* qr, int enable);
+
+/* Track sets.
+ * A track set registers several media, for example the simulcast or SVC layers of a
+ * video, as quality layers of one logical media identified by the track set URL.
+ * Each layer is published under its own URL, with its bitrate in bits per second.
+ * Subscribers of the track set URL receive the highest layer whose bitrate fits the
+ * bandwidth estimate of their connection. In stream mode, the layer is reevaluated
+ * at each group boundary, and the subscriber moves to another layer if that layer
+ * has the first object of the next group, so that the stream remains decodable.
+ * The layers shall use the same group numbering. In datagram and warp modes, the
+ * layer is selected when the subscription starts.
+ * Returns -1 if a track set with the same URL exists or if memory is exhausted.
+ */
+int quicrq_register_track_set(quicrq_ctx_t* qr, const uint8_t* url, size_t url_length, size_t nb_layers,
+    const uint8_t** layer_urls, const size_t* layer_url_lengths, const uint64_t* layer_bitrates);
+
 #ifdef __cplusplus
 }
 #endif
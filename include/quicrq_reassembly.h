@@ -24,6 +24,7 @@ typedef struct st_quicrq_reassembly_context_t {
     uint64_t final_group_id;
     uint64_t final_object_id;
     unsigned int is_finished : 1;
+    unsigned int is_group_truncated : 1; /* The rest of the next group will not arrive */
 } quicrq_reassembly_context_t;
 
 typedef enum {
@@ -64,6 +65,24 @@ int quicrq_reassembly_learn_start_point(quicrq_reassembly_context_t* reassembly_
     uint64_t start_group_id, uint64_t start_object_id, uint64_t current_time,
     quicrq_reassembly_object_ready_fn ready_fn, void* app_media_ctx);
 
+/* Learn that the objects of a group starting at object_id will never arrive,
+ * because the sender truncated the group. A partially received object at that
+ * position is dropped. The missing objects are delivered as placeholders with
+ * flags 0xFF once the number of objects in the group is known. The number of
+ * objects in the previous group is only used if the group is truncated at object 0.
+ */
+int quicrq_reassembly_learn_group_truncated(quicrq_reassembly_context_t* reassembly_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t nb_objects_previous_group, uint64_t current_time,
+    quicrq_reassembly_object_ready_fn ready_fn, void* app_media_ctx);
+
+/* Learn that an object will not be received, because the sender abandoned it
+ * after its deadline passed. A partially received copy of the object is dropped,
+ * and the object is delivered in sequence as a placeholder with flags 0xFF.
+ */
+int quicrq_reassembly_learn_object_expired(quicrq_reassembly_context_t* reassembly_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t nb_objects_previous_group, uint64_t current_time,
+    quicrq_reassembly_object_ready_fn ready_fn, void* app_media_ctx);
+
 /* Obtain the final object ID */
 int quicrq_reassembly_learn_final_object_id(
     quicrq_reassembly_context_t* reassembly_ctx,
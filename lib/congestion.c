@@ -10,6 +10,9 @@
 #include "quicrq_fragment.h"
 
 #define QUICRQ_CONGESTION_THRESHOLD 5
+#define QUICRQ_CONGESTION_EPOCH_PACKETS 4
+#define QUICRQ_CONGESTION_DRAIN_EPOCHS 2
+#define QUICRQ_CONGESTION_MAX_STEP 4
 
 
 /* Handle delay based congestion.
@@ -38,12 +41,103 @@
 *     - if this is the first epoch for this priority, do nothing
 *       because the priority had no observable effect.
 *     - if backlog reported, and threshold > 128, decrease threshold
+*       by a step that depends on how fast the queue drains.
 *     - else if no backlog reported during the last epoch, increase the threshold
 *         - if threshold larger than max flag, clear "is_congested".
 * - in any case, reset "has_backlog", "old threshold", and epoch time.
-*  
+* 
+* The epoch lasts one smoothed RTT, so that the effect of a new threshold can be
+* observed before the next decision, but at least the time needed to send a few
+* packets at the pacing rate.
 */
-int quicrq_congestion_check_per_cnx(quicrq_cnx_ctx_t* cnx_ctx, uint8_t flags, int has_backlog, uint64_t current_time)
+static uint64_t quicrq_congestion_epoch_duration(quicrq_cnx_ctx_t* cnx_ctx)
+{
+    uint64_t epoch_duration = QUICRQ_CONGESTION_EPOCH_DEFAULT;
+
+    if (cnx_ctx->cnx != NULL) {
+        uint64_t rtt = picoquic_get_rtt(cnx_ctx->cnx);
+        uint64_t pacing_rate = picoquic_get_pacing_rate(cnx_ctx->cnx);
+
+        if (rtt > 0) {
+            epoch_duration = rtt;
+        }
+        if (pacing_rate > 0) {
+            uint64_t pacing_time = (QUICRQ_CONGESTION_EPOCH_PACKETS * PICOQUIC_MAX_PACKET_SIZE * 1000000ull) / pacing_rate;
+            if (pacing_time > epoch_duration) {
+                epoch_duration = pacing_time;
+            }
+        }
+        if (epoch_duration < QUICRQ_CONGESTION_EPOCH_MIN) {
+            epoch_duration = QUICRQ_CONGESTION_EPOCH_MIN;
+        }
+        else if (epoch_duration > QUICRQ_CONGESTION_EPOCH_MAX) {
+            epoch_duration = QUICRQ_CONGESTION_EPOCH_MAX;
+        }
+    }
+    return epoch_duration;
+}
+
+/* Compute by how much the threshold is lowered when backlog was reported.
+ * If the queue drained fast enough during the epoch to be empty within a couple of
+ * epochs, the current threshold is working, and is kept. If the queue is not draining,
+ * lower the threshold by one level per epoch worth of queue delay.
+ */
+static uint8_t quicrq_congestion_threshold_step(quicrq_cnx_congestion_state_t* congestion)
+{
+    uint8_t step = 1;
+
+    if (congestion->max_backlog_delay < congestion->previous_backlog_delay) {
+        uint64_t drained = congestion->previous_backlog_delay - congestion->max_backlog_delay;
+        if (drained * QUICRQ_CONGESTION_DRAIN_EPOCHS >= congestion->max_backlog_delay) {
+            step = 0;
+        }
+    }
+    else if (congestion->epoch_duration > 0) {
+        uint64_t backlog_epochs = congestion->max_backlog_delay / congestion->epoch_duration;
+        if (backlog_epochs > QUICRQ_CONGESTION_MAX_STEP) {
+            step = QUICRQ_CONGESTION_MAX_STEP;
+        }
+        else if (backlog_epochs > 1) {
+            step = (uint8_t)backlog_epochs;
+        }
+    }
+    return step;
+}
+
+static void quicrq_congestion_start_epoch(quicrq_cnx_ctx_t* cnx_ctx, uint64_t current_time)
+{
+    cnx_ctx->congestion.has_backlog = 0;
+    cnx_ctx->congestion.nb_drops = 0;
+    cnx_ctx->congestion.max_backlog_delay = 0;
+    cnx_ctx->congestion.epoch_start_time = current_time;
+    cnx_ctx->congestion.epoch_duration = quicrq_congestion_epoch_duration(cnx_ctx);
+    cnx_ctx->congestion.congestion_check_time = current_time + cnx_ctx->congestion.epoch_duration;
+}
+
+static void quicrq_congestion_trace_epoch(quicrq_cnx_ctx_t* cnx_ctx, int has_backlog)
+{
+    quicrq_congestion_trace_t* trace = cnx_ctx->qr_ctx->congestion_trace;
+
+    if (trace != NULL) {
+        if (trace->nb_epochs < QUICRQ_CONGESTION_TRACE_MAX) {
+            quicrq_congestion_epoch_t* epoch = &trace->epochs[trace->nb_epochs];
+            epoch->start_time = cnx_ctx->congestion.epoch_start_time;
+            epoch->duration = cnx_ctx->congestion.epoch_duration;
+            epoch->max_backlog_delay = cnx_ctx->congestion.max_backlog_delay;
+            epoch->nb_drops = cnx_ctx->congestion.nb_drops;
+            epoch->priority_threshold = cnx_ctx->congestion.priority_threshold;
+            epoch->has_backlog = has_backlog;
+            epoch->is_congested = cnx_ctx->congestion.is_congested;
+            trace->nb_epochs++;
+        }
+        trace->nb_epochs_total++;
+    }
+    quicrq_log_message(cnx_ctx, "Congestion epoch, duration %" PRIu64 ", backlog %d, %" PRIu64 " us, drops %" PRIu64 ", threshold 0x%x",
+        cnx_ctx->congestion.epoch_duration, has_backlog, cnx_ctx->congestion.max_backlog_delay, cnx_ctx->congestion.nb_drops,
+        cnx_ctx->congestion.priority_threshold);
+}
+
+int quicrq_congestion_check_per_cnx(quicrq_cnx_ctx_t* cnx_ctx, uint8_t flags, int has_backlog, uint64_t backlog_delay, uint64_t current_time)
 {
     int should_skip = 0;
 
@@ -52,26 +146,37 @@ int quicrq_congestion_check_per_cnx(quicrq_cnx_ctx_t* cnx_ctx, uint8_t flags, in
         cnx_ctx->congestion.max_flags = flags;
     }
     cnx_ctx->congestion.has_backlog |= has_backlog;
+    if (backlog_delay > cnx_ctx->congestion.max_backlog_delay) {
+        cnx_ctx->congestion.max_backlog_delay = backlog_delay;
+    }
 
     if (!cnx_ctx->congestion.is_congested) {
         if (has_backlog) {
             /* Enter the congested state */
             cnx_ctx->congestion.is_congested = 1;
-            cnx_ctx->congestion.has_backlog = 0;
             cnx_ctx->congestion.priority_threshold = cnx_ctx->congestion.max_flags;
             cnx_ctx->congestion.old_priority_threshold = 0xff;
+            cnx_ctx->congestion.previous_backlog_delay = 0;
+            quicrq_congestion_start_epoch(cnx_ctx, current_time);
         }
     } else if (current_time >= cnx_ctx->congestion.congestion_check_time) {
         /* Check the epoch */
         uint8_t old_priority_threshold = cnx_ctx->congestion.priority_threshold;
+        int epoch_has_backlog = cnx_ctx->congestion.has_backlog;
 
         if (cnx_ctx->congestion.old_priority_threshold != cnx_ctx->congestion.priority_threshold) {
             /* The threshold was changed at the last epoch check, so
             * congestion would not reflect the next threshold. Do nothing. */
         } else if (cnx_ctx->congestion.has_backlog) {
             /* if congested, set threshold priority to lower value */
-            if (cnx_ctx->congestion.priority_threshold > 0x80) {
-                cnx_ctx->congestion.priority_threshold -= 1;
+            uint8_t step = quicrq_congestion_threshold_step(&cnx_ctx->congestion);
+            if (step > 0 && cnx_ctx->congestion.priority_threshold > 0x80) {
+                if (cnx_ctx->congestion.priority_threshold > 0x80 + step) {
+                    cnx_ctx->congestion.priority_threshold -= step;
+                }
+                else {
+                    cnx_ctx->congestion.priority_threshold = 0x80;
+                }
             }
         }
         else {
@@ -82,14 +187,16 @@ int quicrq_congestion_check_per_cnx(quicrq_cnx_ctx_t* cnx_ctx, uint8_t flags, in
                 cnx_ctx->congestion.is_congested = 0;
             }
         }
+        quicrq_congestion_trace_epoch(cnx_ctx, epoch_has_backlog);
         /* Reset the values to prepare the next epoch */
         cnx_ctx->congestion.old_priority_threshold = old_priority_threshold;
-        cnx_ctx->congestion.has_backlog = 0;
-        cnx_ctx->congestion.congestion_check_time += 50000; /* TODO: should be RTT of connection */
+        cnx_ctx->congestion.previous_backlog_delay = cnx_ctx->congestion.max_backlog_delay;
+        quicrq_congestion_start_epoch(cnx_ctx, current_time);
     }
     /* Evaluate whether this packet should be skipped */
     if (cnx_ctx->qr_ctx->congestion_control_mode != 0 && cnx_ctx->congestion.is_congested && flags >= cnx_ctx->congestion.priority_threshold) {
         should_skip = 1;
+        cnx_ctx->congestion.nb_drops++;
     }
     return should_skip;
 }
@@ -197,20 +304,72 @@ int quicrq_evaluate_stream_congestion(quicrq_fragment_publisher_context_t* media
         }
         /* Check the cache time, compare to current time, determine congestion */
         should_skip = quicrq_congestion_check_per_cnx(media_ctx->stream_ctx->cnx_ctx,
-            media_ctx->current_fragment->flags, has_backlog, current_time);
+            media_ctx->current_fragment->flags, has_backlog, current_time - media_ctx->current_fragment->cache_time, current_time);
         break;
     }
     return should_skip;
 }
-/* Evaluation of congestion in warp mode */
+
+/* Evaluation of the latency budget.
+ * The queue delay of a fragment, in milliseconds, accumulates the time spent
+ * in the caches of the previous relays. Adding the time spent in the local cache
+ * gives the age of the object. If it exceeds the latency budget of the media, the
+ * object is skipped: for interactive media, late is as good as lost, and sending
+ * late objects takes bandwidth from the fresh ones. The budget is the smallest of
+ * the one set by the publisher on the cache and the one requested by the subscriber.
+ * Relays learn the budget of the publisher from the Latency Budget message.
+ */
+uint64_t quicrq_fragment_age(const quicrq_cached_fragment_t* fragment, uint64_t current_time)
+{
+    /* The queue delay is received from the peer, saturate instead of wrapping around */
+    uint64_t age = (fragment->queue_delay > UINT64_MAX / 1000) ? UINT64_MAX : fragment->queue_delay * 1000;
+
+    if (current_time > fragment->cache_time) {
+        uint64_t residence = current_time - fragment->cache_time;
+        age = (age > UINT64_MAX - residence) ? UINT64_MAX : age + residence;
+    }
+    return age;
+}
+
+int quicrq_evaluate_latency_budget(quicrq_stream_ctx_t* stream_ctx, quicrq_fragment_publisher_context_t* media_ctx,
+    const quicrq_cached_fragment_t* fragment, uint64_t current_time)
+{
+    int should_skip = 0;
+    uint64_t latency_budget = media_ctx->cache_ctx->latency_budget;
+
+    if (stream_ctx != NULL && stream_ctx->latency_budget != 0 &&
+        (latency_budget == 0 || stream_ctx->latency_budget < latency_budget)) {
+        latency_budget = stream_ctx->latency_budget;
+    }
+    if (latency_budget != 0 && fragment->data_length > 0 &&
+        quicrq_fragment_age(fragment, current_time) > latency_budget) {
+        should_skip = 1;
+    }
+    return should_skip;
+}
+
+/* Evaluation of congestion in warp mode.
+ * In warp mode, each group is sent on its own unidirectional stream. When the
+ * "group_p" policy decides to drop the tail of an old group, sending placeholders
+ * for the remaining objects would keep the stream alive, and picoquic would keep
+ * retransmitting the data already queued on it, competing with the newer groups.
+ * Instead, the sender resets the stream with the error code GROUP_TRUNCATED, which
+ * frees the congestion window immediately. The receiver learns that the objects not
+ * yet received will never arrive, and replaces them by placeholders. This is only
+ * done after the first object of the group was sent, because its header carries
+ * the number of objects in the previous group. A relay also truncates the group
+ * when an object it is sending was truncated upstream, which may be object 0:
+ * its header was then already sent.
+ */
 int quicrq_evaluate_warp_congestion(quicrq_uni_stream_ctx_t* uni_stream_ctx, quicrq_fragment_publisher_context_t* media_ctx, 
-    size_t next_object_size, uint8_t flags, uint64_t current_time)
+    size_t next_object_size, uint8_t flags, int* should_truncate, uint64_t current_time)
 {
     int should_skip = 0;
     int has_backlog = 0;
     const uint64_t backlog_threshold = 5;
     quicrq_fragment_cache_t* cache_ctx = media_ctx->cache_ctx;
 
+    *should_truncate = 0;
     if (flags == 0xff && next_object_size == 0) {
         /* This object was marked skipped at a previous relay */
         should_skip = 1;
@@ -223,6 +382,11 @@ int quicrq_evaluate_warp_congestion(quicrq_uni_stream_ctx_t* uni_stream_ctx, qui
         case quicrq_congestion_control_group_p:
             /* compute group mode congestion control */
             should_skip = quicrq_compute_group_mode_congestion(media_ctx, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id);
+            if (should_skip && media_ctx->congestion_control_mode == quicrq_congestion_control_group_p &&
+                uni_stream_ctx->control_stream_ctx->transport_mode == quicrq_transport_mode_warp &&
+                uni_stream_ctx->current_object_id > 0) {
+                *should_truncate = 1;
+            }
             break;
         case quicrq_congestion_control_delay:
         default:
@@ -233,8 +397,11 @@ int quicrq_evaluate_warp_congestion(quicrq_uni_stream_ctx_t* uni_stream_ctx, qui
                 has_backlog = 1;
             } 
             if (uni_stream_ctx->current_object_id > 0 && flags != 0xff) {
+                quicrq_cached_fragment_t* first_fragment = quicrq_fragment_cache_get_fragment(cache_ctx,
+                    uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id, 0);
+                uint64_t backlog_delay = (first_fragment == NULL) ? 0 : current_time - first_fragment->cache_time;
                 should_skip = quicrq_congestion_check_per_cnx(uni_stream_ctx->control_stream_ctx->cnx_ctx,
-                    flags, has_backlog, current_time);
+                    flags, has_backlog, backlog_delay, current_time);
             }
             break;
         }
@@ -247,6 +414,7 @@ int quicrq_evaluate_warp_congestion(quicrq_uni_stream_ctx_t* uni_stream_ctx, qui
 int quicrq_evaluate_datagram_congestion(quicrq_stream_ctx_t * stream_ctx, quicrq_fragment_publisher_context_t* media_ctx, uint64_t current_time)
 {
     const int64_t delta_t_max = QUICRQ_CONGESTION_THRESHOLD * 33333;
+    uint64_t backlog_delay = 0;
     int has_backlog = 0;
     int should_skip = 0;
 
@@ -263,9 +431,10 @@ int quicrq_evaluate_datagram_congestion(quicrq_stream_ctx_t * stream_ctx, quicrq
             break;
         case quicrq_congestion_control_delay:
         default:
-            has_backlog = (int64_t)(current_time - media_ctx->current_fragment->cache_time) > delta_t_max;
+            backlog_delay = current_time - media_ctx->current_fragment->cache_time;
+            has_backlog = (int64_t)backlog_delay > delta_t_max;
             should_skip = quicrq_congestion_check_per_cnx(stream_ctx->cnx_ctx,
-                media_ctx->current_fragment->flags, has_backlog, current_time);
+                media_ctx->current_fragment->flags, has_backlog, backlog_delay, current_time);
             break;
         }
     }
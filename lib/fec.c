@@ -0,0 +1,342 @@
+/* Forward error correction for media sent as datagrams */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "picoquic_utils.h"
+#include "quicrq.h"
+#include "quicrq_internal.h"
+
+/* The FEC mode replaces the "extra repeat" of individual fragments by
+ * repair datagrams, each protecting a window of source fragments in the
+ * same group. The repair symbol is the XOR of the source symbols, padded
+ * with zeroes to the length of the longest one. The source symbol starts
+ * with a fixed size header, so that the receiver can rebuild the datagram
+ * header of the missing fragment:
+ *
+ * fec_source_symbol {
+ *     object_id (64)
+ *     object_offset (64)
+ *     object_length (64)
+ *     queue_delay (64)
+ *     nb_objects_previous_group (64)
+ *     flags (8)
+ *     data_length (16)
+ *     data (..)
+ * }
+ *
+ * A window is closed when it holds fec_window fragments, when the group
+ * changes, or when the media has no data ready and the window is at least
+ * half full. The repair datagram is then sent before the next fragments of
+ * the media.
+ */
+
+void quicrq_set_datagram_fec(quicrq_ctx_t* qr, size_t nb_sources_per_repair)
+{
+    qr->fec_window = (nb_sources_per_repair > QUICRQ_FEC_WINDOW_MAX) ? QUICRQ_FEC_WINDOW_MAX : nb_sources_per_repair;
+}
+
+static uint8_t* quicrq_fec_uint64_encode(uint8_t* bytes, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = (uint8_t)v;
+        v >>= 8;
+    }
+    return bytes + 8;
+}
+
+static const uint8_t* quicrq_fec_uint64_decode(const uint8_t* bytes, uint64_t* v)
+{
+    *v = 0;
+    for (int i = 0; i < 8; i++) {
+        *v = (*v << 8) | bytes[i];
+    }
+    return bytes + 8;
+}
+
+static size_t quicrq_fec_symbol_encode(uint8_t* symbol, uint64_t object_id, uint64_t object_offset, uint64_t object_length,
+    uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group, const uint8_t* data, size_t data_length)
+{
+    uint8_t* bytes = symbol;
+
+    bytes = quicrq_fec_uint64_encode(bytes, object_id);
+    bytes = quicrq_fec_uint64_encode(bytes, object_offset);
+    bytes = quicrq_fec_uint64_encode(bytes, object_length);
+    bytes = quicrq_fec_uint64_encode(bytes, queue_delay);
+    bytes = quicrq_fec_uint64_encode(bytes, nb_objects_previous_group);
+    *bytes++ = flags;
+    *bytes++ = (uint8_t)(data_length >> 8);
+    *bytes++ = (uint8_t)data_length;
+    if (data_length > 0) {
+        memcpy(bytes, data, data_length);
+    }
+    return QUICRQ_FEC_SYMBOL_HEADER + data_length;
+}
+
+static void quicrq_fec_symbol_xor(uint8_t* target, const uint8_t* symbol, size_t symbol_length)
+{
+    for (size_t i = 0; i < symbol_length; i++) {
+        target[i] ^= symbol[i];
+    }
+}
+
+/* Sender side */
+
+static quicrq_fec_sender_t* quicrq_fec_sender_get(quicrq_stream_ctx_t* stream_ctx)
+{
+    if (stream_ctx->fec_sender == NULL) {
+        stream_ctx->fec_sender = (quicrq_fec_sender_t*)malloc(sizeof(quicrq_fec_sender_t));
+        if (stream_ctx->fec_sender != NULL) {
+            memset(stream_ctx->fec_sender, 0, sizeof(quicrq_fec_sender_t));
+        }
+    }
+    return stream_ctx->fec_sender;
+}
+
+/* Format the repair datagram for the current window, and start a new window.
+ * A repair datagram that was not sent yet is replaced.
+ */
+static void quicrq_fec_sender_close_window(quicrq_stream_ctx_t* stream_ctx, quicrq_fec_sender_t* fec_sender)
+{
+    uint8_t* bytes = quicrq_datagram_repair_header_encode(fec_sender->repair, fec_sender->repair + QUICRQ_DATAGRAM_REPAIR_HEADER_MAX,
+        stream_ctx->media_id, fec_sender->group_id, fec_sender->first_fec_sequence, fec_sender->nb_sources);
+
+    if (bytes == NULL) {
+        DBG_PRINTF("%s", "Cannot encode FEC repair header");
+        fec_sender->repair_length = 0;
+    }
+    else {
+        memcpy(bytes, fec_sender->symbol, fec_sender->symbol_length);
+        fec_sender->repair_length = (bytes - fec_sender->repair) + fec_sender->symbol_length;
+    }
+    fec_sender->nb_sources = 0;
+    fec_sender->symbol_length = 0;
+}
+
+/* Return the FEC sequence number of the next fragment sent on the stream,
+ * or UINT64_MAX if FEC is not used.
+ */
+uint64_t quicrq_fec_sender_sequence(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id)
+{
+    uint64_t fec_sequence = UINT64_MAX;
+    quicrq_fec_sender_t* fec_sender;
+
+    if (stream_ctx != NULL && stream_ctx->cnx_ctx->qr_ctx->fec_window > 0 &&
+        (fec_sender = quicrq_fec_sender_get(stream_ctx)) != NULL) {
+        if (fec_sender->nb_sources > 0 && fec_sender->group_id != group_id) {
+            /* Windows do not span groups */
+            quicrq_fec_sender_close_window(stream_ctx, fec_sender);
+        }
+        fec_sequence = fec_sender->next_fec_sequence;
+    }
+    return fec_sequence;
+}
+
+/* Add a fragment that was just sent to the current window */
+int quicrq_fec_sender_add(quicrq_stream_ctx_t* stream_ctx, uint64_t fec_sequence, uint64_t group_id, uint64_t object_id,
+    uint64_t object_offset, uint64_t object_length, uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group,
+    const uint8_t* data, size_t data_length)
+{
+    int ret = 0;
+    quicrq_fec_sender_t* fec_sender = stream_ctx->fec_sender;
+
+    if (fec_sender == NULL || data_length > QUICRQ_FEC_DATA_MAX) {
+        ret = -1;
+    }
+    else {
+        uint8_t source_symbol[QUICRQ_FEC_SYMBOL_MAX];
+        size_t symbol_length = quicrq_fec_symbol_encode(source_symbol, object_id, object_offset, object_length,
+            queue_delay, flags, nb_objects_previous_group, data, data_length);
+
+        if (fec_sender->nb_sources == 0) {
+            fec_sender->group_id = group_id;
+            fec_sender->first_fec_sequence = fec_sequence;
+            memset(fec_sender->symbol, 0, sizeof(fec_sender->symbol));
+        }
+        quicrq_fec_symbol_xor(fec_sender->symbol, source_symbol, symbol_length);
+        if (symbol_length > fec_sender->symbol_length) {
+            fec_sender->symbol_length = symbol_length;
+        }
+        fec_sender->nb_sources++;
+        fec_sender->next_fec_sequence = fec_sequence + 1;
+        if (fec_sender->nb_sources >= stream_ctx->cnx_ctx->qr_ctx->fec_window) {
+            quicrq_fec_sender_close_window(stream_ctx, fec_sender);
+        }
+    }
+    return ret;
+}
+
+/* When the media has no data ready, close the current window if it is at least
+ * half full, so the last fragments sent are protected without waiting for
+ * the next ones. Return 1 if a repair datagram is waiting to be sent.
+ */
+int quicrq_fec_sender_flush(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_fec_sender_t* fec_sender = stream_ctx->fec_sender;
+
+    if (fec_sender != NULL && fec_sender->nb_sources > 0 &&
+        2 * fec_sender->nb_sources >= stream_ctx->cnx_ctx->qr_ctx->fec_window) {
+        quicrq_fec_sender_close_window(stream_ctx, fec_sender);
+    }
+    return (fec_sender != NULL && fec_sender->repair_length > 0);
+}
+
+/* Send the pending repair datagram if it fits in the available space.
+ * If it does not, the source fragments are sent anyway, and the repair is
+ * replaced when the next window closes.
+ */
+int quicrq_fec_sender_send_repair(quicrq_stream_ctx_t* stream_ctx, void* context, size_t space, int* media_was_sent)
+{
+    int ret = 0;
+    quicrq_fec_sender_t* fec_sender = stream_ctx->fec_sender;
+
+    if (fec_sender != NULL && fec_sender->repair_length > 0 && fec_sender->repair_length <= space) {
+        void* buffer = quicrq_provide_datagram_buffer(stream_ctx, context, fec_sender->repair_length);
+        if (buffer == NULL) {
+            ret = -1;
+        }
+        else {
+            memcpy(buffer, fec_sender->repair, fec_sender->repair_length);
+            stream_ctx->last_datagram_size = fec_sender->repair_length;
+            fec_sender->repair_length = 0;
+            fec_sender->nb_repairs_sent++;
+            *media_was_sent = 1;
+        }
+    }
+    return ret;
+}
+
+/* Receiver side */
+
+static quicrq_fec_received_t* quicrq_fec_receiver_slot(quicrq_stream_ctx_t* stream_ctx, uint64_t fec_sequence)
+{
+    quicrq_fec_received_t* slot = NULL;
+
+    if (stream_ctx->fec_receiver == NULL) {
+        stream_ctx->fec_receiver = (quicrq_fec_receiver_t*)malloc(sizeof(quicrq_fec_receiver_t));
+        if (stream_ctx->fec_receiver != NULL) {
+            memset(stream_ctx->fec_receiver, 0, sizeof(quicrq_fec_receiver_t));
+        }
+    }
+    if (stream_ctx->fec_receiver != NULL) {
+        slot = &stream_ctx->fec_receiver->received[fec_sequence % QUICRQ_FEC_RECEIVE_RING];
+        if (slot->symbol == NULL) {
+            slot->symbol = (uint8_t*)malloc(QUICRQ_FEC_SYMBOL_MAX);
+            if (slot->symbol == NULL) {
+                slot = NULL;
+            }
+        }
+    }
+    return slot;
+}
+
+/* Keep the symbol of a received source fragment, for use by the next repair datagrams */
+int quicrq_fec_receive_source(quicrq_stream_ctx_t* stream_ctx, uint64_t fec_sequence, uint64_t group_id, uint64_t object_id,
+    uint64_t object_offset, uint64_t object_length, uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group,
+    const uint8_t* data, size_t data_length)
+{
+    int ret = 0;
+    quicrq_fec_received_t* slot = NULL;
+
+    if (data_length > QUICRQ_FEC_DATA_MAX) {
+        /* Not a valid FEC source, cannot be used for repair */
+        ret = -1;
+    }
+    else if ((slot = quicrq_fec_receiver_slot(stream_ctx, fec_sequence)) == NULL) {
+        ret = -1;
+    }
+    else {
+        slot->fec_sequence = fec_sequence;
+        slot->group_id = group_id;
+        slot->symbol_length = quicrq_fec_symbol_encode(slot->symbol, object_id, object_offset, object_length,
+            queue_delay, flags, nb_objects_previous_group, data, data_length);
+    }
+    return ret;
+}
+
+/* Process a repair datagram. If exactly one of the source fragments in the window
+ * is missing, rebuild it and return 1. Return 0 if nothing was recovered.
+ */
+int quicrq_fec_receive_repair(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t first_fec_sequence, uint64_t nb_sources,
+    const uint8_t* repair, size_t repair_length, quicrq_fec_recovered_fragment_t* recovered)
+{
+    int ret = 0;
+    quicrq_fec_receiver_t* fec_receiver = NULL;
+    uint64_t missing_sequence = UINT64_MAX;
+    int nb_missing = 0;
+
+    if (nb_sources == 0 || nb_sources > QUICRQ_FEC_WINDOW_MAX || repair_length < QUICRQ_FEC_SYMBOL_HEADER ||
+        repair_length > QUICRQ_FEC_SYMBOL_MAX || quicrq_fec_receiver_slot(stream_ctx, first_fec_sequence) == NULL) {
+        /* Cannot be used */
+        nb_missing = -1;
+    }
+    else {
+        fec_receiver = stream_ctx->fec_receiver;
+        memcpy(fec_receiver->recovered, repair, repair_length);
+        for (uint64_t fec_sequence = first_fec_sequence; nb_missing <= 1 && fec_sequence < first_fec_sequence + nb_sources; fec_sequence++) {
+            quicrq_fec_received_t* slot = &fec_receiver->received[fec_sequence % QUICRQ_FEC_RECEIVE_RING];
+            if (slot->symbol != NULL && slot->symbol_length > 0 &&
+                slot->fec_sequence == fec_sequence && slot->group_id == group_id) {
+                if (slot->symbol_length > repair_length) {
+                    /* Inconsistent with the repair datagram */
+                    nb_missing = -1;
+                    break;
+                }
+                quicrq_fec_symbol_xor(fec_receiver->recovered, slot->symbol, slot->symbol_length);
+            }
+            else {
+                missing_sequence = fec_sequence;
+                nb_missing++;
+            }
+        }
+    }
+
+    if (nb_missing == 1) {
+        const uint8_t* bytes = fec_receiver->recovered;
+        uint64_t v = 0;
+
+        recovered->group_id = group_id;
+        bytes = quicrq_fec_uint64_decode(bytes, &recovered->object_id);
+        bytes = quicrq_fec_uint64_decode(bytes, &recovered->object_offset);
+        bytes = quicrq_fec_uint64_decode(bytes, &recovered->object_length);
+        bytes = quicrq_fec_uint64_decode(bytes, &recovered->queue_delay);
+        bytes = quicrq_fec_uint64_decode(bytes, &v);
+        recovered->nb_objects_previous_group = v;
+        recovered->flags = *bytes++;
+        recovered->data_length = ((size_t)bytes[0] << 8) | bytes[1];
+        bytes += 2;
+        recovered->data = bytes;
+        if (QUICRQ_FEC_SYMBOL_HEADER + recovered->data_length > repair_length) {
+            DBG_PRINTF("Inconsistent FEC repair for group %" PRIu64 ", sequence %" PRIu64, group_id, missing_sequence);
+        }
+        else {
+            /* Keep the recovered symbol, as if the fragment was received */
+            quicrq_fec_received_t* slot = &fec_receiver->received[missing_sequence % QUICRQ_FEC_RECEIVE_RING];
+            if (slot->symbol != NULL || (slot = quicrq_fec_receiver_slot(stream_ctx, missing_sequence)) != NULL) {
+                slot->fec_sequence = missing_sequence;
+                slot->group_id = group_id;
+                slot->symbol_length = QUICRQ_FEC_SYMBOL_HEADER + recovered->data_length;
+                memcpy(slot->symbol, fec_receiver->recovered, slot->symbol_length);
+            }
+            fec_receiver->nb_recovered++;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+void quicrq_fec_release(quicrq_stream_ctx_t* stream_ctx)
+{
+    if (stream_ctx->fec_sender != NULL) {
+        free(stream_ctx->fec_sender);
+        stream_ctx->fec_sender = NULL;
+    }
+    if (stream_ctx->fec_receiver != NULL) {
+        for (size_t i = 0; i < QUICRQ_FEC_RECEIVE_RING; i++) {
+            if (stream_ctx->fec_receiver->received[i].symbol != NULL) {
+                free(stream_ctx->fec_receiver->received[i].symbol);
+            }
+        }
+        free(stream_ctx->fec_receiver);
+        stream_ctx->fec_receiver = NULL;
+    }
+}
@@ -14,8 +14,16 @@
  * - by order of arrival -- used for example when sending datagrams at relays.
  * - by group-id/object-id/offset -- used for example when sending on streams.
  * The order of arrival ordering is handled as a double chained list.
- * The group-id/object-id/offset ordering is handled as a splay.
+ * The group-id/object-id/offset ordering is handled with one splay per
+ * group, the groups being found in a ring indexed by group-id. The fragments
+ * of a group are allocated from a slab owned by the group, so that purging
+ * a group does not require deleting its fragments one by one.
  * 
+ * Finding a node in a splay rotates the tree, which means that every reader
+ * modifies the tree. When many subscribers read the same cache, most lookups
+ * are for the first fragment of an object. These lookups are served by an
+ * object directory, a hash table keyed by group-id/object-id. The splay
+ * is then only used for walking through fragments in order.
  */
 void* quicrq_fragment_cache_node_value(picosplay_node_t* fragment_node)
 {
@@ -25,35 +33,331 @@ void* quicrq_fragment_cache_node_value(picosplay_node_t* fragment_node)
 static int64_t quicrq_fragment_cache_node_compare(void* l, void* r) {
     quicrq_cached_fragment_t* ls = (quicrq_cached_fragment_t*)l;
     quicrq_cached_fragment_t* rs = (quicrq_cached_fragment_t*)r;
-    int64_t ret = ls->group_id - rs->group_id;
+    int64_t ret = 0;
 
-    if (ret == 0) {
-        ret = ls->object_id - rs->object_id;
-        if (ret == 0) {
-            if (ls->offset < rs->offset) {
-                ret = -1;
+    /* Explicit comparisons, since lookups may use UINT64_MAX as object_id */
+    if (ls->group_id != rs->group_id) {
+        ret = (ls->group_id < rs->group_id) ? -1 : 1;
+    }
+    else if (ls->object_id != rs->object_id) {
+        ret = (ls->object_id < rs->object_id) ? -1 : 1;
+    }
+    else if (ls->offset != rs->offset) {
+        ret = (ls->offset < rs->offset) ? -1 : 1;
+    }
+    return ret;
+}
+
+static picosplay_node_t* quicrq_fragment_cache_node_create(void* v_media_object)
+{
+    return &((quicrq_cached_fragment_t*)v_media_object)->fragment_node;
+}
+
+/* Slab allocation of the cached fragments.
+ * Each block is preceded by a header pointing to the chunk from which it
+ * was carved. Blocks too large for the slab classes get a dedicated chunk,
+ * kept in the list of index QUICRQ_FRAGMENT_SLAB_NB_CLASSES. When a block
+ * is free, the first bytes of the block are used to chain it in the free
+ * list of the chunk.
+ */
+typedef struct st_quicrq_fragment_block_header_t {
+    quicrq_fragment_chunk_t* chunk;
+    size_t length;
+} quicrq_fragment_block_header_t;
+
+static const size_t quicrq_fragment_slab_class_size[QUICRQ_FRAGMENT_SLAB_NB_CLASSES] = {
+    192, 384, 768, 1280, 1664 };
+
+static void quicrq_fragment_chunk_unlink(quicrq_fragment_slab_t* slab, quicrq_fragment_chunk_t* chunk)
+{
+    if (chunk->previous_chunk == NULL) {
+        slab->first_chunk[chunk->class_id] = chunk->next_chunk;
+    }
+    else {
+        chunk->previous_chunk->next_chunk = chunk->next_chunk;
+    }
+    if (chunk->next_chunk == NULL) {
+        slab->last_chunk[chunk->class_id] = chunk->previous_chunk;
+    }
+    else {
+        chunk->next_chunk->previous_chunk = chunk->previous_chunk;
+    }
+    chunk->previous_chunk = NULL;
+    chunk->next_chunk = NULL;
+}
+
+static void quicrq_fragment_chunk_link(quicrq_fragment_slab_t* slab, quicrq_fragment_chunk_t* chunk, int at_head)
+{
+    if (slab->first_chunk[chunk->class_id] == NULL) {
+        slab->first_chunk[chunk->class_id] = chunk;
+        slab->last_chunk[chunk->class_id] = chunk;
+    }
+    else if (at_head) {
+        chunk->next_chunk = slab->first_chunk[chunk->class_id];
+        chunk->next_chunk->previous_chunk = chunk;
+        slab->first_chunk[chunk->class_id] = chunk;
+    }
+    else {
+        chunk->previous_chunk = slab->last_chunk[chunk->class_id];
+        chunk->previous_chunk->next_chunk = chunk;
+        slab->last_chunk[chunk->class_id] = chunk;
+    }
+}
+
+static quicrq_fragment_chunk_t* quicrq_fragment_chunk_create(quicrq_fragment_slab_t* slab, size_t class_id,
+    size_t block_size, size_t nb_blocks)
+{
+    size_t chunk_size = sizeof(quicrq_fragment_chunk_t) + nb_blocks * block_size;
+    quicrq_fragment_chunk_t* chunk = (quicrq_fragment_chunk_t*)malloc(chunk_size);
+
+    if (chunk != NULL) {
+        memset(chunk, 0, sizeof(quicrq_fragment_chunk_t));
+        chunk->class_id = class_id;
+        chunk->chunk_size = chunk_size;
+        chunk->nb_blocks = nb_blocks;
+        chunk->blocks = (uint8_t*)(chunk + 1);
+        quicrq_fragment_chunk_link(slab, chunk, 1);
+        slab->nb_chunks++;
+        slab->bytes_reserved += chunk_size;
+    }
+    return chunk;
+}
+
+static void quicrq_fragment_chunk_delete(quicrq_fragment_slab_t* slab, quicrq_fragment_chunk_t* chunk)
+{
+    quicrq_fragment_chunk_unlink(slab, chunk);
+    slab->nb_chunks--;
+    slab->bytes_reserved -= chunk->chunk_size;
+    free(chunk);
+}
+
+void* quicrq_fragment_slab_alloc(quicrq_fragment_slab_t* slab, size_t length)
+{
+    quicrq_fragment_block_header_t* header = NULL;
+    quicrq_fragment_chunk_t* chunk = NULL;
+    size_t class_id = 0;
+    size_t block_size;
+
+    while (class_id < QUICRQ_FRAGMENT_SLAB_NB_CLASSES && quicrq_fragment_slab_class_size[class_id] < length) {
+        class_id++;
+    }
+
+    if (class_id >= QUICRQ_FRAGMENT_SLAB_NB_CLASSES) {
+        /* Too large for the slab classes, use a dedicated chunk. */
+        block_size = sizeof(quicrq_fragment_block_header_t) + length;
+        chunk = quicrq_fragment_chunk_create(slab, class_id, block_size, 1);
+    }
+    else {
+        block_size = sizeof(quicrq_fragment_block_header_t) + quicrq_fragment_slab_class_size[class_id];
+        chunk = slab->first_chunk[class_id];
+        if (chunk == NULL || chunk->nb_blocks_used >= chunk->nb_blocks) {
+            /* No chunk with free blocks for that class, create one, twice as large as the previous one. */
+            size_t chunk_size = slab->next_chunk_size[class_id];
+            size_t nb_blocks;
+
+            if (chunk_size < QUICRQ_FRAGMENT_CHUNK_SIZE_MIN) {
+                chunk_size = QUICRQ_FRAGMENT_CHUNK_SIZE_MIN;
             }
-            else if (ls->offset > rs->offset) {
-                ret = 1;
+            nb_blocks = chunk_size / block_size;
+            if (nb_blocks == 0) {
+                nb_blocks = 1;
             }
+            chunk = quicrq_fragment_chunk_create(slab, class_id, block_size, nb_blocks);
+            if (chunk != NULL && chunk_size < QUICRQ_FRAGMENT_CHUNK_SIZE) {
+                slab->next_chunk_size[class_id] = 2 * chunk_size;
+            }
+        }
+    }
+
+    if (chunk != NULL) {
+        if (chunk->first_free_block != NULL) {
+            header = (quicrq_fragment_block_header_t*)chunk->first_free_block;
+            memcpy(&chunk->first_free_block, header + 1, sizeof(uint8_t*));
+        }
+        else {
+            header = (quicrq_fragment_block_header_t*)(chunk->blocks + chunk->nb_blocks_carved * block_size);
+            chunk->nb_blocks_carved++;
+        }
+        header->chunk = chunk;
+        header->length = length;
+        chunk->nb_blocks_used++;
+        slab->bytes_live += length;
+        if (chunk->nb_blocks_used >= chunk->nb_blocks && chunk->next_chunk != NULL) {
+            /* Move the full chunk at the tail of the list */
+            quicrq_fragment_chunk_unlink(slab, chunk);
+            quicrq_fragment_chunk_link(slab, chunk, 0);
+        }
+    }
+
+    return (header == NULL) ? NULL : (void*)(header + 1);
+}
+
+void quicrq_fragment_slab_free(quicrq_fragment_slab_t* slab, void* block)
+{
+    quicrq_fragment_block_header_t* header = ((quicrq_fragment_block_header_t*)block) - 1;
+    quicrq_fragment_chunk_t* chunk = header->chunk;
+    int was_full = (chunk->nb_blocks_used >= chunk->nb_blocks);
+
+    slab->bytes_live -= header->length;
+    chunk->nb_blocks_used--;
+    if (chunk->nb_blocks_used == 0) {
+        /* All blocks are free, release the chunk */
+        quicrq_fragment_chunk_delete(slab, chunk);
+    }
+    else {
+        memcpy(block, &chunk->first_free_block, sizeof(uint8_t*));
+        chunk->first_free_block = (uint8_t*)header;
+        if (was_full && chunk->previous_chunk != NULL) {
+            /* The chunk has a free block now, move it to the head of the list */
+            quicrq_fragment_chunk_unlink(slab, chunk);
+            quicrq_fragment_chunk_link(slab, chunk, 1);
+        }
+    }
+}
+
+/* Release all the chunks of the slab at once, without visiting the blocks.
+ */
+void quicrq_fragment_slab_release(quicrq_fragment_slab_t* slab)
+{
+    for (size_t class_id = 0; class_id <= QUICRQ_FRAGMENT_SLAB_NB_CLASSES; class_id++) {
+        while (slab->first_chunk[class_id] != NULL) {
+            quicrq_fragment_chunk_delete(slab, slab->first_chunk[class_id]);
+        }
+    }
+    slab->bytes_live = 0;
+}
+
+/* Management of the object directory.
+ * The directory uses open addressing with linear probing. Deleted entries
+ * are removed by shifting back the following entries of the probe sequence,
+ * so there is no need for tombstones. The table is doubled when it becomes
+ * half full.
+ */
+#define QUICRQ_OBJECT_DIRECTORY_SIZE_MIN 16
+
+static size_t quicrq_fragment_cache_object_hash(uint64_t group_id, uint64_t object_id)
+{
+    uint64_t h = group_id * 0x9E3779B97F4A7C15ull;
+    h ^= object_id + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (size_t)h;
+}
+
+static size_t quicrq_fragment_cache_object_slot(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id)
+{
+    size_t mask = cache_ctx->object_directory_size - 1;
+    size_t slot = quicrq_fragment_cache_object_hash(group_id, object_id) & mask;
+
+    while (cache_ctx->object_directory[slot].first_fragment != NULL &&
+        (cache_ctx->object_directory[slot].group_id != group_id ||
+            cache_ctx->object_directory[slot].object_id != object_id)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int quicrq_fragment_cache_object_resize(quicrq_fragment_cache_t* cache_ctx, size_t new_size)
+{
+    int ret = 0;
+    quicrq_cached_object_t* old_directory = cache_ctx->object_directory;
+    size_t old_size = cache_ctx->object_directory_size;
+    quicrq_cached_object_t* new_directory = (quicrq_cached_object_t*)malloc(new_size * sizeof(quicrq_cached_object_t));
+
+    if (new_directory == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(new_directory, 0, new_size * sizeof(quicrq_cached_object_t));
+        cache_ctx->object_directory = new_directory;
+        cache_ctx->object_directory_size = new_size;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old_directory[i].first_fragment != NULL) {
+                size_t slot = quicrq_fragment_cache_object_slot(cache_ctx, old_directory[i].group_id, old_directory[i].object_id);
+                new_directory[slot] = old_directory[i];
+            }
+        }
+        if (old_directory != NULL) {
+            free(old_directory);
         }
     }
     return ret;
 }
 
-static picosplay_node_t* quicrq_fragment_cache_node_create(void* v_media_object)
+quicrq_cached_object_t* quicrq_fragment_cache_get_object(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id)
 {
-    return &((quicrq_cached_fragment_t*)v_media_object)->fragment_node;
+    quicrq_cached_object_t* cached_object = NULL;
+
+    if (cache_ctx->nb_cached_objects > 0) {
+        size_t slot = quicrq_fragment_cache_object_slot(cache_ctx, group_id, object_id);
+        if (cache_ctx->object_directory[slot].first_fragment != NULL) {
+            cached_object = &cache_ctx->object_directory[slot];
+        }
+    }
+    return cached_object;
 }
 
-static void quicrq_fragment_cache_node_delete(void* tree, picosplay_node_t* node)
+static int quicrq_fragment_cache_object_add(quicrq_fragment_cache_t* cache_ctx, quicrq_cached_fragment_t* fragment)
 {
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(tree);
-#endif
-    quicrq_fragment_cache_t* cached_media = (quicrq_fragment_cache_t*)((char*)tree - offsetof(struct st_quicrq_fragment_cache_t, fragment_tree));
-    quicrq_cached_fragment_t* fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(node);
+    int ret = 0;
+
+    if (2 * (cache_ctx->nb_cached_objects + 1) > cache_ctx->object_directory_size) {
+        ret = quicrq_fragment_cache_object_resize(cache_ctx, (cache_ctx->object_directory_size == 0) ?
+            QUICRQ_OBJECT_DIRECTORY_SIZE_MIN : 2 * cache_ctx->object_directory_size);
+    }
+    if (ret == 0) {
+        size_t slot = quicrq_fragment_cache_object_slot(cache_ctx, fragment->group_id, fragment->object_id);
+        quicrq_cached_object_t* cached_object = &cache_ctx->object_directory[slot];
+
+        if (cached_object->first_fragment == NULL) {
+            /* If the first fragment is already documented, keep it. */
+            cached_object->group_id = fragment->group_id;
+            cached_object->object_id = fragment->object_id;
+            cached_object->object_length = fragment->object_length;
+            cached_object->nb_objects_previous_group = fragment->nb_objects_previous_group;
+            cached_object->flags = fragment->flags;
+            cached_object->first_fragment = fragment;
+            cache_ctx->nb_cached_objects++;
+        }
+    }
+    return ret;
+}
+
+static void quicrq_fragment_cache_object_remove(quicrq_fragment_cache_t* cache_ctx, quicrq_cached_fragment_t* fragment)
+{
+    if (cache_ctx->nb_cached_objects > 0) {
+        size_t mask = cache_ctx->object_directory_size - 1;
+        size_t slot = quicrq_fragment_cache_object_slot(cache_ctx, fragment->group_id, fragment->object_id);
+
+        if (cache_ctx->object_directory[slot].first_fragment == fragment) {
+            size_t next_slot = slot;
+            /* Shift back the entries that were displaced by the removed one */
+            while (1) {
+                size_t home_slot;
+                next_slot = (next_slot + 1) & mask;
+                if (cache_ctx->object_directory[next_slot].first_fragment == NULL) {
+                    break;
+                }
+                home_slot = quicrq_fragment_cache_object_hash(cache_ctx->object_directory[next_slot].group_id,
+                    cache_ctx->object_directory[next_slot].object_id) & mask;
+                if ((slot <= next_slot) ? (slot < home_slot && home_slot <= next_slot) :
+                    (slot < home_slot || home_slot <= next_slot)) {
+                    /* This entry is at or after its home slot, do not move it */
+                    continue;
+                }
+                cache_ctx->object_directory[slot] = cache_ctx->object_directory[next_slot];
+                slot = next_slot;
+            }
+            memset(&cache_ctx->object_directory[slot], 0, sizeof(quicrq_cached_object_t));
+            cache_ctx->nb_cached_objects--;
+        }
+    }
+}
 
+static void quicrq_fragment_cache_unlink_in_order(quicrq_fragment_cache_t* cached_media, quicrq_cached_fragment_t* fragment)
+{
     if (fragment->previous_in_order == NULL) {
         cached_media->first_fragment = fragment->next_in_order;
     }
@@ -67,46 +371,737 @@ static void quicrq_fragment_cache_node_delete(void* tree, picosplay_node_t* node
     else {
         fragment->next_in_order->previous_in_order = fragment->previous_in_order;
     }
+}
 
-    free(quicrq_fragment_cache_node_value(node));
+/* Account for changes in the memory reserved by a group slab, at the cache
+ * level and at the context level. If the reserved memory grows above the
+ * limit, the limit will be enforced at the next time check.
+ */
+static void quicrq_fragment_cache_memory_update(quicrq_fragment_cache_t* cache_ctx, size_t reserved_before, size_t reserved_after)
+{
+    cache_ctx->bytes_reserved += reserved_after;
+    cache_ctx->bytes_reserved -= reserved_before;
+    if (cache_ctx->qr_ctx != NULL) {
+        cache_ctx->qr_ctx->cache_memory_used += reserved_after;
+        cache_ctx->qr_ctx->cache_memory_used -= reserved_before;
+        if (reserved_after > reserved_before && cache_ctx->qr_ctx->cache_memory_limit > 0 &&
+            cache_ctx->qr_ctx->cache_memory_used > cache_ctx->qr_ctx->cache_memory_limit) {
+            cache_ctx->qr_ctx->is_cache_memory_check_needed = 1;
+        }
+    }
+}
+
+/* The caches of a context are kept in a list ordered by last read time,
+ * so that the least recently read caches are found first when the memory
+ * limit is enforced. New caches have not been read yet, and are placed at
+ * the head of the list.
+ */
+static void quicrq_fragment_cache_lru_unlink(quicrq_fragment_cache_t* cache_ctx)
+{
+    quicrq_ctx_t* qr_ctx = cache_ctx->qr_ctx;
+
+    if (cache_ctx->previous_lru_cache == NULL) {
+        qr_ctx->first_lru_cache = cache_ctx->next_lru_cache;
+    }
+    else {
+        cache_ctx->previous_lru_cache->next_lru_cache = cache_ctx->next_lru_cache;
+    }
+    if (cache_ctx->next_lru_cache == NULL) {
+        qr_ctx->last_lru_cache = cache_ctx->previous_lru_cache;
+    }
+    else {
+        cache_ctx->next_lru_cache->previous_lru_cache = cache_ctx->previous_lru_cache;
+    }
+    cache_ctx->previous_lru_cache = NULL;
+    cache_ctx->next_lru_cache = NULL;
+}
+
+void quicrq_fragment_cache_set_read_time(quicrq_fragment_cache_t* cache_ctx, uint64_t current_time)
+{
+    quicrq_ctx_t* qr_ctx = cache_ctx->qr_ctx;
+
+    cache_ctx->last_read_time = current_time;
+    if (qr_ctx != NULL && qr_ctx->last_lru_cache != cache_ctx) {
+        /* Move the cache at the tail of the list */
+        quicrq_fragment_cache_lru_unlink(cache_ctx);
+        cache_ctx->previous_lru_cache = qr_ctx->last_lru_cache;
+        if (qr_ctx->last_lru_cache == NULL) {
+            qr_ctx->first_lru_cache = cache_ctx;
+        }
+        else {
+            qr_ctx->last_lru_cache->next_lru_cache = cache_ctx;
+        }
+        qr_ctx->last_lru_cache = cache_ctx;
+    }
+}
+
+static void quicrq_fragment_cache_node_delete(void* tree, picosplay_node_t* node)
+{
+    quicrq_cached_group_t* group = (quicrq_cached_group_t*)((char*)tree - offsetof(struct st_quicrq_cached_group_t, fragment_tree));
+    quicrq_fragment_cache_t* cached_media = group->cache_ctx;
+    quicrq_cached_fragment_t* fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(node);
+
+    quicrq_fragment_cache_unlink_in_order(cached_media, fragment);
+
+    if (fragment->offset == 0) {
+        quicrq_fragment_cache_object_remove(cached_media, fragment);
+    }
+    cached_media->nb_cached_fragments--;
+
+    if (fragment->nb_refs > 0) {
+        /* Still referenced, the memory will be freed when the last reference is dropped */
+        fragment->is_deleted = 1;
+    }
+    else {
+        size_t reserved_before = group->slab.bytes_reserved;
+        quicrq_fragment_slab_free(&group->slab, fragment);
+        quicrq_fragment_cache_memory_update(cached_media, reserved_before, group->slab.bytes_reserved);
+    }
+}
+
+/* Management of the group segments.
+ * The groups are kept in a splay ordered by group_id, which is used to walk
+ * through the groups in order. The ring is an index of the groups by group_id
+ * modulo its size. When two groups map to the same slot, the slot holds the
+ * last one created or found, and the other one is found through the splay.
+ * The ring is doubled when the number of groups exceeds its size, so its size
+ * does not depend on the distance between the group ids.
+ */
+#define QUICRQ_GROUP_RING_SIZE_MIN 8
+
+static void* quicrq_fragment_cache_group_node_value(picosplay_node_t* group_node)
+{
+    return (group_node == NULL) ? NULL : (void*)((char*)group_node - offsetof(struct st_quicrq_cached_group_t, group_node));
+}
+
+static int64_t quicrq_fragment_cache_group_node_compare(void* l, void* r)
+{
+    uint64_t l_group_id = ((quicrq_cached_group_t*)l)->group_id;
+    uint64_t r_group_id = ((quicrq_cached_group_t*)r)->group_id;
+
+    /* Group ids may be far apart, the difference would not fit in an int64_t */
+    return (l_group_id < r_group_id) ? -1 : ((l_group_id > r_group_id) ? 1 : 0);
+}
+
+static picosplay_node_t* quicrq_fragment_cache_group_node_create(void* v_group)
+{
+    return &((quicrq_cached_group_t*)v_group)->group_node;
+}
+
+static void quicrq_fragment_cache_group_node_delete(void* tree, picosplay_node_t* node)
+{
+    /* The group memory is released with quicrq_fragment_cache_group_free */
+    (void)tree;
+    memset(node, 0, sizeof(picosplay_node_t));
+}
+
+quicrq_cached_group_t* quicrq_fragment_cache_get_group(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id)
+{
+    quicrq_cached_group_t* group = NULL;
+
+    if (cache_ctx->nb_cached_groups > 0 &&
+        group_id >= cache_ctx->ring_first_group_id &&
+        group_id <= cache_ctx->ring_last_group_id) {
+        quicrq_cached_group_t** slot = &cache_ctx->group_ring[group_id & (cache_ctx->group_ring_size - 1)];
+
+        group = *slot;
+        if (group == NULL || group->group_id != group_id) {
+            quicrq_cached_group_t key;
+            key.group_id = group_id;
+            group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(
+                picosplay_find(&cache_ctx->group_tree, &key));
+            if (group != NULL) {
+                *slot = group;
+            }
+        }
+    }
+    return group;
+}
+
+/* First group with a group_id strictly higher than group_id, or NULL */
+static quicrq_cached_group_t* quicrq_fragment_cache_next_group(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id)
+{
+    quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+    picosplay_node_t* group_node = NULL;
+
+    if (group != NULL) {
+        group_node = picosplay_next(&group->group_node);
+    }
+    else if (cache_ctx->nb_cached_groups > 0 && group_id < cache_ctx->ring_last_group_id) {
+        quicrq_cached_group_t key;
+        key.group_id = group_id;
+        group_node = picosplay_find_previous(&cache_ctx->group_tree, &key);
+        group_node = (group_node == NULL) ? picosplay_first(&cache_ctx->group_tree) : picosplay_next(group_node);
+    }
+    return (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(group_node);
+}
+
+static int quicrq_fragment_cache_group_ring_resize(quicrq_fragment_cache_t* cache_ctx, size_t new_size)
+{
+    int ret = 0;
+    quicrq_cached_group_t** new_ring = (quicrq_cached_group_t**)malloc(new_size * sizeof(quicrq_cached_group_t*));
+
+    if (new_ring == NULL) {
+        ret = -1;
+    }
+    else {
+        picosplay_node_t* group_node = picosplay_first(&cache_ctx->group_tree);
+
+        memset(new_ring, 0, new_size * sizeof(quicrq_cached_group_t*));
+        while (group_node != NULL) {
+            quicrq_cached_group_t* group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(group_node);
+            new_ring[group->group_id & (new_size - 1)] = group;
+            group_node = picosplay_next(group_node);
+        }
+        if (cache_ctx->group_ring != NULL) {
+            free(cache_ctx->group_ring);
+        }
+        cache_ctx->group_ring = new_ring;
+        cache_ctx->group_ring_size = new_size;
+    }
+    return ret;
+}
+
+/* Splay of object reception states in a group. The states are allocated
+ * from the group slab, and released with it.
+ */
+static void* quicrq_fragment_cache_ranges_node_value(picosplay_node_t* object_node)
+{
+    return (object_node == NULL) ? NULL : (void*)((char*)object_node - offsetof(struct st_quicrq_cached_object_ranges_t, object_node));
+}
+
+static int64_t quicrq_fragment_cache_ranges_node_compare(void* l, void* r)
+{
+    return ((quicrq_cached_object_ranges_t*)l)->object_id - ((quicrq_cached_object_ranges_t*)r)->object_id;
+}
+
+static picosplay_node_t* quicrq_fragment_cache_ranges_node_create(void* v_object_ranges)
+{
+    return &((quicrq_cached_object_ranges_t*)v_object_ranges)->object_node;
+}
+
+static void quicrq_fragment_cache_ranges_node_delete(void* tree, picosplay_node_t* node)
+{
+    (void)tree;
+    memset(node, 0, sizeof(picosplay_node_t));
+}
+
+static quicrq_cached_object_ranges_t* quicrq_fragment_cache_ranges_find(quicrq_cached_group_t* group, uint64_t object_id)
+{
+    quicrq_cached_object_ranges_t* object_ranges = group->last_object_ranges;
+
+    if (object_ranges == NULL || object_ranges->object_id != object_id) {
+        quicrq_cached_object_ranges_t key = { 0 };
+        key.object_id = object_id;
+        object_ranges = (quicrq_cached_object_ranges_t*)quicrq_fragment_cache_ranges_node_value(
+            picosplay_find(&group->object_tree, &key));
+    }
+    return object_ranges;
+}
+
+/* Document the reception of the bytes [offset, offset + length) of an object.
+ * The ranges overlapping or adjacent to the new one are merged with it.
+ * Sets *is_completed if this completes the object.
+ */
+static int quicrq_fragment_cache_ranges_add(quicrq_cached_group_t* group, uint64_t object_id, uint64_t object_length,
+    uint64_t offset, uint64_t length, int* is_completed)
+{
+    int ret = 0;
+    quicrq_cached_object_ranges_t* object_ranges = quicrq_fragment_cache_ranges_find(group, object_id);
+
+    *is_completed = 0;
+    if (object_ranges == NULL) {
+        object_ranges = (quicrq_cached_object_ranges_t*)quicrq_fragment_slab_alloc(&group->slab, sizeof(quicrq_cached_object_ranges_t));
+        if (object_ranges == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(object_ranges, 0, sizeof(quicrq_cached_object_ranges_t));
+            object_ranges->object_id = object_id;
+            object_ranges->object_length = object_length;
+            object_ranges->ranges = object_ranges->ranges_inline;
+            object_ranges->nb_ranges_max = QUICRQ_OBJECT_RANGES_INLINE;
+            picosplay_insert(&group->object_tree, object_ranges);
+        }
+    }
+    if (ret == 0) {
+        uint64_t end = offset + length;
+        uint64_t covered = 0;
+        group->last_object_ranges = object_ranges;
+        size_t low = 0;
+        size_t high = object_ranges->nb_ranges;
+        size_t last;
+
+        /* Find the first range that ends at or after the new one starts */
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (object_ranges->ranges[middle].end < offset) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        /* Merge the ranges that overlap or touch the new one */
+        last = low;
+        while (last < object_ranges->nb_ranges && object_ranges->ranges[last].start <= end) {
+            if (object_ranges->ranges[last].start < offset) {
+                offset = object_ranges->ranges[last].start;
+            }
+            if (object_ranges->ranges[last].end > end) {
+                end = object_ranges->ranges[last].end;
+            }
+            covered += object_ranges->ranges[last].end - object_ranges->ranges[last].start;
+            last++;
+        }
+        if (last == low) {
+            /* No merge, a range is inserted */
+            if (object_ranges->nb_ranges >= object_ranges->nb_ranges_max) {
+                size_t new_max = 2 * object_ranges->nb_ranges_max;
+                quicrq_byte_range_t* new_ranges = (quicrq_byte_range_t*)quicrq_fragment_slab_alloc(&group->slab,
+                    new_max * sizeof(quicrq_byte_range_t));
+                if (new_ranges == NULL) {
+                    ret = -1;
+                }
+                else {
+                    memcpy(new_ranges, object_ranges->ranges, object_ranges->nb_ranges * sizeof(quicrq_byte_range_t));
+                    if (object_ranges->ranges != object_ranges->ranges_inline) {
+                        quicrq_fragment_slab_free(&group->slab, object_ranges->ranges);
+                    }
+                    object_ranges->ranges = new_ranges;
+                    object_ranges->nb_ranges_max = new_max;
+                }
+            }
+            if (ret == 0) {
+                memmove(&object_ranges->ranges[low + 1], &object_ranges->ranges[low],
+                    (object_ranges->nb_ranges - low) * sizeof(quicrq_byte_range_t));
+                object_ranges->nb_ranges++;
+            }
+        }
+        else if (last > low + 1) {
+            memmove(&object_ranges->ranges[low + 1], &object_ranges->ranges[last],
+                (object_ranges->nb_ranges - last) * sizeof(quicrq_byte_range_t));
+            object_ranges->nb_ranges -= last - low - 1;
+        }
+        if (ret == 0) {
+            object_ranges->ranges[low].start = offset;
+            object_ranges->ranges[low].end = end;
+            object_ranges->bytes_received += (end - offset) - covered;
+            if (!object_ranges->is_complete && object_ranges->bytes_received >= object_ranges->object_length) {
+                object_ranges->is_complete = 1;
+                *is_completed = 1;
+            }
+        }
+    }
+    return ret;
+}
+
+quicrq_cached_object_ranges_t* quicrq_fragment_cache_get_object_ranges(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id)
+{
+    quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+    return (group == NULL) ? NULL : quicrq_fragment_cache_ranges_find(group, object_id);
+}
+
+static quicrq_cached_group_t* quicrq_fragment_cache_group_create(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id)
+{
+    quicrq_cached_group_t* group = NULL;
+    uint64_t first_group_id = group_id;
+    uint64_t last_group_id = group_id;
+    int ret = 0;
+
+    if (cache_ctx->nb_cached_groups > 0) {
+        if (cache_ctx->ring_first_group_id < first_group_id) {
+            first_group_id = cache_ctx->ring_first_group_id;
+        }
+        if (cache_ctx->ring_last_group_id > last_group_id) {
+            last_group_id = cache_ctx->ring_last_group_id;
+        }
+    }
+    if (cache_ctx->group_ring_size == 0) {
+        ret = quicrq_fragment_cache_group_ring_resize(cache_ctx, QUICRQ_GROUP_RING_SIZE_MIN);
+    }
+    else if (cache_ctx->nb_cached_groups >= cache_ctx->group_ring_size) {
+        ret = quicrq_fragment_cache_group_ring_resize(cache_ctx, 2 * cache_ctx->group_ring_size);
+    }
+
+    if (ret == 0 && (group = (quicrq_cached_group_t*)malloc(sizeof(quicrq_cached_group_t))) != NULL) {
+        memset(group, 0, sizeof(quicrq_cached_group_t));
+        group->cache_ctx = cache_ctx;
+        group->group_id = group_id;
+        picosplay_init_tree(&group->fragment_tree, quicrq_fragment_cache_node_compare,
+            quicrq_fragment_cache_node_create, quicrq_fragment_cache_node_delete,
+            quicrq_fragment_cache_node_value);
+        picosplay_init_tree(&group->object_tree, quicrq_fragment_cache_ranges_node_compare,
+            quicrq_fragment_cache_ranges_node_create, quicrq_fragment_cache_ranges_node_delete,
+            quicrq_fragment_cache_ranges_node_value);
+        picosplay_insert(&cache_ctx->group_tree, group);
+        cache_ctx->group_ring[group_id & (cache_ctx->group_ring_size - 1)] = group;
+        cache_ctx->ring_first_group_id = first_group_id;
+        cache_ctx->ring_last_group_id = last_group_id;
+        cache_ctx->nb_cached_groups++;
+    }
+    return group;
+}
+
+/* Release a whole group segment.
+ * The fragments are still unlinked from the arrival order list and from the
+ * object directory, but they are not deleted from the splay, and their
+ * memory is released with the chunks of the group slab. If fragments
+ * of the group are still referenced, the release of the memory is
+ * deferred until the last reference is dropped.
+ */
+static void quicrq_fragment_cache_group_free(quicrq_cached_group_t* group)
+{
+    if (group->nb_refs > 0) {
+        /* Some fragments are still referenced, defer until the last reference is dropped */
+        group->cache_ctx = NULL;
+    }
+    else {
+        quicrq_fragment_slab_release(&group->slab);
+        free(group);
+    }
+}
+
+static void quicrq_fragment_cache_group_release(quicrq_fragment_cache_t* cache_ctx, quicrq_cached_group_t* group)
+{
+    size_t mask = cache_ctx->group_ring_size - 1;
+    picosplay_node_t* fragment_node = picosplay_first(&group->fragment_tree);
+
+    while (fragment_node != NULL) {
+        quicrq_cached_fragment_t* fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
+        quicrq_fragment_cache_unlink_in_order(cache_ctx, fragment);
+        if (fragment->offset == 0) {
+            quicrq_fragment_cache_object_remove(cache_ctx, fragment);
+        }
+        cache_ctx->nb_cached_fragments--;
+        fragment_node = picosplay_next(fragment_node);
+    }
+
+    quicrq_fragment_cache_memory_update(cache_ctx, group->slab.bytes_reserved, 0);
+    if (cache_ctx->group_ring[group->group_id & mask] == group) {
+        cache_ctx->group_ring[group->group_id & mask] = NULL;
+    }
+    picosplay_delete_hint(&cache_ctx->group_tree, &group->group_node);
+    cache_ctx->nb_cached_groups--;
+    if (cache_ctx->nb_cached_groups > 0) {
+        cache_ctx->ring_first_group_id = ((quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(
+            picosplay_first(&cache_ctx->group_tree)))->group_id;
+        cache_ctx->ring_last_group_id = ((quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(
+            picosplay_last(&cache_ctx->group_tree)))->group_id;
+    }
+    quicrq_fragment_cache_group_free(group);
+}
+
+void quicrq_fragment_cache_ref(quicrq_cached_fragment_t* fragment)
+{
+    fragment->nb_refs++;
+    fragment->group->nb_refs++;
+}
+
+void quicrq_fragment_cache_unref(quicrq_cached_fragment_t* fragment)
+{
+    quicrq_cached_group_t* group = fragment->group;
+
+    fragment->nb_refs--;
+    group->nb_refs--;
+    if (group->cache_ctx == NULL) {
+        /* The group was purged from the cache */
+        if (group->nb_refs <= 0) {
+            quicrq_fragment_slab_release(&group->slab);
+            free(group);
+        }
+    }
+    else if (fragment->nb_refs <= 0 && fragment->is_deleted) {
+        size_t reserved_before = group->slab.bytes_reserved;
+        quicrq_fragment_slab_free(&group->slab, fragment);
+        quicrq_fragment_cache_memory_update(group->cache_ctx, reserved_before, group->slab.bytes_reserved);
+    }
+}
+
+quicrq_cached_fragment_t* quicrq_fragment_cache_first_fragment(quicrq_fragment_cache_t* cache_ctx)
+{
+    quicrq_cached_fragment_t* fragment = NULL;
+    picosplay_node_t* group_node = picosplay_first(&cache_ctx->group_tree);
+
+    while (fragment == NULL && group_node != NULL) {
+        quicrq_cached_group_t* group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(group_node);
+        fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_first(&group->fragment_tree));
+        group_node = picosplay_next(group_node);
+    }
+    return fragment;
+}
+
+quicrq_cached_fragment_t* quicrq_fragment_cache_next_fragment(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t* fragment)
+{
+    uint64_t group_id = fragment->group_id;
+
+    fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_next(&fragment->fragment_node));
+    if (fragment == NULL) {
+        quicrq_cached_group_t* group = quicrq_fragment_cache_next_group(cache_ctx, group_id);
+        while (fragment == NULL && group != NULL) {
+            fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_first(&group->fragment_tree));
+            group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(picosplay_next(&group->group_node));
+        }
+    }
+    return fragment;
+}
+
+quicrq_cached_fragment_t* quicrq_fragment_cache_find_previous(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t offset)
+{
+    quicrq_cached_fragment_t* fragment = NULL;
+
+    if (cache_ctx->nb_cached_groups > 0 && group_id >= cache_ctx->ring_first_group_id) {
+        quicrq_cached_group_t* group;
+
+        if (group_id > cache_ctx->ring_last_group_id) {
+            group_id = cache_ctx->ring_last_group_id;
+            object_id = UINT64_MAX;
+            offset = UINT64_MAX;
+        }
+        group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+        if (group != NULL) {
+            quicrq_cached_fragment_t key = { 0 };
+            key.group_id = group_id;
+            key.object_id = object_id;
+            key.offset = offset;
+            fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_find_previous(&group->fragment_tree, &key));
+        }
+        else {
+            /* Start from the last group before group_id */
+            quicrq_cached_group_t key;
+            key.group_id = group_id;
+            group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(
+                picosplay_find_previous(&cache_ctx->group_tree, &key));
+            if (group != NULL) {
+                fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_last(&group->fragment_tree));
+            }
+        }
+        while (fragment == NULL && group != NULL) {
+            group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(picosplay_previous(&group->group_node));
+            if (group != NULL) {
+                fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_last(&group->fragment_tree));
+            }
+        }
+    }
+    return fragment;
+}
+
+void quicrq_fragment_cache_get_memory_stats(quicrq_fragment_cache_t* cache_ctx,
+    size_t* bytes_reserved, size_t* bytes_live, size_t* nb_chunks)
+{
+    *bytes_reserved = 0;
+    *bytes_live = 0;
+    *nb_chunks = 0;
+    for (picosplay_node_t* group_node = picosplay_first(&cache_ctx->group_tree); group_node != NULL;
+        group_node = picosplay_next(group_node)) {
+        quicrq_cached_group_t* group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(group_node);
+        *bytes_reserved += group->slab.bytes_reserved;
+        *bytes_live += group->slab.bytes_live;
+        *nb_chunks += group->slab.nb_chunks;
+    }
 }
 
 quicrq_cached_fragment_t* quicrq_fragment_cache_get_fragment(quicrq_fragment_cache_t* cache_ctx,
     uint64_t group_id, uint64_t object_id, uint64_t offset)
 {
-    quicrq_cached_fragment_t key = { 0 };
-    key.group_id = group_id;
-    key.object_id = object_id;
-    key.offset = offset;
-    picosplay_node_t* fragment_node = picosplay_find(&cache_ctx->fragment_tree, &key);
-    return (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
+    quicrq_cached_fragment_t* fragment = NULL;
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+
+    if (cached_object != NULL) {
+        /* Walk the fragments of the object in order. This does not rotate the splay. */
+        picosplay_node_t* fragment_node = &cached_object->first_fragment->fragment_node;
+        while (fragment_node != NULL) {
+            quicrq_cached_fragment_t* fragment_state = 
+                (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
+            if (fragment_state->group_id != group_id ||
+                fragment_state->object_id != object_id ||
+                fragment_state->offset > offset) {
+                break;
+            }
+            else if (fragment_state->offset == offset) {
+                fragment = fragment_state;
+                break;
+            }
+            fragment_node = picosplay_next(fragment_node);
+        }
+    }
+    else if (offset > 0) {
+        /* The first fragment of the object is missing, search the fragments of the group. */
+        quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+
+        if (group != NULL) {
+            quicrq_cached_fragment_t key = { 0 };
+            key.group_id = group_id;
+            key.object_id = object_id;
+            key.offset = offset;
+            fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_find(&group->fragment_tree, &key));
+        }
+    }
+    return fragment;
+}
+
+/* Check whether the read cursor can be used as a starting point for a lookup
+ * of group_id/object_id/offset. The reference held by the cursor guarantees that
+ * the fragment memory is valid, but the fragment may have been deleted, or its
+ * group purged from the cache.
+ */
+static quicrq_cached_fragment_t* quicrq_fragment_cursor_start(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t* cursor, uint64_t group_id, uint64_t object_id, uint64_t offset)
+{
+    quicrq_cached_fragment_t* fragment = NULL;
+
+    if (cursor != NULL && !cursor->is_deleted && cursor->group->cache_ctx == cache_ctx &&
+        cursor->group_id == group_id && cursor->object_id == object_id && cursor->offset <= offset) {
+        fragment = cursor;
+    }
+    else {
+        quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+        if (cached_object != NULL) {
+            fragment = cached_object->first_fragment;
+        }
+    }
+    return fragment;
+}
+
+static void quicrq_fragment_cursor_set(quicrq_cached_fragment_t** p_cursor, quicrq_cached_fragment_t* fragment)
+{
+    if (*p_cursor != fragment) {
+        quicrq_cached_fragment_t* previous = *p_cursor;
+        quicrq_fragment_cache_ref(fragment);
+        *p_cursor = fragment;
+        if (previous != NULL) {
+            quicrq_fragment_cache_unref(previous);
+        }
+    }
+}
+
+void quicrq_fragment_cursor_release(quicrq_cached_fragment_t** p_cursor)
+{
+    if (*p_cursor != NULL) {
+        quicrq_fragment_cache_unref(*p_cursor);
+        *p_cursor = NULL;
+    }
+}
+
+quicrq_cached_fragment_t* quicrq_fragment_cursor_get_fragment(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t** p_cursor, uint64_t group_id, uint64_t object_id, uint64_t offset)
+{
+    quicrq_cached_fragment_t* fragment = NULL;
+    quicrq_cached_fragment_t* fragment_state = quicrq_fragment_cursor_start(cache_ctx, *p_cursor, group_id, object_id, offset);
+
+    while (fragment_state != NULL) {
+        if (fragment_state->group_id != group_id ||
+            fragment_state->object_id != object_id ||
+            fragment_state->offset > offset) {
+            break;
+        }
+        else if (fragment_state->offset == offset) {
+            fragment = fragment_state;
+            quicrq_fragment_cursor_set(p_cursor, fragment);
+            break;
+        }
+        fragment_state = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(
+            picosplay_next(&fragment_state->fragment_node));
+    }
+    return fragment;
 }
 
 void quicrq_fragment_cache_media_clear(quicrq_fragment_cache_t* cached_media)
 {
+    picosplay_node_t* group_node;
+
     cached_media->first_fragment = NULL;
     cached_media->last_fragment = NULL;
-    picosplay_empty_tree(&cached_media->fragment_tree);
+    /* Release the group segments without visiting the fragments */
+    while ((group_node = picosplay_first(&cached_media->group_tree)) != NULL) {
+        quicrq_cached_group_t* group = (quicrq_cached_group_t*)quicrq_fragment_cache_group_node_value(group_node);
+        picosplay_delete_hint(&cached_media->group_tree, group_node);
+        quicrq_fragment_cache_group_free(group);
+    }
+    if (cached_media->group_ring != NULL) {
+        free(cached_media->group_ring);
+        cached_media->group_ring = NULL;
+    }
+    cached_media->group_ring_size = 0;
+    cached_media->nb_cached_groups = 0;
+    cached_media->nb_cached_fragments = 0;
+    quicrq_fragment_cache_memory_update(cached_media, cached_media->bytes_reserved, 0);
+    if (cached_media->object_directory != NULL) {
+        free(cached_media->object_directory);
+        cached_media->object_directory = NULL;
+    }
+    cached_media->object_directory_size = 0;
+    cached_media->nb_cached_objects = 0;
+    while (cached_media->first_truncated_group != NULL) {
+        quicrq_truncated_group_t* truncated = cached_media->first_truncated_group;
+        cached_media->first_truncated_group = truncated->next_truncated_group;
+        free(truncated);
+    }
 }
 
 void quicrq_fragment_cache_media_init(quicrq_fragment_cache_t* cached_media)
 {
-    picosplay_init_tree(&cached_media->fragment_tree, quicrq_fragment_cache_node_compare,
-        quicrq_fragment_cache_node_create, quicrq_fragment_cache_node_delete,
-        quicrq_fragment_cache_node_value);
-}
+    /* The group ring and the object directory are allocated on first use */
+    picosplay_init_tree(&cached_media->group_tree, quicrq_fragment_cache_group_node_compare,
+        quicrq_fragment_cache_group_node_create, quicrq_fragment_cache_group_node_delete,
+        quicrq_fragment_cache_group_node_value);
+    cached_media->group_ring = NULL;
+    cached_media->group_ring_size = 0;
+    cached_media->nb_cached_groups = 0;
+    cached_media->nb_cached_fragments = 0;
+}
+
+
+/* Check whether a fragment is the next expected one in media order: the next
+ * offset in the next object, or the first fragment of the next group once all
+ * the objects of the current group have been received.
+ */
+static int quicrq_fragment_cache_is_next_expected(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t offset, uint64_t nb_objects_previous_group)
+{
+    return ((group_id == cache_ctx->next_group_id &&
+        object_id == cache_ctx->next_object_id &&
+        offset == cache_ctx->next_offset) ||
+        (group_id == (cache_ctx->next_group_id + 1) &&
+            object_id == 0 &&
+            offset == 0 &&
+            cache_ctx->next_object_id > 0 &&
+            cache_ctx->next_offset == 0 &&
+            cache_ctx->next_object_id == nb_objects_previous_group));
+}
+
+/* Move the "next" items past the fragment, if it is the next expected one */
+static int quicrq_fragment_cache_progress_one(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t* fragment)
+{
+    int is_expected = quicrq_fragment_cache_is_next_expected(cache_ctx, fragment->group_id, fragment->object_id,
+        fragment->offset, fragment->nb_objects_previous_group);
 
+    if (is_expected) {
+        uint64_t next_offset;
+        if (fragment->group_id != cache_ctx->next_group_id) {
+            cache_ctx->next_group_id += 1;
+            cache_ctx->next_object_id = 0;
+            cache_ctx->next_offset = 0;
+        }
+        next_offset = cache_ctx->next_offset + fragment->data_length;
+        if (next_offset >= fragment->object_length) {
+            cache_ctx->next_object_id += 1;
+            cache_ctx->next_offset = 0;
+        }
+        else {
+            cache_ctx->next_offset = next_offset;
+        }
+    }
+    return is_expected;
+}
 
-/* Fragment cache progress.
- * Manage the "next_group" and "next_object" items.
- * Also manage "highest group" and "highest object"
- */
-void quicrq_fragment_cache_progress(quicrq_fragment_cache_t* cache_ctx,
+static void quicrq_fragment_cache_highest_update(quicrq_fragment_cache_t* cache_ctx,
     quicrq_cached_fragment_t* fragment)
 {
-    /* Check whether the next object is present */
-    picosplay_node_t* next_fragment_node = &fragment->fragment_node;
-
     if (fragment->group_id > cache_ctx->highest_group_id ||
         (fragment->group_id == cache_ctx->highest_group_id &&
             fragment->object_id > cache_ctx->highest_object_id)) {
@@ -117,46 +1112,199 @@ void quicrq_fragment_cache_progress(quicrq_fragment_cache_t* cache_ctx,
     if (fragment->flags > 0 && (cache_ctx->lowest_flags == 0 || cache_ctx->lowest_flags > fragment->flags)) {
         cache_ctx->lowest_flags = fragment->flags;
     }
+}
+
+/* Fragment cache progress.
+ * Manage the "next_group" and "next_object" items.
+ * Also manage "highest group" and "highest object"
+ */
+void quicrq_fragment_cache_progress(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t* fragment)
+{
+    /* Check whether the next object is present */
+    quicrq_cached_fragment_t* next_fragment = fragment;
+
+    quicrq_fragment_cache_highest_update(cache_ctx, fragment);
 
     do {
-        int is_expected = 0;
-        fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(next_fragment_node);
-        if (fragment == NULL) {
+        if (!quicrq_fragment_cache_progress_one(cache_ctx, next_fragment)) {
             break;
         }
-        if (fragment->group_id == cache_ctx->next_group_id &&
-            fragment->object_id == cache_ctx->next_object_id &&
-            fragment->offset == cache_ctx->next_offset) {
-            is_expected = 1;
+    } while ((next_fragment = quicrq_fragment_cache_next_fragment(cache_ctx, next_fragment)) != NULL);
+}
+
+/* Drop the fragments of an object of which only some bytes were received, so
+ * that a placeholder can be cached in its place. The publishers positioned on
+ * one of the dropped fragments are moved back: in datagram mode, to the last
+ * fragment received before them; in stream mode, to the object lookup, which
+ * then finds the placeholder. The number of objects in the previous group is
+ * kept from the first fragment of the object, if the placeholder does not carry it.
+ */
+static void quicrq_fragment_cache_drop_partial_object(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t* nb_objects_previous_group)
+{
+    quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+    quicrq_cached_object_ranges_t* object_ranges = (group == NULL) ? NULL : quicrq_fragment_cache_ranges_find(group, object_id);
+
+    if (object_ranges != NULL && !object_ranges->is_complete) {
+        quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+        quicrq_stream_ctx_t* stream_ctx = (cache_ctx->srce_ctx == NULL) ? NULL : cache_ctx->srce_ctx->first_stream;
+        quicrq_cached_fragment_t key = { 0 };
+        picosplay_node_t* fragment_node = NULL;
+        quicrq_cached_fragment_t* fragment = NULL;
+        size_t reserved_before = 0;
+
+        if (cached_object != NULL && *nb_objects_previous_group == 0) {
+            *nb_objects_previous_group = cached_object->nb_objects_previous_group;
+        }
+        while (stream_ctx != NULL) {
+            quicrq_fragment_publisher_context_t* media_ctx = stream_ctx->media_ctx;
+            if (media_ctx != NULL && media_ctx->current_fragment != NULL &&
+                media_ctx->current_fragment->group_id == group_id && media_ctx->current_fragment->object_id == object_id) {
+                if (stream_ctx->transport_mode == quicrq_transport_mode_datagram) {
+                    /* The fragments received before were already processed */
+                    fragment = media_ctx->current_fragment;
+                    while (fragment != NULL && fragment->group_id == group_id && fragment->object_id == object_id) {
+                        fragment = fragment->previous_in_order;
+                    }
+                    media_ctx->current_fragment = fragment;
+                    media_ctx->is_current_fragment_sent = (fragment != NULL);
+                }
+                else {
+                    media_ctx->current_fragment = NULL;
+                }
+                media_ctx->length_sent = 0;
+            }
+            stream_ctx = stream_ctx->next_stream_for_source;
+        }
+        /* Delete the fragments, last to first */
+        key.group_id = group_id;
+        key.object_id = object_id;
+        key.offset = UINT64_MAX;
+        while ((fragment_node = picosplay_find_previous(&group->fragment_tree, &key)) != NULL &&
+            (fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node))->object_id == object_id) {
+            picosplay_delete_hint(&group->fragment_tree, fragment_node);
         }
-        else if (fragment->group_id == (cache_ctx->next_group_id + 1) &&
-            fragment->object_id == 0 &&
-            fragment->offset == 0 &&
-            cache_ctx->next_object_id > 0 &&
-            cache_ctx->next_offset == 0 &&
-            cache_ctx->next_object_id == fragment->nb_objects_previous_group) {
-            cache_ctx->next_group_id += 1;
-            cache_ctx->next_object_id = 0;
+        /* Forget the byte ranges received */
+        if (group->last_object_ranges == object_ranges) {
+            group->last_object_ranges = NULL;
+        }
+        picosplay_delete_hint(&group->object_tree, &object_ranges->object_node);
+        reserved_before = group->slab.bytes_reserved;
+        if (object_ranges->ranges != object_ranges->ranges_inline) {
+            quicrq_fragment_slab_free(&group->slab, object_ranges->ranges);
+        }
+        quicrq_fragment_slab_free(&group->slab, object_ranges);
+        quicrq_fragment_cache_memory_update(cache_ctx, reserved_before, group->slab.bytes_reserved);
+        /* In sequence progress resumes at the start of the object */
+        if (cache_ctx->next_group_id == group_id && cache_ctx->next_object_id == object_id) {
             cache_ctx->next_offset = 0;
-            is_expected = 1;
         }
-        if (is_expected) {
-            uint64_t next_offset = cache_ctx->next_offset + fragment->data_length;
-            if (next_offset >= fragment->object_length) {
-                cache_ctx->next_object_id += 1;
-                cache_ctx->next_offset = 0;
+    }
+}
+
+/* Eviction of groups when the cache memory budget is exceeded.
+ * A group can only be evicted if it is older than the groups read by all
+ * the subscribers of the cache. The position of a subscriber is the lowest
+ * of the current group of the publisher context, the group of the current
+ * fragment, the first object not yet acknowledged, and the groups sent
+ * on warp streams.
+ */
+static uint64_t quicrq_fragment_cache_lowest_read_group(quicrq_fragment_cache_t* cache_ctx)
+{
+    uint64_t lowest_group_id = UINT64_MAX;
+    quicrq_stream_ctx_t* stream_ctx = (cache_ctx->srce_ctx == NULL) ? NULL : cache_ctx->srce_ctx->first_stream;
+
+    while (stream_ctx != NULL) {
+        quicrq_fragment_publisher_context_t* media_ctx = stream_ctx->media_ctx;
+        quicrq_uni_stream_ctx_t* uni_stream_ctx = stream_ctx->first_uni_stream;
+
+        if (media_ctx != NULL) {
+            quicrq_fragment_publisher_object_state_t* first_object = quicrq_fragment_cache_node_value(picosplay_first(&media_ctx->publisher_object_tree));
+
+            if (media_ctx->current_group_id < lowest_group_id) {
+                lowest_group_id = media_ctx->current_group_id;
             }
-            else {
-                cache_ctx->next_offset = next_offset;
+            if (media_ctx->current_fragment != NULL && media_ctx->current_fragment->group_id < lowest_group_id) {
+                lowest_group_id = media_ctx->current_fragment->group_id;
+            }
+            if (first_object != NULL && first_object->group_id < lowest_group_id) {
+                lowest_group_id = first_object->group_id;
             }
         }
-        else {
-            break;
+        while (uni_stream_ctx != NULL) {
+            if (uni_stream_ctx->current_group_id < lowest_group_id) {
+                lowest_group_id = uni_stream_ctx->current_group_id;
+            }
+            uni_stream_ctx = uni_stream_ctx->next_uni_stream_for_control_stream;
         }
-    } while ((next_fragment_node = picosplay_next(next_fragment_node)) != NULL);
+        stream_ctx = stream_ctx->next_stream_for_source;
+    }
+    return lowest_group_id;
 }
 
-int quicrq_fragment_add_to_cache(quicrq_fragment_cache_t* cache_ctx,
+static void quicrq_fragment_cache_evict_first_group(quicrq_fragment_cache_t* cache_ctx)
+{
+    uint64_t evicted_group_id = cache_ctx->ring_first_group_id;
+    quicrq_cached_fragment_t* fragment;
+
+    quicrq_fragment_cache_group_release(cache_ctx, quicrq_fragment_cache_get_group(cache_ctx, evicted_group_id));
+
+    /* Fragments of the evicted group that arrive later shall be ignored. */
+    if ((fragment = quicrq_fragment_cache_first_fragment(cache_ctx)) != NULL) {
+        cache_ctx->first_group_id = fragment->group_id;
+        cache_ctx->first_object_id = fragment->object_id;
+    }
+    else {
+        cache_ctx->first_group_id = evicted_group_id + 1;
+        cache_ctx->first_object_id = 0;
+    }
+    /* If the evicted group was not complete, in sequence progress resumes after it. */
+    if (cache_ctx->next_group_id < cache_ctx->first_group_id) {
+        cache_ctx->next_group_id = cache_ctx->first_group_id;
+        cache_ctx->next_object_id = cache_ctx->first_object_id;
+        cache_ctx->next_offset = 0;
+        if (fragment != NULL) {
+            quicrq_fragment_cache_progress(cache_ctx, fragment);
+        }
+    }
+}
+
+/* Cache placeholders for the objects of a truncated group that were not fully
+ * received, if the number of objects in the group is known. The fragments of
+ * an object of which only some bytes were received are replaced by the placeholder.
+ */
+static int quicrq_fragment_cache_fill_truncated_group(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_truncated_group_t** p_truncated = &cache_ctx->first_truncated_group;
+    quicrq_truncated_group_t* truncated = NULL;
+    uint64_t nb_objects = quicrq_fragment_get_object_count(cache_ctx, group_id);
+
+    while ((truncated = *p_truncated) != NULL && truncated->group_id != group_id) {
+        p_truncated = &truncated->next_truncated_group;
+    }
+    if (truncated != NULL && nb_objects > 0) {
+        uint8_t placeholder = 0;
+
+        *p_truncated = truncated->next_truncated_group;
+        for (uint64_t object_id = truncated->object_id; ret == 0 && object_id < nb_objects; object_id++) {
+            quicrq_cached_object_ranges_t* object_ranges = quicrq_fragment_cache_get_object_ranges(cache_ctx, group_id, object_id);
+            if (object_ranges == NULL || !object_ranges->is_complete) {
+                ret = quicrq_fragment_propose_to_cache(cache_ctx, &placeholder, group_id, object_id, 0, 0, 0xff,
+                    (object_id == 0) ? truncated->nb_objects_previous_group : 0, 0, 0, current_time);
+            }
+        }
+        free(truncated);
+    }
+    return ret;
+}
+
+/* Add a fragment to the cache. If the fragment is known to be both the next expected one
+ * and after all the fragments already cached (is_appended), the progress is updated
+ * without walking through the following fragments.
+ */
+static int quicrq_fragment_cache_insert(quicrq_fragment_cache_t* cache_ctx,
     const uint8_t* data,
     uint64_t group_id,
     uint64_t object_id,
@@ -166,25 +1314,28 @@ int quicrq_fragment_add_to_cache(quicrq_fragment_cache_t* cache_ctx,
     uint64_t nb_objects_previous_group,
     uint64_t object_length,
     size_t data_length,
+    int is_appended,
     uint64_t current_time)
 {
     int ret = 0;
-    quicrq_cached_fragment_t* fragment = (quicrq_cached_fragment_t*)malloc(
-        sizeof(quicrq_cached_fragment_t) + data_length);
+    quicrq_cached_fragment_t* fragment = NULL;
+    quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+    size_t reserved_before = 0;
+
+    if (group == NULL) {
+        group = quicrq_fragment_cache_group_create(cache_ctx, group_id);
+    }
+    if (group != NULL) {
+        reserved_before = group->slab.bytes_reserved;
+        fragment = (quicrq_cached_fragment_t*)quicrq_fragment_slab_alloc(
+            &group->slab, sizeof(quicrq_cached_fragment_t) + data_length);
+    }
 
     if (fragment == NULL) {
         ret = -1;
     }
     else {
         memset(fragment, 0, sizeof(quicrq_cached_fragment_t));
-        if (cache_ctx->last_fragment == NULL) {
-            cache_ctx->first_fragment = fragment;
-        }
-        else {
-            fragment->previous_in_order = cache_ctx->last_fragment;
-            cache_ctx->last_fragment->next_in_order = fragment;
-        }
-        cache_ctx->last_fragment = fragment;
         fragment->group_id = group_id;
         fragment->object_id = object_id;
         fragment->offset = offset;
@@ -195,14 +1346,90 @@ int quicrq_fragment_add_to_cache(quicrq_fragment_cache_t* cache_ctx,
         fragment->object_length = object_length;
         fragment->data = ((uint8_t*)fragment) + sizeof(quicrq_cached_fragment_t);
         fragment->data_length = data_length;
+        fragment->group = group;
         memcpy(fragment->data, data, data_length);
-        picosplay_insert(&cache_ctx->fragment_tree, fragment);
-        quicrq_fragment_cache_progress(cache_ctx, fragment);
+        if (offset == 0 && quicrq_fragment_cache_object_add(cache_ctx, fragment) != 0) {
+            quicrq_fragment_slab_free(&group->slab, fragment);
+            ret = -1;
+        }
+        else {
+            if (cache_ctx->last_fragment == NULL) {
+                cache_ctx->first_fragment = fragment;
+            }
+            else {
+                fragment->previous_in_order = cache_ctx->last_fragment;
+                cache_ctx->last_fragment->next_in_order = fragment;
+            }
+            cache_ctx->last_fragment = fragment;
+            int is_completed = 0;
+            picosplay_insert(&group->fragment_tree, fragment);
+            cache_ctx->nb_cached_fragments++;
+            ret = quicrq_fragment_cache_ranges_add(group, object_id, object_length, offset, data_length, &is_completed);
+            if (is_completed) {
+                /* The object was just completely received. Keep counts. */
+                cache_ctx->nb_object_received += 1;
+            }
+            if (is_appended) {
+                quicrq_fragment_cache_highest_update(cache_ctx, fragment);
+                (void)quicrq_fragment_cache_progress_one(cache_ctx, fragment);
+            }
+            else {
+                quicrq_fragment_cache_progress(cache_ctx, fragment);
+            }
+        }
+        quicrq_fragment_cache_memory_update(cache_ctx, reserved_before, group->slab.bytes_reserved);
+    }
+    if (ret == 0 && object_id == 0 && offset == 0 && group_id > 0 && cache_ctx->first_truncated_group != NULL) {
+        /* The number of objects in the previous group is now known */
+        ret = quicrq_fragment_cache_fill_truncated_group(cache_ctx, group_id - 1, current_time);
     }
 
     return ret;
 }
 
+int quicrq_fragment_add_to_cache(quicrq_fragment_cache_t* cache_ctx,
+    const uint8_t* data,
+    uint64_t group_id,
+    uint64_t object_id,
+    uint64_t offset,
+    uint64_t queue_delay,
+    uint8_t flags,
+    uint64_t nb_objects_previous_group,
+    uint64_t object_length,
+    size_t data_length,
+    uint64_t current_time)
+{
+    return quicrq_fragment_cache_insert(cache_ctx, data, group_id, object_id, offset, queue_delay, flags,
+        nb_objects_previous_group, object_length, data_length, 0, current_time);
+}
+
+/* Fast path of quicrq_fragment_propose_to_cache: the fragment is the next
+ * expected one, and nothing is cached after it, which is the common case
+ * when fragments are received in order. There is no overlap to check, and the
+ * object is complete if the fragment reaches its end, since all the previous
+ * bytes are already received.
+ */
+static int quicrq_fragment_cache_is_appended(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t offset, uint64_t nb_objects_previous_group)
+{
+    int is_appended = 0;
+
+    if (quicrq_fragment_cache_is_next_expected(cache_ctx, group_id, object_id, offset, nb_objects_previous_group)) {
+        if (cache_ctx->nb_cached_groups == 0 || cache_ctx->ring_last_group_id < group_id) {
+            is_appended = 1;
+        }
+        else if (cache_ctx->ring_last_group_id == group_id) {
+            /* The last inserted fragment is at the root of the splay, so this is usually immediate */
+            quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+            quicrq_cached_fragment_t* last_fragment = (group == NULL) ? NULL :
+                (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_last(&group->fragment_tree));
+            is_appended = (last_fragment == NULL || last_fragment->object_id < object_id ||
+                (last_fragment->object_id == object_id && last_fragment->offset + last_fragment->data_length <= offset));
+        }
+    }
+    return is_appended;
+}
+
 int quicrq_fragment_propose_to_cache(quicrq_fragment_cache_t* cache_ctx,
     const uint8_t* data,
     uint64_t group_id,
@@ -228,10 +1455,23 @@ int quicrq_fragment_propose_to_cache(quicrq_fragment_cache_t* cache_ctx,
         /* This fragment is too old to be considered. */
         return 0;
     }
+    if (flags == 0xff && object_length == 0) {
+        /* A placeholder replaces the fragments of an object that was only partially received */
+        quicrq_fragment_cache_drop_partial_object(cache_ctx, group_id, object_id, &nb_objects_previous_group);
+    }
+    if (quicrq_fragment_cache_is_appended(cache_ctx, group_id, object_id, offset, nb_objects_previous_group)) {
+        ret = quicrq_fragment_cache_insert(cache_ctx, data, group_id, object_id, offset, queue_delay, flags,
+            nb_objects_previous_group, object_length, data_length, 1, current_time);
+        if (ret == 0) {
+            quicrq_source_wakeup(cache_ctx->srce_ctx);
+        }
+        return ret;
+    }
     key.group_id = group_id;
     key.object_id = object_id;
     key.offset = UINT64_MAX;
-    picosplay_node_t* last_fragment_node = picosplay_find_previous(&cache_ctx->fragment_tree, &key);
+    quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+    picosplay_node_t* last_fragment_node = (group == NULL) ? NULL : picosplay_find_previous(&group->fragment_tree, &key);
     do {
         first_fragment_state = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(last_fragment_node);
         if (first_fragment_state == NULL || 
@@ -251,8 +1491,8 @@ int quicrq_fragment_propose_to_cache(quicrq_fragment_cache_t* cache_ctx,
             if (offset + data_length > previous_last_byte) {
                 /* Some of the fragment data comes after this one. Submit */
                 size_t added_length = offset + data_length - previous_last_byte;
-                ret = quicrq_fragment_add_to_cache(cache_ctx, data, 
-                    group_id, object_id, offset, queue_delay, flags, nb_objects_previous_group, object_length, added_length, current_time);
+                ret = quicrq_fragment_add_to_cache(cache_ctx, data + (previous_last_byte - offset),
+                    group_id, object_id, previous_last_byte, queue_delay, flags, nb_objects_previous_group, object_length, added_length, current_time);
                 data_was_added = 1;
                 data_length -= added_length;
                 /* Previous group count is only used on first fragment */
@@ -275,37 +1515,6 @@ int quicrq_fragment_propose_to_cache(quicrq_fragment_cache_t* cache_ctx,
     if (ret == 0 && data_was_added) {
         /* Wake up the consumers of this source */
         quicrq_source_wakeup(cache_ctx->srce_ctx);
-        /* Check whether this object is now complete */
-        last_fragment_node = picosplay_find_previous(&cache_ctx->fragment_tree, &key);
-        first_fragment_state = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(last_fragment_node);
-        if (first_fragment_state != NULL) {
-            int last_is_final =
-                (first_fragment_state->offset + first_fragment_state->data_length) >=
-                first_fragment_state->object_length;
-            uint64_t previous_offset = first_fragment_state->offset;
-
-            while (last_is_final && previous_offset > 0) {
-                last_fragment_node = picosplay_previous(last_fragment_node);
-                if (last_fragment_node == NULL) {
-                    last_is_final = 0;
-                }
-                else {
-                    first_fragment_state = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(last_fragment_node);
-                    if (first_fragment_state->group_id != group_id ||
-                        first_fragment_state->object_id != object_id ||
-                        first_fragment_state->offset + first_fragment_state->data_length < previous_offset) {
-                        last_is_final = 0;
-                    }
-                    else {
-                        previous_offset = first_fragment_state->offset;
-                    }
-                }
-            }
-            if (last_is_final) {
-                /* The object was just completely received. Keep counts. */
-                cache_ctx->nb_object_received += 1;
-            }
-        }
     }
 
     return ret;
@@ -326,17 +1535,28 @@ int quicrq_fragment_cache_learn_start_point(quicrq_fragment_cache_t* cache_ctx,
         cache_ctx->next_group_id = start_group_id;
         cache_ctx->next_object_id = start_object_id;
     }
-    while ((first_fragment_node = picosplay_first(&cache_ctx->fragment_tree)) != NULL) {
-        quicrq_cached_fragment_t* first_fragment_state = 
-            (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(first_fragment_node);
-        if (first_fragment_state == NULL || 
-            first_fragment_state->group_id > start_group_id ||
-            (first_fragment_state->group_id == start_group_id &&
-                first_fragment_state->object_id >= start_object_id)) {
-            break;
+    while (cache_ctx->nb_cached_groups > 0 && cache_ctx->ring_first_group_id <= start_group_id) {
+        quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, cache_ctx->ring_first_group_id);
+        if (group->group_id < start_group_id) {
+            /* The whole group is before the start point */
+            quicrq_fragment_cache_group_release(cache_ctx, group);
         }
         else {
-            picosplay_delete_hint(&cache_ctx->fragment_tree, first_fragment_node);
+            /* Delete the objects of the start group that are before the start point */
+            while ((first_fragment_node = picosplay_first(&group->fragment_tree)) != NULL) {
+                quicrq_cached_fragment_t* first_fragment_state =
+                    (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(first_fragment_node);
+                if (first_fragment_state->object_id >= start_object_id) {
+                    break;
+                }
+                else {
+                    picosplay_delete_hint(&group->fragment_tree, first_fragment_node);
+                }
+            }
+            if (group->fragment_tree.root == NULL) {
+                quicrq_fragment_cache_group_release(cache_ctx, group);
+            }
+            break;
         }
     }
 
@@ -373,19 +1593,221 @@ int quicrq_fragment_cache_learn_end_point(quicrq_fragment_cache_t* cache_ctx,
     return ret;
 }
 
-int quicrq_fragment_cache_set_real_time_cache(quicrq_fragment_cache_t* cache_ctx)
+int quicrq_fragment_cache_learn_group_truncated(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t nb_objects_previous_group, uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_truncated_group_t* truncated = (quicrq_truncated_group_t*)malloc(sizeof(quicrq_truncated_group_t));
+
+    if (truncated == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(truncated, 0, sizeof(quicrq_truncated_group_t));
+        truncated->group_id = group_id;
+        truncated->object_id = object_id;
+        truncated->nb_objects_previous_group = nb_objects_previous_group;
+        truncated->next_truncated_group = cache_ctx->first_truncated_group;
+        cache_ctx->first_truncated_group = truncated;
+        ret = quicrq_fragment_cache_fill_truncated_group(cache_ctx, group_id, current_time);
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_set_object_expire_time(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t expire_time)
+{
+    int ret = 0;
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+
+    if (cached_object == NULL) {
+        ret = -1;
+    }
+    else {
+        cached_object->expire_time = expire_time;
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_learn_object_expired(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t nb_objects_previous_group, uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_cached_object_ranges_t* object_ranges = quicrq_fragment_cache_get_object_ranges(cache_ctx, group_id, object_id);
+
+    if (object_ranges == NULL || !object_ranges->is_complete) {
+        /* The placeholder replaces the fragments received, if any */
+        uint8_t placeholder = 0;
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, &placeholder, group_id, object_id, 0, 0, 0xff,
+            nb_objects_previous_group, 0, 0, current_time);
+    }
+    return ret;
+}
+
+/* Request the repair of the parts of an object that were not received */
+static int quicrq_fragment_cache_request_object_repair(quicrq_fragment_cache_t* cache_ctx, quicrq_stream_ctx_t* upstream_stream_ctx,
+    uint64_t group_id, uint64_t object_id)
+{
+    int ret = 0;
+    quicrq_cached_object_ranges_t* object_ranges = quicrq_fragment_cache_get_object_ranges(cache_ctx, group_id, object_id);
+
+    if (object_ranges == NULL) {
+        ret = quicrq_stream_request_repair(upstream_stream_ctx, group_id, object_id, 0, 0);
+    }
+    else if (!object_ranges->is_complete) {
+        uint64_t previous_end = 0;
+        for (size_t i = 0; ret == 0 && i < object_ranges->nb_ranges; i++) {
+            if (object_ranges->ranges[i].start > previous_end) {
+                ret = quicrq_stream_request_repair(upstream_stream_ctx, group_id, object_id, previous_end,
+                    object_ranges->ranges[i].start - previous_end);
+            }
+            previous_end = object_ranges->ranges[i].end;
+        }
+        if (ret == 0 && previous_end < object_ranges->object_length) {
+            ret = quicrq_stream_request_repair(upstream_stream_ctx, group_id, object_id, previous_end, 0);
+        }
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_check_repair(quicrq_fragment_cache_t* cache_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_stream_ctx_t* upstream_stream_ctx = cache_ctx->upstream_stream_ctx;
+
+    if (upstream_stream_ctx != NULL && upstream_stream_ctx->transport_mode == quicrq_transport_mode_datagram &&
+        current_time >= cache_ctx->repair_check_time) {
+        uint64_t group_id = cache_ctx->next_group_id;
+        uint64_t object_id = cache_ctx->next_object_id;
+        uint64_t check_interval = 0;
+
+        if (group_id < cache_ctx->first_group_id) {
+            group_id = cache_ctx->first_group_id;
+            object_id = cache_ctx->first_object_id;
+        }
+        while (ret == 0 && upstream_stream_ctx->nb_repair_ranges < QUICRQ_REPAIR_RANGES_MAX &&
+            (group_id < cache_ctx->repair_horizon_group_id ||
+            (group_id == cache_ctx->repair_horizon_group_id && object_id < cache_ctx->repair_horizon_object_id))) {
+            uint64_t nb_objects = (group_id < cache_ctx->repair_horizon_group_id) ?
+                quicrq_fragment_get_object_count(cache_ctx, group_id) : UINT64_MAX;
+            if (nb_objects == 0) {
+                /* The number of objects in the group is documented in the first object of the next group */
+                ret = quicrq_fragment_cache_request_object_repair(cache_ctx, upstream_stream_ctx, group_id + 1, 0);
+                break;
+            }
+            else if (object_id >= nb_objects) {
+                group_id++;
+                object_id = 0;
+            }
+            else {
+                ret = quicrq_fragment_cache_request_object_repair(cache_ctx, upstream_stream_ctx, group_id, object_id);
+                object_id++;
+            }
+        }
+        cache_ctx->repair_horizon_group_id = cache_ctx->highest_group_id;
+        cache_ctx->repair_horizon_object_id = cache_ctx->highest_object_id;
+        if (upstream_stream_ctx->cnx_ctx->cnx != NULL) {
+            check_interval = 2 * picoquic_get_rtt(upstream_stream_ctx->cnx_ctx->cnx);
+        }
+        if (check_interval < QUICRQ_REPAIR_CHECK_INTERVAL_MIN) {
+            check_interval = QUICRQ_REPAIR_CHECK_INTERVAL_MIN;
+        }
+        cache_ctx->repair_check_time = current_time + check_interval;
+    }
+    return ret;
+}
+
+/* Forward upstream the request for data that a relay does not hold.
+ * Only done if the media is received as datagrams, and only for objects below the
+ * repair horizon: data above it may still be in flight, and will be requested by
+ * the next check if it is still missing.
+ */
+static int quicrq_fragment_cache_forward_repair(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t offset, uint64_t length)
+{
+    int ret = 0;
+    quicrq_stream_ctx_t* upstream_stream_ctx = cache_ctx->upstream_stream_ctx;
+
+    if (upstream_stream_ctx != NULL && upstream_stream_ctx->transport_mode == quicrq_transport_mode_datagram &&
+        (group_id < cache_ctx->repair_horizon_group_id ||
+        (group_id == cache_ctx->repair_horizon_group_id && object_id < cache_ctx->repair_horizon_object_id))) {
+        ret = quicrq_stream_request_repair(upstream_stream_ctx, group_id, object_id, offset, length);
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_serve_repair(quicrq_stream_ctx_t* stream_ctx, const quicrq_repair_range_t* range, uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_fragment_cache_t* cache_ctx = stream_ctx->media_ctx->cache_ctx;
+    uint64_t covered = range->offset;
+    uint64_t end = (range->length == 0) ? UINT64_MAX : range->offset + range->length;
+    quicrq_cached_fragment_t* fragment = quicrq_fragment_cache_find_previous(cache_ctx, range->group_id, range->object_id, range->offset);
+
+    /* Start from the fragment that contains the offset, or from the next one */
+    if (fragment == NULL) {
+        fragment = quicrq_fragment_cache_first_fragment(cache_ctx);
+    }
+    else if (fragment->group_id != range->group_id || fragment->object_id != range->object_id ||
+        (fragment->object_length > 0 && fragment->offset + fragment->data_length <= range->offset)) {
+        fragment = quicrq_fragment_cache_next_fragment(cache_ctx, fragment);
+    }
+    while (ret == 0 && fragment != NULL && fragment->group_id == range->group_id && fragment->object_id == range->object_id) {
+        if (end > fragment->object_length) {
+            end = fragment->object_length;
+        }
+        if (fragment->object_length > 0 && fragment->offset >= end) {
+            break;
+        }
+        if (fragment->offset > covered) {
+            ret = quicrq_fragment_cache_forward_repair(cache_ctx, range->group_id, range->object_id,
+                covered, fragment->offset - covered);
+        }
+        if (ret == 0 && (fragment->object_length == 0 || fragment->offset + fragment->data_length > covered)) {
+            /* Queue the fragment, or the placeholder of a skipped object */
+            ret = quicrq_datagram_queue_repair(stream_ctx, fragment, current_time);
+            covered = fragment->offset + fragment->data_length;
+        }
+        fragment = quicrq_fragment_cache_next_fragment(cache_ctx, fragment);
+    }
+    if (ret == 0 && covered < end) {
+        ret = quicrq_fragment_cache_forward_repair(cache_ctx, range->group_id, range->object_id,
+            covered, (end == UINT64_MAX) ? 0 : end - covered);
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_set_real_time_cache(quicrq_fragment_cache_t* cache_ctx)
+{
+    int ret = 0;
+    quicrq_stream_ctx_t* stream_ctx = cache_ctx->srce_ctx->first_stream;
+    /* remember the policy */
+    cache_ctx->srce_ctx->is_cache_real_time = 1;
+    /* Set the cache policy for the dependent streams. */
+    while (stream_ctx != NULL && ret == 0) {
+        /* for each client waiting for data on this media,
+        * update the cache policy
+        * so the start point can be releayed. */
+        stream_ctx->is_cache_real_time = 1;
+        if (stream_ctx->cnx_ctx->cnx != NULL) {
+            ret = picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
+        }
+        stream_ctx = stream_ctx->next_stream_for_source;
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_set_latency_budget(quicrq_fragment_cache_t* cache_ctx, uint64_t latency_budget)
 {
     int ret = 0;
     quicrq_stream_ctx_t* stream_ctx = cache_ctx->srce_ctx->first_stream;
-    /* remember the policy */
-    cache_ctx->srce_ctx->is_cache_real_time = 1;
-    /* Set the cache policy for the dependent streams. */
+
+    cache_ctx->latency_budget = latency_budget;
+    /* Forward the budget on the dependent streams */
     while (stream_ctx != NULL && ret == 0) {
-        /* for each client waiting for data on this media,
-        * update the cache policy
-        * so the start point can be releayed. */
-        stream_ctx->is_cache_real_time = 1;
-        if (stream_ctx->cnx_ctx->cnx != NULL) {
+        stream_ctx->publisher_latency_budget = latency_budget;
+        stream_ctx->is_latency_budget_sent = 0;
+        if (stream_ctx->cnx_ctx->cnx != NULL && stream_ctx->send_state == quicrq_sending_ready) {
             ret = picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
         }
         stream_ctx = stream_ctx->next_stream_for_source;
@@ -402,44 +1824,58 @@ int quicrq_fragment_cache_set_real_time_cache(quicrq_fragment_cache_t* cache_ctx
 void quicrq_fragment_cache_media_purge_to_gob(
     quicrq_media_source_ctx_t* srce_ctx)
 {
-    picosplay_node_t* fragment_node;
+    quicrq_cached_fragment_t* fragment;
     quicrq_fragment_cache_t* cache_ctx = srce_ctx->cache_ctx;
     if (cache_ctx != NULL) {
         uint64_t kept_group_id = cache_ctx->next_group_id;
-        quicrq_stream_ctx_t* stream_ctx = srce_ctx->first_stream;
-
         /* Find the smallest GOB not currently read by active connections */
-        while (stream_ctx != NULL) {
-            quicrq_fragment_publisher_context_t* media_ctx = stream_ctx->media_ctx;
-            quicrq_fragment_publisher_object_state_t* first_object = quicrq_fragment_cache_node_value(picosplay_first(&media_ctx->publisher_object_tree));
+        uint64_t lowest_reader_group_id = quicrq_fragment_cache_lowest_reader_group(cache_ctx);
 
-            if (first_object != NULL && first_object->group_id < kept_group_id) {
-                kept_group_id = first_object->group_id;
-            }
-            stream_ctx = stream_ctx->next_stream_for_source;
+        if (lowest_reader_group_id < kept_group_id) {
+            kept_group_id = lowest_reader_group_id;
         }
 
         /* Purge all segments below that GOB. */
-        while ((fragment_node = picosplay_first(&cache_ctx->fragment_tree)) != NULL) {
-            /* Locate the first fragment in object order */
-            quicrq_cached_fragment_t* fragment =
-                (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
-            if (fragment->group_id >= kept_group_id) {
-                /* keep this fragment */
-                cache_ctx->first_group_id = fragment->group_id;
-                cache_ctx->first_object_id = fragment->object_id;
-                break;
-            }
-            else {
-                picosplay_delete_hint(&cache_ctx->fragment_tree, fragment_node);
+        while (cache_ctx->nb_cached_groups > 0 && cache_ctx->ring_first_group_id < kept_group_id) {
+            quicrq_fragment_cache_group_release(cache_ctx,
+                quicrq_fragment_cache_get_group(cache_ctx, cache_ctx->ring_first_group_id));
+        }
+        if ((fragment = quicrq_fragment_cache_first_fragment(cache_ctx)) != NULL) {
+            cache_ctx->first_group_id = fragment->group_id;
+            cache_ctx->first_object_id = fragment->object_id;
+        }
+    }
+}
+
+void quicrq_fragment_cache_enforce_memory_limit(quicrq_ctx_t* qr_ctx)
+{
+    quicrq_fragment_cache_t* cache_ctx = qr_ctx->first_lru_cache;
+
+    /* Subscribers do not move while groups are evicted, so the lowest read
+     * group of each cache is only computed once. */
+    while (cache_ctx != NULL && qr_ctx->cache_memory_limit > 0 &&
+        qr_ctx->cache_memory_used > qr_ctx->cache_memory_limit) {
+        if (cache_ctx->nb_cached_groups > 0) {
+            uint64_t lowest_read_group_id = quicrq_fragment_cache_lowest_read_group(cache_ctx);
+
+            while (cache_ctx->nb_cached_groups > 0 && cache_ctx->ring_first_group_id < lowest_read_group_id &&
+                qr_ctx->cache_memory_used > qr_ctx->cache_memory_limit) {
+                quicrq_fragment_cache_evict_first_group(cache_ctx);
             }
         }
+        cache_ctx = cache_ctx->next_lru_cache;
     }
+    /* If nothing more can be evicted, wait until the reserved memory grows again. */
+    qr_ctx->is_cache_memory_check_needed = 0;
 }
 
 void quicrq_fragment_cache_delete_ctx(quicrq_fragment_cache_t* cache_ctx)
 {
     quicrq_fragment_cache_media_clear(cache_ctx);
+    if (cache_ctx->qr_ctx != NULL) {
+        quicrq_fragment_cache_lru_unlink(cache_ctx);
+    }
+    free(cache_ctx->reader_heap);
 
     free(cache_ctx);
 }
@@ -453,6 +1889,16 @@ quicrq_fragment_cache_t* quicrq_fragment_cache_create_ctx(quicrq_ctx_t* qr_ctx)
         cache_ctx->subscribe_stream_id = UINT64_MAX;
         quicrq_fragment_cache_media_init(cache_ctx);
         cache_ctx->qr_ctx = qr_ctx;
+        if (qr_ctx != NULL) {
+            cache_ctx->next_lru_cache = qr_ctx->first_lru_cache;
+            if (qr_ctx->first_lru_cache == NULL) {
+                qr_ctx->last_lru_cache = cache_ctx;
+            }
+            else {
+                qr_ctx->first_lru_cache->previous_lru_cache = cache_ctx;
+            }
+            qr_ctx->first_lru_cache = cache_ctx;
+        }
     }
     return cache_ctx;
 }
@@ -508,6 +1954,133 @@ static void quicrq_fragment_publisher_object_node_delete(void* tree, picosplay_n
 }
 
 
+/* Reader positions.
+ * The purge of real time caches keeps all the groups that some subscriber
+ * may still send, i.e., groups at or above the group of the first object in
+ * the publisher_object_tree of that subscriber. Instead of scanning all the
+ * subscribers at each purge, each publisher context documents that group in
+ * reader_group_id, and the cache keeps the publisher contexts in a binary
+ * min-heap ordered by reader_group_id. Subscribers update their position
+ * when objects are added to or pruned from their tree.
+ */
+static void quicrq_fragment_reader_heap_set(quicrq_fragment_cache_t* cache_ctx, size_t index,
+    quicrq_fragment_publisher_context_t* media_ctx)
+{
+    cache_ctx->reader_heap[index] = media_ctx;
+    media_ctx->reader_heap_index = index;
+}
+
+static void quicrq_fragment_reader_heap_sift_up(quicrq_fragment_cache_t* cache_ctx, size_t index)
+{
+    quicrq_fragment_publisher_context_t* media_ctx = cache_ctx->reader_heap[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (cache_ctx->reader_heap[parent]->reader_group_id <= media_ctx->reader_group_id) {
+            break;
+        }
+        quicrq_fragment_reader_heap_set(cache_ctx, index, cache_ctx->reader_heap[parent]);
+        index = parent;
+    }
+    quicrq_fragment_reader_heap_set(cache_ctx, index, media_ctx);
+}
+
+static void quicrq_fragment_reader_heap_sift_down(quicrq_fragment_cache_t* cache_ctx, size_t index)
+{
+    quicrq_fragment_publisher_context_t* media_ctx = cache_ctx->reader_heap[index];
+
+    while (2 * index + 1 < cache_ctx->nb_readers) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < cache_ctx->nb_readers &&
+            cache_ctx->reader_heap[child + 1]->reader_group_id < cache_ctx->reader_heap[child]->reader_group_id) {
+            child++;
+        }
+        if (media_ctx->reader_group_id <= cache_ctx->reader_heap[child]->reader_group_id) {
+            break;
+        }
+        quicrq_fragment_reader_heap_set(cache_ctx, index, cache_ctx->reader_heap[child]);
+        index = child;
+    }
+    quicrq_fragment_reader_heap_set(cache_ctx, index, media_ctx);
+}
+
+static int quicrq_fragment_reader_heap_is_member(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_fragment_publisher_context_t* media_ctx)
+{
+    return cache_ctx != NULL && media_ctx->reader_heap_index < cache_ctx->nb_readers &&
+        cache_ctx->reader_heap[media_ctx->reader_heap_index] == media_ctx;
+}
+
+static int quicrq_fragment_reader_heap_insert(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_fragment_publisher_context_t* media_ctx)
+{
+    int ret = 0;
+
+    if (cache_ctx->nb_readers >= cache_ctx->reader_heap_size) {
+        size_t new_size = (cache_ctx->reader_heap_size == 0) ? 16 : 2 * cache_ctx->reader_heap_size;
+        quicrq_fragment_publisher_context_t** new_heap = (quicrq_fragment_publisher_context_t**)
+            realloc(cache_ctx->reader_heap, new_size * sizeof(quicrq_fragment_publisher_context_t*));
+        if (new_heap == NULL) {
+            ret = -1;
+        }
+        else {
+            cache_ctx->reader_heap = new_heap;
+            cache_ctx->reader_heap_size = new_size;
+        }
+    }
+    if (ret == 0) {
+        cache_ctx->nb_readers++;
+        quicrq_fragment_reader_heap_set(cache_ctx, cache_ctx->nb_readers - 1, media_ctx);
+        quicrq_fragment_reader_heap_sift_up(cache_ctx, cache_ctx->nb_readers - 1);
+    }
+    return ret;
+}
+
+static void quicrq_fragment_reader_heap_remove(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_fragment_publisher_context_t* media_ctx)
+{
+    if (quicrq_fragment_reader_heap_is_member(cache_ctx, media_ctx)) {
+        size_t index = media_ctx->reader_heap_index;
+
+        cache_ctx->nb_readers--;
+        if (index < cache_ctx->nb_readers) {
+            quicrq_fragment_reader_heap_set(cache_ctx, index, cache_ctx->reader_heap[cache_ctx->nb_readers]);
+            quicrq_fragment_reader_heap_sift_up(cache_ctx, index);
+            quicrq_fragment_reader_heap_sift_down(cache_ctx, cache_ctx->reader_heap[index]->reader_heap_index);
+        }
+        cache_ctx->reader_heap[cache_ctx->nb_readers] = NULL;
+    }
+}
+
+/* Update the position of a subscriber after its object tree changed.
+ * Contexts that are not registered in the heap of their cache, e.g.,
+ * created directly by test code, only update their reader_group_id.
+ */
+static void quicrq_fragment_publisher_reader_update(quicrq_fragment_publisher_context_t* media_ctx)
+{
+    quicrq_fragment_publisher_object_state_t* first_object = (quicrq_fragment_publisher_object_state_t*)
+        quicrq_fragment_publisher_object_node_value(picosplay_first(&media_ctx->publisher_object_tree));
+    uint64_t reader_group_id = (first_object == NULL) ? UINT64_MAX : first_object->group_id;
+
+    if (reader_group_id != media_ctx->reader_group_id) {
+        uint64_t previous_group_id = media_ctx->reader_group_id;
+        media_ctx->reader_group_id = reader_group_id;
+        if (quicrq_fragment_reader_heap_is_member(media_ctx->cache_ctx, media_ctx)) {
+            if (reader_group_id < previous_group_id) {
+                quicrq_fragment_reader_heap_sift_up(media_ctx->cache_ctx, media_ctx->reader_heap_index);
+            }
+            else {
+                quicrq_fragment_reader_heap_sift_down(media_ctx->cache_ctx, media_ctx->reader_heap_index);
+            }
+        }
+    }
+}
+
+uint64_t quicrq_fragment_cache_lowest_reader_group(quicrq_fragment_cache_t* cache_ctx)
+{
+    return (cache_ctx->nb_readers == 0) ? UINT64_MAX : cache_ctx->reader_heap[0]->reader_group_id;
+}
+
 quicrq_fragment_publisher_object_state_t* quicrq_fragment_publisher_object_add(quicrq_fragment_publisher_context_t* media_ctx,
     uint64_t group_id, uint64_t object_id, uint64_t object_length)
 {
@@ -520,6 +2093,7 @@ quicrq_fragment_publisher_object_state_t* quicrq_fragment_publisher_object_add(q
         publisher_object->object_id = object_id;
         publisher_object->object_length = object_length;
         picosplay_insert(&media_ctx->publisher_object_tree, publisher_object);
+        quicrq_fragment_publisher_reader_update(media_ctx);
     }
 
     return publisher_object;
@@ -539,7 +2113,9 @@ void quicrq_fragment_publisher_close(quicrq_fragment_publisher_context_t* media_
 {
     quicrq_fragment_cache_t * cache_ctx = media_ctx->cache_ctx;
 
+    quicrq_fragment_reader_heap_remove(cache_ctx, media_ctx);
     picosplay_empty_tree(&media_ctx->publisher_object_tree);
+    quicrq_fragment_cursor_release(&media_ctx->read_cursor);
 
     if (cache_ctx->is_feed_closed && cache_ctx->qr_ctx != NULL) {
         /* This may be the last connection served from this cache */
@@ -569,6 +2145,200 @@ int quicrq_fragment_is_ready_to_send(void* v_media_ctx, size_t data_max_size, ui
     return is_ready;
 }
 
+/* Position the publisher on the next fragment to send, in media order.
+ * On return, media_ctx->current_fragment is NULL if nothing is available yet.
+ */
+static void quicrq_fragment_publisher_position(quicrq_fragment_publisher_context_t* media_ctx,
+    int* is_new_group, int* is_media_finished, uint64_t current_time)
+{
+    if ((media_ctx->cache_ctx->final_group_id != 0 || media_ctx->cache_ctx->final_object_id != 0) &&
+        (media_ctx->current_group_id > media_ctx->cache_ctx->final_group_id ||
+            (media_ctx->current_group_id == media_ctx->cache_ctx->final_group_id &&
+                media_ctx->current_object_id >= media_ctx->cache_ctx->final_object_id))) {
+        *is_media_finished = 1;
+    }
+    else {
+        /* If skipping the current objet, check that the next object is available */
+        if (media_ctx->is_current_object_skipped) {
+
+            /* If the exact next object is present, then life if good. */
+            media_ctx->current_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx,
+                media_ctx->current_group_id, media_ctx->current_object_id + 1, 0);
+            if (media_ctx->current_fragment != NULL) {
+                media_ctx->current_object_id += 1;
+                media_ctx->current_offset = 0;
+                media_ctx->is_current_object_skipped = 0;
+            }
+            else {
+                /* If the next group is present & this is as expected, life is also good. */
+                quicrq_cached_fragment_t* next_group_fragment =
+                next_group_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx,
+                    media_ctx->current_group_id + 1, 0, 0);
+                if (next_group_fragment != NULL && 
+                    media_ctx->current_object_id + 1 >= next_group_fragment->nb_objects_previous_group) {
+                    /* The next group begins just after the skipped object, so life is good here too */
+                    if (media_ctx->track_set != NULL) {
+                        next_group_fragment = quicrq_track_set_next_group(media_ctx, media_ctx->current_group_id + 1,
+                            next_group_fragment);
+                    }
+                    media_ctx->current_group_id += 1;
+                    media_ctx->current_object_id = 0;
+                    media_ctx->current_offset = 0;
+                    media_ctx->is_current_object_skipped = 0;
+                    media_ctx->current_fragment = next_group_fragment;
+                    *is_new_group = 1;
+                }
+                else {
+                    if ((media_ctx->cache_ctx->final_group_id > 0 || media_ctx->cache_ctx->final_object_id > 0) &&
+                        (media_ctx->current_group_id > media_ctx->cache_ctx->final_group_id ||
+                            (media_ctx->current_group_id == media_ctx->cache_ctx->final_group_id &&
+                                (media_ctx->current_object_id + 1) >= media_ctx->cache_ctx->final_object_id))) {
+                        *is_media_finished = 1;
+                    }
+                }
+            }
+        } else if (media_ctx->current_fragment == NULL) {
+            if (media_ctx->current_offset > 0 &&
+                quicrq_fragment_get_flags(media_ctx->cache_ctx, media_ctx->current_group_id, media_ctx->current_object_id) == 0xff) {
+                /* The object was replaced by a placeholder after some of its bytes were sent */
+                media_ctx->current_offset = 0;
+            }
+            /* Find the fragment with the expected offset, resuming from the read cursor */
+            media_ctx->current_fragment = quicrq_fragment_cursor_get_fragment(media_ctx->cache_ctx, &media_ctx->read_cursor,
+                media_ctx->current_group_id, media_ctx->current_object_id, media_ctx->current_offset);
+            /* if there is no such fragment and this is the beginning of a new object, try the next group */
+            if (media_ctx->current_fragment == NULL && media_ctx->current_offset == 0) {
+                quicrq_cached_fragment_t* next_group_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx,
+                    media_ctx->current_group_id + 1, 0, 0);
+                if (next_group_fragment != NULL) {
+                    /* This is the first fragment of a new group. Check whether the objects from the
+                     * previous group have been all received. */
+                    if (media_ctx->current_object_id >= next_group_fragment->nb_objects_previous_group) {
+                        if (media_ctx->track_set != NULL) {
+                            /* The group is complete in the current layer, the next one may come from another layer */
+                            next_group_fragment = quicrq_track_set_next_group(media_ctx, media_ctx->current_group_id + 1,
+                                next_group_fragment);
+                        }
+                        media_ctx->current_fragment = next_group_fragment;
+                        media_ctx->current_group_id = media_ctx->current_group_id + 1;
+                        media_ctx->current_object_id = 0;
+                        media_ctx->current_offset = 0;
+                        *is_new_group = 1;
+                    }
+                    else {
+                        DBG_PRINTF("Group %" PRIu64 " is not complete, time= %" PRIu64, media_ctx->current_group_id, current_time);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Consume data_length bytes from the current position of the publisher, possibly
+ * spanning several consecutive fragments of the current object, as returned by
+ * quicrq_fragment_publisher_get_slices.
+ */
+void quicrq_fragment_publisher_consume(quicrq_fragment_publisher_context_t* media_ctx, size_t data_length, uint64_t current_time)
+{
+    quicrq_fragment_cache_set_read_time(media_ctx->cache_ctx, current_time);
+
+    while (media_ctx->current_fragment != NULL) {
+        quicrq_cached_fragment_t* fragment = media_ctx->current_fragment;
+        size_t available = fragment->data_length - media_ctx->length_sent;
+
+        if (data_length < available) {
+            media_ctx->length_sent += data_length;
+            break;
+        }
+        else {
+            size_t next_offset = media_ctx->current_offset + fragment->data_length;
+
+            data_length -= available;
+            media_ctx->length_sent = 0;
+            media_ctx->current_fragment = NULL;
+            quicrq_fragment_cursor_set(&media_ctx->read_cursor, fragment);
+            if (next_offset >= fragment->object_length) {
+                media_ctx->current_object_id++;
+                media_ctx->current_offset = 0;
+                break;
+            }
+            media_ctx->current_offset = next_offset;
+            if (data_length > 0) {
+                /* The next fragment was returned as a slice, so it is the next in the splay */
+                quicrq_cached_fragment_t* next_fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(
+                    picosplay_next(&fragment->fragment_node));
+                if (next_fragment != NULL && next_fragment->group_id == fragment->group_id &&
+                    next_fragment->object_id == fragment->object_id && next_fragment->offset == next_offset) {
+                    media_ctx->current_fragment = next_fragment;
+                }
+            }
+        }
+    }
+}
+
+int quicrq_fragment_publisher_get_slices(quicrq_fragment_publisher_context_t* media_ctx, size_t data_max_size,
+    quicrq_fragment_slice_t* slices, size_t nb_slices_max, size_t* nb_slices, size_t* data_length, uint8_t* flags,
+    int* is_new_group, uint64_t* object_length, int* is_media_finished, int* is_still_active, int* should_skip,
+    uint64_t current_time)
+{
+    *is_new_group = 0;
+    *is_media_finished = 0;
+    *object_length = 0;
+    *is_still_active = 0;
+    *data_length = 0;
+    *should_skip = 0;
+    *nb_slices = 0;
+
+    quicrq_fragment_publisher_position(media_ctx, is_new_group, is_media_finished, current_time);
+
+    if (!*is_media_finished && media_ctx->current_fragment != NULL) {
+        quicrq_cached_fragment_t* fragment = media_ctx->current_fragment;
+        size_t fragment_offset = media_ctx->length_sent;
+        uint64_t next_offset = media_ctx->current_offset;
+
+        *flags = fragment->flags;
+        *object_length = fragment->object_length;
+        *is_still_active = 1;
+        if (fragment->data_length > fragment_offset && fragment->object_id != 0 &&
+            media_ctx->stream_ctx->next_object_id != 0) {
+            *should_skip = quicrq_evaluate_stream_congestion(media_ctx, current_time);
+        }
+        if (!*should_skip && media_ctx->current_offset == 0 && media_ctx->length_sent == 0) {
+            /* Objects that are too late are skipped before any of their bytes is sent */
+            *should_skip = quicrq_evaluate_latency_budget(media_ctx->stream_ctx, media_ctx, fragment, current_time);
+        }
+        /* Collect the consecutive fragments of the current object, without copying them */
+        while (fragment != NULL && *data_length < data_max_size && *nb_slices < nb_slices_max) {
+            size_t copied = fragment->data_length - fragment_offset;
+            if (copied > data_max_size - *data_length) {
+                copied = data_max_size - *data_length;
+            }
+            if (copied > 0) {
+                slices[*nb_slices].data = fragment->data + fragment_offset;
+                slices[*nb_slices].length = copied;
+                *nb_slices += 1;
+                *data_length += copied;
+            }
+            next_offset += fragment->data_length;
+            if (next_offset >= fragment->object_length) {
+                break;
+            }
+            else {
+                quicrq_cached_fragment_t* next_fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(
+                    picosplay_next(&fragment->fragment_node));
+                if (next_fragment == NULL || next_fragment->group_id != fragment->group_id ||
+                    next_fragment->object_id != fragment->object_id || next_fragment->offset != next_offset ||
+                    next_fragment->flags != fragment->flags) {
+                    break;
+                }
+                fragment = next_fragment;
+                fragment_offset = 0;
+            }
+        }
+    }
+    return 0;
+}
+
 int quicrq_fragment_publisher_fn(
     quicrq_media_source_action_enum action,
     void* v_media_ctx,
@@ -598,115 +2368,31 @@ int quicrq_fragment_publisher_fn(
          * variable current_offset = current_offset sent.
          */
 
-        if ((media_ctx->cache_ctx->final_group_id != 0 || media_ctx->cache_ctx->final_object_id != 0) &&
-            (media_ctx->current_group_id > media_ctx->cache_ctx->final_group_id ||
-                (media_ctx->current_group_id == media_ctx->cache_ctx->final_group_id &&
-                    media_ctx->current_object_id >= media_ctx->cache_ctx->final_object_id))) {
-            *is_media_finished = 1;
-        }
-        else {
-            /* If skipping the current objet, check that the next object is available */
-            if (media_ctx->is_current_object_skipped) {
-
-                /* If the exact next object is present, then life if good. */
-                media_ctx->current_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx,
-                    media_ctx->current_group_id, media_ctx->current_object_id + 1, 0);
-                if (media_ctx->current_fragment != NULL) {
-                    media_ctx->current_object_id += 1;
-                    media_ctx->current_offset = 0;
-                    media_ctx->is_current_object_skipped = 0;
-                }
-                else {
-                    /* If the next group is present & this is as expected, life is also good. */
-                    quicrq_cached_fragment_t* next_group_fragment =
-                    next_group_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx,
-                        media_ctx->current_group_id + 1, 0, 0);
-                    if (next_group_fragment != NULL && 
-                        media_ctx->current_object_id + 1 >= next_group_fragment->nb_objects_previous_group) {
-                        /* The next group begins just after the skipped object, so life is good here too */
-                        media_ctx->current_group_id += 1;
-                        media_ctx->current_object_id = 0;
-                        media_ctx->current_offset = 0;
-                        media_ctx->is_current_object_skipped = 0;
-                        media_ctx->current_fragment = next_group_fragment;
-                        *is_new_group = 1;
-                    }
-                    else {
-                        if ((media_ctx->cache_ctx->final_group_id > 0 || media_ctx->cache_ctx->final_object_id > 0) &&
-                            (media_ctx->current_group_id > media_ctx->cache_ctx->final_group_id ||
-                                (media_ctx->current_group_id == media_ctx->cache_ctx->final_group_id &&
-                                    (media_ctx->current_object_id + 1) >= media_ctx->cache_ctx->final_object_id))) {
-                            *is_media_finished = 1;
-                        }
-                    }
-                }
-            } else if (media_ctx->current_fragment == NULL) {
-                /* Find the fragment with the expected offset */
-                media_ctx->current_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx, 
-                    media_ctx->current_group_id, media_ctx->current_object_id, media_ctx->current_offset);
-                /* if there is no such fragment and this is the beginning of a new object, try the next group */
-                if (media_ctx->current_fragment == NULL && media_ctx->current_offset == 0) {
-                    quicrq_cached_fragment_t* next_group_fragment = quicrq_fragment_cache_get_fragment(media_ctx->cache_ctx,
-                        media_ctx->current_group_id + 1, 0, 0);
-                    if (next_group_fragment != NULL) {
-                        /* This is the first fragment of a new group. Check whether the objects from the
-                         * previous group have been all received. */
-                        if (media_ctx->current_object_id >= next_group_fragment->nb_objects_previous_group) {
-                            media_ctx->current_fragment = next_group_fragment;
-                            media_ctx->current_group_id = media_ctx->current_group_id + 1;
-                            media_ctx->current_object_id = 0;
-                            media_ctx->current_offset = 0;
-                            *is_new_group = 1;
-                        }
-                        else {
-                            DBG_PRINTF("Group %" PRIu64 " is not complete, time= %" PRIu64, media_ctx->current_group_id, current_time);
-                        }
-                    }
-                }
-            }
-            if (media_ctx->current_fragment == NULL) {
-                /* Check for end of media maybe */
-            }
-            else {
-                size_t available = media_ctx->current_fragment->data_length - media_ctx->length_sent;
-                size_t copied = data_max_size;
-                int end_of_fragment = 0;
-
-                *flags = media_ctx->current_fragment->flags;
-                *object_length = media_ctx->current_fragment->object_length;
+        quicrq_fragment_publisher_position(media_ctx, is_new_group, is_media_finished, current_time);
 
-                if (data_max_size >= available) {
-                    end_of_fragment = 1;
-                    copied = available;
-                }
-                *data_length = copied;
-                *is_still_active = 1;
-                if (data == NULL) {
-                    if (available > 0 && media_ctx->current_fragment->object_id != 0 &&
-                        media_ctx->stream_ctx->next_object_id != 0 ) {
-                        *should_skip = quicrq_evaluate_stream_congestion(media_ctx, current_time);
-                    }
-                }
+        if (!*is_media_finished && media_ctx->current_fragment != NULL) {
+            size_t available = media_ctx->current_fragment->data_length - media_ctx->length_sent;
+            size_t copied = data_max_size;
 
-                if (data != NULL) {
-                    /* If data is set to NULL, return the available size but do not copy anything */
-                    memcpy(data, media_ctx->current_fragment->data + media_ctx->length_sent, copied);
-                    media_ctx->length_sent += copied;
-                    if (end_of_fragment) {
-                        size_t next_offset = media_ctx->current_offset + media_ctx->current_fragment->data_length;
-                        if (next_offset >= media_ctx->current_fragment->object_length) {
-                            media_ctx->current_object_id++;
-                            media_ctx->current_offset = 0;
-                        }
-                        else {
-                            media_ctx->current_offset = next_offset;
-                        }
+            *flags = media_ctx->current_fragment->flags;
+            *object_length = media_ctx->current_fragment->object_length;
 
-                        media_ctx->length_sent = 0;
-                        media_ctx->current_fragment = NULL;
-                    }
+            if (data_max_size >= available) {
+                copied = available;
+            }
+            *data_length = copied;
+            *is_still_active = 1;
+            if (data == NULL) {
+                if (available > 0 && media_ctx->current_fragment->object_id != 0 &&
+                    media_ctx->stream_ctx->next_object_id != 0 ) {
+                    *should_skip = quicrq_evaluate_stream_congestion(media_ctx, current_time);
                 }
             }
+            else {
+                /* If data is set to NULL, return the available size but do not copy anything */
+                memcpy(data, media_ctx->current_fragment->data + media_ctx->length_sent, copied);
+                quicrq_fragment_publisher_consume(media_ctx, copied, current_time);
+            }
         }
     }
     /* Skip object: if the logic has decided to skip this object, look at the next one */
@@ -747,6 +2433,9 @@ int quicrq_fragment_datagram_publisher_check_fragment(
             media_ctx->current_fragment = media_ctx->current_fragment->next_in_order;
         }
         media_ctx->is_current_fragment_sent = 0;
+        if (media_ctx->current_fragment != NULL) {
+            *should_skip = quicrq_evaluate_latency_budget(stream_ctx, media_ctx, media_ctx->current_fragment, current_time);
+        }
     }
     if (media_ctx->current_fragment == NULL) {
         /* Nothing to send yet */
@@ -773,6 +2462,9 @@ int quicrq_fragment_datagram_publisher_check_fragment(
                 else {
                     /* this is a new object. The fragment should be processed. */
                     *should_skip = quicrq_evaluate_datagram_congestion(stream_ctx, media_ctx, current_time);
+                    if (!*should_skip) {
+                        *should_skip = quicrq_evaluate_latency_budget(stream_ctx, media_ctx, media_ctx->current_fragment, current_time);
+                    }
                     break;
                 }
             }
@@ -822,6 +2514,7 @@ int quicrq_fragment_datagram_publisher_object_prune(
             }
         }
     }
+    quicrq_fragment_publisher_reader_update(media_ctx);
 
     return ret;
 }
@@ -882,18 +2575,35 @@ int quicrq_fragment_datagram_publisher_send_fragment(
     size_t space,
     int* media_was_sent,
     int* at_least_one_active,
-    int should_skip)
+    int should_skip,
+    uint64_t current_time)
 {
     int ret = 0;
     size_t offset = (should_skip) ? 0 : media_ctx->current_fragment->offset + media_ctx->length_sent;
     uint8_t datagram_header[QUICRQ_DATAGRAM_HEADER_MAX];
     uint8_t flags = (should_skip) ? 0xff : media_ctx->current_fragment->flags;
     uint64_t object_length = (should_skip) ? 0 : media_ctx->current_fragment->object_length;
+    uint64_t fec_sequence = quicrq_fec_sender_sequence(stream_ctx, media_ctx->current_fragment->group_id);
+    int use_compact_header = (stream_ctx != NULL && stream_ctx->use_compact_datagram_header);
+    uint64_t group_acked = (use_compact_header && stream_ctx->is_datagram_group_acked) ? stream_ctx->datagram_group_acked : UINT64_MAX;
+    /* The queue delay sent to the peer accumulates the time spent in the local cache */
+    uint64_t queue_delay = (quicrq_fragment_age(media_ctx->current_fragment, current_time) + 500) / 1000;
     size_t h_size = 0;
-    uint8_t* h_byte = quicrq_datagram_header_encode(datagram_header, datagram_header + QUICRQ_DATAGRAM_HEADER_MAX,
-        media_id, media_ctx->current_fragment->group_id, media_ctx->current_fragment->object_id, offset,
-        media_ctx->current_fragment->queue_delay, flags, media_ctx->current_fragment->nb_objects_previous_group,
-        object_length);
+    uint8_t* h_byte;
+    
+    if (use_compact_header) {
+        /* The data length is not known yet, get the largest header size */
+        h_byte = quicrq_datagram_compact_header_encode(datagram_header, datagram_header + QUICRQ_DATAGRAM_HEADER_MAX,
+            media_id, media_ctx->current_fragment->group_id, group_acked, stream_ctx->datagram_group_max,
+            media_ctx->current_fragment->object_id, offset, queue_delay, flags, media_ctx->current_fragment->nb_objects_previous_group,
+            object_length, SIZE_MAX, fec_sequence);
+    }
+    else {
+        h_byte = quicrq_datagram_header_encode(datagram_header, datagram_header + QUICRQ_DATAGRAM_HEADER_MAX,
+            media_id, media_ctx->current_fragment->group_id, media_ctx->current_fragment->object_id, offset,
+            queue_delay, flags, media_ctx->current_fragment->nb_objects_previous_group,
+            object_length, fec_sequence);
+    }
     if (h_byte == NULL) {
         /* Should never happen. */
         ret = -1;
@@ -915,13 +2625,29 @@ int quicrq_fragment_datagram_publisher_send_fragment(
                  */
                 available = media_ctx->current_fragment->data_length - media_ctx->length_sent;
                 copied = space - h_size;
+                if (fec_sequence != UINT64_MAX) {
+                    /* Leave room for the symbol header, so the repair datagram fits in the same space.
+                     * The repair datagram header is never longer than the source fragment header. */
+                    copied = (copied > QUICRQ_FEC_SYMBOL_HEADER) ? copied - QUICRQ_FEC_SYMBOL_HEADER : 0;
+                    if (copied > QUICRQ_FEC_DATA_MAX) {
+                        copied = QUICRQ_FEC_DATA_MAX;
+                    }
+                }
                 if (copied >= available) {
                     copied = available;
                 }
             }
+            if (use_compact_header) {
+                /* Encode again, omitting the fields implied by the data length. The header can only get shorter. */
+                h_byte = quicrq_datagram_compact_header_encode(datagram_header, datagram_header + QUICRQ_DATAGRAM_HEADER_MAX,
+                    media_id, media_ctx->current_fragment->group_id, group_acked, stream_ctx->datagram_group_max,
+                    media_ctx->current_fragment->object_id, offset, queue_delay, flags, media_ctx->current_fragment->nb_objects_previous_group,
+                    object_length, copied, fec_sequence);
+                h_size = h_byte - datagram_header;
+            }
             if (copied > 0 || should_skip || media_ctx->current_fragment->data_length == 0){
                 /* Get a buffer inside the datagram packet */
-                void* buffer = picoquic_provide_datagram_buffer(context, copied + h_size);
+                void* buffer = quicrq_provide_datagram_buffer(stream_ctx, context, copied + h_size);
                 if (buffer == NULL) {
                     ret = -1;
                 }
@@ -939,17 +2665,28 @@ int quicrq_fragment_datagram_publisher_send_fragment(
                         *at_least_one_active = 1;
                         if (stream_ctx != NULL) {
                             /* Keep track in stream context */
+                            stream_ctx->last_datagram_size = copied + h_size;
+                            if (media_ctx->current_fragment->group_id > stream_ctx->datagram_group_max) {
+                                stream_ctx->datagram_group_max = media_ctx->current_fragment->group_id;
+                            }
                             ret = quicrq_datagram_ack_init(stream_ctx,
                                 media_ctx->current_fragment->group_id,
                                 media_ctx->current_fragment->object_id, offset, flags,
                                 media_ctx->current_fragment->nb_objects_previous_group,
-                                ((uint8_t*)buffer) + h_size, copied,
-                                media_ctx->current_fragment->queue_delay, 
+                                media_ctx->current_fragment, copied,
+                                queue_delay, 
                                 media_ctx->current_fragment->object_length, NULL,
                                 picoquic_get_quic_time(stream_ctx->cnx_ctx->qr_ctx->quic));
                             if (ret != 0) {
                                 DBG_PRINTF("Datagram ack init returns %d", ret);
                             }
+                            else if (fec_sequence != UINT64_MAX) {
+                                ret = quicrq_fec_sender_add(stream_ctx, fec_sequence, media_ctx->current_fragment->group_id,
+                                    media_ctx->current_fragment->object_id, offset, object_length,
+                                    queue_delay, flags,
+                                    media_ctx->current_fragment->nb_objects_previous_group,
+                                    ((uint8_t*)buffer) + h_size, copied);
+                            }
                         }
                         if (ret == 0) {
                             ret = quicrq_fragment_datagram_publisher_object_update(media_ctx,
@@ -992,7 +2729,10 @@ int quicrq_fragment_datagram_publisher_prepare(
         /* Then send the object */
         if (ret == 0) {
             ret = quicrq_fragment_datagram_publisher_send_fragment(stream_ctx, media_ctx, media_id,
-                context, space, media_was_sent, at_least_one_active, should_skip);
+                context, space, media_was_sent, at_least_one_active, should_skip, current_time);
+            if (*media_was_sent) {
+                quicrq_fragment_cache_set_read_time(media_ctx->cache_ctx, current_time);
+            }
         }
     }
     return ret;
@@ -1032,7 +2772,7 @@ int quicrq_fragment_datagram_publisher_fn(
             stream_ctx->final_object_id = media_ctx->cache_ctx->final_object_id;
             /* Wake up the control stream so the final message can be sent. */
             picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
-            stream_ctx->is_active_datagram = 0;
+            quicrq_datagram_ready_queue_remove(stream_ctx);
         }
     }
 
@@ -1056,18 +2796,11 @@ void quicrq_fragment_notify_final_to_control(quicrq_fragment_cache_t* cache_ctx,
 uint64_t quicrq_fragment_get_object_count(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id)
 {
     /* Find whether the next object is in cache */
-    quicrq_cached_fragment_t key = { 0 };
-    picosplay_node_t* fragment_node;
     uint64_t nb_objects = 0;
-    key.group_id = group_id + 1;
-    key.object_id = 0;
-    key.offset = 0;
-    fragment_node = picosplay_find(&cache_ctx->fragment_tree, &key);
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id + 1, 0);
 
-    if (fragment_node != NULL) {
-        quicrq_cached_fragment_t* fragment_state =
-            (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
-        nb_objects = fragment_state->nb_objects_previous_group;
+    if (cached_object != NULL) {
+        nb_objects = cached_object->nb_objects_previous_group;
     }
     return nb_objects;
 }
@@ -1075,17 +2808,11 @@ uint64_t quicrq_fragment_get_object_count(quicrq_fragment_cache_t* cache_ctx, ui
 /* Get the object flags, or zero if the object is not available*/
 uint8_t quicrq_fragment_get_flags(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id)
 {
-    quicrq_cached_fragment_t key = { 0 };
-    picosplay_node_t* fragment_node;
     uint8_t flags = 0;
-    key.group_id = group_id;
-    key.object_id = object_id;
-    key.offset = 0;
-    fragment_node = picosplay_find(&cache_ctx->fragment_tree, &key);
-    if (fragment_node != NULL) {
-        quicrq_cached_fragment_t* fragment_state =
-            (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
-        flags = fragment_state->flags;
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+
+    if (cached_object != NULL) {
+        flags = cached_object->flags;
     }
     return flags;
 }
@@ -1097,40 +2824,53 @@ int quicrq_fragment_get_object_properties(quicrq_fragment_cache_t* cache_ctx, ui
     size_t* object_length, uint64_t* nb_objects_previous_group, uint8_t* flags)
 {
     int ret = -1;
-    quicrq_cached_fragment_t key = { 0 };
-    picosplay_node_t* fragment_node;
-    key.group_id = group_id;
-    key.object_id = object_id;
-    key.offset = 0;
-    fragment_node = picosplay_find(&cache_ctx->fragment_tree, &key);
-    if (fragment_node != NULL) {
-        quicrq_cached_fragment_t* fragment_state =
-            (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+
+    if (cached_object != NULL) {
         ret = 0;
-        *object_length = fragment_state->object_length;
-        *nb_objects_previous_group = fragment_state->nb_objects_previous_group;
-        *flags = fragment_state->flags;
+        *object_length = (size_t)cached_object->object_length;
+        *nb_objects_previous_group = cached_object->nb_objects_previous_group;
+        *flags = cached_object->flags;
     }
     return ret;
 }
 
-size_t quicrq_fragment_object_copy_available_data(quicrq_fragment_cache_t* cache_ctx, 
+/* Check whether the deadline for sending the object has passed */
+int quicrq_fragment_object_is_expired(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t current_time)
+{
+    int is_expired = 0;
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+
+    if (cached_object != NULL && cached_object->expire_time != 0 && current_time >= cached_object->expire_time) {
+        is_expired = 1;
+    }
+    return is_expired;
+}
+
+size_t quicrq_fragment_object_copy_available_data(quicrq_fragment_cache_t* cache_ctx, quicrq_cached_fragment_t** p_cursor,
     uint64_t group_id, uint64_t object_id, size_t offset, size_t available, uint8_t* buffer)
 {
     size_t fragment_size = 0;
     uint64_t current_offset = 0;
-    picosplay_node_t* fragment_node = NULL;
-    /* find the fragment tree for the group/object */
-    /* TODO: should start the lookup at the current offset. */
-    quicrq_cached_fragment_t key = { 0 };
-    key.group_id = group_id;
-    key.object_id = object_id;
-    key.offset = 0;
-    fragment_node = picosplay_find(&cache_ctx->fragment_tree, &key);
+    quicrq_cached_fragment_t* fragment_state = NULL;
+    /* Find the first fragment to read. The cursor is only ever set on fragments reached
+     * by reading the object in sequence from offset 0, so resuming from it preserves
+     * the check that the data is contiguous from the beginning of the object. */
+    if (p_cursor != NULL) {
+        fragment_state = quicrq_fragment_cursor_start(cache_ctx, *p_cursor, group_id, object_id, offset);
+    }
+    else {
+        quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+        if (cached_object != NULL) {
+            fragment_state = cached_object->first_fragment;
+        }
+    }
+    if (fragment_state != NULL) {
+        current_offset = fragment_state->offset;
+    }
 
-    while (fragment_node != NULL && fragment_size < available) {
-        quicrq_cached_fragment_t* fragment_state =
-            (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
+    while (fragment_state != NULL && fragment_size < available) {
         if (fragment_state->group_id != group_id || 
             fragment_state->object_id != object_id ||
             fragment_state->offset != current_offset) {
@@ -1148,9 +2888,13 @@ size_t quicrq_fragment_object_copy_available_data(quicrq_fragment_cache_t* cache
                 memcpy(buffer + fragment_size, fragment_state->data + offset_offset, copied);
             }
             fragment_size += copied;
+            if (p_cursor != NULL) {
+                quicrq_fragment_cursor_set(p_cursor, fragment_state);
+            }
         }
         current_offset += fragment_state->data_length;
-        fragment_node = picosplay_next(fragment_node);
+        fragment_state = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(
+            picosplay_next(&fragment_state->fragment_node));
     }
 
     return fragment_size;
@@ -1172,12 +2916,11 @@ size_t quicrq_fragment_object_copy(quicrq_fragment_cache_t* cache_ctx, uint64_t
     uint64_t current_offset = 0;
     picosplay_node_t* fragment_node = NULL;
 
-    /* find the fragment tree for the group/object */
-    quicrq_cached_fragment_t key = { 0 };
-    key.group_id = group_id;
-    key.object_id = object_id;
-    key.offset = 0;
-    fragment_node = picosplay_find(&cache_ctx->fragment_tree, &key);
+    /* find the first fragment of the group/object */
+    quicrq_cached_object_t* cached_object = quicrq_fragment_cache_get_object(cache_ctx, group_id, object_id);
+    if (cached_object != NULL) {
+        fragment_node = &cached_object->first_fragment->fragment_node;
+    }
     *nb_objects_previous_group = 0;
 
     while (fragment_node != NULL) {
@@ -1193,7 +2936,7 @@ size_t quicrq_fragment_object_copy(quicrq_fragment_cache_t* cache_ctx, uint64_t
         /* compute the object size and fill the passed in buffer, if non-null*/
         object_size += fragment_state->data_length;
         if (buffer != NULL) {
-            memcpy(buffer, fragment_state->data + current_offset, fragment_state->data_length);
+            memcpy(buffer + current_offset, fragment_state->data, fragment_state->data_length);
         }
         current_offset += fragment_state->data_length;
 
@@ -1226,15 +2969,45 @@ void* quicrq_fragment_publisher_subscribe(quicrq_fragment_cache_t* cache_ctx, qu
         picosplay_init_tree(&media_ctx->publisher_object_tree, quicrq_fragment_publisher_object_node_compare,
             quicrq_fragment_publisher_object_node_create, quicrq_fragment_publisher_object_node_delete,
             quicrq_fragment_publisher_object_node_value);
+        media_ctx->reader_group_id = UINT64_MAX;
+        if (quicrq_fragment_reader_heap_insert(cache_ctx, media_ctx) != 0) {
+            free(media_ctx);
+            media_ctx = NULL;
+        }
     }
     return media_ctx;
 }
 
+/* Move the publisher to another cache. This is only used by stream publishers,
+ * between two groups, so there is no object state to carry over. The cursor
+ * points to a fragment of the previous cache, and is released.
+ */
+int quicrq_fragment_publisher_set_cache(quicrq_fragment_publisher_context_t* media_ctx, quicrq_fragment_cache_t* cache_ctx)
+{
+    int ret = 0;
+    quicrq_fragment_cache_t* previous_cache_ctx = media_ctx->cache_ctx;
+
+    quicrq_fragment_reader_heap_remove(previous_cache_ctx, media_ctx);
+    if (quicrq_fragment_reader_heap_insert(cache_ctx, media_ctx) != 0) {
+        /* Stay on the previous cache. The heap has room since the publisher was just removed. */
+        (void)quicrq_fragment_reader_heap_insert(previous_cache_ctx, media_ctx);
+        ret = -1;
+    }
+    else {
+        quicrq_fragment_cursor_release(&media_ctx->read_cursor);
+        media_ctx->cache_ctx = cache_ctx;
+        if (previous_cache_ctx->is_feed_closed && previous_cache_ctx->qr_ctx != NULL) {
+            /* This may be the last connection served from the previous cache */
+            previous_cache_ctx->qr_ctx->is_cache_closing_needed = 1;
+        }
+    }
+    return ret;
+}
+
 void quicrq_fragment_publisher_delete(void* v_pub_ctx)
 {
-    quicrq_fragment_cache_t* cache_ctx = (quicrq_fragment_cache_t*)v_pub_ctx;
-    quicrq_fragment_cache_media_clear(cache_ctx);
-    free(cache_ctx);
+    /* Also removes the cache from the LRU list of the quicrq context */
+    quicrq_fragment_cache_delete_ctx((quicrq_fragment_cache_t*)v_pub_ctx);
 }
 
 int quicrq_publish_fragment_cached_media(quicrq_ctx_t* qr_ctx,
@@ -167,8 +167,23 @@ int quicrq_media_object_bridge_fn(
         }
         break;
     case quicrq_media_real_time_cache:
+    case quicrq_media_latency_budget:
         /* Nothing to do there. */
         break;
+    case quicrq_media_group_truncated:
+        ret = quicrq_reassembly_learn_group_truncated(&bridge_ctx->reassembly_ctx, group_id, object_id, nb_objects_previous_group,
+            current_time, quicrq_media_object_bridge_ready, bridge_ctx);
+        if (ret == 0 && bridge_ctx->reassembly_ctx.is_finished) {
+            ret = quicrq_consumer_finished;
+        }
+        break;
+    case quicrq_media_object_expired:
+        ret = quicrq_reassembly_learn_object_expired(&bridge_ctx->reassembly_ctx, group_id, object_id, nb_objects_previous_group,
+            current_time, quicrq_media_object_bridge_ready, bridge_ctx);
+        if (ret == 0 && bridge_ctx->reassembly_ctx.is_finished) {
+            ret = quicrq_consumer_finished;
+        }
+        break;
     case quicrq_media_start_point:
         ret = quicrq_reassembly_learn_start_point(&bridge_ctx->reassembly_ctx, group_id, object_id, current_time,
             quicrq_media_object_bridge_ready, bridge_ctx);
@@ -45,6 +45,7 @@ quicrq_media_object_source_ctx_t* quicrq_publish_object_source(quicrq_ctx_t* qr_
         if (object_source_ctx->cache_ctx == NULL) {
             ret = -1;
         } else {
+            object_source_ctx->cache_ctx->latency_budget = object_source_ctx->properties.latency_budget;
             /* create  qucirq_srce_media_ctx and set it on the cache_ctx */
             ret = quicrq_publish_fragment_cached_media(qr_ctx, object_source_ctx->cache_ctx, url, url_length, 1, object_source_ctx->properties.use_real_time_caching);
             /* If needs be, set the media start point. */
@@ -104,6 +105,10 @@ int quicrq_publish_object(
             object_data, object_source_ctx->next_group_id, object_source_ctx->next_object_id,
             /* offset */ 0, /* queue delay */ 0, properties->flags, nb_objects_previous_group,
             object_length, object_length, current_time);
+        if (ret == 0 && properties->ttl > 0) {
+            ret = quicrq_fragment_cache_set_object_expire_time(object_source_ctx->cache_ctx,
+                object_source_ctx->next_group_id, object_source_ctx->next_object_id, current_time + properties->ttl);
+        }
         if (ret == 0) {
             object_source_ctx->next_object_id++;
         }
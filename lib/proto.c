@@ -107,6 +107,11 @@ const uint8_t* quicrq_notify_msg_decode(const uint8_t* bytes, const uint8_t* byt
  *     intent_mode(i),
  *     [ start_group_id(i),
  *       start_object_id(i),]
+ *     [ datagram_header_mode(i) ]
+ *     latency_budget(i)
+ * 
+ * The datagram header mode is only present if the transport mode is datagram.
+ * The latency budget is expressed in milliseconds, 0 if there is no budget.
  * 
  * 
  * Same encoding and decoding code is used for both.
@@ -115,12 +120,12 @@ const uint8_t* quicrq_notify_msg_decode(const uint8_t* bytes, const uint8_t* byt
 size_t quicrq_rq_msg_reserve(size_t url_length, quicrq_subscribe_intent_enum intent_mode)
 {
     size_t intent_length = (intent_mode == quicrq_subscribe_intent_start_point) ? 17:1;
-    return 8 + 2 + url_length + 8 + 1 + intent_length;
+    return 8 + 2 + url_length + 8 + 1 + intent_length + 1 + 8;
 }
 
 uint8_t* quicrq_rq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, size_t url_length, const uint8_t* url,
     uint64_t media_id, quicrq_transport_mode_enum transport_mode, quicrq_subscribe_intent_enum intent_mode,
-    uint64_t start_group_id,  uint64_t start_object_id)
+    uint64_t start_group_id,  uint64_t start_object_id, uint64_t datagram_header_mode, uint64_t latency_budget)
 {
     if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, message_type)) != NULL &&
         (bytes = picoquic_frames_length_data_encode(bytes, bytes_max, url_length, url)) != NULL &&
@@ -132,13 +137,19 @@ uint8_t* quicrq_rq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t messa
                 bytes = picoquic_frames_varint_encode(bytes, bytes_max, (uint64_t)start_object_id);
             }
         }
+        if (bytes != NULL && transport_mode == quicrq_transport_mode_datagram) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, datagram_header_mode);
+        }
+        if (bytes != NULL) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, latency_budget);
+        }
     }
     return bytes;
 }
 
 const uint8_t* quicrq_rq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t * message_type, size_t * url_length, const uint8_t** url,
     uint64_t *media_id, quicrq_transport_mode_enum* transport_mode, quicrq_subscribe_intent_enum* intent_mode,
-    uint64_t *start_group_id, uint64_t *start_object_id)
+    uint64_t *start_group_id, uint64_t *start_object_id, uint64_t* datagram_header_mode, uint64_t* latency_budget)
 {
     uint64_t intent_64 = 0;
     uint64_t t_mode_64 = 0;
@@ -149,6 +160,8 @@ const uint8_t* quicrq_rq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_m
     *intent_mode = 0;
     *start_group_id = 0;
     *start_object_id = 0;
+    *datagram_header_mode = QUICRQ_DATAGRAM_HEADER_FULL;
+    *latency_budget = 0;
 
     if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, message_type)) != NULL &&
         (bytes = picoquic_frames_varlen_decode(bytes, bytes_max, url_length)) != NULL){
@@ -170,6 +183,12 @@ const uint8_t* quicrq_rq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_m
                         bytes = picoquic_frames_varint_decode(bytes, bytes_max, start_object_id);
                     }
                 }
+                if (bytes != NULL && *transport_mode == quicrq_transport_mode_datagram) {
+                    bytes = picoquic_frames_varint_decode(bytes, bytes_max, datagram_header_mode);
+                }
+                if (bytes != NULL) {
+                    bytes = picoquic_frames_varint_decode(bytes, bytes_max, latency_budget);
+                }
             }
         }
     }
@@ -214,6 +233,108 @@ const uint8_t* quicrq_fin_msg_decode(const uint8_t* bytes, const uint8_t* bytes_
     return bytes;
 }
 
+/* Encoding or decoding the repair request message
+ *
+ * quicrq_repair_request_message {
+ *     message_type(i),
+ *     nb_ranges(i),
+ *     ranges[nb_ranges] {
+ *         group_delta(i),
+ *         object_id_or_delta(i),
+ *         offset(i),
+ *         length(i)
+ *     }
+ * }
+ *
+ * The ranges are sorted by group_id, object_id and offset. The group_delta is
+ * the difference with the group_id of the previous range, or with 0 for the
+ * first range. If the group_delta is zero, the object_id is encoded as a
+ * difference with the object_id of the previous range. A length of 0 means
+ * "until the end of the object".
+ */
+
+size_t quicrq_repair_request_msg_reserve(size_t nb_ranges)
+{
+    /* Each range is encoded as at most 4 varints of 8 bytes */
+    size_t len = 1 + picoquic_frames_varint_encode_length(nb_ranges) + nb_ranges * 32;
+    return len;
+}
+
+uint8_t* quicrq_repair_request_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type,
+    size_t nb_ranges, const quicrq_repair_range_t* ranges)
+{
+    uint64_t previous_group_id = 0;
+    uint64_t previous_object_id = 0;
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, message_type)) != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, nb_ranges);
+    }
+    for (size_t i = 0; bytes != NULL && i < nb_ranges; i++) {
+        if (ranges[i].group_id < previous_group_id ||
+            (ranges[i].group_id == previous_group_id && ranges[i].object_id < previous_object_id)) {
+            /* Ranges are not sorted */
+            bytes = NULL;
+        }
+        else if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, ranges[i].group_id - previous_group_id)) != NULL &&
+            (bytes = picoquic_frames_varint_encode(bytes, bytes_max, (ranges[i].group_id == previous_group_id) ?
+                ranges[i].object_id - previous_object_id : ranges[i].object_id)) != NULL &&
+            (bytes = picoquic_frames_varint_encode(bytes, bytes_max, ranges[i].offset)) != NULL) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, ranges[i].length);
+        }
+        previous_group_id = ranges[i].group_id;
+        previous_object_id = ranges[i].object_id;
+    }
+    return bytes;
+}
+
+const uint8_t* quicrq_repair_range_decode(const uint8_t* bytes, const uint8_t* bytes_max, quicrq_repair_range_t* range)
+{
+    uint64_t group_delta = 0;
+    uint64_t object_id = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &group_delta)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &object_id)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range->offset)) != NULL) {
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range->length);
+    }
+    if (bytes != NULL) {
+        if (group_delta == 0) {
+            range->object_id += object_id;
+        }
+        else {
+            range->group_id += group_delta;
+            range->object_id = object_id;
+        }
+    }
+    return bytes;
+}
+
+const uint8_t* quicrq_repair_request_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type,
+    uint64_t* nb_ranges, size_t* ranges_length, const uint8_t** ranges_bytes)
+{
+    *nb_ranges = 0;
+    *ranges_length = 0;
+    *ranges_bytes = NULL;
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, message_type)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, nb_ranges)) != NULL) {
+        if (*nb_ranges == 0 || *nb_ranges > QUICRQ_REPAIR_RANGES_MAX) {
+            bytes = NULL;
+        }
+        else {
+            /* Check that all ranges can be decoded */
+            quicrq_repair_range_t range = { 0 };
+            *ranges_bytes = bytes;
+            for (uint64_t i = 0; bytes != NULL && i < *nb_ranges; i++) {
+                bytes = quicrq_repair_range_decode(bytes, bytes_max, &range);
+            }
+            if (bytes != NULL) {
+                *ranges_length = bytes - *ranges_bytes;
+            }
+        }
+    }
+    return bytes;
+}
+
 /* Encoding or decoding the fragment message
  *
  * quicrq_fragment_message {
@@ -365,6 +486,33 @@ const uint8_t* quicrq_cache_policy_msg_decode(const uint8_t* bytes, const uint8_
     return bytes;
 }
 
+/* Latency Budget Message
+ *     message_type(i),
+ *     latency_budget(i)
+ * The budget set by the publisher, in milliseconds.
+ */
+size_t quicrq_latency_budget_msg_reserve(uint64_t latency_budget)
+{
+    size_t len = 1 + picoquic_frames_varint_encode_length(latency_budget);
+    return len;
+}
+
+uint8_t* quicrq_latency_budget_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, uint64_t latency_budget)
+{
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, message_type)) != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, latency_budget);
+    }
+    return bytes;
+}
+
+const uint8_t* quicrq_latency_budget_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type, uint64_t* latency_budget)
+{
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, message_type)) != NULL) {
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, latency_budget);
+    }
+    return bytes;
+}
+
 /* Media POST message.  
  *     message_type(i),
  *     url_length(i),
@@ -429,10 +577,12 @@ const uint8_t* quicrq_post_msg_decode(const uint8_t* bytes, const uint8_t* bytes
   *     message_type(i),
   *     transport_mode(i),
   *     [media_id(i)]
+  *     [datagram_header_mode(i)]
   *     
   * This is the response to the POST message. The server tells the client whether it
   * should send as datagrams or as stream, and if using streams send a datagram
-  * stream ID.
+  * stream ID. If using datagrams, the server also tells whether the client should
+  * use compact datagram headers.
   */
 
 size_t quicrq_accept_msg_reserve(quicrq_transport_mode_enum transport_mode, uint64_t media_id)
@@ -442,26 +592,34 @@ size_t quicrq_accept_msg_reserve(quicrq_transport_mode_enum transport_mode, uint
     if (transport_mode != quicrq_transport_mode_single_stream) {
         len += picoquic_frames_varint_encode_length(media_id);
     }
+    if (transport_mode == quicrq_transport_mode_datagram) {
+        len += 1;
+    }
     return len;
 }
 
-uint8_t* quicrq_accept_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, quicrq_transport_mode_enum transport_mode, uint64_t media_id)
+uint8_t* quicrq_accept_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, quicrq_transport_mode_enum transport_mode, uint64_t media_id,
+    uint64_t datagram_header_mode)
 {
     if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, message_type)) != NULL &&
         (bytes = picoquic_frames_varint_encode(bytes, bytes_max, (uint64_t)transport_mode)) != NULL) {
         if (transport_mode != quicrq_transport_mode_single_stream) {
             bytes = picoquic_frames_varint_encode(bytes, bytes_max, media_id);
         }
+        if (bytes != NULL && transport_mode == quicrq_transport_mode_datagram) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, datagram_header_mode);
+        }
     }
     return bytes;
 }
 
 const uint8_t* quicrq_accept_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type,
-    quicrq_transport_mode_enum * transport_mode, uint64_t * media_id)
+    quicrq_transport_mode_enum * transport_mode, uint64_t * media_id, uint64_t* datagram_header_mode)
 {
     uint64_t use_dg = 0;
     *transport_mode = 0;
     *media_id = 0;
+    *datagram_header_mode = QUICRQ_DATAGRAM_HEADER_FULL;
     if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, message_type)) != NULL &&
         (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &use_dg)) != NULL) {
         if (use_dg >= quicrq_transport_mode_max) {
@@ -472,6 +630,9 @@ const uint8_t* quicrq_accept_msg_decode(const uint8_t* bytes, const uint8_t* byt
             if (use_dg != quicrq_transport_mode_single_stream) {
                 bytes = picoquic_frames_varint_decode(bytes, bytes_max, media_id);
             }
+            if (bytes != NULL && use_dg == quicrq_transport_mode_datagram) {
+                bytes = picoquic_frames_varint_decode(bytes, bytes_max, datagram_header_mode);
+            }
         }
     }
 
@@ -593,11 +754,16 @@ const uint8_t* quicrq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max,
         switch (msg->message_type) {
         case QUICRQ_ACTION_REQUEST:
             bytes = quicrq_rq_msg_decode(bytes, bytes_max, &msg->message_type, &msg->url_length, &msg->url,
-                &msg->media_id, &msg->transport_mode, &msg->subscribe_intent, &msg->group_id, &msg->object_id);
+                &msg->media_id, &msg->transport_mode, &msg->subscribe_intent, &msg->group_id, &msg->object_id, &msg->datagram_header_mode,
+                &msg->latency_budget);
             break;
         case QUICRQ_ACTION_FIN_DATAGRAM:
             bytes = quicrq_fin_msg_decode(bytes, bytes_max, &msg->message_type, &msg->group_id, &msg->object_id);
             break;
+        case QUICRQ_ACTION_REPAIR_REQUEST:
+            bytes = quicrq_repair_request_msg_decode(bytes, bytes_max, &msg->message_type, &msg->nb_ranges,
+                &msg->fragment_length, &msg->data);
+            break;
         case QUICRQ_ACTION_FRAGMENT:
             bytes = quicrq_fragment_msg_decode(bytes, bytes_max, &msg->message_type,
                 &msg->group_id, &msg->object_id, &msg->nb_objects_previous_group,
@@ -608,7 +774,7 @@ const uint8_t* quicrq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max,
                 &msg->transport_mode, &msg->cache_policy, &msg->group_id, &msg->object_id);
             break;
         case QUICRQ_ACTION_ACCEPT:
-            bytes = quicrq_accept_msg_decode(bytes, bytes_max, &msg->message_type, &msg->transport_mode, &msg->media_id);
+            bytes = quicrq_accept_msg_decode(bytes, bytes_max, &msg->message_type, &msg->transport_mode, &msg->media_id, &msg->datagram_header_mode);
             break;
         case QUICRQ_ACTION_START_POINT:
             bytes = quicrq_start_point_msg_decode(bytes, bytes_max, &msg->message_type, &msg->group_id, &msg->object_id);
@@ -622,6 +788,9 @@ const uint8_t* quicrq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max,
         case QUICRQ_ACTION_CACHE_POLICY:
             bytes = quicrq_cache_policy_msg_decode(bytes, bytes_max, &msg->message_type, &msg->cache_policy);
             break;
+        case QUICRQ_ACTION_LATENCY_BUDGET:
+            bytes = quicrq_latency_budget_msg_decode(bytes, bytes_max, &msg->message_type, &msg->latency_budget);
+            break;
         case QUICRQ_ACTION_WARP_HEADER:
             bytes = quicrq_warp_header_msg_decode(bytes, bytes_max, &msg->message_type, &msg->media_id, &msg->group_id);
             break;
@@ -644,11 +813,25 @@ uint8_t* quicrq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, quicrq_message_t*
     switch (msg->message_type) {
     case QUICRQ_ACTION_REQUEST:
         bytes = quicrq_rq_msg_encode(bytes, bytes_max, msg->message_type, msg->url_length, msg->url,
-            msg->media_id, msg->transport_mode, msg->subscribe_intent, msg->group_id, msg->object_id);
+            msg->media_id, msg->transport_mode, msg->subscribe_intent, msg->group_id, msg->object_id, msg->datagram_header_mode,
+            msg->latency_budget);
         break;
     case QUICRQ_ACTION_FIN_DATAGRAM:
         bytes = quicrq_fin_msg_encode(bytes, bytes_max, msg->message_type, msg->group_id, msg->object_id);
         break;
+    case QUICRQ_ACTION_REPAIR_REQUEST:
+        /* The ranges are copied as encoded */
+        if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, msg->message_type)) != NULL &&
+            (bytes = picoquic_frames_varint_encode(bytes, bytes_max, msg->nb_ranges)) != NULL) {
+            if (bytes + msg->fragment_length > bytes_max) {
+                bytes = NULL;
+            }
+            else {
+                memcpy(bytes, msg->data, msg->fragment_length);
+                bytes += msg->fragment_length;
+            }
+        }
+        break;
     case QUICRQ_ACTION_FRAGMENT:
         bytes = quicrq_fragment_msg_encode(bytes, bytes_max,
             msg->message_type, msg->group_id, msg->object_id, msg->nb_objects_previous_group,
@@ -659,7 +842,7 @@ uint8_t* quicrq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, quicrq_message_t*
             msg->transport_mode, msg->cache_policy, msg->group_id, msg->object_id);
         break;
     case QUICRQ_ACTION_ACCEPT:
-        bytes = quicrq_accept_msg_encode(bytes, bytes_max, msg->message_type, msg->transport_mode, msg->media_id);
+        bytes = quicrq_accept_msg_encode(bytes, bytes_max, msg->message_type, msg->transport_mode, msg->media_id, msg->datagram_header_mode);
         break;
     case QUICRQ_ACTION_START_POINT:
         bytes = quicrq_start_point_msg_encode(bytes, bytes_max, msg->message_type, msg->group_id, msg->object_id);
@@ -673,6 +856,9 @@ uint8_t* quicrq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, quicrq_message_t*
     case QUICRQ_ACTION_CACHE_POLICY:
         bytes = quicrq_cache_policy_msg_encode(bytes, bytes_max, msg->message_type, msg->cache_policy);
         break;
+    case QUICRQ_ACTION_LATENCY_BUDGET:
+        bytes = quicrq_latency_budget_msg_encode(bytes, bytes_max, msg->message_type, msg->latency_budget);
+        break;
     case QUICRQ_ACTION_WARP_HEADER:
         bytes = quicrq_warp_header_msg_encode(bytes, bytes_max, msg->message_type, msg->media_id, msg->group_id);
         break;
@@ -701,11 +887,20 @@ uint8_t* quicrq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, quicrq_message_t*
  *     [nb_objects_previous_group (i)]
  * }
  */
+/* The datagram stream id carries the media id and, in its three low order bits,
+ * the type of datagram: plain source fragment, source fragment protected by
+ * FEC, followed by its FEC sequence number, FEC repair, bundle, or source
+ * fragment with a compact header.
+ */
 uint8_t* quicrq_datagram_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t media_id, uint64_t group_id,
     uint64_t object_id, uint64_t object_offset, uint64_t queue_delay, uint8_t flags,
-    uint64_t nb_objects_previous_group, uint64_t object_length)
+    uint64_t nb_objects_previous_group, uint64_t object_length, uint64_t fec_sequence)
 {
-    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, media_id)) != NULL &&
+    uint64_t datagram_type = (fec_sequence == UINT64_MAX) ? QUICRQ_DATAGRAM_TYPE_SOURCE : QUICRQ_DATAGRAM_TYPE_FEC_SOURCE;
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, (media_id << QUICRQ_DATAGRAM_TYPE_SHIFT) | datagram_type)) != NULL &&
+        (datagram_type == QUICRQ_DATAGRAM_TYPE_SOURCE || 
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, fec_sequence)) != NULL) &&
         (bytes = picoquic_frames_varint_encode(bytes, bytes_max, group_id)) != NULL &&
         (bytes = picoquic_frames_varint_encode(bytes, bytes_max, object_id)) != NULL &&
         (bytes = picoquic_frames_varint_encode(bytes, bytes_max, object_offset)) != NULL &&
@@ -724,10 +919,198 @@ uint8_t* quicrq_datagram_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint6
     return bytes;
 }
 
+/* Compact datagram header, used if the receiver of the media asked for it:
+ * quicrq_compact_datagram_header {
+ *     datagram_stream_id (i)
+ *     [fec_sequence (i)]
+ *     header_control (8)
+ *     group_id (8, 16, 32 or i)
+ *     object_id (i)
+ *     [offset (i)]
+ *     queue_delay (i)
+ *     flags (8)
+ *     [nb_objects_previous_group (i)]
+ *     [object_length (i)]
+ * }
+ * The group_id is truncated to 1, 2 or 4 bytes if both it and the largest group sent
+ * are close enough to the last group acknowledged by the receiver, and expanded by
+ * the receiver to the value closest
+ * to the largest group received, as QUIC does for packet numbers. This is robust to
+ * losses, because the receiver has always received the acknowledged group. The offset
+ * is omitted if it is zero, and the object length is omitted if the fragment carries the
+ * end of the object, since it is then implied by the length of the datagram.
+ */
+#define QUICRQ_COMPACT_GROUP_8 0
+#define QUICRQ_COMPACT_GROUP_16 1
+#define QUICRQ_COMPACT_GROUP_32 2
+#define QUICRQ_COMPACT_GROUP_VARINT 3
+#define QUICRQ_COMPACT_GROUP_MASK 3
+#define QUICRQ_COMPACT_ZERO_OFFSET 4
+#define QUICRQ_COMPACT_END_OF_OBJECT 8
+
+static const size_t quicrq_compact_group_bytes[] = { 1, 2, 4, 0 };
+
+uint8_t* quicrq_datagram_compact_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t media_id, uint64_t group_id,
+    uint64_t group_acked, uint64_t group_max, uint64_t object_id, uint64_t object_offset, uint64_t queue_delay, uint8_t flags,
+    uint64_t nb_objects_previous_group, uint64_t object_length, size_t data_length, uint64_t fec_sequence)
+{
+    uint64_t datagram_type = (fec_sequence == UINT64_MAX) ? QUICRQ_DATAGRAM_TYPE_COMPACT_SOURCE : QUICRQ_DATAGRAM_TYPE_COMPACT_FEC_SOURCE;
+    uint8_t control = QUICRQ_COMPACT_GROUP_VARINT;
+
+    /* The receiver's largest group is between the acknowledged group and the largest group sent.
+     * Use a window at least four times larger than that span, so that late acknowledgements
+     * of this datagram can also be decoded by the sender. */
+    if (group_acked != UINT64_MAX && group_id >= group_acked) {
+        uint64_t delta = ((group_max > group_id) ? group_max : group_id) - group_acked;
+        if (delta < 0x40) {
+            control = QUICRQ_COMPACT_GROUP_8;
+        }
+        else if (delta < 0x4000) {
+            control = QUICRQ_COMPACT_GROUP_16;
+        }
+        else if (delta < 0x40000000) {
+            control = QUICRQ_COMPACT_GROUP_32;
+        }
+    }
+    if (object_offset == 0) {
+        control |= QUICRQ_COMPACT_ZERO_OFFSET;
+    }
+    if (data_length != SIZE_MAX && object_offset + data_length == object_length) {
+        control |= QUICRQ_COMPACT_END_OF_OBJECT;
+    }
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, (media_id << QUICRQ_DATAGRAM_TYPE_SHIFT) | datagram_type)) != NULL &&
+        (datagram_type == QUICRQ_DATAGRAM_TYPE_COMPACT_SOURCE ||
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, fec_sequence)) != NULL) &&
+        (bytes = picoquic_frames_uint8_encode(bytes, bytes_max, control)) != NULL) {
+        size_t group_bytes = quicrq_compact_group_bytes[control & QUICRQ_COMPACT_GROUP_MASK];
+        if (group_bytes == 0) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, group_id);
+        }
+        else if (bytes + group_bytes > bytes_max) {
+            bytes = NULL;
+        }
+        else {
+            for (size_t i = 0; i < group_bytes; i++) {
+                *bytes++ = (uint8_t)(group_id >> (8 * (group_bytes - i - 1)));
+            }
+        }
+    }
+    if (bytes != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, object_id)) != NULL &&
+        ((control & QUICRQ_COMPACT_ZERO_OFFSET) != 0 ||
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, object_offset)) != NULL) &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, queue_delay)) != NULL &&
+        (bytes = picoquic_frames_uint8_encode(bytes, bytes_max, flags)) != NULL &&
+        ((object_id != 0 || object_offset != 0) ||
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, nb_objects_previous_group)) != NULL) &&
+        (control & QUICRQ_COMPACT_END_OF_OBJECT) == 0) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, object_length);
+    }
+    return bytes;
+}
+
+/* Find the group_id closest to the reference that matches the truncated value */
+static uint64_t quicrq_datagram_group_expand(uint64_t truncated, size_t group_bytes, uint64_t group_reference)
+{
+    uint64_t window = ((uint64_t)1) << (8 * group_bytes);
+    uint64_t half_window = window / 2;
+    uint64_t group_id = (group_reference & ~(window - 1)) | truncated;
+
+    if (group_id + half_window <= group_reference && group_id <= UINT64_MAX - window) {
+        group_id += window;
+    }
+    else if (group_id > group_reference + half_window && group_id >= window) {
+        group_id -= window;
+    }
+    return group_id;
+}
+
+static const uint8_t* quicrq_datagram_compact_header_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* group_id,
+    uint64_t* object_id, uint64_t* object_offset, uint64_t* queue_delay, uint8_t* flags, uint64_t* nb_objects_previous_group,
+    uint64_t* object_length, uint64_t group_reference)
+{
+    uint8_t control = 0;
+
+    if ((bytes = picoquic_frames_uint8_decode(bytes, bytes_max, &control)) != NULL) {
+        size_t group_bytes = quicrq_compact_group_bytes[control & QUICRQ_COMPACT_GROUP_MASK];
+        if (group_bytes == 0) {
+            bytes = picoquic_frames_varint_decode(bytes, bytes_max, group_id);
+        }
+        else if (bytes + group_bytes > bytes_max) {
+            bytes = NULL;
+        }
+        else {
+            uint64_t truncated = 0;
+            for (size_t i = 0; i < group_bytes; i++) {
+                truncated = (truncated << 8) | *bytes++;
+            }
+            *group_id = quicrq_datagram_group_expand(truncated, group_bytes, group_reference);
+        }
+    }
+    *object_offset = 0;
+    *nb_objects_previous_group = 0;
+    if (bytes != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, object_id)) != NULL &&
+        ((control & QUICRQ_COMPACT_ZERO_OFFSET) != 0 ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, object_offset)) != NULL) &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, queue_delay)) != NULL &&
+        (bytes = picoquic_frames_uint8_decode(bytes, bytes_max, flags)) != NULL &&
+        ((*object_id != 0 || *object_offset != 0) ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, nb_objects_previous_group)) != NULL)) {
+        if ((control & QUICRQ_COMPACT_END_OF_OBJECT) != 0) {
+            /* The fragment ends the object */
+            *object_length = *object_offset + (bytes_max - bytes);
+        }
+        else {
+            bytes = picoquic_frames_varint_decode(bytes, bytes_max, object_length);
+        }
+    }
+    return bytes;
+}
+
+/* Decode the datagram stream id, so the stream context can be found before decoding the header */
+const uint8_t* quicrq_datagram_stream_id_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* media_id, uint64_t* datagram_type)
+{
+    uint64_t datagram_stream_id = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &datagram_stream_id)) != NULL) {
+        *media_id = datagram_stream_id >> QUICRQ_DATAGRAM_TYPE_SHIFT;
+        *datagram_type = datagram_stream_id & QUICRQ_DATAGRAM_TYPE_MASK;
+    }
+    return bytes;
+}
+
+/* Decode a full or compact source datagram header. The group reference is the largest
+ * group received on the media, only used to expand truncated group ids.
+ */
 const uint8_t* quicrq_datagram_header_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* media_id, uint64_t* group_id,
-    uint64_t* object_id, uint64_t* object_offset, uint64_t* queue_delay, uint8_t* flags, uint64_t* nb_objects_previous_group, uint64_t* object_length)
+    uint64_t* object_id, uint64_t* object_offset, uint64_t* queue_delay, uint8_t* flags, uint64_t* nb_objects_previous_group, uint64_t* object_length,
+    uint64_t* fec_sequence, uint64_t group_reference)
 {
-    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, media_id)) != NULL &&
+    uint64_t datagram_type = 0;
+
+    *fec_sequence = UINT64_MAX;
+    if ((bytes = quicrq_datagram_stream_id_decode(bytes, bytes_max, media_id, &datagram_type)) != NULL) {
+        switch (datagram_type) {
+        case QUICRQ_DATAGRAM_TYPE_SOURCE:
+        case QUICRQ_DATAGRAM_TYPE_COMPACT_SOURCE:
+            break;
+        case QUICRQ_DATAGRAM_TYPE_FEC_SOURCE:
+        case QUICRQ_DATAGRAM_TYPE_COMPACT_FEC_SOURCE:
+            bytes = picoquic_frames_varint_decode(bytes, bytes_max, fec_sequence);
+            break;
+        default:
+            /* Repair and bundle datagrams have their own decoding functions */
+            bytes = NULL;
+            break;
+        }
+    }
+    if (bytes != NULL && (datagram_type == QUICRQ_DATAGRAM_TYPE_COMPACT_SOURCE || datagram_type == QUICRQ_DATAGRAM_TYPE_COMPACT_FEC_SOURCE)) {
+        bytes = quicrq_datagram_compact_header_decode(bytes, bytes_max, group_id, object_id, object_offset, queue_delay, flags,
+            nb_objects_previous_group, object_length, group_reference);
+    }
+    else if (bytes != NULL &&
         (bytes = picoquic_frames_varint_decode(bytes, bytes_max, group_id)) != NULL &&
         (bytes = picoquic_frames_varint_decode(bytes, bytes_max, object_id)) != NULL &&
         (bytes = picoquic_frames_varint_decode(bytes, bytes_max, object_offset)) != NULL &&
@@ -744,6 +1127,163 @@ const uint8_t* quicrq_datagram_header_decode(const uint8_t* bytes, const uint8_t
     return bytes;
 }
 
+/* The header of repair datagrams identifies the media, the group, and the
+ * range of FEC sequence numbers of the source fragments that it protects.
+ * It is followed by the repair symbol.
+ */
+uint8_t* quicrq_datagram_repair_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t media_id, uint64_t group_id,
+    uint64_t first_fec_sequence, uint64_t nb_sources)
+{
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, (media_id << QUICRQ_DATAGRAM_TYPE_SHIFT) | QUICRQ_DATAGRAM_TYPE_FEC_REPAIR)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, group_id)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, first_fec_sequence)) != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, nb_sources);
+    }
+    return bytes;
+}
+
+const uint8_t* quicrq_datagram_repair_header_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* media_id, uint64_t* group_id,
+    uint64_t* first_fec_sequence, uint64_t* nb_sources)
+{
+    uint64_t datagram_stream_id = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &datagram_stream_id)) != NULL) {
+        if ((datagram_stream_id & QUICRQ_DATAGRAM_TYPE_MASK) != QUICRQ_DATAGRAM_TYPE_FEC_REPAIR) {
+            bytes = NULL;
+        }
+        else if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, group_id)) != NULL &&
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, first_fec_sequence)) != NULL) {
+            *media_id = datagram_stream_id >> QUICRQ_DATAGRAM_TYPE_SHIFT;
+            bytes = picoquic_frames_varint_decode(bytes, bytes_max, nb_sources);
+        }
+    }
+    return bytes;
+}
+
+/* Bundle datagrams start with a datagram stream id of type bundle and media id 0,
+ * followed by a series of records. Each record is encoded as a length followed by
+ * the content of a source or repair datagram.
+ */
+uint8_t* quicrq_datagram_bundle_header_encode(uint8_t* bytes, uint8_t* bytes_max)
+{
+    return picoquic_frames_varint_encode(bytes, bytes_max, QUICRQ_DATAGRAM_TYPE_BUNDLE);
+}
+
+const uint8_t* quicrq_datagram_bundle_header_decode(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    uint64_t datagram_stream_id = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &datagram_stream_id)) != NULL &&
+        datagram_stream_id != QUICRQ_DATAGRAM_TYPE_BUNDLE) {
+        bytes = NULL;
+    }
+    return bytes;
+}
+
+uint8_t* quicrq_datagram_bundle_record_encode(uint8_t* bytes, uint8_t* bytes_max, size_t record_length)
+{
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, record_length)) != NULL &&
+        bytes + record_length > bytes_max) {
+        bytes = NULL;
+    }
+    return bytes;
+}
+
+const uint8_t* quicrq_datagram_bundle_record_decode(const uint8_t* bytes, const uint8_t* bytes_max, size_t* record_length)
+{
+    if ((bytes = picoquic_frames_varlen_decode(bytes, bytes_max, record_length)) != NULL &&
+        (*record_length == 0 || *record_length > (size_t)(bytes_max - bytes))) {
+        bytes = NULL;
+    }
+    return bytes;
+}
+
+/* Directory of local media sources.
+ * The sources are chained in the buckets of a hash table keyed by the URL,
+ * so that subscribe and post requests find the source without scanning the
+ * list of all sources. The number of buckets doubles when the number of
+ * sources exceeds it.
+ */
+static uint64_t quicrq_media_source_url_hash(const uint8_t* url, size_t url_length)
+{
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < url_length; i++) {
+        hash ^= url[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static int quicrq_media_source_table_resize(quicrq_ctx_t* qr_ctx, size_t new_size)
+{
+    int ret = 0;
+    quicrq_media_source_ctx_t** new_table = (quicrq_media_source_ctx_t**)malloc(new_size * sizeof(quicrq_media_source_ctx_t*));
+
+    if (new_table == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(new_table, 0, new_size * sizeof(quicrq_media_source_ctx_t*));
+        for (size_t i = 0; i < qr_ctx->source_table_size; i++) {
+            quicrq_media_source_ctx_t* srce_ctx = qr_ctx->source_table[i];
+            while (srce_ctx != NULL) {
+                quicrq_media_source_ctx_t* next_in_bucket = srce_ctx->next_in_bucket;
+                size_t bucket = (size_t)(srce_ctx->media_url_hash & (new_size - 1));
+                srce_ctx->next_in_bucket = new_table[bucket];
+                new_table[bucket] = srce_ctx;
+                srce_ctx = next_in_bucket;
+            }
+        }
+        free(qr_ctx->source_table);
+        qr_ctx->source_table = new_table;
+        qr_ctx->source_table_size = new_size;
+    }
+    return ret;
+}
+
+static int quicrq_media_source_table_add(quicrq_ctx_t* qr_ctx, quicrq_media_source_ctx_t* srce_ctx)
+{
+    int ret = 0;
+
+    if (qr_ctx->nb_sources >= qr_ctx->source_table_size) {
+        ret = quicrq_media_source_table_resize(qr_ctx, (qr_ctx->source_table_size == 0) ? 64 : 2 * qr_ctx->source_table_size);
+    }
+    if (ret == 0) {
+        size_t bucket = (size_t)(srce_ctx->media_url_hash & (qr_ctx->source_table_size - 1));
+        srce_ctx->next_in_bucket = qr_ctx->source_table[bucket];
+        qr_ctx->source_table[bucket] = srce_ctx;
+        qr_ctx->nb_sources++;
+    }
+    return ret;
+}
+
+static void quicrq_media_source_table_remove(quicrq_ctx_t* qr_ctx, quicrq_media_source_ctx_t* srce_ctx)
+{
+    if (qr_ctx->source_table_size > 0) {
+        quicrq_media_source_ctx_t** p_next = &qr_ctx->source_table[srce_ctx->media_url_hash & (qr_ctx->source_table_size - 1)];
+
+        while (*p_next != NULL) {
+            if (*p_next == srce_ctx) {
+                *p_next = srce_ctx->next_in_bucket;
+                srce_ctx->next_in_bucket = NULL;
+                qr_ctx->nb_sources--;
+                break;
+            }
+            p_next = &(*p_next)->next_in_bucket;
+        }
+    }
+}
+
+void quicrq_media_source_table_release(quicrq_ctx_t* qr_ctx)
+{
+    free(qr_ctx->source_table);
+    qr_ctx->source_table = NULL;
+    qr_ctx->source_table_size = 0;
+    qr_ctx->nb_sources = 0;
+}
+
 /* Publish local source API.
  */
 
@@ -761,25 +1301,33 @@ quicrq_media_source_ctx_t* quicrq_publish_datagram_source(quicrq_ctx_t* qr_ctx,
             srce_ctx->media_url = ((uint8_t*)srce_ctx) + sizeof(quicrq_media_source_ctx_t);
             srce_ctx->media_url_length = url_length;
             memcpy(srce_ctx->media_url, url, url_length);
+            srce_ctx->media_url_hash = quicrq_media_source_url_hash(url, url_length);
             srce_ctx->is_cache_real_time = is_cache_real_time;
-            if (qr_ctx->last_source == NULL) {
-                qr_ctx->first_source = srce_ctx;
-                qr_ctx->last_source = srce_ctx;
+            if (quicrq_media_source_table_add(qr_ctx, srce_ctx) != 0) {
+                DBG_PRINTF("%s", "Fail to add source to table");
+                free(srce_ctx);
+                srce_ctx = NULL;
             }
             else {
-                qr_ctx->last_source->next_source = srce_ctx;
-                srce_ctx->previous_source = qr_ctx->last_source;
-                qr_ctx->last_source = srce_ctx;
-            }
-            srce_ctx->cache_ctx = cache_ctx;
-            srce_ctx->is_local_object_source = is_local_object_source;
-
-            // Called in the case there exists streams on the cnx
-            // For publish object source, it is a no-op
-            if (quicrq_notify_url_to_all(qr_ctx, url, url_length) < 0) {
-                DBG_PRINTF("%s", "Fail to notify new source");
-                quicrq_delete_source(srce_ctx, qr_ctx);
-                srce_ctx = NULL;
+                if (qr_ctx->last_source == NULL) {
+                    qr_ctx->first_source = srce_ctx;
+                    qr_ctx->last_source = srce_ctx;
+                }
+                else {
+                    qr_ctx->last_source->next_source = srce_ctx;
+                    srce_ctx->previous_source = qr_ctx->last_source;
+                    qr_ctx->last_source = srce_ctx;
+                }
+                srce_ctx->cache_ctx = cache_ctx;
+                srce_ctx->is_local_object_source = is_local_object_source;
+
+                // Called in the case there exists streams on the cnx
+                // For publish object source, it is a no-op
+                if (quicrq_notify_url_to_all(qr_ctx, url, url_length) < 0) {
+                    DBG_PRINTF("%s", "Fail to notify new source");
+                    quicrq_delete_source(srce_ctx, qr_ctx);
+                    srce_ctx = NULL;
+                }
             }
         }
     }
@@ -807,6 +1355,8 @@ void quicrq_delete_source(quicrq_media_source_ctx_t* srce_ctx, quicrq_ctx_t* qr_
         stream_ctx = next_stream_ctx;
     }
 
+    quicrq_media_source_table_remove(qr_ctx, srce_ctx);
+
     if (srce_ctx == qr_ctx->first_source) {
         qr_ctx->first_source = srce_ctx->next_source;
     }
@@ -845,15 +1395,20 @@ quicrq_media_source_ctx_t* quicrq_create_default_source(quicrq_ctx_t* qr_ctx, co
 /* Find whether the local context for a media source */
 quicrq_media_source_ctx_t* quicrq_find_local_media_source(quicrq_ctx_t* qr_ctx, const uint8_t* url, const size_t url_length)
 {
-    quicrq_media_source_ctx_t* srce_ctx = qr_ctx->first_source;
+    quicrq_media_source_ctx_t* srce_ctx = NULL;
 
     /* Find whether there is a matching media published locally */
-    while (srce_ctx != NULL) {
-        if (url_length == srce_ctx->media_url_length &&
-            memcmp(url, srce_ctx->media_url, url_length) == 0) {
-            break;
+    if (qr_ctx->source_table_size > 0) {
+        uint64_t hash = quicrq_media_source_url_hash(url, url_length);
+
+        srce_ctx = qr_ctx->source_table[hash & (qr_ctx->source_table_size - 1)];
+        while (srce_ctx != NULL) {
+            if (srce_ctx->media_url_hash == hash && url_length == srce_ctx->media_url_length &&
+                memcmp(url, srce_ctx->media_url, url_length) == 0) {
+                break;
+            }
+            srce_ctx = srce_ctx->next_in_bucket;
         }
-        srce_ctx = srce_ctx->next_source;
     }
     return srce_ctx;
 }
@@ -865,9 +1420,18 @@ int quicrq_subscribe_local_media(quicrq_stream_ctx_t* stream_ctx, const uint8_t*
     int ret = 0;
     quicrq_ctx_t* qr_ctx = stream_ctx->cnx_ctx->qr_ctx;
     quicrq_media_source_ctx_t* srce_ctx = quicrq_find_local_media_source(qr_ctx, url, url_length);
+    quicrq_track_set_t* track_set = NULL;
+    size_t track_layer = 0;
     char buffer[256];
 
-    if (srce_ctx == NULL && qr_ctx->default_source_fn != NULL) {
+    if (srce_ctx == NULL && (track_set = quicrq_find_track_set(qr_ctx, url, url_length)) != NULL) {
+        /* Start from the highest layer that fits the bandwidth estimate and is available */
+        track_layer = quicrq_track_set_select_layer(track_set, 0, quicrq_track_set_bandwidth_estimate(stream_ctx->cnx_ctx));
+        while ((srce_ctx = quicrq_track_set_layer_source(qr_ctx, track_set, track_layer)) == NULL && track_layer > 0) {
+            track_layer--;
+        }
+    }
+    if (srce_ctx == NULL && track_set == NULL && qr_ctx->default_source_fn != NULL) {
         srce_ctx = quicrq_create_default_source(qr_ctx, url, url_length);
     }
     if (srce_ctx == NULL) {
@@ -877,18 +1441,12 @@ int quicrq_subscribe_local_media(quicrq_stream_ctx_t* stream_ctx, const uint8_t*
     }
     else {
         /* Add stream to list of published streams */
-        stream_ctx->media_source = srce_ctx;
-        if (srce_ctx->last_stream == NULL) {
-            srce_ctx->first_stream = stream_ctx;
-            srce_ctx->last_stream = stream_ctx;
-        }
-        else {
-            srce_ctx->last_stream->next_stream_for_source = stream_ctx;
-            stream_ctx->previous_stream_for_source = srce_ctx->last_stream;
-            srce_ctx->last_stream = stream_ctx;
-        }
-        /* set the cache policy */
+        quicrq_link_local_media(stream_ctx, srce_ctx);
+        /* set the cache policy and the latency budget of the publisher */
         stream_ctx->is_cache_real_time = srce_ctx->is_cache_real_time;
+        if (srce_ctx->cache_ctx != NULL) {
+            stream_ctx->publisher_latency_budget = srce_ctx->cache_ctx->latency_budget;
+        }
         /* Create a subscribe media context */
         stream_ctx->media_ctx = quicrq_fragment_publisher_subscribe(srce_ctx->cache_ctx, stream_ctx);
         if (stream_ctx->media_ctx == NULL) {
@@ -897,6 +1455,12 @@ int quicrq_subscribe_local_media(quicrq_stream_ctx_t* stream_ctx, const uint8_t*
                 quicrq_uint8_t_to_text(url, url_length, buffer, 256));
         }
         else {
+            if (track_set != NULL) {
+                stream_ctx->media_ctx->track_set = track_set;
+                stream_ctx->media_ctx->track_layer = track_layer;
+                quicrq_log_message(stream_ctx->cnx_ctx, "Track set layer %d: %s", (int)track_layer,
+                    quicrq_uint8_t_to_text(srce_ctx->media_url, srce_ctx->media_url_length, buffer, 256));
+            }
             quicrq_log_message(stream_ctx->cnx_ctx, "Set a subscription to URL: %s",
                 quicrq_uint8_t_to_text(url, url_length, buffer, 256));
         }
@@ -905,6 +1469,22 @@ int quicrq_subscribe_local_media(quicrq_stream_ctx_t* stream_ctx, const uint8_t*
 }
 
 
+/* Add the stream to the wakeup list of the source.
+ */
+void quicrq_link_local_media(quicrq_stream_ctx_t* stream_ctx, quicrq_media_source_ctx_t* srce_ctx)
+{
+    stream_ctx->media_source = srce_ctx;
+    if (srce_ctx->last_stream == NULL) {
+        srce_ctx->first_stream = stream_ctx;
+        srce_ctx->last_stream = stream_ctx;
+    }
+    else {
+        srce_ctx->last_stream->next_stream_for_source = stream_ctx;
+        stream_ctx->previous_stream_for_source = srce_ctx->last_stream;
+        srce_ctx->last_stream = stream_ctx;
+    }
+}
+
 /* When closing a stream, remove the stream from the source's wakeup list 
  */
 void quicrq_unsubscribe_local_media(quicrq_stream_ctx_t* stream_ctx)
@@ -1137,6 +1717,7 @@ void quicrq_wakeup_media_stream(quicrq_stream_ctx_t* stream_ctx)
             if (((stream_ctx->start_group_id != 0 || stream_ctx->start_object_id != 0) &&
                 !stream_ctx->is_start_object_id_sent) ||
                 (stream_ctx->is_cache_real_time && !stream_ctx->is_cache_policy_sent) ||
+                (stream_ctx->publisher_latency_budget != 0 && !stream_ctx->is_latency_budget_sent) ||
                 (!stream_ctx->is_final_object_id_sent &&
                     ( stream_ctx->final_group_id != 0 ||
                         stream_ctx->final_object_id != 0))){
@@ -1145,7 +1726,7 @@ void quicrq_wakeup_media_stream(quicrq_stream_ctx_t* stream_ctx)
             }
 
             if (stream_ctx->transport_mode == quicrq_transport_mode_datagram) {
-                stream_ctx->is_active_datagram = 1;
+                quicrq_datagram_ready_queue_add(stream_ctx);
                 picoquic_mark_datagram_ready(stream_ctx->cnx_ctx->cnx, 1);
             }
             else if (stream_ctx->transport_mode == quicrq_transport_mode_warp) {
@@ -1182,8 +1763,8 @@ void quicrq_wakeup_media_stream(quicrq_stream_ctx_t* stream_ctx)
 
 
 /* When data is available for a source, wake up the corresponding connection 
- * and possibly stream.
- * TODO: for datagram, we may want to manage a queue of media for which data is ready.
+ * and possibly stream. Datagram streams are added to the queue of ready
+ * streams of their connection, see quicrq_prepare_to_send_datagram.
  */
 void quicrq_source_wakeup(quicrq_media_source_ctx_t* srce_ctx)
 {
@@ -1206,7 +1787,7 @@ int quicrq_cnx_subscribe_media_ex(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* url,
     uint64_t stream_id = picoquic_get_next_local_stream_id(cnx_ctx->cnx, 0);
     quicrq_stream_ctx_t* stream_ctx = quicrq_create_stream_context(cnx_ctx, stream_id);
     quicrq_message_buffer_t* message = &stream_ctx->message_sent;
-    static const quicrq_subscribe_intent_t default_intent = { quicrq_subscribe_intent_start_point, 0, 0 };
+    static const quicrq_subscribe_intent_t default_intent = { quicrq_subscribe_intent_start_point, 0, 0, 0 };
 
     if (intent == NULL) {
         intent = &default_intent;
@@ -1224,7 +1805,9 @@ int quicrq_cnx_subscribe_media_ex(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* url,
             uint64_t media_id = stream_ctx->cnx_ctx->next_media_id;
             uint8_t* message_next = quicrq_rq_msg_encode(message->buffer, message->buffer + message->buffer_alloc,
                 QUICRQ_ACTION_REQUEST, url_length, url, media_id, transport_mode,
-                intent->intent_mode, intent->start_group_id, intent->start_object_id);
+                intent->intent_mode, intent->start_group_id, intent->start_object_id,
+                (cnx_ctx->qr_ctx->compact_datagram_header) ? QUICRQ_DATAGRAM_HEADER_COMPACT : QUICRQ_DATAGRAM_HEADER_FULL,
+                (intent->latency_budget + 999) / 1000);
             if (message_next == NULL) {
                 ret = -1;
             } else {
@@ -1238,6 +1821,7 @@ int quicrq_cnx_subscribe_media_ex(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* url,
                 stream_ctx->send_state = quicrq_sending_initial;
                 stream_ctx->receive_state = quicrq_receive_fragment;
                 stream_ctx->cnx_ctx->next_media_id += 1;
+                ret = quicrq_datagram_index_stream(stream_ctx);
                 if (p_stream_ctx != NULL) {
                     *p_stream_ctx = stream_ctx;
                 }
@@ -1276,9 +1860,11 @@ int quicrq_cnx_connect_media_source(quicrq_stream_ctx_t* stream_ctx, uint8_t * u
     else {
         /* There is no data to send or receive on the control stream at this point.
          * The sender will send a final object eventually.
-         * The receiver will close the stream when not needed anymore. */
+         * The receiver will close the stream when not needed anymore,
+         * and may request repairs in datagram mode. */
         stream_ctx->send_state = quicrq_sending_ready;
-        stream_ctx->receive_state = quicrq_receive_done;
+        stream_ctx->receive_state = (stream_ctx->transport_mode == quicrq_transport_mode_datagram) ?
+            quicrq_receive_repair : quicrq_receive_done;
     }
 
     return ret;
@@ -1365,7 +1951,8 @@ int quicrq_cnx_accept_media(quicrq_stream_ctx_t * stream_ctx, const uint8_t* url
     }
     else {
         uint8_t* message_next = quicrq_accept_msg_encode(message->buffer, message->buffer + message->buffer_alloc,
-            QUICRQ_ACTION_ACCEPT, transport_mode, media_id);
+            QUICRQ_ACTION_ACCEPT, transport_mode, media_id,
+            (stream_ctx->cnx_ctx->qr_ctx->compact_datagram_header) ? QUICRQ_DATAGRAM_HEADER_COMPACT : QUICRQ_DATAGRAM_HEADER_FULL);
         if (message_next == NULL) {
             ret = -1;
         }
@@ -1382,6 +1969,9 @@ int quicrq_cnx_accept_media(quicrq_stream_ctx_t * stream_ctx, const uint8_t* url
             }
             /* Connect to the local listener */
             ret = stream_ctx->cnx_ctx->qr_ctx->consumer_media_init_fn(stream_ctx, url, url_length);
+            if (ret == 0) {
+                ret = quicrq_datagram_index_stream(stream_ctx);
+            }
             /* Activate the receiver */
             picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
             quicrq_log_message(stream_ctx->cnx_ctx, "Accepted post of URL: %s on stream %" PRIu64,
@@ -1418,10 +2008,12 @@ int quicrq_cnx_post_accepted(quicrq_stream_ctx_t* stream_ctx, quicrq_transport_m
     if (transport_mode == quicrq_transport_mode_datagram) {
         stream_ctx->media_id = media_id;
         stream_ctx->send_state = quicrq_sending_ready;
-        stream_ctx->receive_state = quicrq_receive_done;
+        stream_ctx->receive_state = quicrq_receive_repair;
+        ret = quicrq_datagram_index_stream(stream_ctx);
         /* Maybe we need to send policy messages, in which case the stream should be active! */
         int more_to_send = (!stream_ctx->is_start_object_id_sent && (stream_ctx->start_group_id > 0 || stream_ctx->start_object_id > 0));
         more_to_send |= (!stream_ctx->is_cache_policy_sent && stream_ctx->is_cache_real_time);
+        more_to_send |= (!stream_ctx->is_latency_budget_sent && stream_ctx->publisher_latency_budget != 0);
         quicrq_log_message(stream_ctx->cnx_ctx, "Stream %" PRIu64 ", post accepted, start= %" PRIu64 "/%" PRIu64 " %s",
             stream_ctx->stream_id, stream_ctx->start_group_id, stream_ctx->start_object_id,
             (stream_ctx->is_start_object_id_sent) ? "(already sent)":"");
@@ -34,6 +34,7 @@
 #include "quicrq.h"
 #include "quicrq_internal.h"
 #include "quicrq_relay.h"
+#include "quicrq_relay_internal.h"
 #include "quicrq_fragment.h"
 
 /* Allocate space in the message buffer */
@@ -198,9 +199,12 @@ int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void
     size_t data_length = 0;
     uint64_t object_length;
     uint8_t stream_header[QUICRQ_STREAM_HEADER_MAX];
+    uint8_t* h_byte;
     uint8_t flags = 0;
     size_t h_size;
     uint64_t nb_objects_previous_group = 0;
+    quicrq_fragment_slice_t slices[QUICRQ_FRAGMENT_SLICES_MAX];
+    size_t nb_slices = 0;
     int ret = 0;
 
     /* TODO: maintain a priority threshold per connection. If a stream is congested,
@@ -208,32 +212,23 @@ int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void
      * stream if another stream is waiting. 
      */
 
-    /* First, create a "mock" buffer based on the available space instead of the actual number of bytes.
-     * By design, we are encoding the fragment with the "data" parameter set to NULL. */
-    uint8_t* h_byte = quicrq_fragment_msg_encode(stream_header + 2, stream_header + QUICRQ_STREAM_HEADER_MAX, QUICRQ_ACTION_FRAGMENT,
-        stream_ctx->next_group_id, stream_ctx->next_object_id, 0, stream_ctx->next_object_offset,
-        stream_ctx->next_object_offset + available, flags, space, NULL);
+    /* First, predict the size of the message header based on the available space instead of the actual number of bytes. */
+    h_size = 2 + quicrq_fragment_msg_reserve(stream_ctx->next_group_id, stream_ctx->next_object_id, 0,
+        stream_ctx->next_object_offset, stream_ctx->next_object_offset, space);
 
-    if (h_byte == NULL) {
-        /* That should not happen, unless the stream_header size is way too small */
+    if (h_size > space) {
+        /* That should not happen, picoquic should never provide less than 17 bytes. */
         ret = -1;
     }
     else {
-        h_size = h_byte - stream_header;
-        if (h_size > space) {
-            /* That should not happen either, picoquic should never provide less than 17 bytes. */
-            ret = -1;
-        }
-        else {
-            /* Find how much data is actually available */
-            ret = quicrq_fragment_publisher_fn(quicrq_media_source_get_data, stream_ctx->media_ctx, NULL, space - h_size, &available, 
-                &flags, &is_new_group, &object_length, &is_media_finished, &is_still_active, &should_skip, current_time);
-            if (is_new_group) {
-                stream_ctx->next_group_id += 1;
-                nb_objects_previous_group = stream_ctx->next_object_id;
-                stream_ctx->next_object_id = 0;
-                stream_ctx->next_object_offset = 0;
-            }
+        /* Find the data actually available, as slices of the cached fragments */
+        ret = quicrq_fragment_publisher_get_slices(stream_ctx->media_ctx, space - h_size, slices, QUICRQ_FRAGMENT_SLICES_MAX,
+            &nb_slices, &available, &flags, &is_new_group, &object_length, &is_media_finished, &is_still_active, &should_skip, current_time);
+        if (is_new_group) {
+            stream_ctx->next_group_id += 1;
+            nb_objects_previous_group = stream_ctx->next_object_id;
+            stream_ctx->next_object_id = 0;
+            stream_ctx->next_object_offset = 0;
         }
     }
 
@@ -246,7 +241,11 @@ int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void
                 stream_ctx->next_group_id, stream_ctx->next_object_id, nb_objects_previous_group, 0, 0, 0xFF, 0, NULL);
             ret = quicrq_fragment_publisher_fn(quicrq_media_source_skip_object, stream_ctx->media_ctx, NULL, 0, &data_length,
                 &flags, &is_new_group, &object_length, &is_media_finished, &is_still_active, &has_backlog, current_time);
+            if (ret == 0 && (h_byte == NULL || (size_t)(h_byte - stream_header) > space)) {
+                ret = -1;
+            }
             if (ret == 0) {
+                h_size = h_byte - stream_header;
                 uint8_t* buffer = (uint8_t*)picoquic_provide_stream_data_buffer(context, h_size, 0, 1);
                 if (buffer == NULL) {
                     ret = -1;
@@ -312,26 +311,21 @@ int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void
             }
         }
         else {
-            /* Encode the actual header, instead of a prediction */
-            h_byte = quicrq_fragment_msg_encode(stream_header + 2, stream_header + QUICRQ_STREAM_HEADER_MAX, QUICRQ_ACTION_FRAGMENT,
-                stream_ctx->next_group_id, stream_ctx->next_object_id, nb_objects_previous_group, stream_ctx->next_object_offset,
-                object_length, flags, available, NULL);
-
-            if (h_byte == NULL) {
-                /* That should not happen, unless the stream_header size was way too small */
+            if (flags == 0xff && object_length == 0) {
+                /* The placeholder may replace an object of which some bytes were already sent */
+                stream_ctx->next_object_offset = 0;
+            }
+            /* Compute the size of the actual header, instead of a prediction */
+            h_size = 2 + quicrq_fragment_msg_reserve(stream_ctx->next_group_id, stream_ctx->next_object_id, nb_objects_previous_group,
+                stream_ctx->next_object_offset, object_length, available);
+            if (h_size > space) {
                 ret = -1;
-            } else if ((size_t)(h_byte - stream_header) != h_size) {
-                /* Encoding has changed. May need to change the length, and if that recompute the header */
-                h_size = h_byte - stream_header;
-                if (h_size + available > space) {
-                    /* The encoding changed, the computation of available space was wrong. */
-                    available = space - h_size;
-                    h_byte = quicrq_fragment_msg_encode(stream_header + 2, stream_header + QUICRQ_STREAM_HEADER_MAX, QUICRQ_ACTION_FRAGMENT,
-                        stream_ctx->next_group_id, stream_ctx->next_object_id, nb_objects_previous_group, stream_ctx->next_object_offset, 
-                        object_length, flags, available, NULL);
-                    /* The header size may have changed again, if the smaller "available" value is coded on fewer bytes. But it can only be decreased. */
-                    h_size = h_byte - stream_header;
-                }
+            }
+            else if (h_size + available > space) {
+                /* The prediction was wrong. The header size can only decrease if fewer bytes are sent. */
+                available = space - h_size;
+                h_size = 2 + quicrq_fragment_msg_reserve(stream_ctx->next_group_id, stream_ctx->next_object_id, nb_objects_previous_group,
+                    stream_ctx->next_object_offset, object_length, available);
             }
             if (ret == 0) {
                 uint8_t* buffer;
@@ -345,20 +339,31 @@ int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void
                     ret = -1;
                 }
                 else {
-                    /* copy the stream header to the packet */
-                    memcpy(buffer, stream_header, h_size);
-                    ret = quicrq_fragment_publisher_fn(quicrq_media_source_get_data, stream_ctx->media_ctx, buffer + h_size, available, &data_length,
-                        &flags, &is_new_group, &object_length, &is_media_finished, &is_still_active, &has_backlog, current_time);
-                    if (ret == 0 && available != data_length) {
+                    /* Encode the header directly in the packet, then copy the data from the cache */
+                    h_byte = quicrq_fragment_msg_encode(buffer + 2, buffer + h_size, QUICRQ_ACTION_FRAGMENT,
+                        stream_ctx->next_group_id, stream_ctx->next_object_id, nb_objects_previous_group, stream_ctx->next_object_offset,
+                        object_length, flags, available, NULL);
+                    if (h_byte != buffer + h_size) {
                         ret = -1;
                     }
                     else
                     {
                         /* Set the message length */
                         size_t message_length = h_size - 2 + available;
+                        size_t copied = 0;
                         buffer[0] = (uint8_t)(message_length >> 8);
                         buffer[1] = (uint8_t)(message_length & 0xff);
 
+                        for (size_t i = 0; i < nb_slices && copied < available; i++) {
+                            size_t slice_length = slices[i].length;
+                            if (slice_length > available - copied) {
+                                slice_length = available - copied;
+                            }
+                            memcpy(h_byte + copied, slices[i].data, slice_length);
+                            copied += slice_length;
+                        }
+                        quicrq_fragment_publisher_consume(stream_ctx->media_ctx, available, current_time);
+
                         stream_ctx->next_object_offset += available;
                         if (stream_ctx->next_object_offset >= object_length) {
                             stream_ctx->next_object_id++;
@@ -379,24 +384,149 @@ int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void
     return ret;
 }
 
+/* Index of datagram streams.
+ * Datagrams carry the media_id of their stream, and the receive and
+ * acknowledgement paths need to find the stream context for each datagram.
+ * The connection keeps a hash table of the datagram streams, keyed by
+ * media_id and direction. Streams are added when their media_id is set,
+ * and removed when they are deleted. Media ids are allocated sequentially
+ * by the receiver, so the key itself is used as hash.
+ * The number of buckets doubles when it is exceeded by the number of streams.
+ */
+#define QUICRQ_DATAGRAM_INDEX_MIN 16
+
+static uint64_t quicrq_datagram_index_key(uint64_t media_id, int is_sender)
+{
+    return (media_id << 1) | (is_sender ? 1 : 0);
+}
+
+static void quicrq_datagram_index_insert(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t* stream_ctx)
+{
+    size_t bucket = (size_t)stream_ctx->datagram_index_key & (cnx_ctx->datagram_stream_index_size - 1);
+    stream_ctx->next_stream_in_datagram_index = cnx_ctx->datagram_stream_index[bucket];
+    cnx_ctx->datagram_stream_index[bucket] = stream_ctx;
+}
+
+static int quicrq_datagram_index_resize(quicrq_cnx_ctx_t* cnx_ctx, size_t new_size)
+{
+    int ret = 0;
+    quicrq_stream_ctx_t** old_index = cnx_ctx->datagram_stream_index;
+    size_t old_size = cnx_ctx->datagram_stream_index_size;
+    quicrq_stream_ctx_t** new_index = (quicrq_stream_ctx_t**)malloc(new_size * sizeof(quicrq_stream_ctx_t*));
+
+    if (new_index == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(new_index, 0, new_size * sizeof(quicrq_stream_ctx_t*));
+        cnx_ctx->datagram_stream_index = new_index;
+        cnx_ctx->datagram_stream_index_size = new_size;
+        for (size_t i = 0; i < old_size; i++) {
+            quicrq_stream_ctx_t* stream_ctx = old_index[i];
+            while (stream_ctx != NULL) {
+                quicrq_stream_ctx_t* next_stream = stream_ctx->next_stream_in_datagram_index;
+                quicrq_datagram_index_insert(cnx_ctx, stream_ctx);
+                stream_ctx = next_stream;
+            }
+        }
+        free(old_index);
+    }
+    return ret;
+}
+
+static void quicrq_datagram_unindex_stream(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+
+    if (stream_ctx->is_datagram_indexed) {
+        quicrq_stream_ctx_t** p_next = &cnx_ctx->datagram_stream_index[
+            (size_t)stream_ctx->datagram_index_key & (cnx_ctx->datagram_stream_index_size - 1)];
+        while (*p_next != NULL) {
+            if (*p_next == stream_ctx) {
+                *p_next = stream_ctx->next_stream_in_datagram_index;
+                cnx_ctx->nb_datagram_streams_indexed--;
+                break;
+            }
+            p_next = &(*p_next)->next_stream_in_datagram_index;
+        }
+        stream_ctx->next_stream_in_datagram_index = NULL;
+        stream_ctx->is_datagram_indexed = 0;
+    }
+}
+
+/* Add a datagram stream to the index, once its media_id and direction are known.
+ * This must be called again if the media_id or the direction changes.
+ */
+int quicrq_datagram_index_stream(quicrq_stream_ctx_t* stream_ctx)
+{
+    int ret = 0;
+    quicrq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+
+    quicrq_datagram_unindex_stream(stream_ctx);
+    if (stream_ctx->transport_mode == quicrq_transport_mode_datagram) {
+        if (cnx_ctx->nb_datagram_streams_indexed >= cnx_ctx->datagram_stream_index_size) {
+            ret = quicrq_datagram_index_resize(cnx_ctx, (cnx_ctx->datagram_stream_index_size == 0) ?
+                QUICRQ_DATAGRAM_INDEX_MIN : 2 * cnx_ctx->datagram_stream_index_size);
+        }
+        if (ret == 0) {
+            stream_ctx->datagram_index_key = quicrq_datagram_index_key(stream_ctx->media_id, stream_ctx->is_sender);
+            quicrq_datagram_index_insert(cnx_ctx, stream_ctx);
+            cnx_ctx->nb_datagram_streams_indexed++;
+            stream_ctx->is_datagram_indexed = 1;
+        }
+    }
+    return ret;
+}
+
 /* Find the stream context associated with a datagram */
 quicrq_stream_ctx_t* quicrq_find_stream_ctx_for_datagram(quicrq_cnx_ctx_t* cnx_ctx, uint64_t media_id, int is_sender)
 {
     quicrq_stream_ctx_t* stream_ctx = NULL;
+    uint64_t key = quicrq_datagram_index_key(media_id, is_sender);
 
-    /* Find the stream context by datagram ID */
-    stream_ctx = cnx_ctx->first_stream;
-    while (stream_ctx != NULL) {
-        if ((stream_ctx->is_sender == is_sender) && stream_ctx->transport_mode == quicrq_transport_mode_datagram && stream_ctx->media_id == media_id) {
-            break;
+    if (cnx_ctx->datagram_stream_index_size > 0) {
+        stream_ctx = cnx_ctx->datagram_stream_index[(size_t)key & (cnx_ctx->datagram_stream_index_size - 1)];
+        while (stream_ctx != NULL) {
+            if (stream_ctx->datagram_index_key == key) {
+                break;
+            }
+            stream_ctx = stream_ctx->next_stream_in_datagram_index;
         }
-        stream_ctx = stream_ctx->next_stream;
     }
     return stream_ctx;
 }
 
-/* Receive data in a datagram */
-int quicrq_receive_datagram(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* bytes, size_t length, uint64_t current_time)
+/* Pass a fragment received as datagram, or recovered by FEC, to the media context. */
+static int quicrq_receive_datagram_fragment(quicrq_stream_ctx_t* stream_ctx, const uint8_t* data, size_t data_length,
+    uint64_t group_id, uint64_t object_id, uint64_t object_offset, uint64_t queue_delay, uint8_t flags,
+    uint64_t nb_objects_previous_group, uint64_t object_length, uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+
+    /* Verification that there are no unexpected fragments, used in tests */
+    if (group_id < stream_ctx->start_group_id ||
+        (group_id == stream_ctx->start_group_id && object_id < stream_ctx->start_object_id)) {
+        cnx_ctx->qr_ctx->useless_fragments += 1;
+    }
+    /* Pass data to the media context. */
+    if (object_offset + data_length >= object_length) {
+        picoquic_log_app_message(cnx_ctx->cnx, "Received final fragment of object %" PRIu64 "/%" PRIu64 " on datagram stream %" PRIu64 ", stream %" PRIu64,
+            group_id, object_id, stream_ctx->media_id, stream_ctx->stream_id);
+    }
+    ret = stream_ctx->consumer_fn(quicrq_media_datagram_ready, stream_ctx->media_ctx, current_time, data, group_id, object_id, object_offset, 
+        queue_delay, flags, nb_objects_previous_group, object_length, data_length);
+    if (ret == quicrq_consumer_finished) {
+        ret = quicrq_cnx_handle_consumer_finished(stream_ctx, 0, 1, ret);
+    }
+    if (ret != 0) {
+        DBG_PRINTF("Error found on dg stream id %" PRIu64 ", object id %" PRIu64 "/%", stream_ctx->media_id, group_id, object_id);
+    }
+    return ret;
+}
+
+/* Receive a source or repair datagram */
+static int quicrq_receive_datagram_record(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* bytes, size_t length, uint64_t current_time)
 {
     int ret = 0;
     quicrq_stream_ctx_t* stream_ctx = NULL;
@@ -410,56 +540,97 @@ int quicrq_receive_datagram(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* bytes, siz
     uint64_t queue_delay;
     uint64_t nb_objects_previous_group;
     uint64_t object_length;
+    uint64_t fec_sequence;
+    uint64_t nb_sources;
+    uint64_t datagram_type;
     uint8_t flags;
     const uint8_t* next_bytes;
 
-    next_bytes = quicrq_datagram_header_decode(bytes, bytes_max, &media_id, &group_id, &object_id, &object_offset, &queue_delay, &flags, &nb_objects_previous_group, &object_length);
+    /* Find the stream context by datagram ID, then decode the header */
+    if ((next_bytes = quicrq_datagram_stream_id_decode(bytes, bytes_max, &media_id, &datagram_type)) != NULL) {
+        stream_ctx = quicrq_find_stream_ctx_for_datagram(cnx_ctx, media_id, 0);
+        if (datagram_type == QUICRQ_DATAGRAM_TYPE_FEC_REPAIR) {
+            next_bytes = quicrq_datagram_repair_header_decode(bytes, bytes_max, &media_id, &group_id, &fec_sequence, &nb_sources);
+        }
+        else {
+            next_bytes = quicrq_datagram_header_decode(bytes, bytes_max, &media_id, &group_id, &object_id, &object_offset, &queue_delay, &flags,
+                &nb_objects_previous_group, &object_length, &fec_sequence, (stream_ctx == NULL) ? 0 : stream_ctx->datagram_group_max);
+        }
+    }
 
     if (next_bytes == NULL) {
         DBG_PRINTF("%s", "Error decoding datagram header");
         ret = -1;
     }
     else {
-        /* Find the stream context by datagram ID */
-        stream_ctx = quicrq_find_stream_ctx_for_datagram(cnx_ctx, media_id, 0);
         if (stream_ctx == NULL) {
-            DBG_PRINTF("Unexpected datagram on stream %" PRIu64 ", object id %" PRIu64 "/%" PRIu64 ", max: % " PRIu64, 
-                media_id, group_id, object_id, cnx_ctx->next_media_id);
-            picoquic_log_app_message(cnx_ctx->cnx, "Unexpected datagram on stream %" PRIu64 ", object id %" PRIu64 "/%" PRIu64 ", max: % " PRIu64,
-                media_id, group_id, object_id, cnx_ctx->next_media_id);
+            DBG_PRINTF("Unexpected datagram on stream %" PRIu64 ", group id %" PRIu64 ", max: % " PRIu64, 
+                media_id, group_id, cnx_ctx->next_media_id);
+            picoquic_log_app_message(cnx_ctx->cnx, "Unexpected datagram on stream %" PRIu64 ", group id %" PRIu64 ", max: % " PRIu64,
+                media_id, group_id, cnx_ctx->next_media_id);
             if (media_id >= cnx_ctx->next_media_id) {
                 ret = -1;
                 picoquic_log_app_message(cnx_ctx->cnx, "Error, unexpected datagram stream %" PRIu64,
                     media_id);
             }
         }
+        else if (datagram_type == QUICRQ_DATAGRAM_TYPE_FEC_REPAIR) {
+            /* Try to recover a lost fragment */
+            quicrq_fec_recovered_fragment_t recovered;
+            if (quicrq_fec_receive_repair(stream_ctx, group_id, fec_sequence, nb_sources, next_bytes, bytes_max - next_bytes, &recovered) > 0) {
+                picoquic_log_app_message(cnx_ctx->cnx, "Recovered fragment %" PRIu64 "/%" PRIu64 "/%" PRIu64 " by FEC on datagram stream %" PRIu64,
+                    recovered.group_id, recovered.object_id, recovered.object_offset, media_id);
+                ret = quicrq_receive_datagram_fragment(stream_ctx, recovered.data, recovered.data_length, recovered.group_id,
+                    recovered.object_id, recovered.object_offset, recovered.queue_delay, recovered.flags,
+                    recovered.nb_objects_previous_group, recovered.object_length, current_time);
+            }
+        }
         else {
             /* Compute data length based on remaining bytes */
             size_t data_length = bytes_max - next_bytes;
-            /* Verification that there are no unexpected fragments, used in tests */
-            if (group_id < stream_ctx->start_group_id ||
-                (group_id == stream_ctx->start_group_id && object_id < stream_ctx->start_object_id)) {
-                cnx_ctx->qr_ctx->useless_fragments += 1;
-            }
-            /* Pass data to the media context. */
-            if (object_offset + data_length >= object_length) {
-                picoquic_log_app_message(cnx_ctx->cnx, "Received final fragment of object %" PRIu64 "/%" PRIu64 " on datagram stream %" PRIu64 ", stream %" PRIu64,
-                    group_id, object_id, media_id, stream_ctx->stream_id);
-            }
-            ret = stream_ctx->consumer_fn(quicrq_media_datagram_ready, stream_ctx->media_ctx, current_time, next_bytes, group_id, object_id, object_offset, 
-                queue_delay, flags, nb_objects_previous_group, object_length, bytes_max - next_bytes);
-            if (ret == quicrq_consumer_finished) {
-                ret = quicrq_cnx_handle_consumer_finished(stream_ctx, 0, 1, ret);
+            if (group_id > stream_ctx->datagram_group_max) {
+                stream_ctx->datagram_group_max = group_id;
             }
-            if (ret != 0) {
-                DBG_PRINTF("Error found on dg stream id %" PRIu64 ", object id %" PRIu64 "/%", media_id, group_id, object_id);
+            if (fec_sequence != UINT64_MAX &&
+                quicrq_fec_receive_source(stream_ctx, fec_sequence, group_id, object_id, object_offset, object_length,
+                    queue_delay, flags, nb_objects_previous_group, next_bytes, data_length) != 0) {
+                DBG_PRINTF("Cannot keep FEC source %" PRIu64 " on stream %" PRIu64, fec_sequence, media_id);
             }
+            ret = quicrq_receive_datagram_fragment(stream_ctx, next_bytes, data_length, group_id, object_id, object_offset,
+                queue_delay, flags, nb_objects_previous_group, object_length, current_time);
         }
     }
 
     return ret;
 }
 
+/* Receive data in a datagram, unpacking the records if the datagram is a bundle */
+int quicrq_receive_datagram(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+    const uint8_t* bytes_max = bytes + length;
+    const uint8_t* next_bytes = quicrq_datagram_bundle_header_decode(bytes, bytes_max);
+
+    if (next_bytes == NULL) {
+        ret = quicrq_receive_datagram_record(cnx_ctx, bytes, length, current_time);
+    }
+    else {
+        while (ret == 0 && next_bytes < bytes_max) {
+            size_t record_length = 0;
+            if ((next_bytes = quicrq_datagram_bundle_record_decode(next_bytes, bytes_max, &record_length)) == NULL ||
+                quicrq_datagram_bundle_header_decode(next_bytes, next_bytes + record_length) != NULL) {
+                DBG_PRINTF("%s", "Error decoding datagram bundle");
+                ret = -1;
+            }
+            else {
+                ret = quicrq_receive_datagram_record(cnx_ctx, next_bytes, record_length, current_time);
+                next_bytes += record_length;
+            }
+        }
+    }
+    return ret;
+}
+
 /* Handle the list of datagrams pending acknowledgement or retransmission.
  * The code maintains an acknowledgement tree of the fragments that were sent.
  * TODO: handle whether we can have overlapping fragments. We will assume that
@@ -497,34 +668,120 @@ static picosplay_node_t* quicrq_datagram_ack_node_create(void* v_datagram_ack_st
     return &((quicrq_datagram_ack_state_t*)v_datagram_ack_state)->datagram_ack_node;
 }
 
-static void quicrq_datagram_ack_extra_dequeue(quicrq_stream_ctx_t* stream_ctx, quicrq_datagram_ack_state_t* das)
+/* Extra repeats of all connections are scheduled in a min heap of the quicrq
+ * context, ordered by repeat time, then by order of scheduling. Finding the next
+ * repeat time does not require visiting idle connections and streams.
+ */
+static int quicrq_extra_repeat_is_before(quicrq_datagram_ack_state_t* das_l, quicrq_datagram_ack_state_t* das_r)
 {
-    if (das->extra_data == NULL) {
-        return;
+    return das_l->extra_repeat_time < das_r->extra_repeat_time ||
+        (das_l->extra_repeat_time == das_r->extra_repeat_time && das_l->extra_sequence < das_r->extra_sequence);
+}
+
+static void quicrq_extra_repeat_heap_set(quicrq_ctx_t* qr_ctx, size_t index, quicrq_datagram_ack_state_t* das)
+{
+    qr_ctx->extra_repeat_heap[index] = das;
+    das->extra_heap_index = index;
+}
+
+static void quicrq_extra_repeat_heap_sift_up(quicrq_ctx_t* qr_ctx, size_t index)
+{
+    quicrq_datagram_ack_state_t* das = qr_ctx->extra_repeat_heap[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (!quicrq_extra_repeat_is_before(das, qr_ctx->extra_repeat_heap[parent])) {
+            break;
+        }
+        quicrq_extra_repeat_heap_set(qr_ctx, index, qr_ctx->extra_repeat_heap[parent]);
+        index = parent;
     }
-    if (das->extra_previous == NULL) {
-        stream_ctx->extra_first = das->extra_next;
+    quicrq_extra_repeat_heap_set(qr_ctx, index, das);
+}
+
+static void quicrq_extra_repeat_heap_sift_down(quicrq_ctx_t* qr_ctx, size_t index)
+{
+    quicrq_datagram_ack_state_t* das = qr_ctx->extra_repeat_heap[index];
+
+    while (2 * index + 1 < qr_ctx->nb_extra_repeat) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < qr_ctx->nb_extra_repeat &&
+            quicrq_extra_repeat_is_before(qr_ctx->extra_repeat_heap[child + 1], qr_ctx->extra_repeat_heap[child])) {
+            child++;
+        }
+        if (!quicrq_extra_repeat_is_before(qr_ctx->extra_repeat_heap[child], das)) {
+            break;
+        }
+        quicrq_extra_repeat_heap_set(qr_ctx, index, qr_ctx->extra_repeat_heap[child]);
+        index = child;
     }
-    else {
-        das->extra_previous->extra_next = das->extra_next;
+    quicrq_extra_repeat_heap_set(qr_ctx, index, das);
+}
+
+static int quicrq_extra_repeat_heap_insert(quicrq_ctx_t* qr_ctx, quicrq_datagram_ack_state_t* das)
+{
+    int ret = 0;
+
+    if (qr_ctx->nb_extra_repeat >= qr_ctx->extra_repeat_heap_size) {
+        size_t new_size = (qr_ctx->extra_repeat_heap_size == 0) ? 16 : 2 * qr_ctx->extra_repeat_heap_size;
+        quicrq_datagram_ack_state_t** new_heap = (quicrq_datagram_ack_state_t**)
+            realloc(qr_ctx->extra_repeat_heap, new_size * sizeof(quicrq_datagram_ack_state_t*));
+        if (new_heap == NULL) {
+            ret = -1;
+        }
+        else {
+            qr_ctx->extra_repeat_heap = new_heap;
+            qr_ctx->extra_repeat_heap_size = new_size;
+        }
     }
-    if (das->extra_next == NULL) {
-        stream_ctx->extra_last = das->extra_previous;
+    if (ret == 0) {
+        das->extra_sequence = qr_ctx->extra_repeat_sequence++;
+        qr_ctx->nb_extra_repeat++;
+        quicrq_extra_repeat_heap_set(qr_ctx, qr_ctx->nb_extra_repeat - 1, das);
+        quicrq_extra_repeat_heap_sift_up(qr_ctx, qr_ctx->nb_extra_repeat - 1);
     }
-    else {
-        das->extra_next->extra_previous = das->extra_previous;
+    return ret;
+}
+
+static void quicrq_extra_repeat_heap_remove(quicrq_ctx_t* qr_ctx, quicrq_datagram_ack_state_t* das)
+{
+    size_t index = das->extra_heap_index;
+
+    if (index < qr_ctx->nb_extra_repeat && qr_ctx->extra_repeat_heap[index] == das) {
+        qr_ctx->nb_extra_repeat--;
+        if (index < qr_ctx->nb_extra_repeat) {
+            quicrq_extra_repeat_heap_set(qr_ctx, index, qr_ctx->extra_repeat_heap[qr_ctx->nb_extra_repeat]);
+            quicrq_extra_repeat_heap_sift_up(qr_ctx, index);
+            quicrq_extra_repeat_heap_sift_down(qr_ctx, qr_ctx->extra_repeat_heap[index]->extra_heap_index);
+        }
+        qr_ctx->extra_repeat_heap[qr_ctx->nb_extra_repeat] = NULL;
     }
+}
+
+void quicrq_extra_repeat_heap_release(quicrq_ctx_t* qr_ctx)
+{
+    free(qr_ctx->extra_repeat_heap);
+    qr_ctx->extra_repeat_heap = NULL;
+    qr_ctx->extra_repeat_heap_size = 0;
+    qr_ctx->nb_extra_repeat = 0;
+}
+
+static void quicrq_datagram_ack_extra_dequeue(quicrq_stream_ctx_t* stream_ctx, quicrq_datagram_ack_state_t* das)
+{
+    if (das->extra_data == NULL) {
+        return;
+    }
+    quicrq_extra_repeat_heap_remove(stream_ctx->cnx_ctx->qr_ctx, das);
 
-    free(das->extra_data);
     das->extra_data = NULL;
-    das->extra_next = NULL;
-    das->extra_previous = NULL;
+    das->extra_stream_ctx = NULL;
     das->extra_repeat_time = 0;
 }
 
-static void quicrq_datagram_ack_extra_queue(quicrq_stream_ctx_t* stream_ctx, quicrq_datagram_ack_state_t* das, const uint8_t * data, uint64_t repeat_time)
+static void quicrq_datagram_ack_extra_queue(quicrq_stream_ctx_t* stream_ctx, quicrq_datagram_ack_state_t* das, uint64_t repeat_time)
 {
-    if (das->is_extra_queued) {
+    if (das->is_extra_queued || das->fragment == NULL || stream_ctx->cnx_ctx->qr_ctx->fec_window > 0) {
+        /* When FEC is enabled, the repair datagrams replace the extra repeats */
         return;
     }
     das->is_extra_queued = 1;
@@ -533,19 +790,19 @@ static void quicrq_datagram_ack_extra_queue(quicrq_stream_ctx_t* stream_ctx, qui
         /* new repeat request replaces the previous one */
         quicrq_datagram_ack_extra_dequeue(stream_ctx, das);
     }
-    das->extra_data = (uint8_t *)malloc(das->length);
-    if (das->extra_data != NULL) {
-        memcpy(das->extra_data, data, das->length);
-        if (stream_ctx->extra_last == NULL) {
-            stream_ctx->extra_first = das;
-            stream_ctx->extra_last = das;
-        }
-        else {
-            stream_ctx->extra_last->extra_next = das;
-            das->extra_previous = stream_ctx->extra_last;
-            stream_ctx->extra_last = das;
+    das->extra_repeat_time = repeat_time;
+    if (quicrq_extra_repeat_heap_insert(stream_ctx->cnx_ctx->qr_ctx, das) != 0) {
+        /* The extra repeat is an optimization, just skip it. */
+        DBG_PRINTF("%s", "Cannot schedule extra repeat");
+        das->extra_repeat_time = 0;
+    }
+    else {
+        /* The data is read from the cached fragment, which is kept alive by the reference */
+        das->extra_stream_ctx = stream_ctx;
+        das->extra_data = das->fragment->data;
+        if (das->length > 0) {
+            das->extra_data += das->object_offset - das->fragment->offset;
         }
-        das->extra_repeat_time = repeat_time;
         stream_ctx->nb_extra_sent++;
     }
 }
@@ -560,6 +817,9 @@ static void quicrq_datagram_ack_node_delete(void* tree, picosplay_node_t* node)
         /* dequeue from extra repeat list */
         quicrq_datagram_ack_extra_dequeue(stream_ctx, das);
     }
+    if (das->fragment != NULL) {
+        quicrq_fragment_cache_unref(das->fragment);
+    }
     free(quicrq_datagram_ack_node_value(node));
 }
 
@@ -637,7 +897,7 @@ int64_t quicrq_datagram_check_horizon(quicrq_stream_ctx_t* stream_ctx, uint64_t
 }
 
 int quicrq_datagram_ack_init(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t object_id, 
-    uint64_t object_offset, uint8_t flags, uint64_t nb_objects_previous_group, const uint8_t * data, size_t length,
+    uint64_t object_offset, uint8_t flags, uint64_t nb_objects_previous_group, quicrq_cached_fragment_t* fragment, size_t length,
     uint64_t queue_delay, uint64_t object_length, void** p_created_state, uint64_t current_time)
 {
     int ret = 0;
@@ -674,6 +934,10 @@ int quicrq_datagram_ack_init(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id,
                 da_new->object_length = object_length;
                 da_new->queue_delay = queue_delay;
                 da_new->start_time = current_time;
+                if (fragment != NULL) {
+                    da_new->fragment = fragment;
+                    quicrq_fragment_cache_ref(fragment);
+                }
                 picosplay_insert(&stream_ctx->datagram_ack_tree, da_new);
                 if (p_created_state != NULL) {
                     *p_created_state = da_new;
@@ -683,7 +947,7 @@ int quicrq_datagram_ack_init(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id,
                 if (stream_ctx->cnx_ctx->qr_ctx->extra_repeat_after_received_delayed &&
                     stream_ctx->cnx_ctx->qr_ctx->extra_repeat_delay > 0 &&
                     queue_delay > 20) {
-                    quicrq_datagram_ack_extra_queue(stream_ctx, da_new, data, current_time + stream_ctx->cnx_ctx->qr_ctx->extra_repeat_delay);
+                    quicrq_datagram_ack_extra_queue(stream_ctx, da_new, current_time + stream_ctx->cnx_ctx->qr_ctx->extra_repeat_delay);
                 }
             }
         }
@@ -847,7 +1111,7 @@ int quicrq_datagram_handle_repeat(quicrq_stream_ctx_t* stream_ctx,
             found->last_sent_time = current_time;
             bytes = quicrq_datagram_header_encode(bytes, bytes_max, stream_ctx->media_id,
                 found->group_id, found->object_id, found->object_offset, found->queue_delay + queue_delay_delta, found->flags,
-                found->nb_objects_previous_group, found->object_length);
+                found->nb_objects_previous_group, found->object_length, UINT64_MAX);
             /* Check how much data should be send in this fragment */
             header_length = bytes - datagram;
             datagram_length = header_length + data_length;
@@ -865,7 +1129,7 @@ int quicrq_datagram_handle_repeat(quicrq_stream_ctx_t* stream_ctx,
                 if (ret == 0){
                     found->last_sent_time = current_time;
                     if (prepare_extra && stream_ctx->cnx_ctx->qr_ctx->extra_repeat_delay > 0) {
-                        quicrq_datagram_ack_extra_queue(stream_ctx, found, data,
+                        quicrq_datagram_ack_extra_queue(stream_ctx, found,
                             current_time + stream_ctx->cnx_ctx->qr_ctx->extra_repeat_delay);
                     }
                     if (fragment_length < data_length) {
@@ -876,7 +1140,7 @@ int quicrq_datagram_handle_repeat(quicrq_stream_ctx_t* stream_ctx,
 
                         /* split the fragment, get a new one, update old record, point found to new record. */
                         ret = quicrq_datagram_ack_init(stream_ctx, found->group_id, found->object_id, next_offset,
-                            found->flags, found->nb_objects_previous_group, data, data_length,
+                            found->flags, found->nb_objects_previous_group, found->fragment, data_length,
                             found->queue_delay, found->object_length, &p_next_record, found->start_time);
                         if (ret == 0) {
                             quicrq_datagram_ack_state_t* next_record = (quicrq_datagram_ack_state_t*)p_next_record;
@@ -900,6 +1164,58 @@ int quicrq_datagram_handle_repeat(quicrq_stream_ctx_t* stream_ctx,
     return ret;
 }
 
+/* When a receiver requests the repair of missing data, the cached fragments
+ * covering that data are queued as datagrams, using the full datagram header.
+ * These copies are not tracked for acknowledgement: if they are lost, the
+ * receiver will request the data again.
+ */
+int quicrq_datagram_queue_repair(quicrq_stream_ctx_t* stream_ctx, const quicrq_cached_fragment_t* fragment,
+    uint64_t current_time)
+{
+    int ret = 0;
+    const uint8_t* data = fragment->data;
+    size_t data_length = fragment->data_length;
+    uint64_t object_offset = fragment->offset;
+    uint64_t queue_delay = fragment->queue_delay;
+
+    if (current_time > fragment->cache_time) {
+        queue_delay += (current_time - fragment->cache_time + 500) / 1000;
+    }
+    /* Check that the connection is there */
+    if (stream_ctx->cnx_ctx == NULL || stream_ctx->cnx_ctx->cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        do {
+            uint8_t datagram[PICOQUIC_MAX_PACKET_SIZE];
+            uint8_t* bytes = quicrq_datagram_header_encode(datagram, datagram + PICOQUIC_MAX_PACKET_SIZE, stream_ctx->media_id,
+                fragment->group_id, fragment->object_id, object_offset, queue_delay, fragment->flags,
+                fragment->nb_objects_previous_group, fragment->object_length, UINT64_MAX);
+            size_t fragment_length = data_length;
+
+            if (bytes == NULL) {
+                ret = -1;
+            }
+            else {
+                /* Split the fragment if it does not fit in a queued datagram */
+                size_t header_length = bytes - datagram;
+                if (header_length + fragment_length > PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH) {
+                    fragment_length = PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH - header_length;
+                }
+                memcpy(bytes, data, fragment_length);
+                ret = picoquic_queue_datagram_frame(stream_ctx->cnx_ctx->cnx, header_length + fragment_length, datagram);
+                if (ret == 0) {
+                    stream_ctx->nb_repair_fragments_sent++;
+                    data += fragment_length;
+                    data_length -= fragment_length;
+                    object_offset += fragment_length;
+                }
+            }
+        } while (ret == 0 && data_length > 0);
+    }
+    return ret;
+}
+
 int quicrq_datagram_handle_lost(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t object_id, uint64_t object_offset, uint64_t sent_time,
     const uint8_t *bytes, size_t length, uint64_t current_time)
 {
@@ -926,8 +1242,8 @@ int quicrq_datagram_handle_lost(quicrq_stream_ctx_t* stream_ctx, uint64_t group_
     return ret;
 }
 
-/* Handle the acknowledgements of datagrams */
-int quicrq_handle_datagram_ack_nack(quicrq_cnx_ctx_t* cnx_ctx, picoquic_call_back_event_t picoquic_event, 
+/* Handle the acknowledgement or loss of a source or repair datagram */
+static int quicrq_handle_datagram_record_ack_nack(quicrq_cnx_ctx_t* cnx_ctx, picoquic_call_back_event_t picoquic_event,
     uint64_t send_time, const uint8_t* bytes, size_t length, uint64_t current_time)
 {
     int ret = 0;
@@ -941,27 +1257,37 @@ int quicrq_handle_datagram_ack_nack(quicrq_cnx_ctx_t* cnx_ctx, picoquic_call_bac
     uint8_t flags;
     uint64_t nb_objects_previous_group;
     uint64_t object_length;
+    uint64_t fec_sequence;
+    uint64_t datagram_type;
     const uint8_t* next_bytes;
+    quicrq_stream_ctx_t* stream_ctx = NULL;
 
-    if (bytes == NULL) {
+    if (bytes == NULL || (next_bytes = quicrq_datagram_stream_id_decode(bytes, bytes_max, &media_id, &datagram_type)) == NULL) {
         ret = -1;
     }
+    else if (datagram_type == QUICRQ_DATAGRAM_TYPE_FEC_REPAIR) {
+        /* FEC repair datagrams are not repeated if lost */
+    }
     else {
-        next_bytes = quicrq_datagram_header_decode(bytes, bytes_max, &media_id, &group_id, &object_id, &object_offset, &queue_delay, &flags, &nb_objects_previous_group, &object_length);
+        /* Find the stream context by datagram ID.
+         * the stream may already be closed, so not finding it is not an error.
+         */
+        stream_ctx = quicrq_find_stream_ctx_for_datagram(cnx_ctx, media_id, 1);
+        next_bytes = quicrq_datagram_header_decode(bytes, bytes_max, &media_id, &group_id, &object_id, &object_offset, &queue_delay, &flags,
+            &nb_objects_previous_group, &object_length, &fec_sequence, (stream_ctx == NULL) ? 0 : stream_ctx->datagram_group_max);
         
-        /* Retrieve the stream context for the datagram */
         if (next_bytes == NULL) {
             ret = -1;
         }
         else {
-            /* Find the stream context by datagram ID.
-             * the stream may already be closed, so not finding it is not an error.
-             */
-            quicrq_stream_ctx_t* stream_ctx = quicrq_find_stream_ctx_for_datagram(cnx_ctx, media_id, 1);
             if (stream_ctx != NULL) {
                 size_t data_length = (size_t)(bytes_max - next_bytes);
                 switch (picoquic_event) {
                 case picoquic_callback_datagram_acked: /* Ack for packet carrying datagram-object received from peer */
+                    if (!stream_ctx->is_datagram_group_acked || group_id > stream_ctx->datagram_group_acked) {
+                        stream_ctx->is_datagram_group_acked = 1;
+                        stream_ctx->datagram_group_acked = group_id;
+                    }
                     ret = quicrq_datagram_handle_ack(stream_ctx, group_id, object_id, object_offset, data_length);
                     break;
                 case picoquic_callback_datagram_lost: /* Packet carrying datagram-object probably lost */
@@ -981,6 +1307,41 @@ int quicrq_handle_datagram_ack_nack(quicrq_cnx_ctx_t* cnx_ctx, picoquic_call_bac
     return ret;
 }
 
+/* Handle the acknowledgements of datagrams. The records of a bundle are acknowledged,
+ * or repeated, as if they had been sent in separate datagrams.
+ */
+int quicrq_handle_datagram_ack_nack(quicrq_cnx_ctx_t* cnx_ctx, picoquic_call_back_event_t picoquic_event, 
+    uint64_t send_time, const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+
+    if (bytes == NULL) {
+        ret = -1;
+    }
+    else {
+        const uint8_t* bytes_max = bytes + length;
+        const uint8_t* next_bytes = quicrq_datagram_bundle_header_decode(bytes, bytes_max);
+
+        if (next_bytes == NULL) {
+            ret = quicrq_handle_datagram_record_ack_nack(cnx_ctx, picoquic_event, send_time, bytes, length, current_time);
+        }
+        else {
+            while (ret == 0 && next_bytes < bytes_max) {
+                size_t record_length = 0;
+                if ((next_bytes = quicrq_datagram_bundle_record_decode(next_bytes, bytes_max, &record_length)) == NULL) {
+                    ret = -1;
+                }
+                else {
+                    ret = quicrq_handle_datagram_record_ack_nack(cnx_ctx, picoquic_event, send_time, next_bytes, record_length, current_time);
+                    next_bytes += record_length;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
 /* control whether an extra copy of the packet can be sent:
 * - after the packet is repeated (on nack)
 * - if a packet was delayed at a previous hop (after-delayed)
@@ -1001,40 +1362,31 @@ void quicrq_set_extra_repeat_delay(quicrq_ctx_t* qr, uint64_t delay_in_microseco
 }
 
 /* Handling of extra repeats in a quicrq_context.
- * Check all the queues and return the next wakeup time, wich will be "now"
- * if there are queued datagrams, or the time at which the next datagram will be
- * queued
+ * Send the queued datagrams whose repeat time has come, and return the next
+ * wakeup time, which is the repeat time of the first datagram left in the
+ * heap. Only the datagrams that are due are visited.
  */
 uint64_t quicrq_handle_extra_repeat(quicrq_ctx_t* qr, uint64_t current_time)
 {
     uint64_t next_time = UINT64_MAX;
-    quicrq_cnx_ctx_t* cnx_ctx = qr->first_cnx;
 
-    while (cnx_ctx != NULL) {
-        quicrq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
-        while (stream_ctx != NULL) {
-            quicrq_datagram_ack_state_t* das = stream_ctx->extra_first;
-            while (das != NULL) {
-                if (das->extra_repeat_time <= current_time) {
-                    next_time = current_time;
-                    int ret = quicrq_datagram_handle_repeat(stream_ctx, das, das->extra_data, das->length, 0, current_time);
-                    if (ret != 0) {
-                        DBG_PRINTF("Handle repeat error, ret = %d", ret);
-                    }
-                    quicrq_datagram_ack_extra_dequeue(stream_ctx, das);
-                    das = stream_ctx->extra_first;
-                }
-                else
-                {
-                    if (das->extra_repeat_time < next_time) {
-                        next_time = das->extra_repeat_time;
-                    }
-                    break;
-                }
+    while (qr->nb_extra_repeat > 0) {
+        quicrq_datagram_ack_state_t* das = qr->extra_repeat_heap[0];
+        if (das->extra_repeat_time <= current_time) {
+            quicrq_stream_ctx_t* stream_ctx = das->extra_stream_ctx;
+            int ret = quicrq_datagram_handle_repeat(stream_ctx, das, das->extra_data, das->length, 0, current_time);
+            next_time = current_time;
+            if (ret != 0) {
+                DBG_PRINTF("Handle repeat error, ret = %d", ret);
             }
-            stream_ctx = stream_ctx->next_stream;
+            quicrq_datagram_ack_extra_dequeue(stream_ctx, das);
+        }
+        else {
+            if (das->extra_repeat_time < next_time) {
+                next_time = das->extra_repeat_time;
+            }
+            break;
         }
-        cnx_ctx = cnx_ctx->next_cnx;
     }
     return next_time;
 }
@@ -1050,6 +1402,174 @@ void quicrq_enable_congestion_control(quicrq_ctx_t* qr, quicrq_congestion_contro
     }
 }
 
+int quicrq_enable_congestion_trace(quicrq_ctx_t* qr, int enable)
+{
+    int ret = 0;
+
+    if (!enable) {
+        if (qr->congestion_trace != NULL) {
+            free(qr->congestion_trace);
+            qr->congestion_trace = NULL;
+        }
+    }
+    else if (qr->congestion_trace == NULL) {
+        qr->congestion_trace = (quicrq_congestion_trace_t*)malloc(sizeof(quicrq_congestion_trace_t));
+        if (qr->congestion_trace == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(qr->congestion_trace, 0, sizeof(quicrq_congestion_trace_t));
+        }
+    }
+    return ret;
+}
+
+/* Datagram scheduling.
+ * Datagram streams are queued in the connection context when data becomes
+ * available, and removed from the queue when they have nothing left to send,
+ * so that idle streams are not rescanned each time a datagram can be sent.
+ * The queued streams are served in deficit round robin: the stream at the
+ * head of the queue sends datagrams until its deficit is exhausted, then
+ * receives a new quantum and moves to the end of the queue. The deficit may
+ * become negative, because the size of the next datagram is only known
+ * after it is sent. The quantum is weighted by the priority flags of the
+ * current object, lower flag values meaning higher priority, so higher
+ * priority media get a larger share when the datagram budget is tight.
+ */
+#define QUICRQ_DATAGRAM_QUANTUM 1536
+#define QUICRQ_DATAGRAM_DEFAULT_FLAGS 0x80
+
+void quicrq_datagram_ready_queue_add(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+
+    if (!stream_ctx->is_active_datagram) {
+        stream_ctx->is_active_datagram = 1;
+        stream_ctx->datagram_deficit = 0;
+        stream_ctx->next_datagram_ready = NULL;
+        stream_ctx->previous_datagram_ready = cnx_ctx->last_datagram_ready;
+        if (cnx_ctx->last_datagram_ready == NULL) {
+            cnx_ctx->first_datagram_ready = stream_ctx;
+        }
+        else {
+            cnx_ctx->last_datagram_ready->next_datagram_ready = stream_ctx;
+        }
+        cnx_ctx->last_datagram_ready = stream_ctx;
+        cnx_ctx->nb_datagram_ready++;
+    }
+}
+
+void quicrq_datagram_ready_queue_remove(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+
+    if (stream_ctx->is_active_datagram) {
+        if (stream_ctx->next_datagram_ready == NULL) {
+            cnx_ctx->last_datagram_ready = stream_ctx->previous_datagram_ready;
+        }
+        else {
+            stream_ctx->next_datagram_ready->previous_datagram_ready = stream_ctx->previous_datagram_ready;
+        }
+        if (stream_ctx->previous_datagram_ready == NULL) {
+            cnx_ctx->first_datagram_ready = stream_ctx->next_datagram_ready;
+        }
+        else {
+            stream_ctx->previous_datagram_ready->next_datagram_ready = stream_ctx->next_datagram_ready;
+        }
+        stream_ctx->next_datagram_ready = NULL;
+        stream_ctx->previous_datagram_ready = NULL;
+        stream_ctx->is_active_datagram = 0;
+        cnx_ctx->nb_datagram_ready--;
+    }
+}
+
+static int64_t quicrq_datagram_quantum(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_fragment_publisher_context_t* media_ctx = stream_ctx->media_ctx;
+    uint8_t flags = QUICRQ_DATAGRAM_DEFAULT_FLAGS;
+
+    if (media_ctx != NULL && media_ctx->current_fragment != NULL) {
+        flags = media_ctx->current_fragment->flags;
+    }
+    /* Weight from 1 for the lowest priority to 8 for the highest */
+    return (int64_t)QUICRQ_DATAGRAM_QUANTUM * (1 + ((0xff - flags) >> 5));
+}
+
+/* Datagram bundling.
+ * When bundling is enabled and the datagram has enough space, the scheduler
+ * does not stop after the first record. It keeps serving the queued streams
+ * until the space left is too small for another useful record. The records
+ * are prepared in the bundle buffer, then copied to the datagram frame. If
+ * only one record was prepared, it is sent as a plain datagram.
+ */
+void quicrq_set_datagram_bundling(quicrq_ctx_t* qr, int enable)
+{
+    qr->datagram_bundling = (enable != 0);
+}
+
+/* Compact datagram headers.
+ * A receiver that enables compact headers asks for them in its request or accept
+ * messages. The sender uses them if it also enabled them.
+ */
+void quicrq_set_datagram_header_compression(quicrq_ctx_t* qr, int enable)
+{
+    qr->compact_datagram_header = (enable != 0);
+}
+
+/* Obtain a buffer for a source or repair datagram: either the datagram frame
+ * provided by picoquic, or the next record in the bundle being prepared.
+ */
+void* quicrq_provide_datagram_buffer(quicrq_stream_ctx_t* stream_ctx, void* context, size_t length)
+{
+    void* buffer = NULL;
+    quicrq_datagram_bundle_t* bundle = (stream_ctx == NULL) ? NULL : stream_ctx->cnx_ctx->datagram_bundle;
+
+    if (bundle == NULL) {
+        buffer = picoquic_provide_datagram_buffer(context, length);
+    }
+    else {
+        uint8_t* bytes = quicrq_datagram_bundle_record_encode(bundle->bytes + bundle->length, bundle->bytes + bundle->space, length);
+        if (bytes != NULL) {
+            buffer = bytes;
+            bundle->length = (bytes + length) - bundle->bytes;
+            bundle->nb_records++;
+        }
+    }
+    return buffer;
+}
+
+static int quicrq_datagram_bundle_send(quicrq_datagram_bundle_t* bundle, void* context)
+{
+    int ret = 0;
+    const uint8_t* record = bundle->bytes;
+    size_t record_length = bundle->length;
+    uint8_t* buffer = NULL;
+
+    if (bundle->nb_records == 1) {
+        /* Send the record as a plain datagram */
+        if ((record = quicrq_datagram_bundle_record_decode(record, bundle->bytes + bundle->length, &record_length)) == NULL ||
+            (buffer = (uint8_t*)picoquic_provide_datagram_buffer(context, record_length)) == NULL) {
+            ret = -1;
+        }
+    }
+    else {
+        uint8_t header[8];
+        uint8_t* bytes = quicrq_datagram_bundle_header_encode(header, header + sizeof(header));
+        size_t header_length = bytes - header;
+        if ((buffer = (uint8_t*)picoquic_provide_datagram_buffer(context, header_length + record_length)) == NULL) {
+            ret = -1;
+        }
+        else {
+            memcpy(buffer, header, header_length);
+            buffer += header_length;
+        }
+    }
+    if (ret == 0) {
+        memcpy(buffer, record, record_length);
+    }
+    return ret;
+}
+
 /* Prepare to send a datagram */
 
 int quicrq_prepare_to_send_datagram(quicrq_cnx_ctx_t* cnx_ctx, void* context, size_t space, uint64_t current_time)
@@ -1057,28 +1577,74 @@ int quicrq_prepare_to_send_datagram(quicrq_cnx_ctx_t* cnx_ctx, void* context, si
     /* Find a stream on which datagrams are available */
     int ret = 0;
     int at_least_one_active = 0;
-    quicrq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
+    /* Each queued stream is visited at most twice: once to receive a quantum, once to send */
+    size_t nb_visits_max = 2 * cnx_ctx->nb_datagram_ready;
+    quicrq_datagram_bundle_t bundle;
+
+    bundle.length = 0;
+    bundle.nb_records = 0;
+    if (cnx_ctx->qr_ctx->datagram_bundling && space >= 2 * QUICRQ_DATAGRAM_BUNDLE_MIN_SPACE) {
+        /* Reserve one byte for the bundle header */
+        bundle.space = (space - 1 > sizeof(bundle.bytes)) ? sizeof(bundle.bytes) : space - 1;
+        cnx_ctx->datagram_bundle = &bundle;
+    }
 
     /* TODO: handle congestion. Check whether one stream is congested. 
      * look at priority levels, etc.
      */
 
-    while (stream_ctx != NULL) {
-        if (stream_ctx->transport_mode == quicrq_transport_mode_datagram && stream_ctx->is_sender && stream_ctx->is_active_datagram && stream_ctx->media_id < UINT64_MAX) {
+    for (size_t nb_visits = 0; ret == 0 && nb_visits < nb_visits_max && cnx_ctx->first_datagram_ready != NULL; nb_visits++) {
+        quicrq_stream_ctx_t* stream_ctx = cnx_ctx->first_datagram_ready;
+
+        if (stream_ctx->transport_mode != quicrq_transport_mode_datagram || !stream_ctx->is_sender || stream_ctx->media_id == UINT64_MAX) {
+            quicrq_datagram_ready_queue_remove(stream_ctx);
+        }
+        else if (stream_ctx->datagram_deficit <= 0) {
+            /* Give the stream a new quantum and move it to the end of the queue */
+            int64_t deficit = stream_ctx->datagram_deficit + quicrq_datagram_quantum(stream_ctx);
+            quicrq_datagram_ready_queue_remove(stream_ctx);
+            quicrq_datagram_ready_queue_add(stream_ctx);
+            stream_ctx->datagram_deficit = deficit;
+        }
+        else {
             int media_was_sent = 0;
-            ret = quicrq_fragment_datagram_publisher_fn(stream_ctx, context, space, &media_was_sent, &at_least_one_active, current_time);
-            if (media_was_sent || ret != 0) {
-                break;
+            if (cnx_ctx->datagram_bundle != NULL) {
+                space = cnx_ctx->datagram_bundle->space - cnx_ctx->datagram_bundle->length - QUICRQ_DATAGRAM_BUNDLE_RECORD_OVERHEAD;
+            }
+            /* A pending FEC repair is sent before the next fragments */
+            ret = quicrq_fec_sender_send_repair(stream_ctx, context, space, &media_was_sent);
+            if (ret == 0 && !media_was_sent) {
+                ret = quicrq_fragment_datagram_publisher_fn(stream_ctx, context, space, &media_was_sent, &at_least_one_active, current_time);
+                if (ret == 0 && !media_was_sent && quicrq_fec_sender_flush(stream_ctx)) {
+                    /* Nothing else to send, protect the last fragments now */
+                    ret = quicrq_fec_sender_send_repair(stream_ctx, context, space, &media_was_sent);
+                }
             }
-            else {
-                stream_ctx->is_active_datagram = 0;
+            if (media_was_sent) {
+                at_least_one_active = 1;
+                stream_ctx->datagram_deficit -= (int64_t)stream_ctx->last_datagram_size;
+                if (cnx_ctx->datagram_bundle == NULL || cnx_ctx->datagram_bundle->space - cnx_ctx->datagram_bundle->length <
+                    QUICRQ_DATAGRAM_BUNDLE_MIN_SPACE + QUICRQ_DATAGRAM_BUNDLE_RECORD_OVERHEAD) {
+                    break;
+                }
+                /* Keep filling the bundle, visiting the queued streams again */
+                nb_visits_max = nb_visits + 1 + 2 * cnx_ctx->nb_datagram_ready;
             }
+            else if (ret == 0) {
+                quicrq_datagram_ready_queue_remove(stream_ctx);
+            }
+        }
+    }
+
+    if (cnx_ctx->datagram_bundle != NULL) {
+        cnx_ctx->datagram_bundle = NULL;
+        if (ret == 0 && bundle.nb_records > 0) {
+            ret = quicrq_datagram_bundle_send(&bundle, context);
         }
-        stream_ctx = stream_ctx->next_stream;
     }
 
     if (ret == 0) {
-        picoquic_mark_datagram_ready(cnx_ctx->cnx, at_least_one_active);
+        picoquic_mark_datagram_ready(cnx_ctx->cnx, at_least_one_active || cnx_ctx->first_datagram_ready != NULL);
     }
 
     return ret;
@@ -1141,6 +1707,72 @@ int quicrq_prepare_start_point(quicrq_stream_ctx_t* stream_ctx)
     return ret;
 }
 
+/* Queue a repair request, keeping the list sorted and without duplicates */
+int quicrq_stream_request_repair(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t offset, uint64_t length)
+{
+    int ret = 0;
+    size_t rank = 0;
+
+    while (rank < stream_ctx->nb_repair_ranges &&
+        (stream_ctx->repair_ranges[rank].group_id < group_id ||
+        (stream_ctx->repair_ranges[rank].group_id == group_id &&
+            (stream_ctx->repair_ranges[rank].object_id < object_id ||
+            (stream_ctx->repair_ranges[rank].object_id == object_id && stream_ctx->repair_ranges[rank].offset < offset))))) {
+        rank++;
+    }
+    if (rank < stream_ctx->nb_repair_ranges &&
+        stream_ctx->repair_ranges[rank].group_id == group_id &&
+        stream_ctx->repair_ranges[rank].object_id == object_id &&
+        stream_ctx->repair_ranges[rank].offset == offset) {
+        /* Already requested. Keep the largest request. */
+        if (length == 0 || (stream_ctx->repair_ranges[rank].length != 0 && stream_ctx->repair_ranges[rank].length < length)) {
+            stream_ctx->repair_ranges[rank].length = length;
+        }
+    }
+    else if (stream_ctx->nb_repair_ranges < QUICRQ_REPAIR_RANGES_MAX) {
+        for (size_t i = stream_ctx->nb_repair_ranges; i > rank; i--) {
+            stream_ctx->repair_ranges[i] = stream_ctx->repair_ranges[i - 1];
+        }
+        stream_ctx->repair_ranges[rank].group_id = group_id;
+        stream_ctx->repair_ranges[rank].object_id = object_id;
+        stream_ctx->repair_ranges[rank].offset = offset;
+        stream_ctx->repair_ranges[rank].length = length;
+        stream_ctx->nb_repair_ranges++;
+        if (stream_ctx->send_state == quicrq_sending_ready && stream_ctx->cnx_ctx->cnx != NULL) {
+            ret = picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
+        }
+    }
+    return ret;
+}
+
+/* Encode the pending repair requests in the message buffer of the stream */
+static int quicrq_prepare_repair_request(quicrq_stream_ctx_t* stream_ctx)
+{
+    int ret = 0;
+    quicrq_message_buffer_t* message = &stream_ctx->message_sent;
+
+    if (quicrq_msg_buffer_alloc(message, quicrq_repair_request_msg_reserve(stream_ctx->nb_repair_ranges), 0) != 0) {
+        ret = -1;
+    }
+    else {
+        uint8_t* message_next = quicrq_repair_request_msg_encode(message->buffer, message->buffer + message->buffer_alloc,
+            QUICRQ_ACTION_REPAIR_REQUEST, stream_ctx->nb_repair_ranges, stream_ctx->repair_ranges);
+        if (message_next == NULL) {
+            ret = -1;
+        }
+        else {
+            quicrq_log_message(stream_ctx->cnx_ctx, "Stream %" PRIu64 ", sending repair request for %zu ranges, first: %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+                stream_ctx->stream_id, stream_ctx->nb_repair_ranges, stream_ctx->repair_ranges[0].group_id,
+                stream_ctx->repair_ranges[0].object_id, stream_ctx->repair_ranges[0].offset);
+            message->message_size = message_next - message->buffer;
+            stream_ctx->nb_repair_ranges = 0;
+            stream_ctx->send_state = quicrq_sending_repair;
+        }
+    }
+    return ret;
+}
+
 int quicrq_prepare_to_send_on_stream(quicrq_stream_ctx_t* stream_ctx, void* context, size_t space, uint64_t current_time)
 {
     int ret = 0;
@@ -1194,6 +1826,27 @@ int quicrq_prepare_to_send_on_stream(quicrq_stream_ctx_t* stream_ctx, void* cont
                     }
                 }
             }
+            else if (stream_ctx->publisher_latency_budget != 0 && !stream_ctx->is_latency_budget_sent) {
+                /* The budget is sent in milliseconds, rounded up */
+                uint64_t latency_budget_ms = stream_ctx->publisher_latency_budget / 1000 + ((stream_ctx->publisher_latency_budget % 1000) != 0);
+                quicrq_log_message(stream_ctx->cnx_ctx,
+                    "Stream %" PRIu64 ", sending latency budget: %" PRIu64 " ms",
+                    stream_ctx->stream_id, latency_budget_ms);
+                if (quicrq_msg_buffer_alloc(message, quicrq_latency_budget_msg_reserve(latency_budget_ms), 0) != 0) {
+                    ret = -1;
+                }
+                else {
+                    uint8_t* message_next = quicrq_latency_budget_msg_encode(message->buffer, message->buffer + message->buffer_alloc,
+                        QUICRQ_ACTION_LATENCY_BUDGET, latency_budget_ms);
+                    if (message_next == NULL) {
+                        ret = -1;
+                    }
+                    else {
+                        message->message_size = message_next - message->buffer;
+                        stream_ctx->send_state = quicrq_sending_latency_budget;
+                    }
+                }
+            }
             else if (stream_ctx->transport_mode == quicrq_transport_mode_single_stream && quicrq_fragment_is_ready_to_send(stream_ctx->media_ctx, space, current_time)) {
                 stream_ctx->send_state = quicrq_sending_single_stream;
             }
@@ -1207,6 +1860,9 @@ int quicrq_prepare_to_send_on_stream(quicrq_stream_ctx_t* stream_ctx, void* cont
                 picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 0, stream_ctx);
             }
         }
+        else if (stream_ctx->nb_repair_ranges > 0) {
+            ret = quicrq_prepare_repair_request(stream_ctx);
+        }
         else {
             /* TODO: consider receiver messages */
             quicrq_log_message(stream_ctx->cnx_ctx,
@@ -1262,11 +1918,12 @@ int quicrq_prepare_to_send_on_stream(quicrq_stream_ctx_t* stream_ctx, void* cont
         case quicrq_sending_initial:
             /* Send available buffer data. Mark state ready after sent. */
             more_to_send = (stream_ctx->final_group_id > 0 || stream_ctx->final_object_id > 0) && !stream_ctx->is_final_object_id_sent;
+            more_to_send |= (!stream_ctx->is_sender && stream_ctx->nb_repair_ranges > 0);
             ret = quicrq_msg_buffer_prepare_to_send(stream_ctx, context, space, more_to_send);
             break;
         case quicrq_sending_repair:
-            /* Send available buffer data and repair data. Dequeue repair and mark state ready after sent. */
-            more_to_send = (stream_ctx->final_group_id > 0 || stream_ctx->final_object_id > 0) && !stream_ctx->is_final_object_id_sent;
+            /* Send the repair request. Mark state ready after sent, stay active if more requests were queued. */
+            more_to_send = (stream_ctx->nb_repair_ranges > 0);
             ret = quicrq_msg_buffer_prepare_to_send(stream_ctx, context, space, more_to_send);
             break;
         case quicrq_sending_final_point:
@@ -1281,16 +1938,24 @@ int quicrq_prepare_to_send_on_stream(quicrq_stream_ctx_t* stream_ctx, void* cont
             break;
         case quicrq_sending_start_point:
             more_to_send |= (!stream_ctx->is_cache_policy_sent && stream_ctx->is_cache_real_time);
+            more_to_send |= (!stream_ctx->is_latency_budget_sent && stream_ctx->publisher_latency_budget != 0);
             ret = quicrq_msg_buffer_prepare_to_send(stream_ctx, context, space, more_to_send);
             stream_ctx->is_start_object_id_sent = 1;
             stream_ctx->send_state = quicrq_sending_ready;
             break;
         case quicrq_sending_cache_policy:
             more_to_send |= (!stream_ctx->is_start_object_id_sent && (stream_ctx->start_group_id > 0 || stream_ctx->start_object_id > 0));
+            more_to_send |= (!stream_ctx->is_latency_budget_sent && stream_ctx->publisher_latency_budget != 0);
             ret = quicrq_msg_buffer_prepare_to_send(stream_ctx, context, space, more_to_send);
             stream_ctx->is_cache_policy_sent = 1;
             stream_ctx->send_state = quicrq_sending_ready;
             break;
+        case quicrq_sending_latency_budget:
+            ret = quicrq_msg_buffer_prepare_to_send(stream_ctx, context, space, more_to_send);
+            if (stream_ctx->send_state == quicrq_sending_ready) {
+                stream_ctx->is_latency_budget_sent = 1;
+            }
+            break;
         case quicrq_sending_subscribe:
             ret = quicrq_msg_buffer_prepare_to_send(stream_ctx, context, space, 0);
             if (stream_ctx->send_state == quicrq_sending_ready) {
@@ -1399,17 +2064,29 @@ int quicrq_prepare_warp_object_header(quicrq_uni_stream_ctx_t* uni_stream_ctx, u
             &uni_stream_ctx->current_object_length, &uni_stream_ctx->nb_objects_previous_group, 
             &uni_stream_ctx->current_object_flags) == 0){
             int should_skip = 0;
+            int should_truncate = 0;
             quicrq_message_buffer_t* message = &uni_stream_ctx->message_buffer;
             uint8_t* message_next = NULL;
 
-            should_skip = quicrq_evaluate_warp_congestion(uni_stream_ctx, media_ctx, uni_stream_ctx->current_object_length, flags, current_time);
+            should_skip = quicrq_evaluate_warp_congestion(uni_stream_ctx, media_ctx, uni_stream_ctx->current_object_length, flags,
+                &should_truncate, current_time);
+            if (!should_skip && uni_stream_ctx->control_stream_ctx->transport_mode == quicrq_transport_mode_rush &&
+                quicrq_fragment_object_is_expired(cache_ctx, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id,
+                    current_time)) {
+                /* The deadline passed before the object was started: send a placeholder */
+                should_skip = 1;
+            }
 
             if (should_skip) {
                 uni_stream_ctx->current_object_length = 0;
                 uni_stream_ctx->current_object_flags = 0xff;
             }
+            if (should_truncate) {
+                /* The rest of the group is dropped: reset the stream instead of sending placeholders */
+                uni_stream_ctx->send_state = quicrq_sending_warp_group_truncated;
+            }
             /* Encode object header */
-            if (quicrq_msg_buffer_alloc(message, quicrq_object_header_msg_reserve(uni_stream_ctx->current_object_id, 
+            else if (quicrq_msg_buffer_alloc(message, quicrq_object_header_msg_reserve(uni_stream_ctx->current_object_id, 
                 nb_objects_previous_group, uni_stream_ctx->current_object_length), 0) != 0) {
                 ret = -1;
             }
@@ -1447,13 +2124,29 @@ int quicrq_prepare_warp_object_header(quicrq_uni_stream_ctx_t* uni_stream_ctx, u
 int quicrq_prepare_to_send_on_unistream(quicrq_cnx_ctx_t * cnx_ctx, quicrq_uni_stream_ctx_t * uni_stream_ctx, void* context, size_t space, uint64_t current_time)
 {
     int ret = 0;
+
+    if (uni_stream_ctx->send_state == quicrq_sending_object_data && uni_stream_ctx->message_buffer.message_size == 0 &&
+        uni_stream_ctx->control_stream_ctx->transport_mode == quicrq_transport_mode_rush &&
+        quicrq_fragment_object_is_expired(uni_stream_ctx->control_stream_ctx->media_ctx->cache_ctx,
+            uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id, current_time)) {
+        /* The deadline passed while the object was being sent: abandon the stream */
+        uni_stream_ctx->send_state = quicrq_sending_rush_object_expired;
+    }
+    else if (uni_stream_ctx->send_state == quicrq_sending_object_data && uni_stream_ctx->message_buffer.message_size == 0 &&
+        quicrq_fragment_get_flags(uni_stream_ctx->control_stream_ctx->media_ctx->cache_ctx,
+            uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id) == 0xff) {
+        /* The object was truncated or expired upstream and replaced by a placeholder while
+         * being sent: the rest of the object cannot be sent, abandon the stream too. */
+        uni_stream_ctx->send_state = (uni_stream_ctx->control_stream_ctx->transport_mode == quicrq_transport_mode_rush) ?
+            quicrq_sending_rush_object_expired : quicrq_sending_warp_group_truncated;
+    }
     /* prepare the message that needs to be sent */
     if (uni_stream_ctx->send_state == quicrq_sending_object_data) {
         /* Todo: if content is available, send it */
         /* When done: back to quicrq_sending_warp_header_sent */
         quicrq_fragment_publisher_context_t* media_ctx = uni_stream_ctx->control_stream_ctx->media_ctx;
         quicrq_fragment_cache_t* cache_ctx = media_ctx->cache_ctx;
-        size_t fragment_length = quicrq_fragment_object_copy_available_data(cache_ctx,
+        size_t fragment_length = quicrq_fragment_object_copy_available_data(cache_ctx, &media_ctx->read_cursor,
             uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id,
             uni_stream_ctx->current_object_offset, space, NULL);
 
@@ -1463,7 +2156,7 @@ int quicrq_prepare_to_send_on_unistream(quicrq_cnx_ctx_t * cnx_ctx, quicrq_uni_s
                 ret = -1;
             }
             else {
-                size_t copied_length = quicrq_fragment_object_copy_available_data(cache_ctx,
+                size_t copied_length = quicrq_fragment_object_copy_available_data(cache_ctx, &media_ctx->read_cursor,
                     uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id,
                     uni_stream_ctx->current_object_offset, fragment_length, buffer);
                 if (copied_length != fragment_length) {
@@ -1471,6 +2164,7 @@ int quicrq_prepare_to_send_on_unistream(quicrq_cnx_ctx_t * cnx_ctx, quicrq_uni_s
                 }
                 else {
                     uni_stream_ctx->current_object_offset += copied_length;
+                    quicrq_fragment_cache_set_read_time(cache_ctx, current_time);
                     if (uni_stream_ctx->current_object_offset == uni_stream_ctx->current_object_length) {
                         /* this object is sent, back to state quicrq_sending_warp_header_sent */
                         uni_stream_ctx->current_object_id++;
@@ -1513,6 +2207,21 @@ int quicrq_prepare_to_send_on_unistream(quicrq_cnx_ctx_t * cnx_ctx, quicrq_uni_s
                 /* Dispose of uni stream context. */
                 quicrq_delete_uni_stream_ctx(cnx_ctx, uni_stream_ctx);
             }
+            else if (uni_stream_ctx->send_state == quicrq_sending_warp_group_truncated) {
+                /* Abandon the stream, so picoquic stops sending or repeating its data */
+                quicrq_log_message(cnx_ctx, "Reset UniStream %" PRIu64 ", group %" PRIu64 " truncated at object %" PRIu64,
+                    uni_stream_ctx->stream_id, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id);
+                (void)picoquic_reset_stream(cnx_ctx->cnx, uni_stream_ctx->stream_id, QUICRQ_ERROR_GROUP_TRUNCATED);
+                uni_stream_ctx->send_state = quicrq_sending_warp_should_close;
+                quicrq_delete_uni_stream_ctx(cnx_ctx, uni_stream_ctx);
+            }
+            else if (uni_stream_ctx->send_state == quicrq_sending_rush_object_expired) {
+                quicrq_log_message(cnx_ctx, "Reset UniStream %" PRIu64 ", object %" PRIu64 "/%" PRIu64 " expired",
+                    uni_stream_ctx->stream_id, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id);
+                (void)picoquic_reset_stream(cnx_ctx->cnx, uni_stream_ctx->stream_id, QUICRQ_ERROR_OBJECT_EXPIRED);
+                uni_stream_ctx->send_state = quicrq_sending_warp_should_close;
+                quicrq_delete_uni_stream_ctx(cnx_ctx, uni_stream_ctx);
+            }
             else {
                 /* Nothing to send */
                 ret = picoquic_mark_active_stream(cnx_ctx->cnx, uni_stream_ctx->stream_id, 0, uni_stream_ctx);
@@ -1551,24 +2260,176 @@ int quicrq_notify_url_to_stream(quicrq_stream_ctx_t* stream_ctx, const uint8_t*
     return ret;
 }
 
+/* Management of the prefix trie.
+ * Nodes are created when a stream subscribes to a new prefix, splitting an
+ * existing edge if the prefix ends in its middle. When the last stream of
+ * a leaf node is removed, that node and its empty parents are deleted.
+ */
+static quicrq_prefix_node_t* quicrq_prefix_node_create(quicrq_prefix_node_t* parent, const uint8_t* label, size_t label_length)
+{
+    quicrq_prefix_node_t* node = (quicrq_prefix_node_t*)malloc(sizeof(quicrq_prefix_node_t) + label_length);
+
+    if (node != NULL) {
+        memset(node, 0, sizeof(quicrq_prefix_node_t));
+        node->parent = parent;
+        node->label = ((uint8_t*)node) + sizeof(quicrq_prefix_node_t);
+        node->label_length = label_length;
+        memcpy(node->label, label, label_length);
+    }
+    return node;
+}
+
+static quicrq_prefix_node_t** quicrq_prefix_node_find_child(quicrq_prefix_node_t* node, uint8_t first_byte)
+{
+    quicrq_prefix_node_t** p_child = &node->first_child;
+
+    while (*p_child != NULL && (*p_child)->label[0] != first_byte) {
+        p_child = &(*p_child)->next_sibling;
+    }
+    return p_child;
+}
+
+int quicrq_prefix_trie_add_stream(quicrq_ctx_t* qr_ctx, quicrq_stream_ctx_t* stream_ctx)
+{
+    int ret = 0;
+    quicrq_prefix_node_t* node = &qr_ctx->prefix_root;
+    const uint8_t* prefix = stream_ctx->subscribe_prefix;
+    size_t prefix_length = stream_ctx->subscribe_prefix_length;
+    size_t pos = 0;
+
+    while (ret == 0 && pos < prefix_length) {
+        quicrq_prefix_node_t** p_child = quicrq_prefix_node_find_child(node, prefix[pos]);
+        quicrq_prefix_node_t* child = *p_child;
+
+        if (child == NULL) {
+            /* No edge starts with that byte, add a leaf for the rest of the prefix */
+            if ((child = quicrq_prefix_node_create(node, prefix + pos, prefix_length - pos)) == NULL) {
+                ret = -1;
+            }
+            else {
+                *p_child = child;
+                node = child;
+                pos = prefix_length;
+            }
+        }
+        else {
+            size_t common = 0;
+            while (common < child->label_length && pos + common < prefix_length &&
+                child->label[common] == prefix[pos + common]) {
+                common++;
+            }
+            if (common < child->label_length) {
+                /* The prefix diverges or ends within the edge: split it */
+                quicrq_prefix_node_t* middle = quicrq_prefix_node_create(node, child->label, common);
+                if (middle == NULL) {
+                    ret = -1;
+                }
+                else {
+                    middle->next_sibling = child->next_sibling;
+                    middle->first_child = child;
+                    *p_child = middle;
+                    child->next_sibling = NULL;
+                    child->parent = middle;
+                    child->label += common;
+                    child->label_length -= common;
+                    child = middle;
+                }
+            }
+            node = child;
+            pos += common;
+        }
+    }
+    if (ret == 0) {
+        stream_ctx->prefix_node = node;
+        stream_ctx->previous_stream_for_prefix = NULL;
+        stream_ctx->next_stream_for_prefix = node->first_stream;
+        if (node->first_stream != NULL) {
+            node->first_stream->previous_stream_for_prefix = stream_ctx;
+        }
+        node->first_stream = stream_ctx;
+    }
+    return ret;
+}
+
+void quicrq_prefix_trie_remove_stream(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_prefix_node_t* node = stream_ctx->prefix_node;
+
+    if (node != NULL) {
+        if (stream_ctx->previous_stream_for_prefix == NULL) {
+            node->first_stream = stream_ctx->next_stream_for_prefix;
+        }
+        else {
+            stream_ctx->previous_stream_for_prefix->next_stream_for_prefix = stream_ctx->next_stream_for_prefix;
+        }
+        if (stream_ctx->next_stream_for_prefix != NULL) {
+            stream_ctx->next_stream_for_prefix->previous_stream_for_prefix = stream_ctx->previous_stream_for_prefix;
+        }
+        stream_ctx->prefix_node = NULL;
+        stream_ctx->next_stream_for_prefix = NULL;
+        stream_ctx->previous_stream_for_prefix = NULL;
+        /* Delete the nodes that are not needed anymore. The root has no parent and is never deleted. */
+        while (node->parent != NULL && node->first_stream == NULL && node->first_child == NULL) {
+            quicrq_prefix_node_t* parent = node->parent;
+            quicrq_prefix_node_t** p_child = quicrq_prefix_node_find_child(parent, node->label[0]);
+            *p_child = node->next_sibling;
+            free(node);
+            node = parent;
+        }
+    }
+}
+
+quicrq_prefix_node_t* quicrq_prefix_trie_find(quicrq_ctx_t* qr_ctx, const uint8_t* prefix, size_t prefix_length)
+{
+    quicrq_prefix_node_t* node = &qr_ctx->prefix_root;
+    size_t pos = 0;
+
+    while (node != NULL && pos < prefix_length) {
+        quicrq_prefix_node_t* child = *quicrq_prefix_node_find_child(node, prefix[pos]);
+        if (child != NULL && child->label_length <= prefix_length - pos &&
+            memcmp(child->label, prefix + pos, child->label_length) == 0) {
+            pos += child->label_length;
+        }
+        else {
+            child = NULL;
+        }
+        node = child;
+    }
+    return node;
+}
+
+/* Notify a new URL to all the streams whose subscribe prefix matches it.
+ * The streams are found on the path of the URL in the prefix trie.
+ */
 int quicrq_notify_url_to_all(quicrq_ctx_t* qr_ctx, const uint8_t* url, size_t url_length)
 {
     int ret = 0;
-    quicrq_cnx_ctx_t* cnx_ctx = qr_ctx->first_cnx;
+    quicrq_prefix_node_t* node = &qr_ctx->prefix_root;
+    size_t pos = 0;
 
-    while (cnx_ctx != NULL && ret == 0) {
-        quicrq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
+    while (node != NULL && ret == 0) {
+        quicrq_stream_ctx_t* stream_ctx = node->first_stream;
+        quicrq_prefix_node_t* child = NULL;
 
-        while (stream_ctx != NULL) {
-            if (stream_ctx->send_state == quicrq_notify_ready) {
+        while (stream_ctx != NULL && ret == 0) {
+            if (stream_ctx->send_state == quicrq_notify_ready || stream_ctx->send_state == quicrq_sending_notify) {
                 if ((ret = quicrq_notify_url_to_stream(stream_ctx, url, url_length)) > 0) {
                     ret = 0;
-                    break;
                 }
             }
-            stream_ctx = stream_ctx->next_stream;
+            stream_ctx = stream_ctx->next_stream_for_prefix;
         }
-        cnx_ctx = cnx_ctx->next_cnx;
+        if (pos < url_length) {
+            child = *quicrq_prefix_node_find_child(node, url[pos]);
+            if (child != NULL && child->label_length <= url_length - pos &&
+                memcmp(child->label, url + pos, child->label_length) == 0) {
+                pos += child->label_length;
+            }
+            else {
+                child = NULL;
+            }
+        }
+        node = child;
     }
 
     return ret;
@@ -1588,6 +2449,7 @@ int quicrq_process_incoming_subscribe(quicrq_stream_ctx_t* stream_ctx, size_t ur
         memcpy(stream_ctx->subscribe_prefix, url, url_length);
         stream_ctx->receive_state = quicrq_receive_done;
         stream_ctx->send_state = quicrq_notify_ready;
+        ret = quicrq_prefix_trie_add_stream(qr_ctx, stream_ctx);
     }
     if (ret == 0) {
         /* Check all the known media source, see whether they match */
@@ -1669,6 +2531,10 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                             /* Process initial request */
                             stream_ctx->media_id = incoming.media_id;
                             stream_ctx->transport_mode = incoming.transport_mode;
+                            stream_ctx->use_compact_datagram_header = (incoming.datagram_header_mode == QUICRQ_DATAGRAM_HEADER_COMPACT &&
+                                stream_ctx->cnx_ctx->qr_ctx->compact_datagram_header);
+                            stream_ctx->latency_budget = (incoming.latency_budget > UINT64_MAX / 1000) ?
+                                UINT64_MAX : incoming.latency_budget * 1000;
                             /* Open the media -- TODO, variants with different actions. */
                             quicrq_log_message(stream_ctx->cnx_ctx, "Stream %" PRIu64 ", received a subscribe request for url %s, mode = %s, id= %" PRIu64,
                                 stream_ctx->stream_id, quicrq_uint8_t_to_text(incoming.url, incoming.url_length, url_text, 256),
@@ -1680,6 +2546,7 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                             if (ret == 0) {
                                 /* Apply the preferences based on intent */
                                 stream_ctx->is_sender = 1;
+                                ret = quicrq_datagram_index_stream(stream_ctx);
                                 switch (incoming.subscribe_intent) {
                                 case quicrq_subscribe_intent_current_group:
                                     intent_group = stream_ctx->media_ctx->cache_ctx->next_group_id;
@@ -1716,7 +2583,8 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                                 stream_ctx->media_ctx->current_object_id = intent_object;
                                 stream_ctx->media_ctx->current_offset = 0;
                                 ret = quicrq_prepare_start_point(stream_ctx);
-                                stream_ctx->receive_state = quicrq_receive_done;
+                                stream_ctx->receive_state = (incoming.transport_mode == quicrq_transport_mode_datagram) ?
+                                    quicrq_receive_repair : quicrq_receive_done;
                                 picoquic_mark_active_stream(stream_ctx->cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
                             }
                             else if (incoming.transport_mode == quicrq_transport_mode_single_stream) {
@@ -1730,7 +2598,8 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                                 || incoming.transport_mode == quicrq_transport_mode_rush) {
                                 /* Start sending data without endpoint message */
                                 stream_ctx->send_state = quicrq_sending_ready;
-                                stream_ctx->receive_state = quicrq_receive_done;
+                                stream_ctx->receive_state = (incoming.transport_mode == quicrq_transport_mode_datagram) ?
+                                    quicrq_receive_repair : quicrq_receive_done;
                             }
                             else {
                                 /* Not supported yet */
@@ -1764,6 +2633,8 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                         /* Depending on mode, set media ready or datagram ready */
                         quicrq_log_message(stream_ctx->cnx_ctx, "Stream %" PRIu64 ", publish request accepted, mode = %s",
                             stream_ctx->stream_id, quicrq_transport_mode_to_string(incoming.transport_mode));
+                        stream_ctx->use_compact_datagram_header = (incoming.datagram_header_mode == QUICRQ_DATAGRAM_HEADER_COMPACT &&
+                            stream_ctx->cnx_ctx->qr_ctx->compact_datagram_header);
                         ret = quicrq_cnx_post_accepted(stream_ctx, incoming.transport_mode, incoming.media_id);
                         break;
                     case QUICRQ_ACTION_START_POINT:
@@ -1800,6 +2671,31 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                             ret = quicrq_cnx_handle_consumer_finished(stream_ctx, 1, 0, ret);
                         }
                         break;
+                    case QUICRQ_ACTION_REPAIR_REQUEST:
+                        if (stream_ctx->receive_state != quicrq_receive_repair) {
+                            /* Protocol error */
+                            ret = -1;
+                        }
+                        else if (stream_ctx->media_ctx != NULL) {
+                            /* Serve the requested ranges from the cache, or ask upstream */
+                            const uint8_t* range_bytes = incoming.data;
+                            const uint8_t* range_max = incoming.data + incoming.fragment_length;
+                            quicrq_repair_range_t range = { 0 };
+                            uint64_t current_time = picoquic_get_quic_time(stream_ctx->cnx_ctx->qr_ctx->quic);
+
+                            quicrq_log_message(stream_ctx->cnx_ctx,
+                                "Stream %" PRIu64 ", repair request for %" PRIu64 " ranges",
+                                stream_ctx->stream_id, incoming.nb_ranges);
+                            for (uint64_t i = 0; ret == 0 && i < incoming.nb_ranges; i++) {
+                                if ((range_bytes = quicrq_repair_range_decode(range_bytes, range_max, &range)) == NULL) {
+                                    ret = -1;
+                                }
+                                else {
+                                    ret = quicrq_fragment_cache_serve_repair(stream_ctx, &range, current_time);
+                                }
+                            }
+                        }
+                        break;
                     case QUICRQ_ACTION_FRAGMENT:
                         if (stream_ctx->receive_state != quicrq_receive_fragment) {
                             /* Protocol error */
@@ -1868,6 +2764,24 @@ int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes,
                         }
                     break;
                         break;
+                    case QUICRQ_ACTION_LATENCY_BUDGET:
+                        if (stream_ctx->receive_state != quicrq_receive_fragment || stream_ctx->is_sender) {
+                            /* Protocol error */
+                            ret = -1;
+                        }
+                        else {
+                            /* Pass the budget of the publisher to the media consumer, in microseconds, as queue delay */
+                            quicrq_log_message(stream_ctx->cnx_ctx,
+                                "Stream %" PRIu64 ", latency budget: %" PRIu64 " ms",
+                                stream_ctx->stream_id, incoming.latency_budget);
+                            ret = stream_ctx->consumer_fn(quicrq_media_latency_budget, stream_ctx->media_ctx, picoquic_get_quic_time(stream_ctx->cnx_ctx->qr_ctx->quic),
+                                NULL, 0, 0, 0, (incoming.latency_budget > UINT64_MAX / 1000) ? UINT64_MAX : incoming.latency_budget * 1000,
+                                0, 0, 0, 0);
+                            if (ret == quicrq_consumer_finished) {
+                                ret = quicrq_cnx_handle_consumer_finished(stream_ctx, 0, 0, ret);
+                            }
+                        }
+                        break;
                     default:
                         /* Some unknown message, maybe not implemented yet */
                         ret = -1;
@@ -2067,6 +2981,55 @@ int quicrq_receive_warp_or_rush_stream_data(quicrq_cnx_ctx_t* cnx_ctx, quicrq_un
 
     return ret;
 }
+/* Reset of a warp or rush stream by the sender.
+ * If the error code is GROUP_TRUNCATED, the sender dropped the remaining objects
+ * of the group. The objects before the current object were fully received, the
+ * others will never arrive, possibly starting with object 0. The consumer is told,
+ * so it can replace them by placeholders once it learns the number of objects in
+ * the group. If the reset arrives before the warp header, the group and the media
+ * are not known and nothing can be signalled: the group stays missing, as if the
+ * stream had been lost.
+ * If the error code is OBJECT_EXPIRED, the deadline of the object carried by
+ * the rush stream passed before it was fully sent. The consumer is told, so it
+ * can treat the object as skipped. This requires the object header: a rush
+ * stream carries a single object, and its id is only learned from that header.
+ * If the reset arrives before it, nothing can be signalled and the object stays
+ * missing, as if the stream had been lost. If the object was empty, it was
+ * already delivered when the header arrived.
+ */
+int quicrq_receive_warp_stream_reset(quicrq_cnx_ctx_t* cnx_ctx, quicrq_uni_stream_ctx_t* uni_stream_ctx, uint64_t error_code,
+    uint64_t current_time)
+{
+    int ret = 0;
+    quicrq_stream_ctx_t* ctrl_stream_ctx = uni_stream_ctx->control_stream_ctx;
+
+    if (error_code == QUICRQ_ERROR_GROUP_TRUNCATED && ctrl_stream_ctx != NULL &&
+        uni_stream_ctx->receive_state != quicrq_receive_open) {
+        quicrq_log_message(cnx_ctx, "UniStream %" PRIu64 ", group %" PRIu64 " truncated at object %" PRIu64,
+            uni_stream_ctx->stream_id, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id);
+        ret = ctrl_stream_ctx->consumer_fn(quicrq_media_group_truncated, ctrl_stream_ctx->media_ctx, current_time,
+            NULL, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id, 0, 0, 0,
+            uni_stream_ctx->nb_objects_previous_group, 0, 0);
+        if (ret == quicrq_consumer_finished) {
+            ret = quicrq_cnx_handle_consumer_finished(ctrl_stream_ctx, 0, 1, ret);
+        }
+    }
+    else if (error_code == QUICRQ_ERROR_OBJECT_EXPIRED && ctrl_stream_ctx != NULL &&
+        uni_stream_ctx->receive_state == quicrq_receive_object_data) {
+        quicrq_log_message(cnx_ctx, "UniStream %" PRIu64 ", object %" PRIu64 "/%" PRIu64 " expired",
+            uni_stream_ctx->stream_id, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id);
+        ret = ctrl_stream_ctx->consumer_fn(quicrq_media_object_expired, ctrl_stream_ctx->media_ctx, current_time,
+            NULL, uni_stream_ctx->current_group_id, uni_stream_ctx->current_object_id, 0, 0, 0,
+            uni_stream_ctx->nb_objects_previous_group, 0, 0);
+        if (ret == quicrq_consumer_finished) {
+            ret = quicrq_cnx_handle_consumer_finished(ctrl_stream_ctx, 0, 1, ret);
+        }
+    }
+    quicrq_delete_uni_stream_ctx(cnx_ctx, uni_stream_ctx);
+
+    return ret;
+}
+
 /* Callback from Quic
  */
 int quicrq_callback(picoquic_cnx_t* cnx,
@@ -2183,6 +3146,12 @@ int quicrq_callback(picoquic_cnx_t* cnx,
             break;
         }
         case picoquic_callback_stream_reset: /* Client reset stream #x */
+            if (uni_stream_ctx != NULL) {
+                ret = quicrq_receive_warp_stream_reset(cnx_ctx, uni_stream_ctx, picoquic_get_remote_stream_error(cnx, stream_id),
+                    picoquic_get_quic_time(cnx_ctx->qr_ctx->quic));
+            }
+            /* TODO: react to abandon of control streams. */
+            break;
         case picoquic_callback_stop_sending: /* Client asks server to reset stream #x */
             /* TODO: react to abandon stream, etc. */
             break;
@@ -2259,13 +3228,19 @@ quicrq_stream_ctx_t* quicrq_cnx_subscribe_pattern(quicrq_cnx_ctx_t* cnx_ctx, con
             /* Format the media request */
             uint8_t* message_next = quicrq_subscribe_msg_encode(message->buffer, message->buffer + message->buffer_alloc,
                 QUICRQ_ACTION_SUBSCRIBE, url_length, url);
-            if (message_next == NULL) {
+            if (message_next != NULL) {
+                /* Keep the pattern, so that the subscription can be found later */
+                stream_ctx->subscribe_prefix = malloc(url_length + 1);
+            }
+            if (message_next == NULL || stream_ctx->subscribe_prefix == NULL) {
                 cnx_ctx->first_stream->close_reason = quicrq_media_close_internal_error;
                 quicrq_delete_stream_ctx(cnx_ctx, stream_ctx);
                 stream_ctx = NULL;
             }
             else {
                 char buffer[256];
+                stream_ctx->subscribe_prefix_length = url_length;
+                memcpy(stream_ctx->subscribe_prefix, url, url_length);
                 /* Set the call back functions */
                 stream_ctx->media_notify_fn = media_notify_fn;
                 stream_ctx->notify_ctx = notify_ctx;
@@ -2328,6 +3303,17 @@ void quicrq_set_cache_duration(quicrq_ctx_t* qr_ctx, uint64_t cache_duration_max
     qr_ctx->cache_duration_max = cache_duration_max;
 }
 
+void quicrq_set_cache_memory_limit(quicrq_ctx_t* qr_ctx, size_t cache_memory_limit)
+{
+    qr_ctx->cache_memory_limit = cache_memory_limit;
+    qr_ctx->is_cache_memory_check_needed = (cache_memory_limit > 0 && qr_ctx->cache_memory_used > cache_memory_limit);
+}
+
+size_t quicrq_get_cache_memory_used(quicrq_ctx_t* qr_ctx)
+{
+    return qr_ctx->cache_memory_used;
+}
+
 uint64_t quicrq_time_check(quicrq_ctx_t* qr_ctx, uint64_t current_time)
 {
     uint64_t next_time = UINT64_MAX;
@@ -2360,6 +3346,11 @@ uint64_t quicrq_time_check(quicrq_ctx_t* qr_ctx, uint64_t current_time)
         }
     }
 
+    if (qr_ctx->is_cache_memory_check_needed) {
+        /* The memory reserved by the caches grew above the limit, some groups shall be evicted */
+        quicrq_fragment_cache_enforce_memory_limit(qr_ctx);
+    }
+
     return next_time;
 }
 
@@ -2400,6 +3391,11 @@ void quicrq_delete(quicrq_ctx_t* qr_ctx)
         quicrq_delete_source(srce_ctx, qr_ctx);
         srce_ctx = srce_next;
     }
+    quicrq_media_source_table_release(qr_ctx);
+    quicrq_uni_stream_freelist_release(qr_ctx);
+    quicrq_extra_repeat_heap_release(qr_ctx);
+    (void)quicrq_enable_congestion_trace(qr_ctx, 0);
+    quicrq_track_set_release(qr_ctx);
 
     if (qr_ctx->quic != NULL) {
         picoquic_free(qr_ctx->quic);
@@ -2456,6 +3452,166 @@ quicrq_ctx_t* quicrq_create(char const* alpn,
     return qr_ctx;
 }
 
+/* Index of stream contexts by stream_id.
+ * The two low order bits of a QUIC stream id encode the initiator and the
+ * direction, and the ids of each type are allocated sequentially. Each
+ * index only holds one direction, so the hash drops the direction bit and
+ * keeps the initiator bit. The number of buckets doubles when it is
+ * exceeded by the number of nodes; if that fails, the chains get longer.
+ */
+#define QUICRQ_STREAM_INDEX_MIN 16
+
+static size_t quicrq_stream_id_index_bucket(quicrq_stream_id_index_t* index, uint64_t stream_id)
+{
+    return (size_t)(((stream_id >> 2) << 1) | (stream_id & 1)) & (index->nb_buckets - 1);
+}
+
+static void quicrq_stream_id_index_chain(quicrq_stream_id_index_t* index, quicrq_stream_id_node_t* node)
+{
+    /* Chain at the end of the bucket, so the oldest context is found first if ids are reused */
+    quicrq_stream_id_node_t** p_next = &index->buckets[quicrq_stream_id_index_bucket(index, node->stream_id)];
+    while (*p_next != NULL) {
+        p_next = &(*p_next)->next_in_bucket;
+    }
+    node->next_in_bucket = NULL;
+    *p_next = node;
+}
+
+static int quicrq_stream_id_index_resize(quicrq_stream_id_index_t* index, size_t new_size)
+{
+    int ret = 0;
+    quicrq_stream_id_node_t** old_buckets = index->buckets;
+    size_t old_size = index->nb_buckets;
+    quicrq_stream_id_node_t** new_buckets = (quicrq_stream_id_node_t**)malloc(new_size * sizeof(quicrq_stream_id_node_t*));
+
+    if (new_buckets == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(new_buckets, 0, new_size * sizeof(quicrq_stream_id_node_t*));
+        index->buckets = new_buckets;
+        index->nb_buckets = new_size;
+        for (size_t i = 0; i < old_size; i++) {
+            quicrq_stream_id_node_t* node = old_buckets[i];
+            while (node != NULL) {
+                quicrq_stream_id_node_t* next_node = node->next_in_bucket;
+                quicrq_stream_id_index_chain(index, node);
+                node = next_node;
+            }
+        }
+        free(old_buckets);
+    }
+    return ret;
+}
+
+static int quicrq_stream_id_index_insert(quicrq_stream_id_index_t* index, quicrq_stream_id_node_t* node, uint64_t stream_id)
+{
+    int ret = 0;
+
+    if (index->nb_nodes >= index->nb_buckets) {
+        ret = quicrq_stream_id_index_resize(index, (index->nb_buckets == 0) ? QUICRQ_STREAM_INDEX_MIN : 2 * index->nb_buckets);
+        if (index->nb_buckets > 0) {
+            ret = 0;
+        }
+    }
+    if (ret == 0) {
+        node->stream_id = stream_id;
+        quicrq_stream_id_index_chain(index, node);
+        index->nb_nodes++;
+    }
+    return ret;
+}
+
+static void quicrq_stream_id_index_remove(quicrq_stream_id_index_t* index, quicrq_stream_id_node_t* node)
+{
+    if (index->nb_buckets > 0) {
+        quicrq_stream_id_node_t** p_next = &index->buckets[quicrq_stream_id_index_bucket(index, node->stream_id)];
+        while (*p_next != NULL) {
+            if (*p_next == node) {
+                *p_next = node->next_in_bucket;
+                node->next_in_bucket = NULL;
+                index->nb_nodes--;
+                break;
+            }
+            p_next = &(*p_next)->next_in_bucket;
+        }
+    }
+}
+
+static quicrq_stream_id_node_t* quicrq_stream_id_index_find(quicrq_stream_id_index_t* index, uint64_t stream_id)
+{
+    quicrq_stream_id_node_t* node = NULL;
+
+    if (index->nb_buckets > 0) {
+        node = index->buckets[quicrq_stream_id_index_bucket(index, stream_id)];
+        while (node != NULL && node->stream_id != stream_id) {
+            node = node->next_in_bucket;
+        }
+    }
+    return node;
+}
+
+static void quicrq_stream_id_index_release(quicrq_stream_id_index_t* index)
+{
+    free(index->buckets);
+    memset(index, 0, sizeof(quicrq_stream_id_index_t));
+}
+
+/* Uni stream contexts are kept in a free list after use, so that warp and
+ * rush streams, created per group or per object, do not require allocating
+ * a context and a message buffer for each stream.
+ */
+#define QUICRQ_UNI_STREAM_FREELIST_MAX 256
+
+static quicrq_uni_stream_ctx_t* quicrq_uni_stream_ctx_alloc(quicrq_ctx_t* qr_ctx)
+{
+    quicrq_uni_stream_ctx_t* uni_stream_ctx = NULL;
+
+    if (qr_ctx != NULL && qr_ctx->uni_stream_freelist != NULL) {
+        quicrq_message_buffer_t message_buffer;
+
+        uni_stream_ctx = qr_ctx->uni_stream_freelist;
+        qr_ctx->uni_stream_freelist = uni_stream_ctx->next_uni_stream_for_cnx;
+        qr_ctx->nb_uni_streams_free--;
+        /* Keep the message buffer allocated by the previous use */
+        message_buffer = uni_stream_ctx->message_buffer;
+        memset(uni_stream_ctx, 0, sizeof(quicrq_uni_stream_ctx_t));
+        uni_stream_ctx->message_buffer.buffer = message_buffer.buffer;
+        uni_stream_ctx->message_buffer.buffer_alloc = message_buffer.buffer_alloc;
+    }
+    else {
+        uni_stream_ctx = (quicrq_uni_stream_ctx_t*)malloc(sizeof(quicrq_uni_stream_ctx_t));
+        if (uni_stream_ctx != NULL) {
+            memset(uni_stream_ctx, 0, sizeof(quicrq_uni_stream_ctx_t));
+        }
+    }
+    return uni_stream_ctx;
+}
+
+static void quicrq_uni_stream_ctx_recycle(quicrq_ctx_t* qr_ctx, quicrq_uni_stream_ctx_t* uni_stream_ctx)
+{
+    if (qr_ctx != NULL && qr_ctx->nb_uni_streams_free < QUICRQ_UNI_STREAM_FREELIST_MAX) {
+        uni_stream_ctx->next_uni_stream_for_cnx = qr_ctx->uni_stream_freelist;
+        qr_ctx->uni_stream_freelist = uni_stream_ctx;
+        qr_ctx->nb_uni_streams_free++;
+    }
+    else {
+        quicrq_msg_buffer_release(&uni_stream_ctx->message_buffer);
+        free(uni_stream_ctx);
+    }
+}
+
+void quicrq_uni_stream_freelist_release(quicrq_ctx_t* qr_ctx)
+{
+    while (qr_ctx->uni_stream_freelist != NULL) {
+        quicrq_uni_stream_ctx_t* uni_stream_ctx = qr_ctx->uni_stream_freelist;
+        qr_ctx->uni_stream_freelist = uni_stream_ctx->next_uni_stream_for_cnx;
+        quicrq_msg_buffer_release(&uni_stream_ctx->message_buffer);
+        free(uni_stream_ctx);
+    }
+    qr_ctx->nb_uni_streams_free = 0;
+}
+
 /* Delete a connection context */
 void quicrq_delete_cnx_context(quicrq_cnx_ctx_t* cnx_ctx, quicrq_media_close_reason_enum close_reason, uint64_t close_error_code)
 {
@@ -2472,6 +3628,12 @@ void quicrq_delete_cnx_context(quicrq_cnx_ctx_t* cnx_ctx, quicrq_media_close_rea
     while (cnx_ctx->first_uni_stream != NULL) {
         quicrq_delete_uni_stream_ctx(cnx_ctx, cnx_ctx->first_uni_stream);
     }
+    if (cnx_ctx->datagram_stream_index != NULL) {
+        free(cnx_ctx->datagram_stream_index);
+        cnx_ctx->datagram_stream_index = NULL;
+    }
+    quicrq_stream_id_index_release(&cnx_ctx->stream_index);
+    quicrq_stream_id_index_release(&cnx_ctx->uni_stream_index);
 
     /* Delete the quic connection */
     if (cnx_ctx->cnx != NULL) {
@@ -2481,6 +3643,10 @@ void quicrq_delete_cnx_context(quicrq_cnx_ctx_t* cnx_ctx, quicrq_media_close_rea
     }
     /* Remove the connection from the double linked list */
     if (cnx_ctx->qr_ctx != NULL) {
+        if (cnx_ctx->qr_ctx->relay_ctx != NULL && cnx_ctx->qr_ctx->relay_ctx->cnx_ctx == cnx_ctx) {
+            /* The relay will open a new connection to the origin if needed */
+            cnx_ctx->qr_ctx->relay_ctx->cnx_ctx = NULL;
+        }
         if (cnx_ctx->next_cnx == NULL) {
             cnx_ctx->qr_ctx->last_cnx = cnx_ctx->previous_cnx;
         }
@@ -2618,14 +3784,17 @@ void quicrq_delete_uni_stream_ctx(quicrq_cnx_ctx_t* cnx_ctx, quicrq_uni_stream_c
             picoquic_unlink_app_stream_ctx(cnx_ctx->cnx, uni_stream_ctx->stream_id);
         }
     }
-    /* Release memory*/
-    quicrq_msg_buffer_release(&uni_stream_ctx->message_buffer);
-    free(uni_stream_ctx);
+    quicrq_stream_id_index_remove(&cnx_ctx->uni_stream_index, &uni_stream_ctx->stream_id_node);
+    /* Release memory, or keep the context for reuse */
+    quicrq_uni_stream_ctx_recycle(cnx_ctx->qr_ctx, uni_stream_ctx);
 }
 
 void quicrq_delete_stream_ctx(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t* stream_ctx)
 {
     quicrq_datagram_ack_ctx_release(stream_ctx);
+    quicrq_datagram_unindex_stream(stream_ctx);
+    quicrq_datagram_ready_queue_remove(stream_ctx);
+    quicrq_fec_release(stream_ctx);
 
     while (stream_ctx->first_notify_url != NULL) {
         quicrq_notify_url_t* next = stream_ctx->first_notify_url->next_notify_url;
@@ -2633,6 +3802,14 @@ void quicrq_delete_stream_ctx(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t* st
         stream_ctx->first_notify_url = next;
     }
 
+    if (stream_ctx->prefix_node != NULL) {
+        quicrq_prefix_trie_remove_stream(stream_ctx);
+        if (cnx_ctx->is_server && cnx_ctx->qr_ctx->manage_relay_subscribe_fn != NULL) {
+            /* If relay, close the subscription to the origin if no other client needs it */
+            cnx_ctx->qr_ctx->manage_relay_subscribe_fn(cnx_ctx->qr_ctx, quicrq_subscribe_action_unsubscribe,
+                stream_ctx->subscribe_prefix, stream_ctx->subscribe_prefix_length);
+        }
+    }
     if (stream_ctx->subscribe_prefix != NULL) {
         free(stream_ctx->subscribe_prefix);
         stream_ctx->subscribe_prefix = NULL;
@@ -2676,6 +3853,7 @@ void quicrq_delete_stream_ctx(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t* st
 
     quicrq_msg_buffer_release(&stream_ctx->message_receive);
     quicrq_msg_buffer_release(&stream_ctx->message_sent);
+    quicrq_stream_id_index_remove(&cnx_ctx->stream_index, &stream_ctx->stream_id_node);
 
     free(stream_ctx);
 }
@@ -2685,6 +3863,12 @@ quicrq_stream_ctx_t* quicrq_create_stream_context(quicrq_cnx_ctx_t* cnx_ctx, uin
     quicrq_stream_ctx_t* stream_ctx = (quicrq_stream_ctx_t*)malloc(sizeof(quicrq_stream_ctx_t));
     if (stream_ctx != NULL) {
         memset(stream_ctx, 0, sizeof(quicrq_stream_ctx_t));
+        if (quicrq_stream_id_index_insert(&cnx_ctx->stream_index, &stream_ctx->stream_id_node, stream_id) != 0) {
+            free(stream_ctx);
+            stream_ctx = NULL;
+        }
+    }
+    if (stream_ctx != NULL) {
         stream_ctx->cnx_ctx = cnx_ctx;
         stream_ctx->stream_id = stream_id;
         if (cnx_ctx->last_stream == NULL) {
@@ -2717,10 +3901,14 @@ void quicrq_chain_uni_stream_to_control_stream(quicrq_uni_stream_ctx_t* uni_stre
 quicrq_uni_stream_ctx_t* quicrq_create_uni_stream_context(
     quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t * stream_ctx, uint64_t stream_id)
 {
-    quicrq_uni_stream_ctx_t* uni_stream_ctx = (quicrq_uni_stream_ctx_t*)malloc(sizeof(quicrq_uni_stream_ctx_t));
+    quicrq_uni_stream_ctx_t* uni_stream_ctx = quicrq_uni_stream_ctx_alloc(cnx_ctx->qr_ctx);
+    if (uni_stream_ctx != NULL &&
+        quicrq_stream_id_index_insert(&cnx_ctx->uni_stream_index, &uni_stream_ctx->stream_id_node, stream_id) != 0) {
+        quicrq_uni_stream_ctx_recycle(cnx_ctx->qr_ctx, uni_stream_ctx);
+        uni_stream_ctx = NULL;
+    }
     if (uni_stream_ctx != NULL) {
         /* Chain to connection */
-        memset(uni_stream_ctx, 0, sizeof(quicrq_uni_stream_ctx_t));
         uni_stream_ctx->stream_id = stream_id;
         if (cnx_ctx->last_uni_stream == NULL) {
             cnx_ctx->first_uni_stream = uni_stream_ctx;
@@ -2743,14 +3931,10 @@ quicrq_stream_ctx_t* quicrq_find_or_create_stream(
     quicrq_cnx_ctx_t* cnx_ctx,
     int should_create)
 {
-    quicrq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
+    quicrq_stream_id_node_t* node = quicrq_stream_id_index_find(&cnx_ctx->stream_index, stream_id);
+    quicrq_stream_ctx_t* stream_ctx = (node == NULL) ? NULL :
+        (quicrq_stream_ctx_t*)((char*)node - offsetof(struct st_quicrq_stream_ctx_t, stream_id_node));
 
-    while (stream_ctx != NULL) {
-        if (stream_ctx->stream_id == stream_id) {
-            break;
-        }
-        stream_ctx = stream_ctx->next_stream;
-    }
     if (stream_ctx == NULL && should_create) {
         stream_ctx = quicrq_create_stream_context(cnx_ctx, stream_id);
     }
@@ -2764,14 +3948,9 @@ quicrq_uni_stream_ctx_t* quicrq_find_or_create_uni_stream(
     quicrq_stream_ctx_t* stream_ctx,
     int should_create)
 {
-    quicrq_uni_stream_ctx_t* uni_stream_ctx = cnx_ctx->first_uni_stream;
-
-    while (uni_stream_ctx != NULL) {
-        if (uni_stream_ctx->stream_id == stream_id) {
-            break;
-        }
-        uni_stream_ctx = uni_stream_ctx->next_uni_stream_for_cnx;
-    }
+    quicrq_stream_id_node_t* node = quicrq_stream_id_index_find(&cnx_ctx->uni_stream_index, stream_id);
+    quicrq_uni_stream_ctx_t* uni_stream_ctx = (node == NULL) ? NULL :
+        (quicrq_uni_stream_ctx_t*)((char*)node - offsetof(struct st_quicrq_uni_stream_ctx_t, stream_id_node));
 
     if (uni_stream_ctx == NULL && should_create) {
         uni_stream_ctx = quicrq_create_uni_stream_context(cnx_ctx, stream_ctx, stream_id);
@@ -27,10 +27,132 @@ typedef struct st_quicrq_cached_fragment_t {
     uint64_t object_length;
     struct st_quicrq_cached_fragment_t* previous_in_order;
     struct st_quicrq_cached_fragment_t* next_in_order;
+    struct st_quicrq_cached_group_t* group; /* Group segment holding the fragment */
+    int nb_refs; /* References held outside of the cache, e.g., by datagram ack states */
+    int is_deleted; /* Deleted from the cache while still referenced */
     size_t data_length;
     uint8_t* data;
 } quicrq_cached_fragment_t;
 
+/* Slab allocator for cached fragments.
+ * Each fragment is allocated as a single block holding the fragment
+ * header and the fragment data. Blocks are carved from large chunks,
+ * with one list of chunks per size class. The size classes are
+ * chosen so that a typical datagram fragment fits in the largest class;
+ * larger fragments get a dedicated chunk, kept in an extra list.
+ * Each group has its own slab, and most groups only hold a few fragments
+ * of each class, so the first chunk of a class is small and the size of
+ * the following chunks doubles, up to QUICRQ_FRAGMENT_CHUNK_SIZE.
+ * A chunk is released as soon as all its blocks are freed, or when
+ * the whole slab is released.
+ */
+#define QUICRQ_FRAGMENT_SLAB_NB_CLASSES 5
+#define QUICRQ_FRAGMENT_CHUNK_SIZE_MIN 0x800
+#define QUICRQ_FRAGMENT_CHUNK_SIZE 0x10000
+
+typedef struct st_quicrq_fragment_chunk_t {
+    struct st_quicrq_fragment_chunk_t* previous_chunk;
+    struct st_quicrq_fragment_chunk_t* next_chunk;
+    size_t class_id;
+    size_t chunk_size; /* Bytes obtained from malloc for this chunk */
+    size_t nb_blocks;
+    size_t nb_blocks_used;
+    size_t nb_blocks_carved;
+    uint8_t* first_free_block;
+    uint8_t* blocks;
+} quicrq_fragment_chunk_t;
+
+typedef struct st_quicrq_fragment_slab_t {
+    /* For each class, chunks with free blocks are at the head of the list, full chunks at the tail. */
+    quicrq_fragment_chunk_t* first_chunk[QUICRQ_FRAGMENT_SLAB_NB_CLASSES + 1];
+    quicrq_fragment_chunk_t* last_chunk[QUICRQ_FRAGMENT_SLAB_NB_CLASSES + 1];
+    size_t bytes_reserved; /* Bytes obtained from malloc for the chunks */
+    size_t bytes_live; /* Bytes in blocks currently allocated */
+    size_t nb_chunks; /* Number of chunks currently allocated */
+    size_t next_chunk_size[QUICRQ_FRAGMENT_SLAB_NB_CLASSES]; /* Size of the next chunk of each class, 0 if none yet */
+} quicrq_fragment_slab_t;
+
+/* Entry in the object directory of the cache.
+ * The directory is an open addressing hash table keyed by group_id and object_id.
+ * Each entry points to the first fragment of the object (offset 0), and
+ * copies the properties documented in that fragment, so that readers
+ * can obtain them without searching (and thus rotating) the fragment splay.
+ * Empty slots have first_fragment == NULL.
+ */
+typedef struct st_quicrq_cached_object_t {
+    uint64_t group_id;
+    uint64_t object_id;
+    uint64_t object_length;
+    uint64_t nb_objects_previous_group;
+    uint64_t expire_time; /* Deadline for sending the object in rush mode, 0 if none */
+    uint8_t flags;
+    quicrq_cached_fragment_t* first_fragment;
+} quicrq_cached_object_t;
+
+/* Reception state of an object.
+ * The bytes received for the object are documented as a sorted array of
+ * disjoint ranges, so that the completion of the object can be detected
+ * when a fragment is added, without walking through the fragments of the
+ * object. The state is allocated from the slab of the group, and is kept
+ * in a splay of the group ordered by object_id.
+ */
+typedef struct st_quicrq_byte_range_t {
+    uint64_t start;
+    uint64_t end;
+} quicrq_byte_range_t;
+
+#define QUICRQ_OBJECT_RANGES_INLINE 4
+
+typedef struct st_quicrq_cached_object_ranges_t {
+    picosplay_node_t object_node;
+    uint64_t object_id;
+    uint64_t object_length;
+    uint64_t bytes_received;
+    int is_complete;
+    size_t nb_ranges;
+    size_t nb_ranges_max;
+    quicrq_byte_range_t* ranges; /* Points to ranges_inline, or to a block of the slab */
+    quicrq_byte_range_t ranges_inline[QUICRQ_OBJECT_RANGES_INLINE];
+} quicrq_cached_object_ranges_t;
+
+/* Group segment of the cache.
+ * The fragments of each group are kept in a splay specific to the group,
+ * ordered by object_id/offset, and are allocated from a slab specific to
+ * the group. Purging a group releases the chunks of its slab at once,
+ * without deleting its fragments one by one from a splay.
+ * The group segments are kept in a splay ordered by group_id, and are
+ * found through a ring indexed by group_id modulo the size of the ring.
+ * The ring only grows with the number of groups, so group ids may be
+ * sparse; a slot that does not hold the requested group is completed
+ * by a lookup in the splay.
+ * Fragments are immutable once cached. Their data may be referenced
+ * outside of the cache, for example to repeat datagrams. If a group is
+ * purged while some of its fragments are still referenced, the group is
+ * removed from the cache (cache_ctx set to NULL) but its memory is only
+ * released when the last reference is dropped.
+ */
+typedef struct st_quicrq_cached_group_t {
+    picosplay_node_t group_node;
+    struct st_quicrq_fragment_cache_t* cache_ctx; /* NULL if the group was purged from the cache */
+    uint64_t group_id;
+    int nb_refs; /* Number of references to fragments of the group */
+    picosplay_tree_t fragment_tree; /* Splay of the group fragments, ordered by object_id/offset */
+    picosplay_tree_t object_tree; /* Splay of the object reception states, ordered by object_id */
+    quicrq_cached_object_ranges_t* last_object_ranges; /* Last state updated, found without searching the splay */
+    quicrq_fragment_slab_t slab; /* Allocator for the fragments of the group */
+} quicrq_cached_group_t;
+
+/* Group truncated by the sender of the media, waiting for the number of
+ * objects in the group to be known before the missing objects are cached
+ * as placeholders.
+ */
+typedef struct st_quicrq_truncated_group_t {
+    struct st_quicrq_truncated_group_t* next_truncated_group;
+    uint64_t group_id;
+    uint64_t object_id; /* First object that will not be received */
+    uint64_t nb_objects_previous_group; /* Used if the group is truncated at object 0 */
+} quicrq_truncated_group_t;
+
 typedef struct st_quicrq_fragment_cache_t {
     quicrq_media_source_ctx_t* srce_ctx; /* Back pointer to source context */
     quicrq_ctx_t* qr_ctx; /* back pointer to quicrq context */
@@ -47,8 +169,30 @@ typedef struct st_quicrq_fragment_cache_t {
     uint64_t highest_object_id; /* Highest object id received within the highest group id. */
     quicrq_cached_fragment_t* first_fragment; /* Fragments in order of arrival */
     quicrq_cached_fragment_t* last_fragment;
-    picosplay_tree_t fragment_tree; /* Splay ordered by group_id/object_id/offset */
+    picosplay_tree_t group_tree; /* Group segments, ordered by group_id */
+    quicrq_cached_group_t** group_ring; /* Index of the group segments by group_id modulo ring size, allocated on first use */
+    size_t group_ring_size; /* Number of slots in the ring, power of 2, at least nb_cached_groups */
+    size_t nb_cached_groups; /* Number of group segments in the cache */
+    uint64_t ring_first_group_id; /* Lowest group_id in the cache, if nb_cached_groups > 0 */
+    uint64_t ring_last_group_id; /* Highest group_id in the cache, if nb_cached_groups > 0 */
+    size_t nb_cached_fragments; /* Total number of fragments in the cache */
+    size_t bytes_reserved; /* Memory reserved by the groups of the cache, accounted in qr_ctx->cache_memory_used */
+    uint64_t last_read_time; /* Last time data was read by a subscriber, used for eviction */
+    struct st_quicrq_fragment_cache_t* previous_lru_cache; /* Double linked list of caches in qr_ctx, by last_read_time */
+    struct st_quicrq_fragment_cache_t* next_lru_cache;
+    quicrq_cached_object_t* object_directory; /* Hash of objects by group_id/object_id, allocated on first use */
+    size_t object_directory_size; /* Number of slots in the directory, power of 2 */
+    size_t nb_cached_objects; /* Number of objects documented in the directory */
+    struct st_quicrq_fragment_publisher_context_t** reader_heap; /* Min-heap of subscribers by reader_group_id */
+    size_t reader_heap_size; /* Number of allocated slots in the heap */
+    size_t nb_readers; /* Number of subscribers in the heap */
     uint8_t lowest_flags;
+    uint64_t latency_budget; /* Set by the publisher, in microseconds, 0 if none */
+    quicrq_stream_ctx_t* upstream_stream_ctx; /* Stream on which the media is received, if repair can be requested, or NULL */
+    uint64_t repair_check_time; /* Next check for missing data */
+    uint64_t repair_horizon_group_id; /* Highest object received at the previous check */
+    uint64_t repair_horizon_object_id;
+    quicrq_truncated_group_t* first_truncated_group; /* Truncated groups waiting for their object count */
     int is_feed_closed; /* Whether the data providing connection is closed. */
     uint64_t cache_delete_time;
 } quicrq_fragment_cache_t;
@@ -81,14 +225,82 @@ typedef struct st_quicrq_fragment_publisher_context_t {
     quicrq_cached_fragment_t* current_fragment;
     uint64_t length_sent;
     int is_current_fragment_sent;
+    quicrq_cached_fragment_t* read_cursor; /* Last fragment read, referenced, or NULL */
+    uint64_t reader_group_id; /* Group of first object in publisher_object_tree, UINT64_MAX if empty */
+    size_t reader_heap_index; /* Position in the cache reader heap */
     picosplay_tree_t publisher_object_tree;
+    quicrq_track_set_t* track_set; /* Set if subscribed to a track set, NULL otherwise */
+    size_t track_layer; /* Layer of the track set currently served from cache_ctx */
 } quicrq_fragment_publisher_context_t;
 
 void* quicrq_fragment_cache_node_value(picosplay_node_t* fragment_node);
 
+/* Lowest group still read by a subscriber of the cache, UINT64_MAX if none.
+ * This is read from the root of the reader heap, in constant time.
+ */
+uint64_t quicrq_fragment_cache_lowest_reader_group(quicrq_fragment_cache_t* cache_ctx);
+
+/* Allocation of fragment blocks from the slab of the cache.
+ */
+void* quicrq_fragment_slab_alloc(quicrq_fragment_slab_t* slab, size_t length);
+
+void quicrq_fragment_slab_free(quicrq_fragment_slab_t* slab, void* block);
+
+void quicrq_fragment_slab_release(quicrq_fragment_slab_t* slab);
+
+/* Statistics of the cache allocator */
+void quicrq_fragment_cache_get_memory_stats(quicrq_fragment_cache_t* cache_ctx,
+    size_t* bytes_reserved, size_t* bytes_live, size_t* nb_chunks);
+
+/* Find the directory entry of an object, or NULL if the first
+ * fragment of that object is not present in the cache.
+ * This does not modify the fragment splay.
+ */
+quicrq_cached_object_t* quicrq_fragment_cache_get_object(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id);
+
+/* Access to the group segments, and walk through the fragments in
+ * group_id/object_id/offset order across groups.
+ */
+quicrq_cached_group_t* quicrq_fragment_cache_get_group(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id);
+
+quicrq_cached_fragment_t* quicrq_fragment_cache_first_fragment(quicrq_fragment_cache_t* cache_ctx);
+
+quicrq_cached_fragment_t* quicrq_fragment_cache_next_fragment(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t* fragment);
+
+/* Reception state of an object, or NULL if no fragment of the object was received */
+quicrq_cached_object_ranges_t* quicrq_fragment_cache_get_object_ranges(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id);
+
+/* Find the last fragment at or before group_id/object_id/offset */
+quicrq_cached_fragment_t* quicrq_fragment_cache_find_previous(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t offset);
+
+/* Keep a reference to a cached fragment, so its data remains available
+ * after the fragment or its group is purged from the cache.
+ */
+void quicrq_fragment_cache_ref(quicrq_cached_fragment_t* fragment);
+
+void quicrq_fragment_cache_unref(quicrq_cached_fragment_t* fragment);
+
+/* Find the fragment starting exactly at the specified offset, or NULL.
+ * The lookup is fastest when the first fragment of the object is cached.
+ */
 quicrq_cached_fragment_t* quicrq_fragment_cache_get_fragment(quicrq_fragment_cache_t* cached_ctx,
     uint64_t group_id, uint64_t object_id, uint64_t offset);
 
+/* Read cursor.
+ * The cursor holds a reference to the last fragment read by a publisher, so that
+ * sequential reads of an object resume from that fragment instead of walking the
+ * object from its first fragment. A cursor pointing to a fragment that was purged
+ * since is ignored, and the lookup restarts from the object directory.
+ */
+quicrq_cached_fragment_t* quicrq_fragment_cursor_get_fragment(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_cached_fragment_t** p_cursor, uint64_t group_id, uint64_t object_id, uint64_t offset);
+
+void quicrq_fragment_cursor_release(quicrq_cached_fragment_t** p_cursor);
+
 void quicrq_fragment_cache_media_clear(quicrq_fragment_cache_t* cached_media);
 
 void quicrq_fragment_cache_media_init(quicrq_fragment_cache_t* cached_media);
@@ -128,8 +340,46 @@ int quicrq_fragment_cache_learn_start_point(quicrq_fragment_cache_t* cached_ctx,
 
 int quicrq_fragment_cache_learn_end_point(quicrq_fragment_cache_t* cached_ctx, uint64_t final_group_id, uint64_t final_object_id);
 
+/* Learn that the objects of a group starting at object_id will not be received.
+ * Once the number of objects in the group is known, placeholders with flags 0xFF
+ * are cached for the objects that were not fully received, so that the
+ * subscribers of the cache can move to the next group. The number of objects
+ * in the previous group is only used if the group is truncated at object 0.
+ */
+int quicrq_fragment_cache_learn_group_truncated(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t nb_objects_previous_group, uint64_t current_time);
+
+/* Set the deadline after which the object will not be sent in rush mode. */
+int quicrq_fragment_cache_set_object_expire_time(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t expire_time);
+
+/* Learn that an object expired upstream. Unless the object was fully received, a
+ * placeholder with flags 0xFF is cached in its place, replacing the fragments received.
+ * The rush streams that were sending these fragments are then reset.
+ */
+int quicrq_fragment_cache_learn_object_expired(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t nb_objects_previous_group, uint64_t current_time);
+
+/* Receiver driven repair, in datagram mode.
+ * The check asks the upstream stream to repair the data still missing below the highest
+ * object seen at the previous check. The check runs at most once per interval,
+ * twice the RTT of the upstream connection but at least QUICRQ_REPAIR_CHECK_INTERVAL_MIN.
+ * Serving a repair request queues the cached fragments overlapping the range as
+ * datagrams on the requesting stream, and forwards the missing parts upstream if the
+ * media is received as datagrams and the parts are below the repair horizon.
+ */
+#define QUICRQ_REPAIR_CHECK_INTERVAL_MIN 20000
+
+int quicrq_fragment_cache_check_repair(quicrq_fragment_cache_t* cache_ctx, uint64_t current_time);
+
+int quicrq_fragment_cache_serve_repair(quicrq_stream_ctx_t* stream_ctx, const quicrq_repair_range_t* range, uint64_t current_time);
+
 int quicrq_fragment_cache_set_real_time_cache(quicrq_fragment_cache_t* cached_ctx);
 
+/* Learn the latency budget of the publisher, received from upstream by a relay. The budget
+ * is applied to the subscribers of the relay, and forwarded to them. */
+int quicrq_fragment_cache_set_latency_budget(quicrq_fragment_cache_t* cache_ctx, uint64_t latency_budget);
+
 /* Purging old fragments from the cache. 
  * This should only be done for caches of type "real time".
  * - Compute the first kept GOB.
@@ -139,6 +389,16 @@ int quicrq_fragment_cache_set_real_time_cache(quicrq_fragment_cache_t* cached_ct
 void quicrq_fragment_cache_media_purge_to_gob(
     quicrq_media_source_ctx_t* srce_ctx);
 
+/* Enforce the cache memory limit of the context.
+ * Evict groups from the least recently read caches, oldest group first,
+ * until the memory used is within the limit. Groups that are being read by
+ * a subscriber, and the groups after them, are never evicted.
+ * The enforcement is requested when the reserved memory grows above the limit,
+ * and performed by quicrq_time_check for all the caches of the context.
+ */
+void quicrq_fragment_cache_set_read_time(quicrq_fragment_cache_t* cache_ctx, uint64_t current_time);
+void quicrq_fragment_cache_enforce_memory_limit(quicrq_ctx_t* qr_ctx);
+
 /* Purging the old fragments from the cache.
  * There are two modes of operation.
  * In the general case, we want to make sure that all data has a chance of being
@@ -205,6 +465,27 @@ int quicrq_fragment_publisher_fn(
 
 int quicrq_fragment_is_ready_to_send(void* v_media_ctx, size_t data_max_size, uint64_t current_time);
 
+/* Scatter-gather access to the stream publisher.
+ * quicrq_fragment_publisher_get_slices positions the publisher like the "get data" action
+ * with a NULL data pointer, and returns the data available for the current object as
+ * a list of slices pointing into the cached fragments, up to data_max_size bytes.
+ * Once the data is copied, quicrq_fragment_publisher_consume moves the publisher
+ * forward by the number of bytes actually sent.
+ */
+#define QUICRQ_FRAGMENT_SLICES_MAX 16
+
+typedef struct st_quicrq_fragment_slice_t {
+    const uint8_t* data;
+    size_t length;
+} quicrq_fragment_slice_t;
+
+int quicrq_fragment_publisher_get_slices(quicrq_fragment_publisher_context_t* media_ctx, size_t data_max_size,
+    quicrq_fragment_slice_t* slices, size_t nb_slices_max, size_t* nb_slices, size_t* data_length, uint8_t* flags,
+    int* is_new_group, uint64_t* object_length, int* is_media_finished, int* is_still_active, int* should_skip,
+    uint64_t current_time);
+
+void quicrq_fragment_publisher_consume(quicrq_fragment_publisher_context_t* media_ctx, size_t data_length, uint64_t current_time);
+
 /* datagram_publisher_check_object:
  * evaluate and if necessary progress the "current fragment" pointer.
  * After this evaluation, expect the following results:
@@ -249,7 +530,8 @@ int quicrq_fragment_datagram_publisher_send_fragment(
     size_t space,
     int* media_was_sent,
     int* at_least_one_active,
-    int should_skip);
+    int should_skip,
+    uint64_t current_time);
 
 int quicrq_fragment_datagram_publisher_prepare(
     quicrq_stream_ctx_t* stream_ctx,
@@ -279,7 +561,13 @@ uint8_t quicrq_fragment_get_flags(quicrq_fragment_cache_t* cache_ctx, uint64_t g
 int quicrq_fragment_get_object_properties(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
     size_t* object_length, uint64_t* nb_objects_previous_group, uint8_t* flags);
 
-size_t quicrq_fragment_object_copy_available_data(quicrq_fragment_cache_t* cache_ctx,
+int quicrq_fragment_object_is_expired(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t current_time);
+
+/* Copy the data available in sequence from the specified offset. If p_cursor
+ * is not NULL, the lookup resumes from the read cursor, and the cursor is updated.
+ */
+size_t quicrq_fragment_object_copy_available_data(quicrq_fragment_cache_t* cache_ctx, quicrq_cached_fragment_t** p_cursor,
     uint64_t group_id, uint64_t object_id, size_t offset, size_t available, uint8_t* buffer);
 
 size_t quicrq_fragment_object_copy(quicrq_fragment_cache_t* cache_ctx, uint64_t group_id, uint64_t object_id, uint64_t* nb_objects_previous_group, uint8_t* flags, uint8_t* buffer);
@@ -288,6 +576,13 @@ void* quicrq_fragment_publisher_subscribe(quicrq_fragment_cache_t* cache_ctx, qu
 
 void quicrq_fragment_publisher_delete(void* v_pub_ctx);
 
+/* Move a stream publisher to another cache, before it starts reading a new group. */
+int quicrq_fragment_publisher_set_cache(quicrq_fragment_publisher_context_t* media_ctx, quicrq_fragment_cache_t* cache_ctx);
+
+/* Layer switch of track set subscriptions, at the beginning of group group_id */
+quicrq_cached_fragment_t* quicrq_track_set_next_group(quicrq_fragment_publisher_context_t* media_ctx, uint64_t group_id,
+    quicrq_cached_fragment_t* next_group_fragment);
+
 /* Fragment cache media publish */
 int quicrq_publish_fragment_cached_media(quicrq_ctx_t* qr_ctx,
     quicrq_fragment_cache_t* cache_ctx, const uint8_t* url, const size_t url_length,
@@ -296,13 +591,23 @@ int quicrq_publish_fragment_cached_media(quicrq_ctx_t* qr_ctx,
 /* Evaluation of congestion for single stream transmission */
 int quicrq_evaluate_stream_congestion(quicrq_fragment_publisher_context_t* media_ctx, uint64_t current_time);
 
-/* Evaluation of congestion in warp transmission mode */
+/* Evaluation of congestion in warp transmission mode.
+ * Sets should_truncate if the stream of the group should be reset instead of
+ * sending placeholders for the remaining objects.
+ */
 int quicrq_evaluate_warp_congestion(quicrq_uni_stream_ctx_t* uni_stream_ctx, quicrq_fragment_publisher_context_t* media_ctx,
-    size_t next_object_size, uint8_t flags, uint64_t current_time);
+    size_t next_object_size, uint8_t flags, int* should_truncate, uint64_t current_time);
 
 /* Evaluation of congestion in datagram mode */
 int quicrq_evaluate_datagram_congestion(quicrq_stream_ctx_t* stream_ctx, quicrq_fragment_publisher_context_t* media_ctx, uint64_t current_time);
 
+/* Age of a fragment, adding the queue delay accumulated upstream to the time spent in the local cache */
+uint64_t quicrq_fragment_age(const quicrq_cached_fragment_t* fragment, uint64_t current_time);
+
+/* Evaluation of the latency budget, returns 1 if the object of the fragment should be skipped */
+int quicrq_evaluate_latency_budget(quicrq_stream_ctx_t* stream_ctx, quicrq_fragment_publisher_context_t* media_ctx,
+    const quicrq_cached_fragment_t* fragment, uint64_t current_time);
+
 #ifdef __cplusplus
 }
 #endif
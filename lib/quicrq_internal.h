@@ -62,6 +62,7 @@ void quicrq_msg_buffer_release(quicrq_message_buffer_t* msg_buffer);
  * - Repair: 1 byte code, followed by content of a datagram
  */
 #define QUICRQ_ACTION_REQUEST 1
+#define QUICRQ_ACTION_REPAIR_REQUEST 2
 #define QUICRQ_ACTION_FIN_DATAGRAM 3
 #define QUICRQ_ACTION_FRAGMENT 5
 #define QUICRQ_ACTION_POST 6
@@ -73,6 +74,7 @@ void quicrq_msg_buffer_release(quicrq_message_buffer_t* msg_buffer);
 #define QUICRQ_ACTION_WARP_HEADER 12
 #define QUICRQ_ACTION_OBJECT_HEADER 13
 #define QUICRQ_ACTION_RUSH_HEADER 14
+#define QUICRQ_ACTION_LATENCY_BUDGET 15
 
 /* Protocol message.
  * This structure is used when decoding messages
@@ -93,15 +95,30 @@ typedef struct st_quicrq_message_t {
     quicrq_transport_mode_enum transport_mode;
     uint8_t cache_policy;
     quicrq_subscribe_intent_enum subscribe_intent;
+    uint64_t datagram_header_mode;
+    uint64_t latency_budget; /* in milliseconds */
+    uint64_t nb_ranges; /* Number of ranges in a repair request, encoded in data and fragment_length */
 } quicrq_message_t;
 
+/* Range of missing data in a repair request.
+ * A length of 0 designates the whole object, or the data from offset to the end of the object.
+ */
+typedef struct st_quicrq_repair_range_t {
+    uint64_t group_id;
+    uint64_t object_id;
+    uint64_t offset;
+    uint64_t length;
+} quicrq_repair_range_t;
+
+#define QUICRQ_REPAIR_RANGES_MAX 16
+
 /* Encode and decode protocol messages
  * 
  * The protocol defines a set of actions, identified by a code.
  * 
  * - rq_msg: request message, ask for a media identified by an URL
  * - fin_msg: signal the last obect identifier in the media flow
- * - repair_request: require repeat of a specific object fragment (not used yet)
+ * - repair_request: require repeat of a list of missing object fragments, in datagram mode
  * - repair_msg: provide the value of a specific fragment
  * - quicr_msg: generic message, with type and value specified inside "msg" argument
  * 
@@ -122,10 +139,10 @@ const uint8_t* quicrq_notify_msg_decode(const uint8_t* bytes, const uint8_t* byt
 size_t quicrq_rq_msg_reserve(size_t url_length, quicrq_subscribe_intent_enum intent_mode);
 uint8_t* quicrq_rq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, size_t url_length, const uint8_t* url,
     uint64_t media_id, quicrq_transport_mode_enum transport_mode, quicrq_subscribe_intent_enum intent_mode,
-    uint64_t start_group_id, uint64_t start_object_id);
+    uint64_t start_group_id, uint64_t start_object_id, uint64_t datagram_header_mode, uint64_t latency_budget);
 const uint8_t* quicrq_rq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type, size_t* url_length, const uint8_t** url,
     uint64_t* media_id, quicrq_transport_mode_enum* transport_mode, quicrq_subscribe_intent_enum* intent_mode,
-    uint64_t* start_group_id, uint64_t* start_object_id);
+    uint64_t* start_group_id, uint64_t* start_object_id, uint64_t* datagram_header_mode, uint64_t* latency_budget);
 size_t quicrq_post_msg_reserve(size_t url_length);
 uint8_t* quicrq_post_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, size_t url_length, 
     const uint8_t* url, quicrq_transport_mode_enum transport_mode, uint8_t cache_policy,
@@ -150,11 +167,22 @@ const uint8_t* quicrq_fragment_msg_decode(const uint8_t* bytes, const uint8_t* b
 size_t quicrq_start_point_msg_reserve(uint64_t start_group, uint64_t start_object);
 uint8_t* quicrq_start_point_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, uint64_t start_group, uint64_t start_object);
 const uint8_t* quicrq_start_point_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type, uint64_t* start_group, uint64_t* start_object);
+size_t quicrq_repair_request_msg_reserve(size_t nb_ranges);
+uint8_t* quicrq_repair_request_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type,
+    size_t nb_ranges, const quicrq_repair_range_t* ranges);
+const uint8_t* quicrq_repair_request_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type,
+    uint64_t* nb_ranges, size_t* ranges_length, const uint8_t** ranges_bytes);
+/* Decode the next range of a repair request. The ranges are delta encoded: "range" shall be
+ * set to zero before decoding the first range, and holds the previous range afterwards. */
+const uint8_t* quicrq_repair_range_decode(const uint8_t* bytes, const uint8_t* bytes_max, quicrq_repair_range_t* range);
 uint8_t* quicrq_msg_encode(uint8_t* bytes, uint8_t* bytes_max, quicrq_message_t* msg);
 const uint8_t* quicrq_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, quicrq_message_t * msg);
 size_t quicrq_cache_policy_msg_reserve();
 uint8_t* quicrq_cache_policy_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, uint8_t cache_policy);
 const uint8_t* quicrq_cache_policy_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t * message_type, uint8_t * cache_policy);
+size_t quicrq_latency_budget_msg_reserve(uint64_t latency_budget);
+uint8_t* quicrq_latency_budget_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, uint64_t latency_budget);
+const uint8_t* quicrq_latency_budget_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type, uint64_t* latency_budget);
 size_t quicrq_warp_header_msg_reserve(uint64_t media_id, uint64_t group_id);
 uint8_t* quicrq_warp_header_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t message_type, uint64_t media_id, uint64_t group_id);
 const uint8_t* quicrq_warp_header_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type, uint64_t* media_id, uint64_t* group_id);
@@ -164,18 +192,58 @@ uint8_t* quicrq_object_header_msg_encode(uint8_t* bytes, uint8_t* bytes_max, uin
 const uint8_t* quicrq_object_header_msg_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* message_type,
     uint64_t* object_id, uint64_t* nb_objects_previous_group, uint8_t* flags, size_t* length);
 
-/* Encode and decode the header of datagram packets. */
-#define QUICRQ_DATAGRAM_HEADER_MAX 16
+/* Encode and decode the header of datagram packets.
+ * The fec_sequence is set to UINT64_MAX if the fragment is not protected by FEC.
+ * The compact header is only used if the receiver of the media asked for it.
+ * When encoding it, the group_acked is the last group acknowledged by the
+ * receiver, or UINT64_MAX if none, the group_max is the largest group sent
+ * on the media, and the data_length is SIZE_MAX if not
+ * known yet, which gives the largest header size.
+ * The datagram stream id is 8*media_id + datagram_type, the type being
+ * encoded in the three low order bits.
+ */
+#define QUICRQ_DATAGRAM_HEADER_MAX 32
+#define QUICRQ_DATAGRAM_TYPE_SHIFT 3
+#define QUICRQ_DATAGRAM_TYPE_MASK 7
+#define QUICRQ_DATAGRAM_TYPE_SOURCE 0
+#define QUICRQ_DATAGRAM_TYPE_FEC_SOURCE 1
+#define QUICRQ_DATAGRAM_TYPE_FEC_REPAIR 2
+#define QUICRQ_DATAGRAM_TYPE_BUNDLE 3
+#define QUICRQ_DATAGRAM_TYPE_COMPACT_SOURCE 4
+#define QUICRQ_DATAGRAM_TYPE_COMPACT_FEC_SOURCE 5
+#define QUICRQ_DATAGRAM_HEADER_FULL 0
+#define QUICRQ_DATAGRAM_HEADER_COMPACT 1
 uint8_t* quicrq_datagram_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t media_id, uint64_t group_id, 
-    uint64_t object_id, uint64_t object_offset, uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group, uint64_t object_length);
+    uint64_t object_id, uint64_t object_offset, uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group, uint64_t object_length,
+    uint64_t fec_sequence);
 const uint8_t* quicrq_datagram_header_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* media_id, uint64_t* group_id,
-    uint64_t* object_id, uint64_t* object_offset, uint64_t *queue_delay, uint8_t * flags, uint64_t *nb_objects_previous_group, uint64_t* object_length);
+    uint64_t* object_id, uint64_t* object_offset, uint64_t *queue_delay, uint8_t * flags, uint64_t *nb_objects_previous_group, uint64_t* object_length,
+    uint64_t* fec_sequence, uint64_t group_reference);
+uint8_t* quicrq_datagram_compact_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t media_id, uint64_t group_id,
+    uint64_t group_acked, uint64_t group_max, uint64_t object_id, uint64_t object_offset, uint64_t queue_delay, uint8_t flags,
+    uint64_t nb_objects_previous_group, uint64_t object_length, size_t data_length, uint64_t fec_sequence);
+const uint8_t* quicrq_datagram_stream_id_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* media_id, uint64_t* datagram_type);
+#define QUICRQ_DATAGRAM_REPAIR_HEADER_MAX 32
+uint8_t* quicrq_datagram_repair_header_encode(uint8_t* bytes, uint8_t* bytes_max, uint64_t media_id, uint64_t group_id,
+    uint64_t first_fec_sequence, uint64_t nb_sources);
+const uint8_t* quicrq_datagram_repair_header_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* media_id, uint64_t* group_id,
+    uint64_t* first_fec_sequence, uint64_t* nb_sources);
+/* A bundle datagram carries several records, each holding a source or repair datagram */
+uint8_t* quicrq_datagram_bundle_header_encode(uint8_t* bytes, uint8_t* bytes_max);
+const uint8_t* quicrq_datagram_bundle_header_decode(const uint8_t* bytes, const uint8_t* bytes_max);
+uint8_t* quicrq_datagram_bundle_record_encode(uint8_t* bytes, uint8_t* bytes_max, size_t record_length);
+const uint8_t* quicrq_datagram_bundle_record_decode(const uint8_t* bytes, const uint8_t* bytes_max, size_t* record_length);
 /* Stream header is indentical to repair message */
 #define QUICRQ_STREAM_HEADER_MAX 2+1+8+4+2
 
-/* Initialize the tracking of a datagram after sending it in a stream context */
+/* Initialize the tracking of a datagram after sending it in a stream context.
+ * The tracking state holds a reference to the cached fragment from which the
+ * datagram was sent, so the data can be repeated without keeping a copy.
+ */
+struct st_quicrq_cached_fragment_t;
 int quicrq_datagram_ack_init(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t object_id,
-    uint64_t object_offset, uint8_t flags, uint64_t nb_objects_previous_group, const uint8_t* data, size_t length,
+    uint64_t object_offset, uint8_t flags, uint64_t nb_objects_previous_group,
+    struct st_quicrq_cached_fragment_t* fragment, size_t length,
     uint64_t queue_delay, uint64_t object_length, void** p_created_state, uint64_t current_time);
 
 /* Media publisher API.
@@ -261,6 +329,8 @@ struct st_quicrq_media_object_source_ctx_t {
 struct st_quicrq_media_source_ctx_t {
     struct st_quicrq_media_source_ctx_t* next_source;
     struct st_quicrq_media_source_ctx_t* previous_source;
+    struct st_quicrq_media_source_ctx_t* next_in_bucket; /* Next source in the same bucket of qr_ctx->source_table */
+    uint64_t media_url_hash;
     struct st_quicrq_stream_ctx_t* first_stream;
     struct st_quicrq_stream_ctx_t* last_stream;
     uint8_t* media_url;
@@ -271,11 +341,40 @@ struct st_quicrq_media_source_ctx_t {
 };
 
 quicrq_media_source_ctx_t* quicrq_find_local_media_source(quicrq_ctx_t* qr_ctx, const uint8_t* url, const size_t url_length);
+void quicrq_media_source_table_release(quicrq_ctx_t* qr_ctx);
 int quicrq_subscribe_local_media(quicrq_stream_ctx_t* stream_ctx, const uint8_t* url, const size_t url_length);
+void quicrq_link_local_media(quicrq_stream_ctx_t* stream_ctx, quicrq_media_source_ctx_t* srce_ctx);
 void quicrq_unsubscribe_local_media(quicrq_stream_ctx_t* stream_ctx);
+quicrq_media_source_ctx_t* quicrq_create_default_source(quicrq_ctx_t* qr_ctx, const uint8_t* url, size_t url_length);
 void quicrq_wakeup_media_stream(quicrq_stream_ctx_t* stream_ctx);
 void quicrq_wakeup_media_uni_stream(quicrq_stream_ctx_t* stream_ctx);
 
+/* Track sets: quality layers of a logical media, sorted by increasing bitrate.
+ * Moving to a higher layer requires a bandwidth estimate larger than the
+ * bitrate of that layer by QUICRQ_TRACK_SET_UP_SWITCH_MARGIN percent.
+ */
+#define QUICRQ_TRACK_SET_UP_SWITCH_MARGIN 25
+
+typedef struct st_quicrq_track_layer_t {
+    uint8_t* url;
+    size_t url_length;
+    uint64_t bitrate; /* bits per second */
+} quicrq_track_layer_t;
+
+typedef struct st_quicrq_track_set_t {
+    struct st_quicrq_track_set_t* next_track_set;
+    uint8_t* url;
+    size_t url_length;
+    size_t nb_layers;
+    quicrq_track_layer_t* layers;
+} quicrq_track_set_t;
+
+quicrq_track_set_t* quicrq_find_track_set(quicrq_ctx_t* qr_ctx, const uint8_t* url, size_t url_length);
+void quicrq_track_set_release(quicrq_ctx_t* qr_ctx);
+uint64_t quicrq_track_set_bandwidth_estimate(quicrq_cnx_ctx_t* cnx_ctx);
+size_t quicrq_track_set_select_layer(const quicrq_track_set_t* track_set, size_t current_layer, uint64_t bandwidth_estimate);
+quicrq_media_source_ctx_t* quicrq_track_set_layer_source(quicrq_ctx_t* qr_ctx, const quicrq_track_set_t* track_set, size_t layer);
+
 /* Quic media consumer. Old definition, moved to internal only.
  * 
  * The application sets a "media consumer function" and a "media consumer context" for
@@ -329,6 +428,7 @@ typedef enum {
     quicrq_sending_final_point,
     quicrq_sending_start_point,
     quicrq_sending_cache_policy,
+    quicrq_sending_latency_budget,
     quicrq_sending_fin,
     quicrq_sending_subscribe,
     quicrq_waiting_notify,
@@ -343,6 +443,7 @@ typedef enum {
     quicrq_receive_confirmation,
     quicrq_receive_fragment,
     quicrq_receive_notify,
+    quicrq_receive_repair, /* Sender in datagram mode, only repair requests are expected */
     quicrq_receive_done
 }  quicrq_stream_receive_state_enum;
 
@@ -356,6 +457,8 @@ typedef enum {
     quicrq_sending_object_header,
     quicrq_sending_object_data,
     quicrq_sending_warp_all_sent,
+    quicrq_sending_warp_group_truncated,
+    quicrq_sending_rush_object_expired,
     quicrq_sending_warp_should_close
 } quicrq_uni_stream_sending_state_enum;
 
@@ -378,14 +481,19 @@ typedef struct st_quicrq_datagram_ack_state_t {
     size_t length;
     int is_acked;
     int nack_received;
+    /* Reference to the cached fragment that contains the data */
+    struct st_quicrq_cached_fragment_t* fragment;
     /* Handling of extra repeat, i.e., poor man's FEC.
-     * Presence of extra data indicates an extra repeat is scheduled. 
-     * Length of extra_data is always equal to length of fragment.
+     * Presence of extra data indicates an extra repeat is scheduled,
+     * and that the state is in the extra repeat heap of the quicrq context. 
+     * The extra data points inside the referenced fragment, its length
+     * is always equal to length of fragment.
      */
-    struct st_quicrq_datagram_ack_state_t* extra_previous;
-    struct st_quicrq_datagram_ack_state_t* extra_next;
+    struct st_quicrq_stream_ctx_t* extra_stream_ctx;
+    size_t extra_heap_index;
+    uint64_t extra_sequence; /* Order of scheduling, to break ties between equal repeat times */
     uint64_t extra_repeat_time;
-    uint8_t* extra_data;
+    const uint8_t* extra_data;
     int is_extra_queued;
     /* Start time is the time of the first transmission at this node */
     uint64_t start_time;
@@ -399,10 +507,112 @@ typedef struct st_quicrq_notify_url_t {
     uint8_t* url;
 } quicrq_notify_url_t;
 
+/* Prefix trie of subscribe patterns.
+ * Each node of the radix trie holds the bytes of the edge that leads to it
+ * from its parent, and the list of notify streams whose subscribe_prefix
+ * ends exactly at that node. Notifying a new URL walks the trie along the
+ * bytes of the URL, and visits only the streams of the nodes on that path.
+ */
+typedef struct st_quicrq_prefix_node_t {
+    struct st_quicrq_prefix_node_t* parent;
+    struct st_quicrq_prefix_node_t* first_child;
+    struct st_quicrq_prefix_node_t* next_sibling;
+    struct st_quicrq_stream_ctx_t* first_stream;
+    size_t label_length;
+    uint8_t* label;
+} quicrq_prefix_node_t;
+
+/* Index of stream contexts by stream_id.
+ * Stream and uni stream contexts embed a node, chained in the buckets
+ * of a per connection hash table.
+ */
+typedef struct st_quicrq_stream_id_node_t {
+    struct st_quicrq_stream_id_node_t* next_in_bucket;
+    uint64_t stream_id;
+} quicrq_stream_id_node_t;
+
+typedef struct st_quicrq_stream_id_index_t {
+    quicrq_stream_id_node_t** buckets; /* Allocated on first use */
+    size_t nb_buckets; /* Power of 2 */
+    size_t nb_nodes;
+} quicrq_stream_id_index_t;
+
+/* Datagram bundling.
+ * When bundling is enabled, the records prepared for a datagram are first
+ * written in the bundle buffer, so that several small fragments, possibly
+ * from different media, can be sent in the same datagram frame. The bundle
+ * is referenced from the connection context while the datagram is prepared.
+ */
+#define QUICRQ_DATAGRAM_BUNDLE_MIN_SPACE 64
+#define QUICRQ_DATAGRAM_BUNDLE_RECORD_OVERHEAD 2
+
+typedef struct st_quicrq_datagram_bundle_t {
+    size_t space; /* Bytes available for the records */
+    size_t length; /* Bytes used by the records */
+    size_t nb_records;
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+} quicrq_datagram_bundle_t;
+
+/* Forward error correction for media sent as datagrams.
+ * When enabled at the sender, the source fragments of a group are protected
+ * in windows of up to fec_window fragments. Each fragment carries an FEC
+ * sequence number, and a repair datagram carrying the XOR of the source
+ * symbols is sent after the last fragment of the window. A source symbol
+ * is a fixed size header describing the fragment, followed by its data.
+ * The receiver keeps the symbols of the last received fragments, and
+ * recovers a fragment if it is the only one missing in a window.
+ */
+#define QUICRQ_FEC_WINDOW_MAX 16
+#define QUICRQ_FEC_RECEIVE_RING 32
+#define QUICRQ_FEC_SYMBOL_HEADER 43
+#define QUICRQ_FEC_DATA_MAX (PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH - QUICRQ_DATAGRAM_REPAIR_HEADER_MAX - QUICRQ_FEC_SYMBOL_HEADER)
+#define QUICRQ_FEC_SYMBOL_MAX (QUICRQ_FEC_SYMBOL_HEADER + QUICRQ_FEC_DATA_MAX)
+
+typedef struct st_quicrq_fec_sender_t {
+    uint64_t next_fec_sequence;
+    /* Current window */
+    uint64_t group_id;
+    uint64_t first_fec_sequence;
+    size_t nb_sources;
+    size_t symbol_length;
+    uint8_t symbol[QUICRQ_FEC_SYMBOL_MAX];
+    /* Repair datagram waiting to be sent, if repair_length > 0 */
+    size_t repair_length;
+    uint8_t repair[QUICRQ_DATAGRAM_REPAIR_HEADER_MAX + QUICRQ_FEC_SYMBOL_MAX];
+    uint64_t nb_repairs_sent;
+} quicrq_fec_sender_t;
+
+typedef struct st_quicrq_fec_received_t {
+    uint64_t fec_sequence;
+    uint64_t group_id;
+    size_t symbol_length;
+    uint8_t* symbol; /* Allocated on first use, QUICRQ_FEC_SYMBOL_MAX bytes */
+} quicrq_fec_received_t;
+
+typedef struct st_quicrq_fec_receiver_t {
+    quicrq_fec_received_t received[QUICRQ_FEC_RECEIVE_RING];
+    uint8_t recovered[QUICRQ_FEC_SYMBOL_MAX];
+    uint64_t nb_recovered;
+} quicrq_fec_receiver_t;
+
+/* Description of a fragment recovered by FEC. The data points inside the receiver context. */
+typedef struct st_quicrq_fec_recovered_fragment_t {
+    uint64_t group_id;
+    uint64_t object_id;
+    uint64_t object_offset;
+    uint64_t object_length;
+    uint64_t queue_delay;
+    uint64_t nb_objects_previous_group;
+    uint8_t flags;
+    const uint8_t* data;
+    size_t data_length;
+} quicrq_fec_recovered_fragment_t;
+
 /* Context representing unidirectional streams*/
 struct st_quicrq_uni_stream_ctx_t {
     struct st_quicrq_uni_stream_ctx_t* next_uni_stream_for_cnx;
     struct st_quicrq_uni_stream_ctx_t* previous_uni_stream_for_cnx;
+    quicrq_stream_id_node_t stream_id_node;
     /* Control stream context - has media_source */
     struct st_quicrq_stream_ctx_t* control_stream_ctx;
     struct st_quicrq_uni_stream_ctx_t* next_uni_stream_for_control_stream;
@@ -428,19 +638,26 @@ struct st_quicrq_uni_stream_ctx_t {
 struct st_quicrq_stream_ctx_t {
     struct st_quicrq_stream_ctx_t* next_stream;
     struct st_quicrq_stream_ctx_t* previous_stream;
+    quicrq_stream_id_node_t stream_id_node;
     struct st_quicrq_cnx_ctx_t* cnx_ctx;
     /* Source from which data is read and sent on the stream. */
     quicrq_media_source_ctx_t* media_source;
     struct st_quicrq_stream_ctx_t* next_stream_for_source;
     struct st_quicrq_stream_ctx_t* previous_stream_for_source;
-    /* queue of datagrams that qualify for extra transmission */
-    struct st_quicrq_datagram_ack_state_t* extra_first;
-    struct st_quicrq_datagram_ack_state_t* extra_last;
     /* stream_id: control stream identifier */
     uint64_t stream_id;
     /* media_id: local identifier of media stream.
      * TODO: rename to media_stream_id as part of RUSH/WARP development. */
     uint64_t media_id;
+    struct st_quicrq_stream_ctx_t* next_stream_in_datagram_index; /* Next stream in the same bucket of cnx_ctx->datagram_stream_index */
+    uint64_t datagram_index_key; /* media_id and direction under which the stream is indexed */
+    /* Datagram scheduling. Streams with datagrams ready to send are queued in the
+     * connection context while is_active_datagram is set, and served in deficit
+     * round robin. */
+    struct st_quicrq_stream_ctx_t* next_datagram_ready;
+    struct st_quicrq_stream_ctx_t* previous_datagram_ready;
+    int64_t datagram_deficit; /* Bytes that the stream may send before yielding */
+    size_t last_datagram_size; /* Size of the last datagram sent, header included */
     /* Designation of next expected object, start object, final object */
     uint64_t next_group_id;
     uint64_t next_object_id;
@@ -451,6 +668,8 @@ struct st_quicrq_stream_ctx_t {
     uint64_t final_object_id;
     uint64_t next_warp_group_id; /* group_id to create next in warp mode */
     uint64_t next_rush_object_id; /* in rush, next object to send in this group */
+    uint64_t latency_budget; /* Requested by the subscriber, in microseconds, 0 if none */
+    uint64_t publisher_latency_budget; /* Set by the publisher of the media, in microseconds, 0 if none */
     /* Control of datagrams sent for that media
      * We only keep track of fragments that are above the horizon.
      * The one below horizon are already acked, or otherwise forgotten.
@@ -463,11 +682,30 @@ struct st_quicrq_stream_ctx_t {
     int nb_horizon_acks;
     int nb_extra_sent;
     int nb_fragment_lost;
+    /* FEC state, allocated when FEC protected datagrams are sent or received */
+    quicrq_fec_sender_t* fec_sender;
+    quicrq_fec_receiver_t* fec_receiver;
+    /* Compact datagram headers. The sender truncates the group id based on the
+     * last group acknowledged, the receiver expands it based on the largest
+     * group received. */
+    int use_compact_datagram_header;
+    int is_datagram_group_acked;
+    uint64_t datagram_group_acked;
+    uint64_t datagram_group_max;
     picosplay_tree_t datagram_ack_tree;
+    /* Repair requests. The receiver of datagrams queues the ranges of missing data,
+     * sorted by group_id/object_id/offset, until they are sent on the control stream.
+     * The sender counts the fragments repeated in response. */
+    size_t nb_repair_ranges;
+    quicrq_repair_range_t repair_ranges[QUICRQ_REPAIR_RANGES_MAX];
+    uint64_t nb_repair_fragments_sent;
     /* For notification streams, URL and notification queue */
     uint8_t* subscribe_prefix;
     size_t subscribe_prefix_length;
     quicrq_notify_url_t* first_notify_url;
+    quicrq_prefix_node_t* prefix_node; /* Node of qr_ctx->prefix_root holding this stream, or NULL */
+    struct st_quicrq_stream_ctx_t* next_stream_for_prefix;
+    struct st_quicrq_stream_ctx_t* previous_stream_for_prefix;
     quicrq_media_notify_fn media_notify_fn;
     void* notify_ctx;
     /* Transport mode: stream, datagram, etc. */
@@ -481,6 +719,7 @@ struct st_quicrq_stream_ctx_t {
     /* Control flags */
     uint8_t lowest_flags; /* Mark the lowest value of the flags field for media segments */
     unsigned int is_sender : 1;
+    unsigned int is_datagram_indexed : 1;
     /* is_cache_real_time:
      * Indicates whether local cache management follows the "real time" logic,
      * in which only recent objects are kept. By default, cache management 
@@ -501,6 +740,7 @@ struct st_quicrq_stream_ctx_t {
     unsigned int is_start_object_id_sent : 1;
     unsigned int is_final_object_id_sent : 1;
     unsigned int is_cache_policy_sent : 1;
+    unsigned int is_latency_budget_sent : 1;
     unsigned int is_warp_mode_started: 1;
 
     quicrq_message_buffer_t message_sent;
@@ -516,6 +756,17 @@ struct st_quicrq_stream_ctx_t {
 
 int quicrq_set_media_stream_ctx(quicrq_stream_ctx_t* stream_ctx, quicrq_media_consumer_fn media_fn, void* media_ctx);
 
+/* Ask the sender of a datagram media to repeat the data at offset and length in an object,
+ * or the whole object if length is zero. The request is queued and sent on the control
+ * stream. If the queue is full, the request is ignored; it will be repeated if the data
+ * is still missing at the next check. */
+int quicrq_stream_request_repair(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t object_id,
+    uint64_t offset, uint64_t length);
+
+/* Queue a copy of a cached fragment as a datagram, in response to a repair request */
+int quicrq_datagram_queue_repair(quicrq_stream_ctx_t* stream_ctx, const struct st_quicrq_cached_fragment_t* fragment,
+    uint64_t current_time);
+
 typedef struct st_quicrq_cnx_congestion_state_t {
     int has_backlog; /* Indicates whether at least on flow is congested. */
     int is_congested;
@@ -523,8 +774,35 @@ typedef struct st_quicrq_cnx_congestion_state_t {
     uint8_t priority_threshold; /* Indicates the highest priority level that may be dropped. */
     uint8_t old_priority_threshold; /* Threshold at beginning of epoch. */
     uint64_t congestion_check_time;
+    uint64_t epoch_start_time;
+    uint64_t epoch_duration; /* Based on the RTT and the pacing rate of the connection */
+    uint64_t max_backlog_delay; /* Largest queue delay reported during the epoch */
+    uint64_t previous_backlog_delay; /* Largest queue delay reported during the previous epoch */
+    uint64_t nb_drops; /* Objects skipped during the epoch */
 } quicrq_cnx_congestion_state_t;
 
+/* Congestion trace, recording the state of delay based congestion control
+ * at the end of each epoch, for all connections of a quicrq context.
+ * Only the first QUICRQ_CONGESTION_TRACE_MAX epochs are kept.
+ */
+#define QUICRQ_CONGESTION_TRACE_MAX 1024
+
+typedef struct st_quicrq_congestion_epoch_t {
+    uint64_t start_time;
+    uint64_t duration;
+    uint64_t max_backlog_delay;
+    uint64_t nb_drops;
+    uint8_t priority_threshold; /* Threshold for the next epoch */
+    int has_backlog;
+    int is_congested;
+} quicrq_congestion_epoch_t;
+
+typedef struct st_quicrq_congestion_trace_t {
+    uint64_t nb_epochs_total;
+    size_t nb_epochs;
+    quicrq_congestion_epoch_t epochs[QUICRQ_CONGESTION_TRACE_MAX];
+} quicrq_congestion_trace_t;
+
 /* Quicrq per connection context */
 struct st_quicrq_cnx_ctx_t {
     struct st_quicrq_cnx_ctx_t* next_cnx;
@@ -542,9 +820,22 @@ struct st_quicrq_cnx_ctx_t {
     uint64_t next_abandon_datagram_id; /* used to test whether unexpected datagrams are OK */
     struct st_quicrq_stream_ctx_t* first_stream;
     struct st_quicrq_stream_ctx_t* last_stream;
+    /* Hash index of datagram streams by media_id and direction, allocated on first use */
+    struct st_quicrq_stream_ctx_t** datagram_stream_index;
+    size_t datagram_stream_index_size; /* Number of buckets, power of 2 */
+    size_t nb_datagram_streams_indexed;
+    /* Queue of datagram streams with data ready to send */
+    struct st_quicrq_stream_ctx_t* first_datagram_ready;
+    struct st_quicrq_stream_ctx_t* last_datagram_ready;
+    size_t nb_datagram_ready;
+    /* Bundle being filled, only set while preparing a datagram */
+    quicrq_datagram_bundle_t* datagram_bundle;
     /* reference to the unidirectional streams */
     struct st_quicrq_uni_stream_ctx_t* first_uni_stream;
     struct st_quicrq_uni_stream_ctx_t* last_uni_stream;
+    /* Index of stream and uni stream contexts by stream_id */
+    quicrq_stream_id_index_t stream_index;
+    quicrq_stream_id_index_t uni_stream_index;
 };
 
 /* Prototype function for managing the cache of relays.
@@ -559,6 +850,10 @@ typedef uint64_t (*quicrq_manage_relay_cache_fn)(quicrq_ctx_t* qr_ctx, uint64_t
 
 int quicrq_notify_url_to_stream(quicrq_stream_ctx_t* stream_ctx, const uint8_t* url, size_t url_length);
 int quicrq_notify_url_to_all(quicrq_ctx_t * qr_ctx, const uint8_t* url, size_t url_length);
+int quicrq_process_incoming_subscribe(quicrq_stream_ctx_t* stream_ctx, size_t url_length, const uint8_t* url);
+int quicrq_prefix_trie_add_stream(quicrq_ctx_t* qr_ctx, quicrq_stream_ctx_t* stream_ctx);
+void quicrq_prefix_trie_remove_stream(quicrq_stream_ctx_t* stream_ctx);
+quicrq_prefix_node_t* quicrq_prefix_trie_find(quicrq_ctx_t* qr_ctx, const uint8_t* prefix, size_t prefix_length);
 
 /* Prototype function for managing cache at relay. */
 typedef enum {
@@ -574,6 +869,12 @@ struct st_quicrq_ctx_t {
     /* Local media sources */
     quicrq_media_source_ctx_t* first_source;
     quicrq_media_source_ctx_t* last_source;
+    /* Hash table of local media sources by URL, allocated on first use */
+    quicrq_media_source_ctx_t** source_table;
+    size_t source_table_size; /* Number of buckets, power of 2 */
+    size_t nb_sources; /* Number of sources in the table */
+    /* Subscribe patterns received from peers, by prefix */
+    quicrq_prefix_node_t prefix_root;
     /* local media object sources */
     struct st_quicrq_media_object_source_ctx_t* first_object_source;
     struct st_quicrq_media_object_source_ctx_t* last_object_source;
@@ -597,16 +898,39 @@ struct st_quicrq_ctx_t {
     int is_cache_closing_needed;
     uint64_t cache_duration_max;
     uint64_t cache_check_next_time;
+    size_t cache_memory_limit; /* Maximum memory used by caches, or zero if no limit */
+    size_t cache_memory_used; /* Memory currently reserved by all caches in the context */
+    int is_cache_memory_check_needed; /* Reserved memory grew above the limit since the last enforcement */
+    struct st_quicrq_fragment_cache_t* first_lru_cache; /* Caches by time of last read, least recently read first */
+    struct st_quicrq_fragment_cache_t* last_lru_cache;
     quicrq_manage_relay_cache_fn manage_relay_cache_fn;
     quicrq_manage_relay_subscribe_fn manage_relay_subscribe_fn;
     /* Extra repeat option */
     int extra_repeat_on_nack : 1;
     int extra_repeat_after_received_delayed : 1;
     uint64_t extra_repeat_delay;
+    /* Min heap of the datagrams scheduled for extra repeat, by extra_repeat_time */
+    struct st_quicrq_datagram_ack_state_t** extra_repeat_heap;
+    size_t extra_repeat_heap_size;
+    size_t nb_extra_repeat;
+    uint64_t extra_repeat_sequence;
+    /* Number of source fragments per FEC repair datagram, 0 if FEC is disabled */
+    size_t fec_window;
+    /* Pack several fragments in one datagram when possible */
+    int datagram_bundling;
+    /* Ask for, or accept to send, compact datagram headers */
+    int compact_datagram_header;
+    /* Uni stream contexts kept for reuse, chained by next_uni_stream_for_cnx */
+    struct st_quicrq_uni_stream_ctx_t* uni_stream_freelist;
+    size_t nb_uni_streams_free;
     /* Count of media fragments received with numbers < start point */
     uint64_t useless_fragments;
     /* Control how enable congestion control -- mostly for testability */
     quicrq_congestion_control_enum congestion_control_mode;
+    /* Trace of congestion epochs, allocated if enabled */
+    quicrq_congestion_trace_t* congestion_trace;
+    /* Track sets registered with quicrq_register_track_set */
+    quicrq_track_set_t* first_track_set;
 };
 
 quicrq_stream_ctx_t* quicrq_find_or_create_stream(
@@ -614,6 +938,15 @@ quicrq_stream_ctx_t* quicrq_find_or_create_stream(
     quicrq_cnx_ctx_t* cnx_ctx,
     int should_create);
 quicrq_stream_ctx_t* quicrq_create_stream_context(quicrq_cnx_ctx_t* cnx_ctx, uint64_t stream_id);
+int quicrq_datagram_index_stream(quicrq_stream_ctx_t* stream_ctx);
+quicrq_stream_ctx_t* quicrq_find_stream_ctx_for_datagram(quicrq_cnx_ctx_t* cnx_ctx, uint64_t media_id, int is_sender);
+void quicrq_datagram_ready_queue_add(quicrq_stream_ctx_t* stream_ctx);
+void quicrq_datagram_ready_queue_remove(quicrq_stream_ctx_t* stream_ctx);
+int quicrq_prepare_to_send_datagram(quicrq_cnx_ctx_t* cnx_ctx, void* context, size_t space, uint64_t current_time);
+void* quicrq_provide_datagram_buffer(quicrq_stream_ctx_t* stream_ctx, void* context, size_t length);
+int quicrq_receive_datagram(quicrq_cnx_ctx_t* cnx_ctx, const uint8_t* bytes, size_t length, uint64_t current_time);
+int quicrq_handle_datagram_ack_nack(quicrq_cnx_ctx_t* cnx_ctx, picoquic_call_back_event_t picoquic_event,
+    uint64_t send_time, const uint8_t* bytes, size_t length, uint64_t current_time);
 
 quicrq_uni_stream_ctx_t* quicrq_find_or_create_uni_stream(
     uint64_t stream_id,
@@ -622,9 +955,38 @@ quicrq_uni_stream_ctx_t* quicrq_find_or_create_uni_stream(
     int should_create);
 
 void quicrq_chain_uni_stream_to_control_stream(quicrq_uni_stream_ctx_t* uni_stream_ctx, quicrq_stream_ctx_t* stream_ctx);
+void quicrq_uni_stream_freelist_release(quicrq_ctx_t* qr_ctx);
+void quicrq_extra_repeat_heap_release(quicrq_ctx_t* qr_ctx);
+
+/* Forward error correction, see fec.c */
+uint64_t quicrq_fec_sender_sequence(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id);
+int quicrq_fec_sender_add(quicrq_stream_ctx_t* stream_ctx, uint64_t fec_sequence, uint64_t group_id, uint64_t object_id,
+    uint64_t object_offset, uint64_t object_length, uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group,
+    const uint8_t* data, size_t data_length);
+int quicrq_fec_sender_flush(quicrq_stream_ctx_t* stream_ctx);
+int quicrq_fec_sender_send_repair(quicrq_stream_ctx_t* stream_ctx, void* context, size_t space, int* media_was_sent);
+int quicrq_fec_receive_source(quicrq_stream_ctx_t* stream_ctx, uint64_t fec_sequence, uint64_t group_id, uint64_t object_id,
+    uint64_t object_offset, uint64_t object_length, uint64_t queue_delay, uint8_t flags, uint64_t nb_objects_previous_group,
+    const uint8_t* data, size_t data_length);
+int quicrq_fec_receive_repair(quicrq_stream_ctx_t* stream_ctx, uint64_t group_id, uint64_t first_fec_sequence, uint64_t nb_sources,
+    const uint8_t* repair, size_t repair_length, quicrq_fec_recovered_fragment_t* recovered);
+void quicrq_fec_release(quicrq_stream_ctx_t* stream_ctx);
 
 void quicrq_delete_stream_ctx(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t* stream_ctx);
 void quicrq_delete_uni_stream_ctx(quicrq_cnx_ctx_t* cnx_ctx, quicrq_uni_stream_ctx_t* stream_ctx);
+int quicrq_receive_warp_stream_reset(quicrq_cnx_ctx_t* cnx_ctx, quicrq_uni_stream_ctx_t* uni_stream_ctx, uint64_t error_code,
+    uint64_t current_time);
+
+/* Receive data on a control stream, or prepare to send the next control message */
+int quicrq_receive_stream_data(quicrq_stream_ctx_t* stream_ctx, uint8_t* bytes, size_t length, int is_fin);
+int quicrq_prepare_to_send_on_stream(quicrq_stream_ctx_t* stream_ctx, void* context, size_t space, uint64_t current_time);
+
+/* Prepare to send media data on a stream, as requested by picoquic */
+int quicrq_prepare_to_send_media_to_stream(quicrq_stream_ctx_t* stream_ctx, void* context, size_t space, uint64_t current_time);
+
+/* Prepare to send a warp header, object headers and object data on a warp or rush stream */
+int quicrq_prepare_to_send_on_unistream(quicrq_cnx_ctx_t* cnx_ctx, quicrq_uni_stream_ctx_t* uni_stream_ctx, void* context,
+    size_t space, uint64_t current_time);
 
 /* Encode and decode the object header */
 const uint8_t* quicr_decode_object_header(const uint8_t* fh, const uint8_t* fh_max, quicrq_media_object_header_t* hdr);
@@ -664,8 +1026,13 @@ void quicrq_log_message(quicrq_cnx_ctx_t* cnx_ctx, const char* fmt, ...);
 char quicrq_transport_mode_to_letter(quicrq_transport_mode_enum transport_mode);
 const char* quicrq_transport_mode_to_string(quicrq_transport_mode_enum transport_mode);
 
-/* Evaluation of congestion state */
-int quicrq_congestion_check_per_cnx(quicrq_cnx_ctx_t* cnx_ctx, uint8_t flags, int has_backlog, uint64_t current_time);
+/* Evaluation of congestion state.
+ * The backlog delay is the time spent in the queue by the object being evaluated.
+ */
+#define QUICRQ_CONGESTION_EPOCH_DEFAULT 50000
+#define QUICRQ_CONGESTION_EPOCH_MIN 5000
+#define QUICRQ_CONGESTION_EPOCH_MAX 500000
+int quicrq_congestion_check_per_cnx(quicrq_cnx_ctx_t* cnx_ctx, uint8_t flags, int has_backlog, uint64_t backlog_delay, uint64_t current_time);
 
 #ifdef __cplusplus
 }
@@ -51,8 +51,23 @@
 typedef struct st_quicrq_relay_consumer_context_t {
     quicrq_ctx_t* qr_ctx;
     quicrq_fragment_cache_t* cache_ctx;
+    quicrq_stream_ctx_t* stream_ctx; /* Stream on which the media is received */
 } quicrq_relay_consumer_context_t;
 
+int quicrq_relay_consumer_cb(
+    quicrq_media_consumer_enum action,
+    void* media_ctx,
+    uint64_t current_time,
+    const uint8_t* data,
+    uint64_t group_id,
+    uint64_t object_id,
+    uint64_t offset,
+    uint64_t queue_delay,
+    uint8_t flags,
+    uint64_t nb_objects_previous_group,
+    uint64_t object_length,
+    size_t data_length);
+
 typedef struct st_quicrq_relay_context_t {
     const char* sni;
     struct sockaddr_storage server_addr;
@@ -42,6 +42,8 @@ typedef struct st_quicrq_reassembly_object_t {
     uint64_t data_received;
     uint64_t last_update_time;
     uint8_t* reassembled;
+    int is_placeholder; /* Placeholder for an object that will not be received, not yet delivered */
+    int is_group_truncated; /* Placeholder marking the first object not received in a truncated group */
 } quicrq_reassembly_object_t;
 
 /* manage the splay of objects waiting reassembly */
@@ -216,6 +218,34 @@ static void quicrq_reassembly_object_delete(quicrq_reassembly_context_t* reassem
     free(object);
 }
 
+/* Replace an object that will not be received by a placeholder with flags 0xFF.
+ * A partially received copy of the object is dropped.
+ */
+static quicrq_reassembly_object_t* quicrq_reassembly_placeholder_create(quicrq_reassembly_context_t* reassembly_ctx,
+    uint64_t group_id, uint64_t object_id, uint64_t nb_objects_previous_group, uint64_t current_time)
+{
+    quicrq_reassembly_object_t* object = quicrq_object_find(reassembly_ctx, group_id, object_id);
+
+    if (object != NULL) {
+        quicrq_reassembly_object_delete(reassembly_ctx, object);
+    }
+    object = quicrq_reassembly_object_create(reassembly_ctx, group_id, object_id);
+    if (object != NULL) {
+        if ((object->reassembled = (uint8_t*)malloc(1)) == NULL) {
+            quicrq_reassembly_object_delete(reassembly_ctx, object);
+            object = NULL;
+        }
+        else {
+            object->flags = 0xff;
+            object->nb_objects_previous_group = nb_objects_previous_group;
+            object->is_last_received = 1;
+            object->is_placeholder = 1;
+            object->last_update_time = current_time;
+        }
+    }
+    return object;
+}
+
 static int quicrq_reassembly_object_add_packet(
     quicrq_reassembly_object_t* object,
     uint64_t current_time,
@@ -348,6 +378,30 @@ static int quicrq_reassembly_object_reassemble(quicrq_reassembly_object_t* objec
     return ret;
 }
 
+/* Move to the next group. If the current group was truncated, the objects that
+ * will never be received are first delivered as placeholders.
+ */
+static int quicrq_reassembly_next_group(quicrq_reassembly_context_t* reassembly_ctx,
+    uint64_t current_time,
+    uint64_t nb_objects,
+    quicrq_reassembly_object_ready_fn ready_fn,
+    void* app_media_ctx)
+{
+    int ret = 0;
+    uint8_t placeholder = 0;
+
+    while (ret == 0 && reassembly_ctx->is_group_truncated && reassembly_ctx->next_object_id < nb_objects) {
+        ret = ready_fn(app_media_ctx, current_time, reassembly_ctx->next_group_id, reassembly_ctx->next_object_id, 0xff,
+            &placeholder, 0, quicrq_reassembly_object_in_sequence);
+        reassembly_ctx->next_object_id++;
+    }
+    reassembly_ctx->next_group_id += 1;
+    reassembly_ctx->next_object_id = 0;
+    reassembly_ctx->is_group_truncated = 0;
+
+    return ret;
+}
+
 int quicrq_reassembly_update_start_point(quicrq_reassembly_context_t* reassembly_ctx,
     uint64_t current_time,
     quicrq_reassembly_object_ready_fn ready_fn,
@@ -361,7 +415,8 @@ int quicrq_reassembly_update_start_point(quicrq_reassembly_context_t* reassembly
     /* Objects are "in order" if one of two conditions is true:
     *  - The object with key "next group id" and "next object id" is present,
     *  - or, the object with key "next_group_id + 1" and value "next object id=0" is present, and
-    *    the number of objects in the previous group matches "next object id"
+    *    the number of objects in the previous group matches "next object id", or the
+    *    previous group was truncated.
     */
 
     while (ret == 0){
@@ -369,21 +424,24 @@ int quicrq_reassembly_update_start_point(quicrq_reassembly_context_t* reassembly
         if (object == NULL) {
             object = quicrq_object_find(reassembly_ctx, reassembly_ctx->next_group_id + 1, 0);
             if (object != NULL && object->reassembled != NULL &&
-                object->nb_objects_previous_group == reassembly_ctx->next_object_id) {
-                reassembly_ctx->next_group_id += 1;
-                reassembly_ctx->next_object_id = 0;
+                (object->nb_objects_previous_group == reassembly_ctx->next_object_id || reassembly_ctx->is_group_truncated)) {
+                ret = quicrq_reassembly_next_group(reassembly_ctx, current_time, object->nb_objects_previous_group,
+                    ready_fn, app_media_ctx);
             }
             else {
                 /* The next group start segment is present, but there is a gap. */
                 break;
             }
         }
-        if (object == NULL || object->reassembled == NULL) {
+        if (ret != 0 || object == NULL || object->reassembled == NULL) {
             break;
         } 
         /* Submit the object in order */
         ret = ready_fn(app_media_ctx, current_time, object->group_id, object->object_id, object->flags, object->reassembled,
-            (size_t)object->object_length, quicrq_reassembly_object_repair);
+            (size_t)object->object_length, (object->is_placeholder) ? quicrq_reassembly_object_in_sequence : quicrq_reassembly_object_repair);
+        if (object->is_group_truncated) {
+            reassembly_ctx->is_group_truncated = 1;
+        }
         /* delete the object that was just repaired. */
         quicrq_reassembly_object_delete(reassembly_ctx, object);
         /* update the next_object id */
@@ -423,6 +481,11 @@ int quicrq_reassembly_input(
     else {
         quicrq_reassembly_object_t* object = quicrq_object_find(reassembly_ctx, group_id, object_id);
 
+        if (object != NULL && object->reassembled == NULL && flags == 0xff && object_length == 0) {
+            /* A placeholder replaces an object that was only partially received */
+            quicrq_reassembly_object_delete(reassembly_ctx, object);
+            object = NULL;
+        }
         if (object == NULL) {
             /* Create a media object for reassembly */
             object = quicrq_reassembly_object_create(reassembly_ctx, group_id, object_id);
@@ -465,11 +528,11 @@ int quicrq_reassembly_input(
                     quicrq_reassembly_object_mode_enum object_mode;
                     if (group_id == reassembly_ctx->next_group_id + 1 &&
                         object_id == 0 &&
-                        object->nb_objects_previous_group <= reassembly_ctx->next_object_id) {
+                        (object->nb_objects_previous_group <= reassembly_ctx->next_object_id || reassembly_ctx->is_group_truncated)) {
                         /* This is the first object of a new group, and all objects of the previous group
-                         * have been received */
-                        reassembly_ctx->next_group_id += 1;
-                        reassembly_ctx->next_object_id = 0;
+                         * have been received, or will never be */
+                        ret = quicrq_reassembly_next_group(reassembly_ctx, current_time, object->nb_objects_previous_group,
+                            ready_fn, app_media_ctx);
                     }
 
                     object_mode = (
@@ -477,7 +540,7 @@ int quicrq_reassembly_input(
                         reassembly_ctx->next_object_id == object_id) ?
                         quicrq_reassembly_object_in_sequence : quicrq_reassembly_object_peek;
 
-                    if (object->reassembled == NULL) {
+                    if (ret == 0 && object->reassembled == NULL) {
                         /* Reassemble and verify -- maybe should do that in real time instead of at the end? */
                         ret = quicrq_reassembly_object_reassemble(object);
                         if (ret == 0) {
@@ -525,6 +588,74 @@ int quicrq_reassembly_learn_start_point(
     return ret;
 }
 
+int quicrq_reassembly_learn_group_truncated(
+    quicrq_reassembly_context_t* reassembly_ctx,
+    uint64_t group_id,
+    uint64_t object_id,
+    uint64_t nb_objects_previous_group,
+    uint64_t current_time,
+    quicrq_reassembly_object_ready_fn ready_fn,
+    void* app_media_ctx)
+{
+    int ret = 0;
+
+    if (group_id == reassembly_ctx->next_group_id && object_id < reassembly_ctx->next_object_id) {
+        object_id = reassembly_ctx->next_object_id;
+    }
+    if (group_id < reassembly_ctx->next_group_id) {
+        /* No need for this group. */
+    }
+    else {
+        /* Skip the objects already received, drop the partial one */
+        quicrq_reassembly_object_t* object = quicrq_object_find(reassembly_ctx, group_id, object_id);
+
+        while (object != NULL && object->reassembled != NULL) {
+            object_id++;
+            object = quicrq_object_find(reassembly_ctx, group_id, object_id);
+        }
+        /* Mark the truncation point by a placeholder object */
+        object = quicrq_reassembly_placeholder_create(reassembly_ctx, group_id, object_id,
+            (object_id == 0) ? nb_objects_previous_group : 0, current_time);
+        if (object == NULL) {
+            ret = -1;
+        }
+        else {
+            object->is_group_truncated = 1;
+            ret = quicrq_reassembly_update_start_point(reassembly_ctx, current_time, ready_fn, app_media_ctx);
+        }
+    }
+    return ret;
+}
+
+int quicrq_reassembly_learn_object_expired(
+    quicrq_reassembly_context_t* reassembly_ctx,
+    uint64_t group_id,
+    uint64_t object_id,
+    uint64_t nb_objects_previous_group,
+    uint64_t current_time,
+    quicrq_reassembly_object_ready_fn ready_fn,
+    void* app_media_ctx)
+{
+    int ret = 0;
+    quicrq_reassembly_object_t* object = NULL;
+
+    if (group_id < reassembly_ctx->next_group_id ||
+        (group_id == reassembly_ctx->next_group_id && object_id < reassembly_ctx->next_object_id)) {
+        /* No need for this object. */
+    }
+    else if ((object = quicrq_object_find(reassembly_ctx, group_id, object_id)) != NULL && object->reassembled != NULL) {
+        /* The object was fully received before the sender abandoned it. */
+    }
+    else if (quicrq_reassembly_placeholder_create(reassembly_ctx, group_id, object_id, nb_objects_previous_group,
+        current_time) == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = quicrq_reassembly_update_start_point(reassembly_ctx, current_time, ready_fn, app_media_ctx);
+    }
+    return ret;
+}
+
 int quicrq_reassembly_learn_final_object_id(
     quicrq_reassembly_context_t* reassembly_ctx,
     uint64_t final_group_id,
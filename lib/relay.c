@@ -57,6 +57,10 @@ int quicrq_relay_consumer_cb(
          /* Add fragment (or fragments) to cache */
         ret = quicrq_fragment_propose_to_cache(cons_ctx->cache_ctx, data, 
             group_id, object_id, offset, queue_delay, flags, nb_objects_previous_group, object_length, data_length, current_time);
+        /* Ask the upstream sender to repair the data that is still missing */
+        if (ret == 0) {
+            ret = quicrq_fragment_cache_check_repair(cons_ctx->cache_ctx, current_time);
+        }
         /* Manage fin of transmission */
         if (ret == 0) {
             /* If the final group id and object id are known, and the next expected
@@ -83,10 +87,34 @@ int quicrq_relay_consumer_cb(
         /* Set the cache policy to real time for the media, and then for all subscribed groups */
         ret = quicrq_fragment_cache_set_real_time_cache(cons_ctx->cache_ctx);
         break;
+    case quicrq_media_latency_budget:
+        /* Apply the budget of the publisher to the subscribers of the relay, and forward it */
+        ret = quicrq_fragment_cache_set_latency_budget(cons_ctx->cache_ctx, queue_delay);
+        break;
     case quicrq_media_start_point:
         /* Document the start point, and clean the cache of data before that point */
         ret = quicrq_fragment_cache_learn_start_point(cons_ctx->cache_ctx, group_id, object_id);
         break;
+    case quicrq_media_group_truncated:
+        /* The missing objects of the group will be cached as placeholders */
+        ret = quicrq_fragment_cache_learn_group_truncated(cons_ctx->cache_ctx, group_id, object_id, nb_objects_previous_group,
+            current_time);
+        if (ret == 0 && (cons_ctx->cache_ctx->final_group_id > 0 || cons_ctx->cache_ctx->final_object_id > 0) &&
+            cons_ctx->cache_ctx->next_group_id == cons_ctx->cache_ctx->final_group_id &&
+            cons_ctx->cache_ctx->next_object_id == cons_ctx->cache_ctx->final_object_id) {
+            ret = quicrq_consumer_finished;
+        }
+        break;
+    case quicrq_media_object_expired:
+        /* Pass the expiration to the rush streams of the relay, or cache a placeholder */
+        ret = quicrq_fragment_cache_learn_object_expired(cons_ctx->cache_ctx, group_id, object_id, nb_objects_previous_group,
+            current_time);
+        if (ret == 0 && (cons_ctx->cache_ctx->final_group_id > 0 || cons_ctx->cache_ctx->final_object_id > 0) &&
+            cons_ctx->cache_ctx->next_group_id == cons_ctx->cache_ctx->final_group_id &&
+            cons_ctx->cache_ctx->next_object_id == cons_ctx->cache_ctx->final_object_id) {
+            ret = quicrq_consumer_finished;
+        }
+        break;
     case quicrq_media_close:
         /* Document the final object */
         if (cons_ctx->cache_ctx->final_group_id == 0 && cons_ctx->cache_ctx->final_object_id == 0) {
@@ -107,17 +135,9 @@ int quicrq_relay_consumer_cb(
                 /* find the last object that was fully received. If there is none,
                  * leave the final_group_id and final_object_id
                  */
-                quicrq_cached_fragment_t key = { 0 };
-                picosplay_node_t* fragment_node = NULL;
-                quicrq_cached_fragment_t* fragment = NULL;
-
-                key.group_id = cons_ctx->cache_ctx->next_group_id;
-                key.object_id = 0;
-                key.offset = 0;
-                fragment_node = picosplay_find_previous(&cons_ctx->cache_ctx->fragment_tree, &key);
-                if (fragment_node != NULL) {
-                    fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(fragment_node);
-                }
+                quicrq_cached_fragment_t* fragment = quicrq_fragment_cache_find_previous(cons_ctx->cache_ctx,
+                    cons_ctx->cache_ctx->next_group_id, 0, 0);
+
                 if (fragment != NULL) {
                     cons_ctx->cache_ctx->final_group_id = fragment->group_id;
                     cons_ctx->cache_ctx->final_object_id = fragment->object_id;
@@ -132,6 +152,9 @@ int quicrq_relay_consumer_cb(
             /* Nothing? */
         }
         cons_ctx->cache_ctx->is_feed_closed = 1;
+        if (cons_ctx->cache_ctx->upstream_stream_ctx == cons_ctx->stream_ctx) {
+            cons_ctx->cache_ctx->upstream_stream_ctx = NULL;
+        }
         
         /* Set the target delete date */
         /* Notify consumers of the stream */
@@ -231,6 +254,8 @@ int quicrq_relay_default_source_fn(void* default_source_ctx, quicrq_ctx_t* qr_ct
                         /* Document the stream ID for that cache */
                         char buffer[256];
                         cache_ctx->subscribe_stream_id = relay_ctx->cnx_ctx->last_stream->stream_id; 
+                        cons_ctx->stream_ctx = relay_ctx->cnx_ctx->last_stream;
+                        cache_ctx->upstream_stream_ctx = cons_ctx->stream_ctx;
                         picoquic_log_app_message(relay_ctx->cnx_ctx->cnx, "Asking server for URL: %s on stream %" PRIu64,
                             quicrq_uint8_t_to_text(url, url_length, buffer, 256), cache_ctx->subscribe_stream_id);
                     }
@@ -325,6 +350,8 @@ int quicrq_relay_consumer_init_callback(quicrq_stream_ctx_t* stream_ctx, const u
                     char buffer[256];
 
                     cons_ctx->cache_ctx = cache_ctx;
+                    cons_ctx->stream_ctx = stream_ctx;
+                    cache_ctx->upstream_stream_ctx = stream_ctx;
                     ret = quicrq_set_media_stream_ctx(stream_ctx, quicrq_relay_consumer_cb, cons_ctx);
                     picoquic_log_app_message(stream_ctx->cnx_ctx->cnx, "Posting URL: %s to server on stream %" PRIu64,
                         quicrq_uint8_t_to_text(url, url_length, buffer, 256), stream_ctx->stream_id);
@@ -348,15 +375,8 @@ int quicrq_relay_subscribe_notify(void* notify_ctx, const uint8_t* url, size_t u
     /* Retrieve the relay context */
     quicrq_ctx_t* qr_ctx = (quicrq_ctx_t*)notify_ctx;
     /* Find whether there is already a source with that name */
-    quicrq_media_source_ctx_t* srce_ctx = qr_ctx->first_source;
+    quicrq_media_source_ctx_t* srce_ctx = quicrq_find_local_media_source(qr_ctx, url, url_length);
 
-    while (srce_ctx != NULL) {
-        if (srce_ctx->media_url_length == url_length &&
-            memcmp(srce_ctx->media_url, url, url_length) == 0) {
-            break;
-        }
-        srce_ctx = srce_ctx->next_source;
-    }
     if (srce_ctx == NULL) {
         /* If there is not, add the corresponding file to the catch, as
          * if a subscribe to a file had been received. */
@@ -389,25 +409,22 @@ void quicrq_relay_subscribe_pattern(quicrq_ctx_t* qr_ctx, quicrq_subscribe_actio
     if (action == quicrq_subscribe_action_unsubscribe) {
         if (qr_ctx->relay_ctx->cnx_ctx != NULL) {
             /* Check whether there is still a client connection subscribed to this pattern */
-            quicrq_cnx_ctx_t* cnx_ctx = qr_ctx->first_cnx;
+            quicrq_prefix_node_t* prefix_node = quicrq_prefix_trie_find(qr_ctx, url, url_length);
             int is_subscribed = 0;
-            while (cnx_ctx != NULL && !is_subscribed) {
-                /* Only examine the connections to this relay */
-                if (cnx_ctx->is_server) {
-                    quicrq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
-                    while (stream_ctx != NULL) {
-                        if (stream_ctx->send_state == quicrq_notify_ready &&
-                            stream_ctx->subscribe_prefix_length == url_length &&
-                            memcmp(stream_ctx->subscribe_prefix, url, url_length) == 0) {
-                            is_subscribed = 1;
-                            break;
-                        }
-                        stream_ctx = stream_ctx->next_stream;
+            if (prefix_node != NULL) {
+                quicrq_stream_ctx_t* stream_ctx = prefix_node->first_stream;
+                while (stream_ctx != NULL) {
+                    /* Only examine the connections to this relay */
+                    if (stream_ctx->cnx_ctx->is_server &&
+                        (stream_ctx->send_state == quicrq_notify_ready || stream_ctx->send_state == quicrq_sending_notify)) {
+                        is_subscribed = 1;
+                        break;
                     }
+                    stream_ctx = stream_ctx->next_stream_for_prefix;
                 }
             }
-            /* Find the outgoing stream for that pattern and close it. */
-            if (is_subscribed) {
+            /* If there is none, find the outgoing stream for that pattern and close it. */
+            if (!is_subscribed) {
                 quicrq_stream_ctx_t* stream_ctx = quicrq_relay_find_subscription(qr_ctx, url, url_length);
                 if (stream_ctx != NULL) {
                     int ret = quicrq_cnx_subscribe_pattern_close(qr_ctx->relay_ctx->cnx_ctx, stream_ctx);
@@ -496,7 +513,8 @@ void quicrq_disable_relay(quicrq_ctx_t* qr_ctx)
 }
 
 /* Management of the relay cache.
- * Ensure that old segments are removed.
+ * Ensure that old segments are removed, and that the cache memory
+ * stays within budget.
  */
 uint64_t quicrq_manage_relay_cache(quicrq_ctx_t* qr_ctx, uint64_t current_time)
 {
@@ -596,6 +614,10 @@ int quicrq_origin_consumer_init_callback(quicrq_stream_ctx_t* stream_ctx, const
         if (ret == 0) {
             /* set the parameter in the stream context. */
             cons_ctx->cache_ctx = cache_ctx;
+            cons_ctx->stream_ctx = stream_ctx;
+            if (cache_ctx != NULL) {
+                cache_ctx->upstream_stream_ctx = stream_ctx;
+            }
             ret = quicrq_set_media_stream_ctx(stream_ctx, quicrq_relay_consumer_cb, cons_ctx);
         }
 
@@ -0,0 +1,199 @@
+/* Selection of quality layers for track sets */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "picoquic_utils.h"
+#include "quicrq.h"
+#include "quicrq_internal.h"
+#include "quicrq_fragment.h"
+
+/* A track set groups the quality layers of a simulcast or SVC media, each
+ * published as a separate media with its own URL, under the URL of the
+ * logical media. The layers are kept sorted by increasing bitrate.
+ *
+ * A subscription to the track set URL is served from the cache of one of
+ * the layers. The layer is selected when the subscription starts, and then
+ * reevaluated each time the publisher reaches the end of a group: the
+ * publisher only moves to another layer if that layer has the first object
+ * of the next group, so the subscriber always receives complete groups.
+ * The selected layer is the highest one whose bitrate fits the bandwidth
+ * estimate of the connection. Moving to a higher layer requires an extra
+ * margin of QUICRQ_TRACK_SET_UP_SWITCH_MARGIN percent, so that small
+ * variations of the estimate do not cause the subscriber to oscillate
+ * between two layers.
+ */
+
+static void quicrq_track_set_delete(quicrq_track_set_t* track_set)
+{
+    if (track_set->layers != NULL) {
+        for (size_t i = 0; i < track_set->nb_layers; i++) {
+            if (track_set->layers[i].url != NULL) {
+                free(track_set->layers[i].url);
+            }
+        }
+        free(track_set->layers);
+    }
+    if (track_set->url != NULL) {
+        free(track_set->url);
+    }
+    free(track_set);
+}
+
+quicrq_track_set_t* quicrq_find_track_set(quicrq_ctx_t* qr_ctx, const uint8_t* url, size_t url_length)
+{
+    quicrq_track_set_t* track_set = qr_ctx->first_track_set;
+
+    while (track_set != NULL) {
+        if (track_set->url_length == url_length && memcmp(track_set->url, url, url_length) == 0) {
+            break;
+        }
+        track_set = track_set->next_track_set;
+    }
+    return track_set;
+}
+
+int quicrq_register_track_set(quicrq_ctx_t* qr_ctx, const uint8_t* url, size_t url_length, size_t nb_layers,
+    const uint8_t** layer_urls, const size_t* layer_url_lengths, const uint64_t* layer_bitrates)
+{
+    int ret = 0;
+    quicrq_track_set_t* track_set = NULL;
+
+    if (nb_layers == 0 || quicrq_find_track_set(qr_ctx, url, url_length) != NULL) {
+        ret = -1;
+    }
+    else if ((track_set = (quicrq_track_set_t*)malloc(sizeof(quicrq_track_set_t))) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(track_set, 0, sizeof(quicrq_track_set_t));
+        track_set->url = (uint8_t*)malloc(url_length);
+        track_set->layers = (quicrq_track_layer_t*)malloc(nb_layers * sizeof(quicrq_track_layer_t));
+        if (track_set->url == NULL || track_set->layers == NULL) {
+            ret = -1;
+        }
+        else {
+            memcpy(track_set->url, url, url_length);
+            track_set->url_length = url_length;
+            memset(track_set->layers, 0, nb_layers * sizeof(quicrq_track_layer_t));
+            for (size_t i = 0; ret == 0 && i < nb_layers; i++) {
+                /* Insert the layer in order of increasing bitrate */
+                size_t j = track_set->nb_layers;
+                uint8_t* layer_url = (uint8_t*)malloc(layer_url_lengths[i]);
+
+                if (layer_url == NULL) {
+                    ret = -1;
+                }
+                else {
+                    memcpy(layer_url, layer_urls[i], layer_url_lengths[i]);
+                    while (j > 0 && track_set->layers[j - 1].bitrate > layer_bitrates[i]) {
+                        track_set->layers[j] = track_set->layers[j - 1];
+                        j--;
+                    }
+                    track_set->layers[j].url = layer_url;
+                    track_set->layers[j].url_length = layer_url_lengths[i];
+                    track_set->layers[j].bitrate = layer_bitrates[i];
+                    track_set->nb_layers++;
+                }
+            }
+        }
+        if (ret == 0) {
+            track_set->next_track_set = qr_ctx->first_track_set;
+            qr_ctx->first_track_set = track_set;
+        }
+        else {
+            quicrq_track_set_delete(track_set);
+        }
+    }
+    return ret;
+}
+
+void quicrq_track_set_release(quicrq_ctx_t* qr_ctx)
+{
+    while (qr_ctx->first_track_set != NULL) {
+        quicrq_track_set_t* track_set = qr_ctx->first_track_set;
+        qr_ctx->first_track_set = track_set->next_track_set;
+        quicrq_track_set_delete(track_set);
+    }
+}
+
+/* The bandwidth estimate is derived from the pacing rate of the connection,
+ * which picoquic computes from the delivery rate measured by the congestion
+ * control algorithm. The estimate is expressed in bits per second.
+ */
+uint64_t quicrq_track_set_bandwidth_estimate(quicrq_cnx_ctx_t* cnx_ctx)
+{
+    uint64_t bandwidth_estimate = UINT64_MAX;
+
+    if (cnx_ctx->cnx != NULL) {
+        uint64_t pacing_rate = picoquic_get_pacing_rate(cnx_ctx->cnx);
+        if (pacing_rate < UINT64_MAX / 8) {
+            bandwidth_estimate = 8 * pacing_rate;
+        }
+    }
+    return bandwidth_estimate;
+}
+
+size_t quicrq_track_set_select_layer(const quicrq_track_set_t* track_set, size_t current_layer, uint64_t bandwidth_estimate)
+{
+    size_t layer = 0;
+
+    for (size_t i = 1; i < track_set->nb_layers; i++) {
+        uint64_t bitrate = track_set->layers[i].bitrate;
+        if (i > current_layer) {
+            bitrate += (bitrate / 100) * QUICRQ_TRACK_SET_UP_SWITCH_MARGIN;
+        }
+        if (bitrate > bandwidth_estimate) {
+            break;
+        }
+        layer = i;
+    }
+    return layer;
+}
+
+/* Find the source of a layer. If the layer is not available locally, for
+ * example when a relay has not yet fetched it, the default source function
+ * is called to start fetching it, so the layer becomes available at a later
+ * group boundary.
+ */
+quicrq_media_source_ctx_t* quicrq_track_set_layer_source(quicrq_ctx_t* qr_ctx, const quicrq_track_set_t* track_set, size_t layer)
+{
+    quicrq_media_source_ctx_t* srce_ctx = quicrq_find_local_media_source(qr_ctx,
+        track_set->layers[layer].url, track_set->layers[layer].url_length);
+
+    if (srce_ctx == NULL && qr_ctx->default_source_fn != NULL) {
+        srce_ctx = quicrq_create_default_source(qr_ctx, track_set->layers[layer].url, track_set->layers[layer].url_length);
+    }
+    return srce_ctx;
+}
+
+/* Called by the stream publisher when it is about to start the group group_id,
+ * of which next_group_fragment is the first fragment in the current layer.
+ * Returns the first fragment of that group in the layer that will be used.
+ */
+quicrq_cached_fragment_t* quicrq_track_set_next_group(quicrq_fragment_publisher_context_t* media_ctx, uint64_t group_id,
+    quicrq_cached_fragment_t* next_group_fragment)
+{
+    quicrq_stream_ctx_t* stream_ctx = media_ctx->stream_ctx;
+    size_t layer = quicrq_track_set_select_layer(media_ctx->track_set, media_ctx->track_layer,
+        quicrq_track_set_bandwidth_estimate(stream_ctx->cnx_ctx));
+
+    if (layer != media_ctx->track_layer) {
+        quicrq_media_source_ctx_t* srce_ctx = quicrq_track_set_layer_source(stream_ctx->cnx_ctx->qr_ctx,
+            media_ctx->track_set, layer);
+        quicrq_cached_fragment_t* layer_fragment = (srce_ctx == NULL || srce_ctx->cache_ctx == NULL) ? NULL :
+            quicrq_fragment_cache_get_fragment(srce_ctx->cache_ctx, group_id, 0, 0);
+
+        if (layer_fragment != NULL && quicrq_fragment_publisher_set_cache(media_ctx, srce_ctx->cache_ctx) == 0) {
+            char buffer[256];
+
+            quicrq_unsubscribe_local_media(stream_ctx);
+            quicrq_link_local_media(stream_ctx, srce_ctx);
+            quicrq_log_message(stream_ctx->cnx_ctx, "Stream %" PRIu64 ", group %" PRIu64 " from layer %d: %s",
+                stream_ctx->stream_id, group_id, (int)layer,
+                quicrq_uint8_t_to_text(srce_ctx->media_url, srce_ctx->media_url_length, buffer, 256));
+            media_ctx->track_layer = layer;
+            next_group_fragment = layer_fragment;
+        }
+    }
+    return next_group_fragment;
+}
@@ -24,6 +24,8 @@ typedef enum {
 static const quicrq_test_def_t test_table[] =
 {
     { "proto_msg", proto_msg_test},
+    { "proto_datagram_header", proto_datagram_header_test },
+    { "proto_source_lookup", proto_source_lookup_test },
     { "basic", quicrq_basic_test },
     { "basic_rt", quicrq_basic_rt_test },
     { "congestion_basic", quicrq_congestion_basic_test },
@@ -49,6 +51,8 @@ static const quicrq_test_def_t test_table[] =
     { "datagram_client", quicrq_datagram_client_test },
     { "datagram_limit", quicrq_datagram_limit_test },
     { "datagram_unsubscribe", quicrq_datagram_unsubscribe_test },
+    { "datagram_index", quicrq_datagram_index_test },
+    { "stream_index", quicrq_stream_index_test },
     { "twomedia", quicrq_twomedia_test },
     { "twomedia_datagram", quicrq_twomedia_datagram_test },
     { "twomedia_datagram_loss", quicrq_twomedia_datagram_loss_test },
@@ -68,6 +72,8 @@ static const quicrq_test_def_t test_table[] =
     { "subscribe_relay1", quicrq_subscribe_relay1_test },
     { "subscribe_relay2", quicrq_subscribe_relay2_test },
     { "subscribe_relay3", quicrq_subscribe_relay3_test },
+    { "subscribe_prefix_trie", quicrq_subscribe_prefix_trie_test },
+    { "subscribe_relay_unsubscribe", quicrq_subscribe_relay_unsubscribe_test },
     { "triangle_basic", quicrq_triangle_basic_test },
     { "triangle_basic_loss", quicrq_triangle_basic_loss_test },
     { "triangle_datagram", quicrq_triangle_datagram_test },
@@ -105,6 +111,10 @@ static const quicrq_test_def_t test_table[] =
     { "twoways_basic", quicrq_twoways_basic_test },
     { "twoways_datagram", quicrq_twoways_datagram_test },
     { "twoways_datagram_loss", quicrq_twoways_datagram_loss_test },
+    { "twoways_warp", quicrq_twoways_warp_test },
+    { "twoways_warp_loss", quicrq_twoways_warp_loss_test },
+    { "twoways_rush", quicrq_twoways_rush_test },
+    { "twoways_rush_loss", quicrq_twoways_rush_loss_test },
     { "twomedia_tri_stream", quicrq_twomedia_tri_stream_test },
     { "twomedia_tri_datagram", quicrq_twomedia_tri_datagram_test },
     { "twomedia_tri_later", quicrq_twomedia_tri_later_test },
@@ -117,6 +127,26 @@ static const quicrq_test_def_t test_table[] =
     { "fourlegs_datagram_last", quicrq_fourlegs_datagram_last_test },
     { "fourlegs_datagram_loss", quicrq_fourlegs_datagram_loss_test },
     { "fragment_cache_fill", quicrq_fragment_cache_fill_test },
+    { "fragment_cache_bench", quicrq_fragment_cache_bench_test },
+    { "fragment_cache_slab", quicrq_fragment_cache_slab_test },
+    { "fragment_cache_purge", quicrq_fragment_cache_purge_test },
+    { "fragment_cache_deferred_release", quicrq_fragment_cache_deferred_release_test },
+    { "fragment_cache_memory_limit", quicrq_fragment_cache_memory_limit_test },
+    { "fragment_cache_source_delete", quicrq_fragment_cache_source_delete_test },
+    { "fragment_stream_send_bench", quicrq_fragment_stream_send_bench_test },
+    { "fragment_stream_send", quicrq_fragment_stream_send_test },
+    { "fragment_cache_append", quicrq_fragment_cache_append_test },
+    { "fragment_cache_ranges", quicrq_fragment_cache_ranges_test },
+    { "fragment_cache_readers", quicrq_fragment_cache_readers_test },
+    { "datagram_scheduler", quicrq_datagram_scheduler_test },
+    { "datagram_fec", quicrq_datagram_fec_test },
+    { "datagram_bundle", quicrq_datagram_bundle_test },
+    { "extra_repeat_heap", quicrq_extra_repeat_heap_test },
+    { "track_set", quicrq_track_set_test },
+    { "latency_budget", quicrq_latency_budget_test },
+    { "group_truncated", quicrq_group_truncated_test },
+    { "object_ttl", quicrq_object_ttl_test },
+    { "repair_request", quicrq_repair_request_test },
     { "get_addr", quicrq_get_addr_test },
     { "warp_basic", quicrq_warp_basic_test },
     { "warp_basic_client", quicrq_warp_basic_client_test },
@@ -131,11 +161,14 @@ static const quicrq_test_def_t test_table[] =
     { "rush_basic", quicrq_rush_basic_test },
     { "rush_basic_client", quicrq_rush_basic_client_test },
     { "rush_basic_loss", quicrq_rush_basic_loss_test },
+    { "rush_relay", quicrq_rush_relay_test },
+    { "rush_relay_loss", quicrq_rush_relay_loss_test },
     { "rush_triangle", quicrq_triangle_rush_test },
     { "congestion_rush", quicrq_congestion_rush_test },
     { "congestion_rush_g", quicrq_congestion_rush_g_test },
     { "congestion_rush_gs", quicrq_congestion_rush_gs_test },
-    { "congestion_rush_zero_s", quicrq_congestion_rush_zero_s_test }
+    { "congestion_rush_zero_s", quicrq_congestion_rush_zero_s_test },
+    { "congestion_epoch", quicrq_congestion_epoch_test }
 };
 
 static size_t const nb_tests = sizeof(test_table) / sizeof(quicrq_test_def_t);
@@ -780,3 +780,222 @@ int quicrq_get_addr_test()
 
     return ret;
 }
+
+/* Datagram index test.
+ * Create many datagram streams on a connection, in both directions, mixed
+ * with single stream media, and verify that datagrams are mapped to the
+ * right stream by the index, including after some streams are deleted.
+ */
+#define DATAGRAM_INDEX_NB_MEDIA 200
+#define DATAGRAM_INDEX_NB_LOOKUPS 1000000
+
+static int quicrq_datagram_index_check(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t** streams, int step)
+{
+    int ret = 0;
+
+    for (uint64_t i = 0; ret == 0 && i < 2 * DATAGRAM_INDEX_NB_MEDIA; i++) {
+        quicrq_stream_ctx_t* expected = ((i % 5) == 4) ? NULL : streams[i];
+        if (quicrq_find_stream_ctx_for_datagram(cnx_ctx, i / 2, (int)(i & 1)) != expected) {
+            DBG_PRINTF("Step %d, wrong stream for media %" PRIu64 ", sender %d", step, i / 2, (int)(i & 1));
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int quicrq_datagram_index_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    quicrq_stream_ctx_t* streams[2 * DATAGRAM_INDEX_NB_MEDIA];
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+
+    memset(streams, 0, sizeof(streams));
+    if (cnx_ctx == NULL) {
+        ret = -1;
+    }
+
+    /* Create one stream per media and direction. Every fifth one uses single stream mode,
+     * with the same media_id, and shall not be found by datagrams. */
+    for (uint64_t i = 0; ret == 0 && i < 2 * DATAGRAM_INDEX_NB_MEDIA; i++) {
+        if ((streams[i] = quicrq_create_stream_context(cnx_ctx, 4 * i)) == NULL) {
+            ret = -1;
+        }
+        else {
+            streams[i]->media_id = i / 2;
+            streams[i]->is_sender = (i & 1);
+            streams[i]->transport_mode = ((i % 5) == 4) ? quicrq_transport_mode_single_stream : quicrq_transport_mode_datagram;
+            ret = quicrq_datagram_index_stream(streams[i]);
+        }
+    }
+
+    if (ret == 0) {
+        ret = quicrq_datagram_index_check(cnx_ctx, streams, 0);
+    }
+
+    if (ret == 0) {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+
+        for (int i = 0; ret == 0 && i < DATAGRAM_INDEX_NB_LOOKUPS; i++) {
+            uint64_t media_id = (uint64_t)((i * 7) % DATAGRAM_INDEX_NB_MEDIA);
+            if (quicrq_find_stream_ctx_for_datagram(cnx_ctx, media_id, 0) == NULL && (media_id % 5) != 2) {
+                ret = -1;
+            }
+        }
+        duration = picoquic_current_time() - start_time;
+        DBG_PRINTF("%d datagram lookups over %d media in %" PRIu64 " us", DATAGRAM_INDEX_NB_LOOKUPS, DATAGRAM_INDEX_NB_MEDIA, duration);
+    }
+
+    if (ret == 0) {
+        /* Delete every third stream */
+        for (size_t i = 0; i < 2 * DATAGRAM_INDEX_NB_MEDIA; i += 3) {
+            quicrq_delete_stream_ctx(cnx_ctx, streams[i]);
+            streams[i] = NULL;
+        }
+        ret = quicrq_datagram_index_check(cnx_ctx, streams, 1);
+    }
+
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+/* Stream index test.
+ * Create many control streams and unidirectional streams on a connection,
+ * as happens in warp and rush modes, and verify that they are found by
+ * stream id, that deleted streams are not found, and that the contexts of
+ * deleted unidirectional streams are reused.
+ */
+#define STREAM_INDEX_NB_STREAMS 100
+#define STREAM_INDEX_NB_UNI_STREAMS 4000
+#define STREAM_INDEX_NB_LOOKUPS 1000000
+
+static int quicrq_stream_index_check(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t** streams, quicrq_uni_stream_ctx_t** uni_streams, int step)
+{
+    int ret = 0;
+
+    for (uint64_t i = 0; ret == 0 && i < STREAM_INDEX_NB_STREAMS; i++) {
+        if (quicrq_find_or_create_stream(4 * i, cnx_ctx, 0) != streams[i]) {
+            DBG_PRINTF("Step %d, wrong context for stream %" PRIu64, step, 4 * i);
+            ret = -1;
+        }
+    }
+    for (uint64_t i = 0; ret == 0 && i < STREAM_INDEX_NB_UNI_STREAMS; i++) {
+        if (quicrq_find_or_create_uni_stream(4 * i + 2, cnx_ctx, NULL, 0) != uni_streams[i]) {
+            DBG_PRINTF("Step %d, wrong context for uni stream %" PRIu64, step, 4 * i + 2);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int quicrq_stream_index_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    quicrq_stream_ctx_t* streams[STREAM_INDEX_NB_STREAMS];
+    quicrq_uni_stream_ctx_t** uni_streams = (quicrq_uni_stream_ctx_t**)malloc(STREAM_INDEX_NB_UNI_STREAMS * sizeof(quicrq_uni_stream_ctx_t*));
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+
+    memset(streams, 0, sizeof(streams));
+    if (cnx_ctx == NULL || uni_streams == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(uni_streams, 0, STREAM_INDEX_NB_UNI_STREAMS * sizeof(quicrq_uni_stream_ctx_t*));
+    }
+
+    for (uint64_t i = 0; ret == 0 && i < STREAM_INDEX_NB_STREAMS; i++) {
+        if ((streams[i] = quicrq_find_or_create_stream(4 * i, cnx_ctx, 1)) == NULL) {
+            ret = -1;
+        }
+    }
+    for (uint64_t i = 0; ret == 0 && i < STREAM_INDEX_NB_UNI_STREAMS; i++) {
+        if ((uni_streams[i] = quicrq_find_or_create_uni_stream(4 * i + 2, cnx_ctx, streams[i % STREAM_INDEX_NB_STREAMS], 1)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = quicrq_stream_index_check(cnx_ctx, streams, uni_streams, 0);
+    }
+
+    if (ret == 0) {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+
+        for (int i = 0; ret == 0 && i < STREAM_INDEX_NB_LOOKUPS; i++) {
+            uint64_t uni_rank = (uint64_t)((i * 7) % STREAM_INDEX_NB_UNI_STREAMS);
+            if (quicrq_find_or_create_uni_stream(4 * uni_rank + 2, cnx_ctx, NULL, 0) != uni_streams[uni_rank]) {
+                ret = -1;
+            }
+        }
+        duration = picoquic_current_time() - start_time;
+        DBG_PRINTF("%d uni stream lookups over %d streams in %" PRIu64 " us", STREAM_INDEX_NB_LOOKUPS, STREAM_INDEX_NB_UNI_STREAMS, duration);
+    }
+
+    if (ret == 0) {
+        /* Delete every other uni stream, then check that the index is updated */
+        quicrq_uni_stream_ctx_t* first_deleted = uni_streams[0];
+        int is_reused = 0;
+
+        for (size_t i = 0; i < STREAM_INDEX_NB_UNI_STREAMS; i += 2) {
+            quicrq_delete_uni_stream_ctx(cnx_ctx, uni_streams[i]);
+            uni_streams[i] = NULL;
+        }
+        ret = quicrq_stream_index_check(cnx_ctx, streams, uni_streams, 1);
+        /* Recreate the deleted streams. The first deleted context went to the
+         * free list, and shall be reused. */
+        for (size_t i = 0; ret == 0 && i < STREAM_INDEX_NB_UNI_STREAMS; i += 2) {
+            if ((uni_streams[i] = quicrq_find_or_create_uni_stream(4 * i + 2, cnx_ctx, streams[i % STREAM_INDEX_NB_STREAMS], 1)) == NULL) {
+                ret = -1;
+            }
+            else if (uni_streams[i]->control_stream_ctx != streams[i % STREAM_INDEX_NB_STREAMS] ||
+                uni_streams[i]->message_buffer.nb_bytes_read != 0 || uni_streams[i]->send_state != 0) {
+                DBG_PRINTF("Uni stream %zu not properly reset", i);
+                ret = -1;
+            }
+            else if (uni_streams[i] == first_deleted) {
+                is_reused = 1;
+            }
+        }
+        if (ret == 0 && !is_reused) {
+            DBG_PRINTF("%s", "Uni stream context was not reused");
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = quicrq_stream_index_check(cnx_ctx, streams, uni_streams, 2);
+        }
+    }
+
+    if (ret == 0) {
+        /* Delete some control streams */
+        for (size_t i = 0; i < STREAM_INDEX_NB_STREAMS; i += 3) {
+            quicrq_delete_stream_ctx(cnx_ctx, streams[i]);
+            streams[i] = NULL;
+        }
+        for (size_t i = 0; ret == 0 && i < STREAM_INDEX_NB_STREAMS; i++) {
+            if (quicrq_find_or_create_stream(4 * i, cnx_ctx, 0) != streams[i]) {
+                DBG_PRINTF("Wrong context for stream %zu after deletion", 4 * i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    if (uni_streams != NULL) {
+        free(uni_streams);
+    }
+
+    return ret;
+}
@@ -4,6 +4,8 @@
 #include "quicrq.h"
 #include "quicrq_relay.h"
 #include "quicrq_internal.h"
+#include "quicrq_relay_internal.h"
+#include "quicrq_fragment.h"
 #include "quicrq_test_internal.h"
 
 /* Triangle test
@@ -75,8 +77,9 @@ quicrq_test_config_t* quicrq_test_congestion_config_create(quicrq_congestion_tes
             ret = -1;
         }
 
-        for (int i = 0; i < 3; i++) {
+        for (int i = 0; ret == 0 && i < 3; i++) {
             quicrq_enable_congestion_control(config->nodes[i], spec->congestion_control_mode);
+            ret = quicrq_enable_congestion_trace(config->nodes[i], 1);
         }
     }
 
@@ -136,6 +139,40 @@ quicrq_test_config_t* quicrq_test_congestion_config_create(quicrq_congestion_tes
     return config;
 }
 
+/* Verify the congestion trace of the node sending on the congested link.
+ * Delay based congestion control shall report epochs if drops are expected,
+ * with durations within the allowed range, and thresholds no lower than 0x80.
+ */
+static int quicrq_congestion_trace_check(quicrq_test_config_t* config, quicrq_congestion_test_t* spec)
+{
+    int ret = 0;
+    quicrq_congestion_trace_t* trace = config->nodes[(spec->congested_receiver) ? 0 : 1]->congestion_trace;
+    uint64_t nb_drops = 0;
+
+    if (trace == NULL) {
+        ret = -1;
+    }
+    else {
+        for (size_t i = 0; ret == 0 && i < trace->nb_epochs; i++) {
+            if (trace->epochs[i].duration < QUICRQ_CONGESTION_EPOCH_MIN ||
+                trace->epochs[i].duration > QUICRQ_CONGESTION_EPOCH_MAX ||
+                trace->epochs[i].priority_threshold < 0x80) {
+                DBG_PRINTF("Epoch %zu, duration %" PRIu64 ", threshold 0x%x", i, trace->epochs[i].duration,
+                    trace->epochs[i].priority_threshold);
+                ret = -1;
+            }
+            nb_drops += trace->epochs[i].nb_drops;
+        }
+        if (ret == 0 && spec->congestion_control_mode == quicrq_congestion_control_delay &&
+            spec->congestion_mode != congestion_mode_zero && spec->max_drops > 0 && trace->nb_epochs_total == 0) {
+            DBG_PRINTF("%s", "No congestion epoch in trace");
+            ret = -1;
+        }
+        DBG_PRINTF("Congestion trace: %" PRIu64 " epochs, %" PRIu64 " drops in first %zu", trace->nb_epochs_total, nb_drops, trace->nb_epochs);
+    }
+    return ret;
+}
+
 /* Basic relay test */
 int quicrq_congestion_test_one(int is_real_time, quicrq_transport_mode_enum transport_mode, quicrq_congestion_test_t * spec)
 {
@@ -312,6 +349,10 @@ int quicrq_congestion_test_one(int is_real_time, quicrq_transport_mode_enum tran
         ret = -1;
     }
 
+    if (ret == 0) {
+        ret = quicrq_congestion_trace_check(config, spec);
+    }
+
     /* Clear everything. */
     if (config != NULL) {
         quicrq_test_config_delete(config);
@@ -767,3 +808,802 @@ int quicrq_congestion_rush_zero_s_test()
 
     return ret;
 }
+
+/* Congestion epoch test.
+ * Drive the delay based congestion control of a connection with a synthetic
+ * backlog, one report per epoch: a growing queue, then a draining queue, then
+ * no queue. Verify in the congestion trace that the epochs last at least one
+ * RTT, that the threshold drops by several levels while the queue grows, is
+ * kept while the queue drains, and rises back until congestion ends. Then check
+ * that a threshold already below 0x80 is not raised to 0x80 by a backlog.
+ */
+#define CONGESTION_EPOCH_NB_GROWING 6
+#define CONGESTION_EPOCH_NB_DRAINING 4
+#define CONGESTION_EPOCH_NB_MAX 32
+
+int quicrq_congestion_epoch_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+    quicrq_congestion_trace_t* trace = NULL;
+    uint64_t backlog_delay = 0;
+    size_t nb_reports = 0;
+
+    if (cnx_ctx == NULL || quicrq_enable_congestion_trace(qr_ctx, 1) != 0) {
+        ret = -1;
+    }
+    else {
+        uint64_t rtt = picoquic_get_rtt(cnx_ctx->cnx);
+        uint64_t min_epoch = (rtt < QUICRQ_CONGESTION_EPOCH_MAX) ? rtt : QUICRQ_CONGESTION_EPOCH_MAX;
+
+        trace = qr_ctx->congestion_trace;
+        quicrq_enable_congestion_control(qr_ctx, quicrq_congestion_control_delay);
+        /* Learn the largest flag, then enter congestion */
+        (void)quicrq_congestion_check_per_cnx(cnx_ctx, 0x88, 0, 0, simulated_time);
+        (void)quicrq_congestion_check_per_cnx(cnx_ctx, 0x88, 1, 10000, simulated_time);
+        if (!cnx_ctx->congestion.is_congested || cnx_ctx->congestion.priority_threshold != 0x88 ||
+            cnx_ctx->congestion.epoch_duration < min_epoch) {
+            DBG_PRINTF("Unexpected start of congestion, threshold 0x%x, epoch %" PRIu64,
+                cnx_ctx->congestion.priority_threshold, cnx_ctx->congestion.epoch_duration);
+            ret = -1;
+        }
+    }
+
+    /* One report at the end of each epoch */
+    while (ret == 0 && cnx_ctx->congestion.is_congested && nb_reports < CONGESTION_EPOCH_NB_MAX) {
+        int has_backlog = 1;
+        uint64_t epoch_duration = cnx_ctx->congestion.epoch_duration;
+
+        if (nb_reports < CONGESTION_EPOCH_NB_GROWING) {
+            backlog_delay += epoch_duration;
+        }
+        else if (nb_reports < CONGESTION_EPOCH_NB_GROWING + CONGESTION_EPOCH_NB_DRAINING) {
+            backlog_delay -= backlog_delay / 2;
+        }
+        else {
+            has_backlog = 0;
+            backlog_delay = 0;
+        }
+        simulated_time = cnx_ctx->congestion.congestion_check_time;
+        (void)quicrq_congestion_check_per_cnx(cnx_ctx, 0x88, has_backlog, backlog_delay, simulated_time);
+        nb_reports++;
+    }
+
+    if (ret == 0) {
+        uint8_t previous_threshold = 0x88;
+        int max_step = 0;
+        uint64_t nb_drops = 0;
+
+        for (size_t i = 0; ret == 0 && i < trace->nb_epochs; i++) {
+            quicrq_congestion_epoch_t* epoch = &trace->epochs[i];
+            DBG_PRINTF("Epoch %zu, duration %" PRIu64 ", backlog %" PRIu64 ", drops %" PRIu64 ", threshold 0x%x",
+                i, epoch->duration, epoch->max_backlog_delay, epoch->nb_drops, epoch->priority_threshold);
+            if (epoch->duration < QUICRQ_CONGESTION_EPOCH_MIN || epoch->duration > QUICRQ_CONGESTION_EPOCH_MAX) {
+                ret = -1;
+            }
+            else if (i < CONGESTION_EPOCH_NB_GROWING && previous_threshold - epoch->priority_threshold > max_step) {
+                max_step = previous_threshold - epoch->priority_threshold;
+            }
+            else if (i >= CONGESTION_EPOCH_NB_GROWING && i < CONGESTION_EPOCH_NB_GROWING + CONGESTION_EPOCH_NB_DRAINING &&
+                epoch->priority_threshold < previous_threshold) {
+                DBG_PRINTF("Threshold lowered while the queue drains, epoch %zu", i);
+                ret = -1;
+            }
+            previous_threshold = epoch->priority_threshold;
+            nb_drops += epoch->nb_drops;
+        }
+        if (ret == 0 && (trace->nb_epochs != nb_reports || max_step < 2 || nb_drops == 0 ||
+            cnx_ctx->congestion.is_congested || trace->epochs[trace->nb_epochs - 1].is_congested)) {
+            DBG_PRINTF("%zu epochs for %zu reports, max step %d, %" PRIu64 " drops, congested: %d",
+                trace->nb_epochs, nb_reports, max_step, nb_drops, cnx_ctx->congestion.is_congested);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Media that only uses flags below 0x80 never gets its threshold raised by backlog */
+        simulated_time = cnx_ctx->congestion.congestion_check_time;
+        cnx_ctx->congestion.max_flags = 0x20;
+        (void)quicrq_congestion_check_per_cnx(cnx_ctx, 0x20, 1, 10000, simulated_time);
+        for (int i = 0; ret == 0 && i < 4; i++) {
+            simulated_time = cnx_ctx->congestion.congestion_check_time;
+            (void)quicrq_congestion_check_per_cnx(cnx_ctx, 0x20, 1, 10000 * (i + 2), simulated_time);
+            if (cnx_ctx->congestion.priority_threshold != 0x20) {
+                DBG_PRINTF("Threshold moved to 0x%x, epoch %d", cnx_ctx->congestion.priority_threshold, i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (cnx_ctx != NULL) {
+        quicrq_delete_cnx_context(cnx_ctx, quicrq_media_close_delete_context, 0);
+    }
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+/* Datagram scheduler test.
+ * Publish three media as datagrams on the same connection, two with
+ * the same priority and one with a lower priority, and verify that
+ * when the datagram budget is limited all media get a share of the
+ * datagrams, in proportion to their priority.
+ */
+#define DATAGRAM_SCHEDULER_NB_MEDIA 3
+#define DATAGRAM_SCHEDULER_NB_OBJECTS 400
+#define DATAGRAM_SCHEDULER_NB_DATAGRAMS 300
+
+int quicrq_datagram_scheduler_test()
+{
+    int ret = 0;
+    uint8_t data[1000];
+    uint8_t packet[1200];
+    const uint8_t media_flags[DATAGRAM_SCHEDULER_NB_MEDIA] = { 0x82, 0x82, 0xc2 };
+    size_t bytes_sent[DATAGRAM_SCHEDULER_NB_MEDIA];
+    quicrq_test_publisher_t publisher;
+
+    memset(data, 0x55, sizeof(data));
+    memset(bytes_sent, 0, sizeof(bytes_sent));
+    ret = quicrq_test_publisher_init(&publisher, DATAGRAM_SCHEDULER_NB_MEDIA, quicrq_transport_mode_datagram);
+
+    /* Fill the caches with one object per group. This wakes up the streams. */
+    for (uint64_t group_id = 0; ret == 0 && group_id < DATAGRAM_SCHEDULER_NB_OBJECTS; group_id++) {
+        for (size_t i = 0; ret == 0 && i < DATAGRAM_SCHEDULER_NB_MEDIA; i++) {
+            ret = quicrq_fragment_propose_to_cache(publisher.cache_ctx[i], data, group_id, 0, 0, 0, media_flags[i],
+                (group_id > 0) ? 1 : 0, sizeof(data), sizeof(data), publisher.simulated_time);
+        }
+    }
+
+    if (ret == 0 && publisher.cnx_ctx->nb_datagram_ready != DATAGRAM_SCHEDULER_NB_MEDIA) {
+        DBG_PRINTF("Expected %d ready streams, got %zu", DATAGRAM_SCHEDULER_NB_MEDIA, publisher.cnx_ctx->nb_datagram_ready);
+        ret = -1;
+    }
+
+    /* Send a limited number of datagrams, and account for them per media */
+    for (int n = 0; ret == 0 && n < DATAGRAM_SCHEDULER_NB_DATAGRAMS; n++) {
+        quicrq_test_datagram_buffer_argument_t d_context;
+        quicrq_test_datagram_buffer_init(&d_context, packet, sizeof(packet));
+
+        ret = quicrq_prepare_to_send_datagram(publisher.cnx_ctx, &d_context, d_context.allowed_space, publisher.simulated_time);
+        if (ret == 0) {
+            const uint8_t* bytes = d_context.bytes0;
+            uint64_t media_id;
+            uint64_t group_id;
+            uint64_t object_id;
+            uint64_t object_offset;
+            uint64_t queue_delay;
+            uint8_t flags;
+            uint64_t nb_objects_previous_group;
+            uint64_t object_length;
+            uint64_t fec_sequence;
+
+            while (bytes < d_context.bytes_max && *bytes == 0) {
+                bytes++;
+            }
+            if (d_context.after_data <= d_context.bytes0 || bytes >= d_context.bytes_max || *bytes != 0x30) {
+                DBG_PRINTF("No datagram sent at step %d", n);
+                ret = -1;
+            }
+            else if (quicrq_datagram_header_decode(bytes + 1, d_context.bytes_max, &media_id, &group_id, &object_id,
+                &object_offset, &queue_delay, &flags, &nb_objects_previous_group, &object_length, &fec_sequence, 0) == NULL ||
+                media_id >= DATAGRAM_SCHEDULER_NB_MEDIA) {
+                DBG_PRINTF("Cannot decode datagram at step %d", n);
+                ret = -1;
+            }
+            else {
+                bytes_sent[media_id] += d_context.bytes_max - bytes - 1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        DBG_PRINTF("Bytes sent per media: %zu, %zu, %zu", bytes_sent[0], bytes_sent[1], bytes_sent[2]);
+        /* Equal priorities get equal shares, the lower priority gets about half of that */
+        if (bytes_sent[0] > 11 * bytes_sent[1] / 10 || bytes_sent[1] > 11 * bytes_sent[0] / 10 ||
+            bytes_sent[2] < 4 * bytes_sent[0] / 10 || bytes_sent[2] > 6 * bytes_sent[0] / 10) {
+            DBG_PRINTF("%s", "Unexpected share of datagrams between media");
+            ret = -1;
+        }
+    }
+
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+/* Extra repeat heap test.
+ * Schedule extra repeats on a fraction of a large number of connections,
+ * and verify that they are sent in order of repeat time, that the next
+ * wake up time is correct, and that deleting connections removes their
+ * scheduled repeats. Then enable FEC, and verify that no extra
+ * repeat is scheduled.
+ */
+#define EXTRA_REPEAT_HEAP_NB_CNX 1000
+#define EXTRA_REPEAT_HEAP_NB_CHECKS 100000
+#define EXTRA_REPEAT_HEAP_DELAY 10000
+
+int quicrq_extra_repeat_heap_test()
+{
+    int ret = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t data[100];
+    size_t nb_scheduled = 0;
+    quicrq_cnx_ctx_t** cnx_ctx = (quicrq_cnx_ctx_t**)malloc(EXTRA_REPEAT_HEAP_NB_CNX * sizeof(quicrq_cnx_ctx_t*));
+    quicrq_test_publisher_t publisher;
+    quicrq_ctx_t* qr_ctx = NULL;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_cached_fragment_t* fragment = NULL;
+
+    memset(data, 0x33, sizeof(data));
+    if (quicrq_test_publisher_init(&publisher, 1, quicrq_transport_mode_datagram) != 0 || cnx_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(cnx_ctx, 0, EXTRA_REPEAT_HEAP_NB_CNX * sizeof(quicrq_cnx_ctx_t*));
+        qr_ctx = publisher.qr_ctx;
+        cache_ctx = publisher.cache_ctx[0];
+        quicrq_set_extra_repeat(qr_ctx, 0, 1);
+        quicrq_set_extra_repeat_delay(qr_ctx, EXTRA_REPEAT_HEAP_DELAY);
+        if (quicrq_fragment_propose_to_cache(cache_ctx, data, 0, 0, 0, 0, 0, 0, sizeof(data), sizeof(data), 0) != 0 ||
+            (fragment = quicrq_fragment_cache_first_fragment(cache_ctx)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    /* Create the connections. Every tenth one schedules an extra repeat of a delayed fragment,
+     * in reverse order of connection creation. */
+    for (size_t i = 0; ret == 0 && i < EXTRA_REPEAT_HEAP_NB_CNX; i++) {
+        quicrq_stream_ctx_t* stream_ctx = NULL;
+
+        if ((cnx_ctx[i] = quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr)) == NULL ||
+            (stream_ctx = quicrq_create_stream_context(cnx_ctx[i], 0)) == NULL) {
+            ret = -1;
+        }
+        else {
+            stream_ctx->is_sender = 1;
+            stream_ctx->transport_mode = quicrq_transport_mode_datagram;
+            if ((i % 10) == 0) {
+                ret = quicrq_datagram_ack_init(stream_ctx, 0, 0, 0, 0, 0, fragment, sizeof(data), 100, sizeof(data),
+                    NULL, (uint64_t)(EXTRA_REPEAT_HEAP_NB_CNX - i));
+                nb_scheduled++;
+            }
+        }
+    }
+    if (ret == 0 && qr_ctx->nb_extra_repeat != nb_scheduled) {
+        DBG_PRINTF("Expected %zu extra repeats, got %zu", nb_scheduled, qr_ctx->nb_extra_repeat);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+
+        for (int i = 0; ret == 0 && i < EXTRA_REPEAT_HEAP_NB_CHECKS; i++) {
+            if (quicrq_handle_extra_repeat(qr_ctx, EXTRA_REPEAT_HEAP_DELAY / 2) != EXTRA_REPEAT_HEAP_DELAY + 10) {
+                ret = -1;
+            }
+        }
+        duration = picoquic_current_time() - start_time;
+        DBG_PRINTF("%d extra repeat checks over %d connections in %" PRIu64 " us", EXTRA_REPEAT_HEAP_NB_CHECKS, EXTRA_REPEAT_HEAP_NB_CNX, duration);
+    }
+
+    if (ret == 0) {
+        /* Send the repeats scheduled for the last 6 connections */
+        uint64_t current_time = EXTRA_REPEAT_HEAP_DELAY + 60;
+        if (quicrq_handle_extra_repeat(qr_ctx, current_time) != current_time ||
+            qr_ctx->nb_extra_repeat != nb_scheduled - 6 ||
+            quicrq_handle_extra_repeat(qr_ctx, current_time) != current_time + 10) {
+            DBG_PRINTF("Unexpected state after first repeats, %zu left", qr_ctx->nb_extra_repeat);
+            ret = -1;
+        }
+        else {
+            nb_scheduled -= 6;
+        }
+    }
+
+    if (ret == 0) {
+        /* Delete every other connection with a scheduled repeat */
+        for (size_t i = 0; i < EXTRA_REPEAT_HEAP_NB_CNX; i += 20) {
+            if (EXTRA_REPEAT_HEAP_NB_CNX - i > 60) {
+                nb_scheduled--;
+            }
+            quicrq_delete_cnx_context(cnx_ctx[i], quicrq_media_close_delete_context, 0);
+            cnx_ctx[i] = NULL;
+        }
+        if (qr_ctx->nb_extra_repeat != nb_scheduled ||
+            quicrq_handle_extra_repeat(qr_ctx, 0) != EXTRA_REPEAT_HEAP_DELAY + 70) {
+            DBG_PRINTF("Unexpected state after deletions, %zu left", qr_ctx->nb_extra_repeat);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Send all the remaining repeats */
+        if (quicrq_handle_extra_repeat(qr_ctx, UINT64_MAX - 1) != UINT64_MAX - 1 ||
+            qr_ctx->nb_extra_repeat != 0 ||
+            quicrq_handle_extra_repeat(qr_ctx, UINT64_MAX - 1) != UINT64_MAX) {
+            DBG_PRINTF("Unexpected state after last repeats, %zu left", qr_ctx->nb_extra_repeat);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* The repair datagrams replace the extra repeats */
+        quicrq_stream_ctx_t* stream_ctx = quicrq_create_stream_context(cnx_ctx[1], 4);
+
+        quicrq_set_datagram_fec(qr_ctx, 4);
+        if (stream_ctx == NULL) {
+            ret = -1;
+        }
+        else {
+            stream_ctx->is_sender = 1;
+            stream_ctx->transport_mode = quicrq_transport_mode_datagram;
+            ret = quicrq_datagram_ack_init(stream_ctx, 0, 0, 0, 0, 0, fragment, sizeof(data), 100, sizeof(data),
+                NULL, EXTRA_REPEAT_HEAP_DELAY);
+            if (ret == 0 && qr_ctx->nb_extra_repeat != 0) {
+                DBG_PRINTF("Extra repeat scheduled with FEC, %zu in heap", qr_ctx->nb_extra_repeat);
+                ret = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; cnx_ctx != NULL && i < EXTRA_REPEAT_HEAP_NB_CNX; i++) {
+        if (cnx_ctx[i] != NULL) {
+            quicrq_delete_cnx_context(cnx_ctx[i], quicrq_media_close_delete_context, 0);
+        }
+    }
+    quicrq_test_publisher_release(&publisher);
+    if (cnx_ctx != NULL) {
+        free(cnx_ctx);
+    }
+
+    return ret;
+}
+
+/* Track set test.
+ * Publish three layers of a media, with the same group numbering but a different
+ * number of objects per group, and register them as a track set. Subscribe to the
+ * track set in stream mode, and change the layer bitrates before each group so that
+ * the selected layer changes. Verify that the publisher only changes layer at group
+ * boundaries, that each group is served completely from one layer, and that the
+ * stream is moved to the wakeup list and reader heap of the new layer.
+ */
+#define TRACK_SET_NB_LAYERS 3
+#define TRACK_SET_NB_GROUPS 4
+#define TRACK_SET_OBJECT_SIZE 100
+
+static size_t quicrq_track_set_test_nb_objects(size_t layer)
+{
+    return (layer == 2) ? 2 : 3;
+}
+
+static int quicrq_track_set_test_read_group(quicrq_stream_ctx_t* stream_ctx, quicrq_fragment_cache_t** cache_ctx,
+    size_t layer, uint64_t group_id)
+{
+    int ret = 0;
+    quicrq_fragment_publisher_context_t* media_ctx = stream_ctx->media_ctx;
+
+    for (uint64_t object_id = 0; ret == 0 && object_id < quicrq_track_set_test_nb_objects(layer); object_id++) {
+        quicrq_fragment_slice_t slices[QUICRQ_FRAGMENT_SLICES_MAX];
+        size_t nb_slices = 0;
+        size_t data_length = 0;
+        uint8_t flags = 0;
+        int is_new_group = 0;
+        uint64_t object_length = 0;
+        int is_media_finished = 0;
+        int is_still_active = 0;
+        int should_skip = 0;
+        uint8_t expected = (uint8_t)(0x10 * layer + 4 * group_id + object_id);
+
+        ret = quicrq_fragment_publisher_get_slices(media_ctx, 1024, slices, QUICRQ_FRAGMENT_SLICES_MAX, &nb_slices,
+            &data_length, &flags, &is_new_group, &object_length, &is_media_finished, &is_still_active, &should_skip, 0);
+        if (ret == 0 && (data_length != TRACK_SET_OBJECT_SIZE || nb_slices != 1 || slices[0].data[0] != expected ||
+            media_ctx->current_group_id != group_id || media_ctx->current_object_id != object_id ||
+            is_new_group != (group_id > 0 && object_id == 0))) {
+            DBG_PRINTF("Unexpected object %" PRIu64 "/%" PRIu64 " from layer %zu", group_id, object_id, layer);
+            ret = -1;
+        }
+        if (ret == 0) {
+            quicrq_fragment_publisher_consume(media_ctx, data_length, 0);
+        }
+    }
+    if (ret == 0 && (media_ctx->track_layer != layer || media_ctx->cache_ctx != cache_ctx[layer] ||
+        stream_ctx->media_source != cache_ctx[layer]->srce_ctx)) {
+        DBG_PRINTF("Group %" PRIu64 " not served from layer %zu", group_id, layer);
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < TRACK_SET_NB_LAYERS; i++) {
+        if (cache_ctx[i]->nb_readers != ((i == layer) ? 1 : 0) ||
+            (cache_ctx[i]->srce_ctx->first_stream == stream_ctx) != (i == layer)) {
+            DBG_PRINTF("Unexpected readers of layer %zu", i);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int quicrq_track_set_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t data[TRACK_SET_OBJECT_SIZE];
+    char layer_names[TRACK_SET_NB_LAYERS][16];
+    const uint8_t* layer_urls[TRACK_SET_NB_LAYERS];
+    size_t layer_url_lengths[TRACK_SET_NB_LAYERS];
+    uint64_t layer_bitrates[TRACK_SET_NB_LAYERS];
+    quicrq_fragment_cache_t* cache_ctx[TRACK_SET_NB_LAYERS] = { NULL };
+    /* Layer selected for each group, and bitrates set before the group starts */
+    const size_t group_layer[TRACK_SET_NB_GROUPS] = { 1, 0, 2, 2 };
+    const uint64_t group_bitrates[TRACK_SET_NB_GROUPS][TRACK_SET_NB_LAYERS] = {
+        { 25, 50, 200 }, { 25, 200, 300 }, { 25, 30, 50 }, { 25, 30, 90 } };
+    const uint8_t track_set_url[] = { 'v', 'i', 'd', 'e', 'o' };
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+    quicrq_stream_ctx_t* stream_ctx = (cnx_ctx == NULL) ? NULL : quicrq_create_stream_context(cnx_ctx, 0);
+    quicrq_track_set_t* track_set = NULL;
+    uint64_t bandwidth_estimate = (cnx_ctx == NULL) ? 0 : quicrq_track_set_bandwidth_estimate(cnx_ctx);
+
+    if (stream_ctx == NULL || bandwidth_estimate == 0 || bandwidth_estimate == UINT64_MAX) {
+        ret = -1;
+    }
+
+    /* Publish the layers, in order of decreasing bitrate */
+    for (size_t layer = 0; ret == 0 && layer < TRACK_SET_NB_LAYERS; layer++) {
+        size_t i = TRACK_SET_NB_LAYERS - 1 - layer;
+
+        (void)picoquic_sprintf(layer_names[i], sizeof(layer_names[i]), NULL, "video/layer%zu", layer);
+        layer_urls[i] = (const uint8_t*)layer_names[i];
+        layer_url_lengths[i] = strlen(layer_names[i]);
+        layer_bitrates[i] = (bandwidth_estimate / 100) * group_bitrates[0][layer];
+        if ((cache_ctx[layer] = quicrq_fragment_cache_create_ctx(qr_ctx)) == NULL) {
+            ret = -1;
+        }
+        else if ((ret = quicrq_publish_fragment_cached_media(qr_ctx, cache_ctx[layer], layer_urls[i], layer_url_lengths[i], 0, 1)) != 0) {
+            quicrq_fragment_cache_delete_ctx(cache_ctx[layer]);
+            cache_ctx[layer] = NULL;
+        }
+        for (uint64_t group_id = 0; ret == 0 && group_id < TRACK_SET_NB_GROUPS; group_id++) {
+            for (uint64_t object_id = 0; ret == 0 && object_id < quicrq_track_set_test_nb_objects(layer); object_id++) {
+                memset(data, (int)(0x10 * layer + 4 * group_id + object_id), sizeof(data));
+                ret = quicrq_fragment_propose_to_cache(cache_ctx[layer], data, group_id, object_id, 0, 0, 0,
+                    (group_id > 0 && object_id == 0) ? quicrq_track_set_test_nb_objects(layer) : 0,
+                    TRACK_SET_OBJECT_SIZE, TRACK_SET_OBJECT_SIZE, 0);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        ret = quicrq_register_track_set(qr_ctx, track_set_url, sizeof(track_set_url), TRACK_SET_NB_LAYERS,
+            layer_urls, layer_url_lengths, layer_bitrates);
+        if (ret == 0 && quicrq_register_track_set(qr_ctx, track_set_url, sizeof(track_set_url), TRACK_SET_NB_LAYERS,
+            layer_urls, layer_url_lengths, layer_bitrates) == 0) {
+            DBG_PRINTF("%s", "Duplicate track set accepted");
+            ret = -1;
+        }
+        else if ((track_set = quicrq_find_track_set(qr_ctx, track_set_url, sizeof(track_set_url))) == NULL ||
+            track_set->nb_layers != TRACK_SET_NB_LAYERS) {
+            ret = -1;
+        }
+        for (size_t layer = 0; ret == 0 && layer < TRACK_SET_NB_LAYERS; layer++) {
+            if (track_set->layers[layer].url_length != strlen("video/layer0") ||
+                track_set->layers[layer].url[track_set->layers[layer].url_length - 1] != (uint8_t)('0' + layer)) {
+                DBG_PRINTF("Layer %zu not sorted by bitrate", layer);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Moving to a higher layer requires a margin, moving down does not */
+        uint64_t estimate = (track_set->layers[1].bitrate / 100) * 110;
+        if (quicrq_track_set_select_layer(track_set, 0, estimate) != 0 ||
+            quicrq_track_set_select_layer(track_set, 1, estimate) != 1 ||
+            quicrq_track_set_select_layer(track_set, 2, estimate) != 1 ||
+            quicrq_track_set_select_layer(track_set, 1, track_set->layers[1].bitrate - 1) != 0 ||
+            quicrq_track_set_select_layer(track_set, 0, 0) != 0 ||
+            quicrq_track_set_select_layer(track_set, 0, UINT64_MAX) != 2) {
+            DBG_PRINTF("%s", "Unexpected layer selection");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        stream_ctx->is_sender = 1;
+        ret = quicrq_subscribe_local_media(stream_ctx, track_set_url, sizeof(track_set_url));
+        if (ret == 0 && (stream_ctx->media_ctx == NULL || stream_ctx->media_ctx->track_set != track_set)) {
+            ret = -1;
+        }
+    }
+
+    for (uint64_t group_id = 0; ret == 0 && group_id < TRACK_SET_NB_GROUPS; group_id++) {
+        for (size_t layer = 0; layer < TRACK_SET_NB_LAYERS; layer++) {
+            track_set->layers[layer].bitrate = (bandwidth_estimate / 100) * group_bitrates[group_id][layer];
+        }
+        ret = quicrq_track_set_test_read_group(stream_ctx, cache_ctx, group_layer[group_id], group_id);
+    }
+
+    if (ret == 0) {
+        /* All groups were sent, nothing more is available */
+        quicrq_fragment_slice_t slices[QUICRQ_FRAGMENT_SLICES_MAX];
+        size_t nb_slices = 0;
+        size_t data_length = 0;
+        uint8_t flags = 0;
+        int is_new_group = 0;
+        uint64_t object_length = 0;
+        int is_media_finished = 0;
+        int is_still_active = 0;
+        int should_skip = 0;
+
+        ret = quicrq_fragment_publisher_get_slices(stream_ctx->media_ctx, 1024, slices, QUICRQ_FRAGMENT_SLICES_MAX, &nb_slices,
+            &data_length, &flags, &is_new_group, &object_length, &is_media_finished, &is_still_active, &should_skip, 0);
+        if (ret == 0 && data_length != 0) {
+            ret = -1;
+        }
+    }
+
+    if (qr_ctx != NULL) {
+        /* This will also delete the stream, the sources, the caches and the track set */
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+/* Latency budget test.
+ * Fill a cache with objects of different ages: two objects that have been
+ * waiting in the local cache for too long, two fresh objects, and one object
+ * that is fresh locally but arrived with a large queue delay accumulated in
+ * previous relays. Send them in stream or datagram mode, and verify that the
+ * late objects are replaced by skip placeholders while the fresh objects are
+ * sent, and in datagram mode that the queue delay includes the local wait.
+ * The stream test uses the budget of the publisher, the datagram test the
+ * smaller budget of the subscriber.
+ */
+#define LATENCY_BUDGET_NB_OBJECTS 5
+#define LATENCY_BUDGET_OBJECT_SIZE 100
+#define LATENCY_BUDGET_MAX_MESSAGES 32
+
+static int quicrq_latency_budget_test_one(int is_datagram)
+{
+    int ret = 0;
+    uint64_t current_time = 120000;
+    uint8_t data[LATENCY_BUDGET_OBJECT_SIZE];
+    uint8_t packet[1200];
+    /* Objects 0 and 1 were cached at time 0, the others at 100 ms. Object 4 arrived with an 80 ms queue delay. */
+    const uint64_t cache_times[LATENCY_BUDGET_NB_OBJECTS] = { 0, 0, 100000, 100000, 100000 };
+    const uint64_t queue_delays[LATENCY_BUDGET_NB_OBJECTS] = { 0, 0, 0, 0, 80 };
+    const int is_late[LATENCY_BUDGET_NB_OBJECTS] = { 1, 1, 0, 0, 1 };
+    int nb_skipped[LATENCY_BUDGET_NB_OBJECTS] = { 0 };
+    size_t bytes_sent[LATENCY_BUDGET_NB_OBJECTS] = { 0 };
+    quicrq_test_publisher_t publisher;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_stream_ctx_t* stream_ctx = NULL;
+
+    if (quicrq_test_publisher_init(&publisher, 1,
+        (is_datagram) ? quicrq_transport_mode_datagram : quicrq_transport_mode_single_stream) != 0) {
+        ret = -1;
+    }
+    else {
+        cache_ctx = publisher.cache_ctx[0];
+        stream_ctx = publisher.stream_ctx[0];
+        if (is_datagram) {
+            cache_ctx->latency_budget = 200000;
+            stream_ctx->latency_budget = 50000;
+        }
+        else {
+            cache_ctx->latency_budget = 50000;
+        }
+    }
+
+    for (uint64_t object_id = 0; ret == 0 && object_id < LATENCY_BUDGET_NB_OBJECTS; object_id++) {
+        memset(data, (int)object_id, sizeof(data));
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 0, object_id, 0, queue_delays[object_id], 0, 0,
+            sizeof(data), sizeof(data), cache_times[object_id]);
+    }
+
+    for (int nb_messages = 0; ret == 0 && nb_messages < LATENCY_BUDGET_MAX_MESSAGES; nb_messages++) {
+        quicrq_message_t incoming;
+        const uint8_t* bytes = NULL;
+        const uint8_t* bytes_max = NULL;
+
+        if (is_datagram) {
+            quicrq_test_datagram_buffer_argument_t d_context;
+            quicrq_test_datagram_buffer_init(&d_context, packet, sizeof(packet));
+
+            ret = quicrq_prepare_to_send_datagram(publisher.cnx_ctx, &d_context, d_context.allowed_space, current_time);
+            if (ret != 0 || d_context.after_data <= d_context.bytes0) {
+                break;
+            }
+            bytes = d_context.bytes0;
+            bytes_max = d_context.bytes_max;
+            while (bytes < bytes_max && *bytes == 0) {
+                bytes++;
+            }
+            if (bytes >= bytes_max || *bytes != 0x30) {
+                ret = -1;
+            }
+            else {
+                uint64_t media_id;
+                uint64_t queue_delay;
+                uint64_t fec_sequence;
+
+                memset(&incoming, 0, sizeof(incoming));
+                bytes = quicrq_datagram_header_decode(bytes + 1, bytes_max, &media_id, &incoming.group_id, &incoming.object_id,
+                    &incoming.fragment_offset, &queue_delay, &incoming.flags, &incoming.nb_objects_previous_group,
+                    &incoming.object_length, &fec_sequence, 0);
+                if (bytes == NULL) {
+                    ret = -1;
+                }
+                else {
+                    incoming.fragment_length = bytes_max - bytes;
+                    /* The queue delay of sent objects includes the time spent in the local cache */
+                    if (incoming.object_id < LATENCY_BUDGET_NB_OBJECTS && incoming.flags != 0xff &&
+                        queue_delay != queue_delays[incoming.object_id] + (current_time - cache_times[incoming.object_id]) / 1000) {
+                        DBG_PRINTF("Object %" PRIu64 " sent with queue delay %" PRIu64, incoming.object_id, queue_delay);
+                        ret = -1;
+                    }
+                }
+            }
+        }
+        else {
+            quicrq_test_stream_buffer_argument_t s_context;
+            quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+
+            ret = quicrq_prepare_to_send_media_to_stream(stream_ctx, &s_context, s_context.allowed_space, current_time);
+            if (ret != 0 || s_context.app_buffer == NULL || s_context.length == 0) {
+                break;
+            }
+            bytes_max = s_context.app_buffer + s_context.length;
+            if (quicrq_msg_decode(s_context.app_buffer + 2, bytes_max, &incoming) == NULL ||
+                incoming.message_type != QUICRQ_ACTION_FRAGMENT) {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            if (incoming.group_id != 0 || incoming.object_id >= LATENCY_BUDGET_NB_OBJECTS) {
+                ret = -1;
+            }
+            else if (incoming.flags == 0xff) {
+                nb_skipped[incoming.object_id]++;
+            }
+            else {
+                bytes_sent[incoming.object_id] += incoming.fragment_length;
+            }
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < LATENCY_BUDGET_NB_OBJECTS; i++) {
+        if (nb_skipped[i] != is_late[i] || bytes_sent[i] != ((is_late[i]) ? 0 : LATENCY_BUDGET_OBJECT_SIZE)) {
+            DBG_PRINTF("Object %zu: skipped %d times, %zu bytes sent", i, nb_skipped[i], bytes_sent[i]);
+            ret = -1;
+        }
+    }
+
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+/* Relay of the publisher budget.
+ * The origin sends its latency budget on the media stream. The relay stores it
+ * in its cache, so it applies to the relay subscribers, and forwards it to them.
+ */
+static int quicrq_latency_budget_relay_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t packet[256];
+    quicrq_message_t incoming;
+    quicrq_media_source_ctx_t srce_ctx;
+    quicrq_relay_consumer_context_t cons_ctx;
+    quicrq_stream_ctx_t* origin_stream = NULL;
+    quicrq_stream_ctx_t* relay_upstream = NULL;
+    quicrq_stream_ctx_t* relay_downstream = NULL;
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+    quicrq_fragment_cache_t* relay_cache = (qr_ctx == NULL) ? NULL : quicrq_fragment_cache_create_ctx(qr_ctx);
+
+    memset(&srce_ctx, 0, sizeof(srce_ctx));
+    memset(&cons_ctx, 0, sizeof(cons_ctx));
+    if (cnx_ctx == NULL || relay_cache == NULL ||
+        (origin_stream = quicrq_create_stream_context(cnx_ctx, 0)) == NULL ||
+        (relay_upstream = quicrq_create_stream_context(cnx_ctx, 4)) == NULL ||
+        (relay_downstream = quicrq_create_stream_context(cnx_ctx, 8)) == NULL) {
+        ret = -1;
+    }
+    else {
+        relay_cache->srce_ctx = &srce_ctx;
+        srce_ctx.cache_ctx = relay_cache;
+        cons_ctx.qr_ctx = qr_ctx;
+        cons_ctx.cache_ctx = relay_cache;
+        cons_ctx.stream_ctx = relay_upstream;
+        origin_stream->is_sender = 1;
+        origin_stream->transport_mode = quicrq_transport_mode_datagram;
+        origin_stream->publisher_latency_budget = 30500;
+        relay_upstream->transport_mode = quicrq_transport_mode_datagram;
+        relay_upstream->receive_state = quicrq_receive_fragment;
+        ret = quicrq_set_media_stream_ctx(relay_upstream, quicrq_relay_consumer_cb, &cons_ctx);
+        relay_downstream->is_sender = 1;
+        relay_downstream->transport_mode = quicrq_transport_mode_datagram;
+        quicrq_link_local_media(relay_downstream, &srce_ctx);
+    }
+
+    /* The origin sends the budget rounded up to the millisecond, the relay learns it */
+    if (ret == 0) {
+        quicrq_test_stream_buffer_argument_t s_context;
+
+        quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+        ret = quicrq_prepare_to_send_on_stream(origin_stream, &s_context, s_context.allowed_space, simulated_time);
+        if (ret != 0 || s_context.app_buffer == NULL || !origin_stream->is_latency_budget_sent) {
+            DBG_PRINTF("%s", "Latency budget not sent");
+            ret = -1;
+        }
+        else {
+            ret = quicrq_receive_stream_data(relay_upstream, s_context.app_buffer, s_context.length, 0);
+        }
+    }
+    if (ret == 0 && (relay_cache->latency_budget != 31000 || relay_downstream->publisher_latency_budget != 31000 ||
+        relay_downstream->is_latency_budget_sent)) {
+        DBG_PRINTF("Relay budget %" PRIu64 ", downstream %" PRIu64, relay_cache->latency_budget,
+            relay_downstream->publisher_latency_budget);
+        ret = -1;
+    }
+    /* The relay forwards the budget to its subscribers */
+    if (ret == 0) {
+        quicrq_test_stream_buffer_argument_t s_context;
+
+        quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+        ret = quicrq_prepare_to_send_on_stream(relay_downstream, &s_context, s_context.allowed_space, simulated_time);
+        if (ret != 0 || s_context.app_buffer == NULL || s_context.length <= 2 ||
+            quicrq_msg_decode(s_context.app_buffer + 2, s_context.app_buffer + s_context.length, &incoming) == NULL) {
+            DBG_PRINTF("%s", "Latency budget not forwarded");
+            ret = -1;
+        }
+        else if (incoming.message_type != QUICRQ_ACTION_LATENCY_BUDGET || incoming.latency_budget != 31 ||
+            !relay_downstream->is_latency_budget_sent) {
+            DBG_PRINTF("Forwarded message type %" PRIu64 ", budget %" PRIu64, incoming.message_type, incoming.latency_budget);
+            ret = -1;
+        }
+    }
+
+    if (relay_upstream != NULL) {
+        /* The consumer context is not allocated, do not close it */
+        relay_upstream->consumer_fn = NULL;
+        relay_upstream->media_ctx = NULL;
+    }
+    if (relay_downstream != NULL) {
+        quicrq_unsubscribe_local_media(relay_downstream);
+    }
+    if (cnx_ctx != NULL) {
+        quicrq_delete_cnx_context(cnx_ctx, quicrq_media_close_delete_context, 0);
+    }
+    if (relay_cache != NULL) {
+        quicrq_fragment_cache_delete_ctx(relay_cache);
+    }
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+int quicrq_latency_budget_test()
+{
+    int ret = quicrq_latency_budget_test_one(0);
+
+    if (ret == 0) {
+        ret = quicrq_latency_budget_test_one(1);
+    }
+    if (ret == 0) {
+        ret = quicrq_latency_budget_relay_test();
+    }
+
+    return ret;
+}
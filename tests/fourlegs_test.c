@@ -124,7 +124,7 @@ void quicrq_debug_source_test(quicrq_ctx_t* node, int node_id)
         if (cache_ctx == NULL) {
             DBG_PRINTF("No cache for node{%d], source[%d]", node_id, source_id);
         } else {
-            quicrq_cached_fragment_t* fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_first(&source->cache_ctx->fragment_tree));
+            quicrq_cached_fragment_t* fragment = quicrq_fragment_cache_first_fragment(source->cache_ctx);
 
             if (fragment == NULL) {
                 DBG_PRINTF("Empty cache for node{%d], source[%d]", node_id, source_id);
@@ -149,7 +149,7 @@ void quicrq_debug_source_test(quicrq_ctx_t* node, int node_id)
                     }
                     current_offset += fragment->data_length;
                     is_last_fragment = current_offset >= fragment->object_length;
-                    fragment = (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_next(&fragment->fragment_node));
+                    fragment = quicrq_fragment_cache_next_fragment(source->cache_ctx, fragment);
                     if (fragment == NULL){
                         if (!is_last_fragment) {
                             DBG_PRINTF("Cache[%d,%d] last object %" PRIu64 "/%" PRIu64 " offset %zu, incomplete", node_id, source_id,
@@ -5,7 +5,9 @@
 #include "quicrq.h"
 #include "quicrq_relay.h"
 #include "quicrq_internal.h"
+#include "quicrq_relay_internal.h"
 #include "quicrq_fragment.h"
+#include "quicrq_reassembly.h"
 #include "quicrq_test_internal.h"
 
 /* Unit tests of the fragment cache
@@ -89,8 +91,8 @@ int quicrq_fragment_cache_verify(quicrq_fragment_cache_t* cache_ctx)
     }
     if (ret == 0) {
         /* Check that cache contains exactly the expected number of fragments */
-        if (cache_ctx->fragment_tree.size != nb_fragments_found) {
-            DBG_PRINTF("Found %d fragments, cache contains %d", nb_fragments_found, cache_ctx->fragment_tree.size);
+        if (cache_ctx->nb_cached_fragments != (size_t)nb_fragments_found) {
+            DBG_PRINTF("Found %d fragments, cache contains %zu", nb_fragments_found, cache_ctx->nb_cached_fragments);
             ret = -1;
         }
     }
@@ -104,8 +106,8 @@ int quicrq_fragment_cache_verify(quicrq_fragment_cache_t* cache_ctx)
             previous_fragment = fragment;
             fragment = fragment->next_in_order;
         }
-        if (nb_in_chain != cache_ctx->fragment_tree.size) {
-            DBG_PRINTF("Found %d fragments in chain, cache contains %d", nb_in_chain, cache_ctx->fragment_tree.size);
+        if ((size_t)nb_in_chain != cache_ctx->nb_cached_fragments) {
+            DBG_PRINTF("Found %d fragments in chain, cache contains %zu", nb_in_chain, cache_ctx->nb_cached_fragments);
             ret = -1;
         }
         else if (previous_fragment != cache_ctx->last_fragment) {
@@ -224,16 +226,98 @@ int quicrq_fragment_cache_fill_test_one(size_t fragment_max, size_t start_object
     return ret;
 }
 
-/* For the purpose of simulating the picoquic API, we copy here
- * the definition of the context used by the API
- * `picoquic_provide_datagram_buffer` */
-typedef struct st_fragment_test_datagram_buffer_argument_t {
-    uint8_t* bytes0; /* Points to the beginning of the encoding of the datagram object */
-    uint8_t* bytes; /* Position after encoding the datagram object type */
-    uint8_t* bytes_max; /* Pointer to the end of the packet */
-    uint8_t* after_data; /* Pointer to end of data written by app */
-    size_t allowed_space; /* Data size from bytes to end of packet */
-} fragment_test_datagram_buffer_argument_t;
+/* Mimic the buffer contexts set by picoquic before asking the
+ * application for data: the datagram frame type byte, and a stream
+ * frame header of type, stream id and offset.
+ */
+void quicrq_test_datagram_buffer_init(quicrq_test_datagram_buffer_argument_t* d_context, uint8_t* packet, size_t packet_size)
+{
+    memset(d_context, 0, sizeof(quicrq_test_datagram_buffer_argument_t));
+    d_context->bytes0 = &packet[0];
+    d_context->bytes = &packet[1];
+    d_context->after_data = &packet[0];
+    d_context->bytes_max = &packet[0] + packet_size;
+    d_context->allowed_space = packet_size - 1;
+}
+
+void quicrq_test_stream_buffer_init(quicrq_test_stream_buffer_argument_t* s_context, uint8_t* packet, size_t packet_size)
+{
+    memset(s_context, 0, sizeof(quicrq_test_stream_buffer_argument_t));
+    packet[0] = 0x08;
+    s_context->bytes = packet;
+    s_context->byte_index = 1;
+    s_context->byte_space = packet_size - 1;
+    s_context->allowed_space = packet_size - 3;
+}
+
+/* Create a local publisher. On failure, whatever was created is left in
+ * the publisher context, and must be released.
+ */
+int quicrq_test_publisher_init(quicrq_test_publisher_t* publisher, size_t nb_media, quicrq_transport_mode_enum transport_mode)
+{
+    int ret = 0;
+    struct sockaddr_storage addr = { 0 };
+
+    memset(publisher, 0, sizeof(quicrq_test_publisher_t));
+    if (nb_media > QUICRQ_TEST_PUBLISHER_MEDIA_MAX ||
+        (publisher->qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &publisher->simulated_time)) == NULL ||
+        (publisher->cnx_ctx = quicrq_create_client_cnx(publisher->qr_ctx, NULL, (struct sockaddr*)&addr)) == NULL) {
+        ret = -1;
+    }
+    else {
+        quicrq_enable_congestion_control(publisher->qr_ctx, quicrq_congestion_control_none);
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_media; i++) {
+        quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(publisher->qr_ctx);
+        quicrq_stream_ctx_t* stream_ctx = NULL;
+
+        if (cache_ctx == NULL) {
+            ret = -1;
+        }
+        else {
+            publisher->cache_ctx[i] = cache_ctx;
+            publisher->nb_media++;
+            if ((stream_ctx = quicrq_create_stream_context(publisher->cnx_ctx, 4 * (uint64_t)i)) == NULL) {
+                ret = -1;
+            }
+            else {
+                publisher->stream_ctx[i] = stream_ctx;
+                cache_ctx->srce_ctx = &publisher->srce_ctx[i];
+                publisher->srce_ctx[i].cache_ctx = cache_ctx;
+                publisher->srce_ctx[i].first_stream = stream_ctx;
+                publisher->srce_ctx[i].last_stream = stream_ctx;
+                stream_ctx->media_id = i;
+                stream_ctx->is_sender = 1;
+                stream_ctx->transport_mode = transport_mode;
+                if ((stream_ctx->media_ctx = quicrq_fragment_publisher_subscribe(cache_ctx, stream_ctx)) == NULL) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+void quicrq_test_publisher_release(quicrq_test_publisher_t* publisher)
+{
+    /* Close the streams before deleting the caches, and the caches before the quicrq context */
+    if (publisher->cnx_ctx != NULL) {
+        quicrq_delete_cnx_context(publisher->cnx_ctx, quicrq_media_close_delete_context, 0);
+        publisher->cnx_ctx = NULL;
+    }
+    for (size_t i = 0; i < publisher->nb_media; i++) {
+        quicrq_fragment_cache_delete_ctx(publisher->cache_ctx[i]);
+        publisher->cache_ctx[i] = NULL;
+        publisher->stream_ctx[i] = NULL;
+    }
+    publisher->nb_media = 0;
+    if (publisher->qr_ctx != NULL) {
+        quicrq_delete(publisher->qr_ctx);
+        publisher->qr_ctx = NULL;
+    }
+}
 
 /* Simulate a relay trying to forward data after it is added to the cache. */
 int quicrq_fragment_cache_publish_simulate(quicrq_fragment_publisher_context_t* pub_ctx, quicrq_fragment_cache_t* cache_ctx_p, 
@@ -263,7 +347,7 @@ int quicrq_fragment_cache_publish_simulate(quicrq_fragment_publisher_context_t*
             int not_ready = 0;
 
             /* Setup a datagram buffer context to mimic picoquic's behavior */
-            fragment_test_datagram_buffer_argument_t d_context = { 0 };
+            quicrq_test_datagram_buffer_argument_t d_context = { 0 };
             data[0] = 0x30;
             d_context.bytes0 = &data[0];
             d_context.bytes = &data[1];
@@ -300,10 +384,12 @@ int quicrq_fragment_cache_publish_simulate(quicrq_fragment_publisher_context_t*
                     uint64_t media_id;
                     uint64_t object_offset;
                     uint64_t queue_delay;
+                    uint64_t fec_sequence;
                     const uint8_t* datagram_max = bytes + datagram_length;
 
                     bytes = quicrq_datagram_header_decode(bytes, datagram_max, &media_id,
-                        &group_id, &object_id, &object_offset, &queue_delay, &flags, &nb_objects_previous_group, &object_length);
+                        &group_id, &object_id, &object_offset, &queue_delay, &flags, &nb_objects_previous_group, &object_length,
+                        &fec_sequence, 0);
                     if (bytes == NULL) {
                         DBG_PRINTF("Cannot decode datagram header, length = %zu", datagram_length);
                         ret = -1;
@@ -497,6 +583,7 @@ int quicrq_fragment_cache_publish_test_one(int is_datagram)
     }
 
     if (pub_ctx != NULL) {
+        quicrq_fragment_cursor_release(&pub_ctx->read_cursor);
         free(pub_ctx);
     }
     if (qr_ctx != NULL) {
@@ -561,3 +648,1583 @@ int quicrq_fragment_cache_fill_test()
 
     return ret;
 }
+
+/* Benchmark of object lookups in the fragment cache.
+ * A cache is filled with a number of groups, objects and fragments, and
+ * then read by a number of simulated readers, each at a different position
+ * in the cache and progressing one object at a time. We compare the
+ * lookup rate using the object directory against the rate obtained by
+ * searching the fragment splay, as was done before the object directory
+ * was introduced. Reading the splay rotates the tree, so readers at
+ * different positions keep rewriting it.
+ */
+#define FRAGMENT_BENCH_NB_GROUPS 100
+#define FRAGMENT_BENCH_OBJECTS_PER_GROUP 30
+#define FRAGMENT_BENCH_FRAGMENTS_PER_OBJECT 4
+#define FRAGMENT_BENCH_FRAGMENT_SIZE 16
+#define FRAGMENT_BENCH_NB_LOOKUPS 300000
+
+static quicrq_cached_fragment_t* quicrq_fragment_cache_bench_splay_lookup(quicrq_fragment_cache_t* cache_ctx,
+    uint64_t group_id, uint64_t object_id)
+{
+    quicrq_cached_fragment_t key = { 0 };
+    quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+    key.group_id = group_id;
+    key.object_id = object_id;
+    key.offset = 0;
+    return (group == NULL) ? NULL :
+        (quicrq_cached_fragment_t*)quicrq_fragment_cache_node_value(picosplay_find(&group->fragment_tree, &key));
+}
+
+/* Bring the first fragment of each group to the root of the group splay and record it,
+ * or check that the roots did not change */
+static int quicrq_fragment_cache_bench_roots(quicrq_fragment_cache_t* cache_ctx, picosplay_node_t** roots, int is_check)
+{
+    int ret = 0;
+
+    for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_BENCH_NB_GROUPS; group_id++) {
+        quicrq_cached_group_t* group = quicrq_fragment_cache_get_group(cache_ctx, group_id);
+        if (group == NULL) {
+            ret = -1;
+        }
+        else if (!is_check) {
+            (void)quicrq_fragment_cache_bench_splay_lookup(cache_ctx, group_id, 0);
+            roots[group_id] = group->fragment_tree.root;
+        }
+        else if (roots[group_id] != group->fragment_tree.root) {
+            DBG_PRINTF("Splay of group %" PRIu64 " rotated by directory lookups", group_id);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int quicrq_fragment_cache_bench_one(quicrq_fragment_cache_t* cache_ctx, size_t nb_readers, int use_splay, uint64_t* lookups_per_second)
+{
+    int ret = 0;
+    uint64_t nb_objects = FRAGMENT_BENCH_NB_GROUPS * FRAGMENT_BENCH_OBJECTS_PER_GROUP;
+    uint64_t* reader_position = (uint64_t*)malloc(nb_readers * sizeof(uint64_t));
+
+    if (reader_position == NULL) {
+        ret = -1;
+    }
+    else {
+        uint64_t start_time;
+        uint64_t duration;
+
+        for (size_t i = 0; i < nb_readers; i++) {
+            reader_position[i] = (i * nb_objects) / nb_readers;
+        }
+        start_time = picoquic_current_time();
+        for (size_t n = 0; ret == 0 && n < FRAGMENT_BENCH_NB_LOOKUPS; n++) {
+            size_t reader = n % nb_readers;
+            uint64_t group_id = reader_position[reader] / FRAGMENT_BENCH_OBJECTS_PER_GROUP;
+            uint64_t object_id = reader_position[reader] % FRAGMENT_BENCH_OBJECTS_PER_GROUP;
+            quicrq_cached_fragment_t* fragment;
+
+            if (use_splay) {
+                fragment = quicrq_fragment_cache_bench_splay_lookup(cache_ctx, group_id, object_id);
+            }
+            else {
+                fragment = quicrq_fragment_cache_get_fragment(cache_ctx, group_id, object_id, 0);
+            }
+            if (fragment == NULL || fragment->group_id != group_id || fragment->object_id != object_id) {
+                DBG_PRINTF("Cannot find object %" PRIu64 "/%" PRIu64 ", splay: %d", group_id, object_id, use_splay);
+                ret = -1;
+            }
+            reader_position[reader] = (reader_position[reader] + 1) % nb_objects;
+        }
+        duration = picoquic_current_time() - start_time;
+        if (duration == 0) {
+            duration = 1;
+        }
+        *lookups_per_second = (((uint64_t)FRAGMENT_BENCH_NB_LOOKUPS) * 1000000) / duration;
+        free(reader_position);
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_bench_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_BENCH_FRAGMENT_SIZE * FRAGMENT_BENCH_FRAGMENTS_PER_OBJECT];
+    quicrq_media_source_ctx_t* srce_ctx = (quicrq_media_source_ctx_t*)malloc(sizeof(quicrq_media_source_ctx_t));
+    quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(NULL);
+    const size_t nb_readers[] = { 1, 100, 1000 };
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+
+    if (cache_ctx == NULL || srce_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(srce_ctx, 0, sizeof(quicrq_media_source_ctx_t));
+        cache_ctx->srce_ctx = srce_ctx;
+        /* Fill the cache */
+        for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_BENCH_NB_GROUPS; group_id++) {
+            for (uint64_t object_id = 0; ret == 0 && object_id < FRAGMENT_BENCH_OBJECTS_PER_GROUP; object_id++) {
+                uint64_t nb_objects_previous_group = (object_id == 0 && group_id > 0) ? FRAGMENT_BENCH_OBJECTS_PER_GROUP : 0;
+                for (size_t f_id = 0; ret == 0 && f_id < FRAGMENT_BENCH_FRAGMENTS_PER_OBJECT; f_id++) {
+                    size_t offset = f_id * FRAGMENT_BENCH_FRAGMENT_SIZE;
+                    ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, group_id, object_id, offset, 0, 0,
+                        (offset == 0) ? nb_objects_previous_group : 0, sizeof(data), FRAGMENT_BENCH_FRAGMENT_SIZE, 0);
+                }
+            }
+        }
+        if (ret == 0 && cache_ctx->nb_cached_objects != FRAGMENT_BENCH_NB_GROUPS * FRAGMENT_BENCH_OBJECTS_PER_GROUP) {
+            DBG_PRINTF("Expected %d objects in directory, got %zu", FRAGMENT_BENCH_NB_GROUPS * FRAGMENT_BENCH_OBJECTS_PER_GROUP,
+                cache_ctx->nb_cached_objects);
+            ret = -1;
+        }
+        /* Compare the lookup rates. The directory lookups shall not touch the splays. */
+        for (size_t i = 0; ret == 0 && i < sizeof(nb_readers) / sizeof(size_t); i++) {
+            uint64_t splay_rate = 0;
+            uint64_t directory_rate = 0;
+            picosplay_node_t* roots[FRAGMENT_BENCH_NB_GROUPS];
+
+            ret = quicrq_fragment_cache_bench_one(cache_ctx, nb_readers[i], 1, &splay_rate);
+            if (ret == 0) {
+                ret = quicrq_fragment_cache_bench_roots(cache_ctx, roots, 0);
+            }
+            if (ret == 0) {
+                ret = quicrq_fragment_cache_bench_one(cache_ctx, nb_readers[i], 0, &directory_rate);
+            }
+            if (ret == 0) {
+                ret = quicrq_fragment_cache_bench_roots(cache_ctx, roots, 1);
+            }
+            if (ret == 0) {
+                DBG_PRINTF("%zu readers, splay: %" PRIu64 " lookups/s, directory: %" PRIu64 " lookups/s",
+                    nb_readers[i], splay_rate, directory_rate);
+            }
+        }
+    }
+
+    if (srce_ctx != NULL) {
+        free(srce_ctx);
+    }
+
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+
+    return ret;
+}
+
+/* Test of the slab allocator of the fragment cache.
+ * Fill the cache with a mix of fragment sizes, including fragments too
+ * large for the slab classes, and verify that the allocator statistics
+ * return to zero once the old groups are purged and the cache is cleared.
+ * Then verify that a small group only reserves small chunks, and that
+ * a group far ahead of the cached groups is accepted without growing
+ * the group ring beyond bounds.
+ */
+#define FRAGMENT_SLAB_NB_GROUPS 20
+#define FRAGMENT_SLAB_OBJECTS_PER_GROUP 10
+
+static int quicrq_fragment_cache_slab_check(quicrq_fragment_cache_t* cache_ctx, size_t expected_live)
+{
+    int ret = 0;
+    size_t bytes_reserved = 0;
+    size_t bytes_live = 0;
+    size_t nb_chunks = 0;
+
+    quicrq_fragment_cache_get_memory_stats(cache_ctx, &bytes_reserved, &bytes_live, &nb_chunks);
+    if (bytes_live != expected_live || bytes_reserved < bytes_live ||
+        (bytes_live == 0 && (bytes_reserved != 0 || nb_chunks != 0))) {
+        DBG_PRINTF("Slab stats: reserved %zu, live %zu (expected %zu), chunks %zu",
+            bytes_reserved, bytes_live, expected_live, nb_chunks);
+        ret = -1;
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_slab_test()
+{
+    int ret = 0;
+    const size_t fragment_size[] = { 20, 300, 1200, 2000 };
+    size_t nb_sizes = sizeof(fragment_size) / sizeof(size_t);
+    size_t object_length = 0;
+    size_t group_bytes = 0;
+    uint8_t data[3520];
+    quicrq_media_source_ctx_t* srce_ctx = (quicrq_media_source_ctx_t*)malloc(sizeof(quicrq_media_source_ctx_t));
+    quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(NULL);
+
+    for (size_t i = 0; i < nb_sizes; i++) {
+        object_length += fragment_size[i];
+        group_bytes += sizeof(quicrq_cached_fragment_t) + fragment_size[i];
+    }
+    /* Each object also has a reception state, with a single range since fragments arrive in order */
+    group_bytes += sizeof(quicrq_cached_object_ranges_t);
+    group_bytes *= FRAGMENT_SLAB_OBJECTS_PER_GROUP;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+
+    if (cache_ctx == NULL || srce_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(srce_ctx, 0, sizeof(quicrq_media_source_ctx_t));
+        cache_ctx->srce_ctx = srce_ctx;
+        srce_ctx->cache_ctx = cache_ctx;
+        /* Fill the cache */
+        for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_SLAB_NB_GROUPS; group_id++) {
+            for (uint64_t object_id = 0; ret == 0 && object_id < FRAGMENT_SLAB_OBJECTS_PER_GROUP; object_id++) {
+                uint64_t nb_objects_previous_group = (object_id == 0 && group_id > 0) ? FRAGMENT_SLAB_OBJECTS_PER_GROUP : 0;
+                size_t offset = 0;
+                for (size_t f_id = 0; ret == 0 && f_id < nb_sizes; f_id++) {
+                    ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, group_id, object_id, offset, 0, 0,
+                        (offset == 0) ? nb_objects_previous_group : 0, object_length, fragment_size[f_id], 0);
+                    offset += fragment_size[f_id];
+                }
+            }
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_cache_slab_check(cache_ctx, FRAGMENT_SLAB_NB_GROUPS * group_bytes);
+        }
+        if (ret == 0) {
+            /* Purge all groups except the last one */
+            quicrq_fragment_cache_media_purge_to_gob(srce_ctx);
+            ret = quicrq_fragment_cache_slab_check(cache_ctx, group_bytes);
+        }
+        if (ret == 0) {
+            quicrq_fragment_cache_media_clear(cache_ctx);
+            ret = quicrq_fragment_cache_slab_check(cache_ctx, 0);
+        }
+        if (ret == 0) {
+            /* A group with a single small object only reserves small chunks */
+            size_t bytes_reserved = 0;
+            size_t bytes_live = 0;
+            size_t nb_chunks = 0;
+
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data, FRAGMENT_SLAB_NB_GROUPS, 0, 0, 0, 0,
+                FRAGMENT_SLAB_OBJECTS_PER_GROUP, fragment_size[0], fragment_size[0], 0);
+            quicrq_fragment_cache_get_memory_stats(cache_ctx, &bytes_reserved, &bytes_live, &nb_chunks);
+            if (ret == 0 && bytes_reserved > nb_chunks * (sizeof(quicrq_fragment_chunk_t) + QUICRQ_FRAGMENT_CHUNK_SIZE_MIN)) {
+                DBG_PRINTF("Small group reserves %zu bytes in %zu chunks", bytes_reserved, nb_chunks);
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            /* Groups far apart are all kept, in order, and the ring only grows with the number of groups */
+            uint64_t group_ids[4] = { FRAGMENT_SLAB_NB_GROUPS, FRAGMENT_SLAB_NB_GROUPS + 0x10, FRAGMENT_SLAB_NB_GROUPS + 0x100000,
+                FRAGMENT_SLAB_NB_GROUPS + 0x10000000000ull };
+            quicrq_cached_fragment_t* fragment = NULL;
+
+            for (int i = 3; ret == 0 && i > 0; i--) {
+                ret = quicrq_fragment_propose_to_cache(cache_ctx, data, group_ids[i], 0, 0, 0, 0,
+                    1, fragment_size[0], fragment_size[0], 0);
+            }
+            if (ret == 0 && (cache_ctx->nb_cached_groups != 4 || cache_ctx->group_ring_size > 8)) {
+                DBG_PRINTF("Far groups, %zu groups, ring size %zu", cache_ctx->nb_cached_groups, cache_ctx->group_ring_size);
+                ret = -1;
+            }
+            fragment = quicrq_fragment_cache_first_fragment(cache_ctx);
+            for (int i = 0; ret == 0 && i < 4; i++) {
+                if (fragment == NULL || fragment->group_id != group_ids[i] ||
+                    quicrq_fragment_cache_get_group(cache_ctx, group_ids[i]) != fragment->group ||
+                    quicrq_fragment_cache_find_previous(cache_ctx, group_ids[i] + 1, 0, 0) != fragment) {
+                    DBG_PRINTF("Far group %d not found", i);
+                    ret = -1;
+                }
+                else {
+                    fragment = quicrq_fragment_cache_next_fragment(cache_ctx, fragment);
+                }
+            }
+            if (ret == 0 && fragment != NULL) {
+                DBG_PRINTF("%s", "Unexpected fragment after the far groups");
+                ret = -1;
+            }
+            if (ret == 0 && quicrq_fragment_cache_get_group(cache_ctx, FRAGMENT_SLAB_NB_GROUPS + 8) != NULL) {
+                DBG_PRINTF("%s", "Found a group sharing a ring slot with a cached group");
+                ret = -1;
+            }
+        }
+    }
+
+    if (srce_ctx != NULL) {
+        free(srce_ctx);
+    }
+
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+
+    return ret;
+}
+
+/* Test of the purge of whole groups.
+ * Each group starts with a large object split in many fragments, as would
+ * be the case for an I-frame, followed by smaller objects. The fragments of
+ * successive groups are interleaved in arrival order. We verify that purging
+ * old groups leaves a consistent cache, and report the purge duration.
+ * We also verify that fragments referenced outside of the cache remain
+ * available after their group is purged, or after the cache is deleted.
+ */
+#define FRAGMENT_PURGE_NB_GROUPS 32
+#define FRAGMENT_PURGE_OBJECTS_PER_GROUP 30
+#define FRAGMENT_PURGE_FRAGMENTS_FIRST_OBJECT 300
+#define FRAGMENT_PURGE_FRAGMENT_SIZE 1000
+
+static int quicrq_fragment_cache_purge_check(quicrq_fragment_cache_t* cache_ctx, uint64_t first_group_id, uint64_t first_object_id)
+{
+    int ret = 0;
+    size_t nb_in_chain = 0;
+    size_t nb_in_order = 0;
+    size_t nb_objects = 0;
+    quicrq_cached_fragment_t* fragment = cache_ctx->first_fragment;
+
+    while (fragment != NULL && ret == 0) {
+        if (fragment->group_id < first_group_id ||
+            (fragment->group_id == first_group_id && fragment->object_id < first_object_id)) {
+            DBG_PRINTF("Fragment %" PRIu64 "/%" PRIu64 " should have been purged", fragment->group_id, fragment->object_id);
+            ret = -1;
+        }
+        nb_in_chain++;
+        fragment = fragment->next_in_order;
+    }
+    fragment = quicrq_fragment_cache_first_fragment(cache_ctx);
+    while (fragment != NULL && ret == 0) {
+        if (fragment->offset == 0) {
+            nb_objects++;
+            if (quicrq_fragment_cache_get_object(cache_ctx, fragment->group_id, fragment->object_id) == NULL) {
+                DBG_PRINTF("Object %" PRIu64 "/%" PRIu64 " not in directory", fragment->group_id, fragment->object_id);
+                ret = -1;
+            }
+        }
+        nb_in_order++;
+        fragment = quicrq_fragment_cache_next_fragment(cache_ctx, fragment);
+    }
+    if (ret == 0 && (nb_in_chain != cache_ctx->nb_cached_fragments || nb_in_order != cache_ctx->nb_cached_fragments ||
+        nb_objects != cache_ctx->nb_cached_objects)) {
+        DBG_PRINTF("Found %zu fragments in chain, %zu in order, %zu objects, expected %zu and %zu",
+            nb_in_chain, nb_in_order, nb_objects, cache_ctx->nb_cached_fragments, cache_ctx->nb_cached_objects);
+        ret = -1;
+    }
+    return ret;
+}
+
+static int quicrq_fragment_cache_purge_fill_object(quicrq_fragment_cache_t* cache_ctx, uint8_t* data,
+    uint64_t group_id, uint64_t object_id)
+{
+    int ret = 0;
+    size_t nb_fragments = (object_id == 0) ? FRAGMENT_PURGE_FRAGMENTS_FIRST_OBJECT : 1;
+    uint64_t nb_objects_previous_group = (object_id == 0 && group_id > 0) ? FRAGMENT_PURGE_OBJECTS_PER_GROUP : 0;
+
+    for (size_t f_id = 0; ret == 0 && f_id < nb_fragments; f_id++) {
+        uint64_t offset = f_id * FRAGMENT_PURGE_FRAGMENT_SIZE;
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, group_id, object_id, offset, 0, 0,
+            (offset == 0) ? nb_objects_previous_group : 0, nb_fragments * FRAGMENT_PURGE_FRAGMENT_SIZE,
+            FRAGMENT_PURGE_FRAGMENT_SIZE, 0);
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_purge_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_PURGE_FRAGMENT_SIZE];
+    quicrq_media_source_ctx_t* srce_ctx = (quicrq_media_source_ctx_t*)malloc(sizeof(quicrq_media_source_ctx_t));
+    quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(NULL);
+    quicrq_cached_fragment_t* referenced = NULL;
+
+    memset(data, 0xAA, sizeof(data));
+
+    if (cache_ctx == NULL || srce_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(srce_ctx, 0, sizeof(quicrq_media_source_ctx_t));
+        cache_ctx->srce_ctx = srce_ctx;
+        srce_ctx->cache_ctx = cache_ctx;
+        /* Fill the cache, with the first object of each group arriving
+         * before the last objects of the previous group */
+        for (uint64_t group_id = 0; ret == 0 && group_id <= FRAGMENT_PURGE_NB_GROUPS; group_id++) {
+            for (uint64_t object_id = 1; ret == 0 && group_id > 0 && object_id < FRAGMENT_PURGE_OBJECTS_PER_GROUP; object_id++) {
+                ret = quicrq_fragment_cache_purge_fill_object(cache_ctx, data, group_id - 1, object_id);
+                if (ret == 0 && object_id == FRAGMENT_PURGE_OBJECTS_PER_GROUP / 2 && group_id < FRAGMENT_PURGE_NB_GROUPS) {
+                    ret = quicrq_fragment_cache_purge_fill_object(cache_ctx, data, group_id, 0);
+                }
+            }
+            if (ret == 0 && group_id == 0) {
+                ret = quicrq_fragment_cache_purge_fill_object(cache_ctx, data, group_id, 0);
+            }
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_cache_purge_check(cache_ctx, 0, 0);
+        }
+        if (ret == 0 && cache_ctx->next_group_id != FRAGMENT_PURGE_NB_GROUPS - 1) {
+            DBG_PRINTF("Next group is %" PRIu64 ", expected %d", cache_ctx->next_group_id, FRAGMENT_PURGE_NB_GROUPS - 1);
+            ret = -1;
+        }
+        if (ret == 0) {
+            /* Drop the first objects of the first group, as if a start point was learned */
+            ret = quicrq_fragment_cache_learn_start_point(cache_ctx, 0, 2);
+            if (ret == 0) {
+                ret = quicrq_fragment_cache_purge_check(cache_ctx, 0, 2);
+            }
+        }
+        if (ret == 0) {
+            /* Keep a reference to a fragment of the first group, as would a datagram ack state */
+            referenced = quicrq_fragment_cache_get_fragment(cache_ctx, 0, FRAGMENT_PURGE_OBJECTS_PER_GROUP - 1, 0);
+            if (referenced == NULL) {
+                ret = -1;
+            }
+            else {
+                quicrq_fragment_cache_ref(referenced);
+            }
+        }
+        if (ret == 0) {
+            /* Purge all groups except the last one */
+            size_t nb_fragments_before = cache_ctx->nb_cached_fragments;
+            uint64_t start_time = picoquic_current_time();
+            uint64_t duration;
+
+            quicrq_fragment_cache_media_purge_to_gob(srce_ctx);
+            duration = picoquic_current_time() - start_time;
+            DBG_PRINTF("Purged %zu fragments in %" PRIu64 " us", nb_fragments_before - cache_ctx->nb_cached_fragments, duration);
+            ret = quicrq_fragment_cache_purge_check(cache_ctx, FRAGMENT_PURGE_NB_GROUPS - 1, 0);
+            if (ret == 0 && (cache_ctx->nb_cached_groups != 1 ||
+                cache_ctx->nb_cached_fragments != FRAGMENT_PURGE_FRAGMENTS_FIRST_OBJECT + FRAGMENT_PURGE_OBJECTS_PER_GROUP - 1)) {
+                DBG_PRINTF("After purge, %zu groups, %zu fragments", cache_ctx->nb_cached_groups, cache_ctx->nb_cached_fragments);
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            /* The referenced fragment was purged, but its data shall remain available */
+            if (referenced->data_length != FRAGMENT_PURGE_FRAGMENT_SIZE ||
+                memcmp(referenced->data, data, FRAGMENT_PURGE_FRAGMENT_SIZE) != 0) {
+                DBG_PRINTF("%s", "Referenced fragment was modified by the purge");
+                ret = -1;
+            }
+            quicrq_fragment_cache_unref(referenced);
+            referenced = NULL;
+        }
+        if (ret == 0) {
+            /* Keep a reference across the deletion of the cache */
+            referenced = quicrq_fragment_cache_first_fragment(cache_ctx);
+            if (referenced == NULL) {
+                ret = -1;
+            }
+            else {
+                quicrq_fragment_cache_ref(referenced);
+            }
+        }
+    }
+
+    if (srce_ctx != NULL) {
+        free(srce_ctx);
+    }
+
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+
+    if (referenced != NULL) {
+        if (memcmp(referenced->data, data, referenced->data_length) != 0) {
+            DBG_PRINTF("%s", "Referenced fragment was modified by the cache deletion");
+            ret = -1;
+        }
+        quicrq_fragment_cache_unref(referenced);
+    }
+
+    return ret;
+}
+
+/* Test of the cache memory budget.
+ * Two caches are filled in the same context, and the memory limit is lowered
+ * in two steps. We verify that groups are evicted from the least recently read
+ * cache first, oldest group first, that the group read by a subscriber is
+ * never evicted, and that the memory accounting of the context is exact.
+ * When nothing more can be evicted, enforcement is only requested again
+ * after the reserved memory grows.
+ */
+#define FRAGMENT_MEMORY_NB_GROUPS 8
+#define FRAGMENT_MEMORY_OBJECTS_PER_GROUP 10
+#define FRAGMENT_MEMORY_FRAGMENT_SIZE 1000
+#define FRAGMENT_MEMORY_READ_GROUP 2
+
+static int quicrq_fragment_cache_memory_check(quicrq_ctx_t* qr_ctx, quicrq_fragment_cache_t** cache_ctx, size_t nb_caches)
+{
+    int ret = 0;
+    size_t total_reserved = 0;
+
+    for (size_t i = 0; i < nb_caches; i++) {
+        size_t bytes_reserved = 0;
+        size_t bytes_live = 0;
+        size_t nb_chunks = 0;
+
+        quicrq_fragment_cache_get_memory_stats(cache_ctx[i], &bytes_reserved, &bytes_live, &nb_chunks);
+        if (bytes_reserved != cache_ctx[i]->bytes_reserved) {
+            DBG_PRINTF("Cache %zu accounts %zu bytes, slabs hold %zu", i, cache_ctx[i]->bytes_reserved, bytes_reserved);
+            ret = -1;
+        }
+        total_reserved += bytes_reserved;
+    }
+    if (ret == 0 && total_reserved != quicrq_get_cache_memory_used(qr_ctx)) {
+        DBG_PRINTF("Context accounts %zu bytes, caches hold %zu", quicrq_get_cache_memory_used(qr_ctx), total_reserved);
+        ret = -1;
+    }
+    if (ret == 0 && qr_ctx->cache_memory_limit > 0 && quicrq_get_cache_memory_used(qr_ctx) > qr_ctx->cache_memory_limit) {
+        DBG_PRINTF("Context uses %zu bytes, above limit %zu", quicrq_get_cache_memory_used(qr_ctx), qr_ctx->cache_memory_limit);
+        ret = -1;
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_memory_limit_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_MEMORY_FRAGMENT_SIZE];
+    quicrq_ctx_t* qr_ctx = (quicrq_ctx_t*)malloc(sizeof(quicrq_ctx_t));
+    quicrq_media_source_ctx_t srce_ctx[2];
+    quicrq_fragment_cache_t* cache_ctx[2] = { NULL, NULL };
+    quicrq_stream_ctx_t reader_stream_ctx;
+    quicrq_fragment_publisher_context_t reader_media_ctx;
+
+    memset(data, 0x55, sizeof(data));
+    memset(srce_ctx, 0, sizeof(srce_ctx));
+    memset(&reader_stream_ctx, 0, sizeof(reader_stream_ctx));
+    memset(&reader_media_ctx, 0, sizeof(reader_media_ctx));
+
+    if (qr_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(qr_ctx, 0, sizeof(quicrq_ctx_t));
+        qr_ctx->first_source = &srce_ctx[0];
+        srce_ctx[0].next_source = &srce_ctx[1];
+        for (int i = 0; ret == 0 && i < 2; i++) {
+            if ((cache_ctx[i] = quicrq_fragment_cache_create_ctx(qr_ctx)) == NULL) {
+                ret = -1;
+            }
+            else {
+                cache_ctx[i]->srce_ctx = &srce_ctx[i];
+                srce_ctx[i].cache_ctx = cache_ctx[i];
+            }
+        }
+    }
+
+    /* Fill both caches */
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_MEMORY_NB_GROUPS; group_id++) {
+            for (uint64_t object_id = 0; ret == 0 && object_id < FRAGMENT_MEMORY_OBJECTS_PER_GROUP; object_id++) {
+                ret = quicrq_fragment_propose_to_cache(cache_ctx[i], data, group_id, object_id, 0, 0, 0,
+                    (object_id == 0 && group_id > 0) ? FRAGMENT_MEMORY_OBJECTS_PER_GROUP : 0,
+                    FRAGMENT_MEMORY_FRAGMENT_SIZE, FRAGMENT_MEMORY_FRAGMENT_SIZE, 0);
+            }
+        }
+    }
+    if (ret == 0) {
+        ret = quicrq_fragment_cache_memory_check(qr_ctx, cache_ctx, 2);
+    }
+
+    if (ret == 0) {
+        /* The second cache was read more recently, and has a subscriber reading a group */
+        size_t used = quicrq_get_cache_memory_used(qr_ctx);
+        quicrq_fragment_cache_set_read_time(cache_ctx[1], 100);
+        quicrq_fragment_cache_set_read_time(cache_ctx[0], 150);
+        quicrq_fragment_cache_set_read_time(cache_ctx[1], 200);
+        reader_media_ctx.current_group_id = FRAGMENT_MEMORY_READ_GROUP;
+        reader_stream_ctx.media_ctx = &reader_media_ctx;
+        srce_ctx[1].first_stream = &reader_stream_ctx;
+
+        /* Lower the limit by a quarter: only the oldest groups of the first cache are evicted */
+        quicrq_set_cache_memory_limit(qr_ctx, used - used / 4);
+        quicrq_fragment_cache_enforce_memory_limit(qr_ctx);
+        ret = quicrq_fragment_cache_memory_check(qr_ctx, cache_ctx, 2);
+        if (ret == 0 && (cache_ctx[0]->ring_first_group_id == 0 || cache_ctx[0]->first_group_id != cache_ctx[0]->ring_first_group_id ||
+            cache_ctx[1]->nb_cached_groups != FRAGMENT_MEMORY_NB_GROUPS)) {
+            DBG_PRINTF("Unexpected eviction, first groups %" PRIu64 ", %" PRIu64 ", nb groups %zu",
+                cache_ctx[0]->ring_first_group_id, cache_ctx[1]->ring_first_group_id, cache_ctx[1]->nb_cached_groups);
+            ret = -1;
+        }
+        if (ret == 0) {
+            /* Lower the limit so that all evictable groups are evicted. */
+            quicrq_set_cache_memory_limit(qr_ctx, used / 8);
+            quicrq_fragment_cache_enforce_memory_limit(qr_ctx);
+            if (cache_ctx[0]->nb_cached_groups != 0 || cache_ctx[0]->first_group_id != FRAGMENT_MEMORY_NB_GROUPS ||
+                cache_ctx[1]->nb_cached_groups != FRAGMENT_MEMORY_NB_GROUPS - FRAGMENT_MEMORY_READ_GROUP ||
+                cache_ctx[1]->ring_first_group_id != FRAGMENT_MEMORY_READ_GROUP) {
+                DBG_PRINTF("Unexpected eviction, nb groups %zu, %zu, first group %" PRIu64,
+                    cache_ctx[0]->nb_cached_groups, cache_ctx[1]->nb_cached_groups, cache_ctx[1]->ring_first_group_id);
+                ret = -1;
+            }
+            else if (qr_ctx->is_cache_memory_check_needed) {
+                DBG_PRINTF("%s", "Enforcement still requested when nothing can be evicted");
+                ret = -1;
+            }
+            else if ((ret = quicrq_fragment_propose_to_cache(cache_ctx[0], data, FRAGMENT_MEMORY_NB_GROUPS, 0, 0, 0, 0,
+                FRAGMENT_MEMORY_OBJECTS_PER_GROUP, FRAGMENT_MEMORY_FRAGMENT_SIZE, FRAGMENT_MEMORY_FRAGMENT_SIZE, 0)) != 0 ||
+                !qr_ctx->is_cache_memory_check_needed) {
+                DBG_PRINTF("%s", "Enforcement not requested after the reserved memory grew above the limit");
+                ret = -1;
+            }
+            else {
+                /* The limit cannot be met, but the accounting shall be correct */
+                quicrq_set_cache_memory_limit(qr_ctx, 0);
+                ret = quicrq_fragment_cache_memory_check(qr_ctx, cache_ctx, 2);
+            }
+        }
+        if (ret == 0) {
+            /* Late fragments of evicted groups are ignored, only the fragment of the new group is cached */
+            ret = quicrq_fragment_propose_to_cache(cache_ctx[0], data, 3, 1, 0, 0, 0, 0,
+                FRAGMENT_MEMORY_FRAGMENT_SIZE, FRAGMENT_MEMORY_FRAGMENT_SIZE, 0);
+            if (ret == 0 && cache_ctx[0]->nb_cached_fragments != 1) {
+                DBG_PRINTF("%s", "Late fragment of evicted group was cached");
+                ret = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (cache_ctx[i] != NULL) {
+            quicrq_fragment_cache_delete_ctx(cache_ctx[i]);
+        }
+    }
+
+    if (qr_ctx != NULL) {
+        if (ret == 0 && quicrq_get_cache_memory_used(qr_ctx) != 0) {
+            DBG_PRINTF("%zu bytes still accounted after deleting the caches", quicrq_get_cache_memory_used(qr_ctx));
+            ret = -1;
+        }
+        free(qr_ctx);
+    }
+
+    return ret;
+}
+
+/* Deleting a published source shall also remove its cache from the list
+ * of caches used for the memory limit. Publish an object source between two
+ * plain caches, delete it, then create another cache and enforce the limit,
+ * which both walk through the list.
+ */
+static int quicrq_fragment_cache_lru_check(quicrq_ctx_t* qr_ctx, quicrq_fragment_cache_t** expected, size_t nb_expected)
+{
+    int ret = 0;
+    quicrq_fragment_cache_t* cache_ctx = qr_ctx->first_lru_cache;
+    quicrq_fragment_cache_t* previous_cache_ctx = NULL;
+    size_t nb_found = 0;
+
+    while (ret == 0 && cache_ctx != NULL) {
+        if (nb_found >= nb_expected || cache_ctx != expected[nb_found] || cache_ctx->previous_lru_cache != previous_cache_ctx) {
+            DBG_PRINTF("Unexpected cache at position %zu of the LRU list", nb_found);
+            ret = -1;
+        }
+        else {
+            previous_cache_ctx = cache_ctx;
+            cache_ctx = cache_ctx->next_lru_cache;
+            nb_found++;
+        }
+    }
+    if (ret == 0 && (nb_found != nb_expected || qr_ctx->last_lru_cache != previous_cache_ctx)) {
+        DBG_PRINTF("LRU list has %zu caches instead of %zu", nb_found, nb_expected);
+        ret = -1;
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_source_delete_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    uint8_t data[FRAGMENT_MEMORY_FRAGMENT_SIZE];
+    char const* url = "source_delete_test";
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_fragment_cache_t* cache_ctx[2] = { NULL, NULL };
+    quicrq_media_object_source_ctx_t* object_source_ctx = NULL;
+    quicrq_media_source_ctx_t srce_ctx;
+    quicrq_media_object_properties_t properties;
+
+    memset(data, 0x55, sizeof(data));
+    memset(&srce_ctx, 0, sizeof(srce_ctx));
+    memset(&properties, 0, sizeof(properties));
+
+    if (qr_ctx == NULL || (cache_ctx[1] = quicrq_fragment_cache_create_ctx(qr_ctx)) == NULL ||
+        (object_source_ctx = quicrq_publish_object_source(qr_ctx, (const uint8_t*)url, strlen(url), NULL)) == NULL) {
+        ret = -1;
+    }
+    else {
+        cache_ctx[1]->srce_ctx = &srce_ctx;
+        srce_ctx.cache_ctx = cache_ctx[1];
+    }
+
+    /* Fill the plain cache and the published source */
+    for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_MEMORY_NB_GROUPS; group_id++) {
+        for (uint64_t object_id = 0; ret == 0 && object_id < FRAGMENT_MEMORY_OBJECTS_PER_GROUP; object_id++) {
+            ret = quicrq_fragment_propose_to_cache(cache_ctx[1], data, group_id, object_id, 0, 0, 0,
+                (object_id == 0 && group_id > 0) ? FRAGMENT_MEMORY_OBJECTS_PER_GROUP : 0,
+                FRAGMENT_MEMORY_FRAGMENT_SIZE, FRAGMENT_MEMORY_FRAGMENT_SIZE, 0);
+            if (ret == 0) {
+                ret = quicrq_publish_object(object_source_ctx, data, FRAGMENT_MEMORY_FRAGMENT_SIZE, &properties, group_id, object_id);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* The source is at the head of the list. Delete it, and check that the memory is no longer accounted */
+        quicrq_delete_object_source(object_source_ctx);
+        object_source_ctx = NULL;
+        ret = quicrq_fragment_cache_lru_check(qr_ctx, &cache_ctx[1], 1);
+        if (ret == 0) {
+            ret = quicrq_fragment_cache_memory_check(qr_ctx, &cache_ctx[1], 1);
+        }
+    }
+
+    if (ret == 0) {
+        /* A new cache is linked at the head of the list */
+        if ((cache_ctx[0] = quicrq_fragment_cache_create_ctx(qr_ctx)) == NULL) {
+            ret = -1;
+        }
+        else {
+            ret = quicrq_fragment_cache_lru_check(qr_ctx, cache_ctx, 2);
+        }
+    }
+
+    if (ret == 0) {
+        /* Enforcing the limit walks the list, and evicts from the plain cache */
+        quicrq_set_cache_memory_limit(qr_ctx, quicrq_get_cache_memory_used(qr_ctx) / 2);
+        quicrq_fragment_cache_enforce_memory_limit(qr_ctx);
+        ret = quicrq_fragment_cache_memory_check(qr_ctx, cache_ctx, 2);
+        if (ret == 0 && cache_ctx[1]->ring_first_group_id == 0) {
+            DBG_PRINTF("%s", "No group evicted from the remaining cache");
+            ret = -1;
+        }
+    }
+
+    if (object_source_ctx != NULL) {
+        quicrq_delete_object_source(object_source_ctx);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (cache_ctx[i] != NULL) {
+            quicrq_fragment_cache_delete_ctx(cache_ctx[i]);
+        }
+    }
+    if (qr_ctx != NULL) {
+        if (ret == 0 && (qr_ctx->first_lru_cache != NULL || qr_ctx->last_lru_cache != NULL)) {
+            DBG_PRINTF("%s", "Caches still listed after deleting them");
+            ret = -1;
+        }
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+/* Deferred release of referenced fragments.
+ * Datagram ack states keep references to the fragments they may repeat.
+ * A group purged from the cache, or a fragment deleted from it, while still
+ * referenced stays in memory until the last reference is dropped. The memory
+ * of purged groups is no longer accounted to the context, and the memory of
+ * a deleted fragment is returned when its reference is dropped. Each object
+ * is larger than the slab classes, so it is freed with its own chunk.
+ */
+#define FRAGMENT_DEFERRED_NB_GROUPS 3
+#define FRAGMENT_DEFERRED_OBJECTS_PER_GROUP 4
+#define FRAGMENT_DEFERRED_OBJECT_SIZE 0x4000
+
+int quicrq_fragment_cache_deferred_release_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_DEFERRED_OBJECT_SIZE];
+    quicrq_ctx_t* qr_ctx = (quicrq_ctx_t*)malloc(sizeof(quicrq_ctx_t));
+    quicrq_media_source_ctx_t srce_ctx;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_cached_fragment_t* purged = NULL;
+    quicrq_cached_fragment_t* deleted = NULL;
+    quicrq_cached_fragment_t* orphan = NULL;
+
+    memset(data, 0x77, sizeof(data));
+    memset(&srce_ctx, 0, sizeof(srce_ctx));
+
+    if (qr_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(qr_ctx, 0, sizeof(quicrq_ctx_t));
+        if ((cache_ctx = quicrq_fragment_cache_create_ctx(qr_ctx)) == NULL) {
+            ret = -1;
+        }
+        else {
+            cache_ctx->srce_ctx = &srce_ctx;
+            srce_ctx.cache_ctx = cache_ctx;
+        }
+    }
+
+    for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_DEFERRED_NB_GROUPS; group_id++) {
+        for (uint64_t object_id = 0; ret == 0 && object_id < FRAGMENT_DEFERRED_OBJECTS_PER_GROUP; object_id++) {
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data, group_id, object_id, 0, 0, 0,
+                (object_id == 0 && group_id > 0) ? FRAGMENT_DEFERRED_OBJECTS_PER_GROUP : 0,
+                FRAGMENT_DEFERRED_OBJECT_SIZE, FRAGMENT_DEFERRED_OBJECT_SIZE, 0);
+        }
+    }
+
+    if (ret == 0) {
+        /* Reference a fragment of a group that will be purged, and one that will be deleted alone */
+        purged = quicrq_fragment_cache_get_fragment(cache_ctx, 0, 1, 0);
+        deleted = quicrq_fragment_cache_get_fragment(cache_ctx, FRAGMENT_DEFERRED_NB_GROUPS - 1, 0, 0);
+        if (purged == NULL || deleted == NULL) {
+            ret = -1;
+        }
+        else {
+            quicrq_fragment_cache_ref(purged);
+            quicrq_fragment_cache_ref(deleted);
+        }
+    }
+
+    if (ret == 0) {
+        /* The start point purges the first groups, and deletes the first object of the last group */
+        size_t used_before = quicrq_get_cache_memory_used(qr_ctx);
+
+        ret = quicrq_fragment_cache_learn_start_point(cache_ctx, FRAGMENT_DEFERRED_NB_GROUPS - 1, 1);
+        if (ret == 0) {
+            ret = quicrq_fragment_cache_memory_check(qr_ctx, &cache_ctx, 1);
+        }
+        if (ret == 0 && (cache_ctx->nb_cached_groups != 1 || purged->group->cache_ctx != NULL ||
+            !deleted->is_deleted || quicrq_get_cache_memory_used(qr_ctx) >= used_before)) {
+            DBG_PRINTF("After start point, %zu groups, %zu bytes used, %zu before",
+                cache_ctx->nb_cached_groups, quicrq_get_cache_memory_used(qr_ctx), used_before);
+            ret = -1;
+        }
+        if (ret == 0 && (memcmp(purged->data, data, purged->data_length) != 0 ||
+            memcmp(deleted->data, data, deleted->data_length) != 0)) {
+            DBG_PRINTF("%s", "Referenced fragment modified before the reference was dropped");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Dropping the reference to the deleted fragment returns its chunk */
+        size_t used_before = quicrq_get_cache_memory_used(qr_ctx);
+
+        quicrq_fragment_cache_unref(deleted);
+        deleted = NULL;
+        ret = quicrq_fragment_cache_memory_check(qr_ctx, &cache_ctx, 1);
+        if (ret == 0 && quicrq_get_cache_memory_used(qr_ctx) + FRAGMENT_DEFERRED_OBJECT_SIZE > used_before) {
+            DBG_PRINTF("Deleted fragment not returned, %zu bytes used, %zu before", quicrq_get_cache_memory_used(qr_ctx), used_before);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Dropping the reference to the purged group releases it, without changing the accounting */
+        size_t used_before = quicrq_get_cache_memory_used(qr_ctx);
+
+        quicrq_fragment_cache_unref(purged);
+        purged = NULL;
+        ret = quicrq_fragment_cache_memory_check(qr_ctx, &cache_ctx, 1);
+        if (ret == 0 && quicrq_get_cache_memory_used(qr_ctx) != used_before) {
+            DBG_PRINTF("Purged group accounted again, %zu bytes used, %zu before", quicrq_get_cache_memory_used(qr_ctx), used_before);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* A reference held across the deletion of the cache */
+        orphan = quicrq_fragment_cache_get_fragment(cache_ctx, FRAGMENT_DEFERRED_NB_GROUPS - 1, 1, 0);
+        if (orphan == NULL) {
+            ret = -1;
+        }
+        else {
+            quicrq_fragment_cache_ref(orphan);
+        }
+    }
+
+    if (purged != NULL) {
+        quicrq_fragment_cache_unref(purged);
+    }
+    if (deleted != NULL) {
+        quicrq_fragment_cache_unref(deleted);
+    }
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+    if (qr_ctx != NULL) {
+        if (ret == 0 && quicrq_get_cache_memory_used(qr_ctx) != 0) {
+            DBG_PRINTF("%zu bytes still accounted after deleting the cache", quicrq_get_cache_memory_used(qr_ctx));
+            ret = -1;
+        }
+        free(qr_ctx);
+    }
+    if (orphan != NULL) {
+        if (ret == 0 && memcmp(orphan->data, data, orphan->data_length) != 0) {
+            DBG_PRINTF("%s", "Referenced fragment modified by the cache deletion");
+            ret = -1;
+        }
+        quicrq_fragment_cache_unref(orphan);
+    }
+
+    return ret;
+}
+
+/* Micro benchmark of the stream sender.
+ * Stream a 2 MB object from the cache through quicrq_prepare_to_send_media_to_stream,
+ * as picoquic would when the stream is ready, and verify that the data
+ * is sent in sequence. The publisher resumes reading from its read cursor, so
+ * the cost of each call shall not depend on the position in the object.
+ * Then drop the group of that object from the cache, and verify that the
+ * cursor pointing to it is safely ignored.
+ */
+#define FRAGMENT_STREAM_BENCH_OBJECT_SIZE 0x200000
+#define FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE 1000
+#define FRAGMENT_STREAM_BENCH_PACKET_SIZE 1440
+
+static int quicrq_fragment_stream_bench_send(quicrq_stream_ctx_t* stream_ctx, const uint8_t* data,
+    uint64_t group_id, uint64_t object_id, size_t object_length, uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t packet[FRAGMENT_STREAM_BENCH_PACKET_SIZE];
+    int nb_calls = 0;
+
+    while (ret == 0 && (stream_ctx->next_group_id < group_id ||
+        (stream_ctx->next_group_id == group_id && stream_ctx->next_object_id <= object_id))) {
+        quicrq_test_stream_buffer_argument_t s_context;
+        size_t offset_before = (size_t)stream_ctx->next_object_offset;
+        size_t payload_length;
+
+        quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+        ret = quicrq_prepare_to_send_media_to_stream(stream_ctx, &s_context, s_context.allowed_space, current_time);
+        if (ret == 0) {
+            if (s_context.app_buffer == NULL || s_context.length == 0) {
+                DBG_PRINTF("No data sent at offset %zu", offset_before);
+                ret = -1;
+                break;
+            }
+            payload_length = (stream_ctx->next_object_offset == 0) ?
+                object_length - offset_before : (size_t)stream_ctx->next_object_offset - offset_before;
+            if (payload_length > s_context.length ||
+                memcmp(s_context.app_buffer + s_context.length - payload_length, data + offset_before, payload_length) != 0) {
+                DBG_PRINTF("Unexpected data sent at offset %zu", offset_before);
+                ret = -1;
+            }
+        }
+        nb_calls++;
+    }
+    if (ret == 0 && stream_ctx->next_object_offset != 0) {
+        ret = -1;
+    }
+    DBG_PRINTF("Sent object %" PRIu64 "/%" PRIu64 " in %d calls", group_id, object_id, nb_calls);
+    return ret;
+}
+
+int quicrq_fragment_stream_send_bench_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t* data = (uint8_t*)malloc(FRAGMENT_STREAM_BENCH_OBJECT_SIZE);
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+    quicrq_stream_ctx_t* stream_ctx = (cnx_ctx == NULL) ? NULL : quicrq_create_stream_context(cnx_ctx, 0);
+    quicrq_media_source_ctx_t* srce_ctx = (quicrq_media_source_ctx_t*)malloc(sizeof(quicrq_media_source_ctx_t));
+    quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(NULL);
+    quicrq_fragment_publisher_context_t* pub_ctx = NULL;
+
+    if (data == NULL || cache_ctx == NULL || srce_ctx == NULL || stream_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(srce_ctx, 0, sizeof(quicrq_media_source_ctx_t));
+        cache_ctx->srce_ctx = srce_ctx;
+        for (size_t i = 0; i < FRAGMENT_STREAM_BENCH_OBJECT_SIZE; i++) {
+            data[i] = (uint8_t)(i + (i >> 8));
+        }
+        /* Fill the cache with the large object, followed by a small object in the next group */
+        for (size_t offset = 0; ret == 0 && offset < FRAGMENT_STREAM_BENCH_OBJECT_SIZE; offset += FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE) {
+            size_t data_length = FRAGMENT_STREAM_BENCH_OBJECT_SIZE - offset;
+            if (data_length > FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE) {
+                data_length = FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE;
+            }
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, 0, 0, offset, 0, 0, 0,
+                FRAGMENT_STREAM_BENCH_OBJECT_SIZE, data_length, 0);
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 1, 0, 0, 0, 0, 1,
+                FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE, FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE, 0);
+        }
+        if (ret == 0) {
+            pub_ctx = (quicrq_fragment_publisher_context_t*)quicrq_fragment_publisher_subscribe(cache_ctx, stream_ctx);
+            if (pub_ctx == NULL) {
+                ret = -1;
+            }
+            else {
+                stream_ctx->media_ctx = pub_ctx;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+
+        ret = quicrq_fragment_stream_bench_send(stream_ctx, data, 0, 0, FRAGMENT_STREAM_BENCH_OBJECT_SIZE, simulated_time);
+        duration = picoquic_current_time() - start_time;
+        if (duration == 0) {
+            duration = 1;
+        }
+        DBG_PRINTF("Streamed %d bytes in %" PRIu64 " us, %" PRIu64 " MB/s", FRAGMENT_STREAM_BENCH_OBJECT_SIZE, duration,
+            ((uint64_t)FRAGMENT_STREAM_BENCH_OBJECT_SIZE) / duration);
+        if (ret == 0 && (pub_ctx->read_cursor == NULL || pub_ctx->read_cursor->group_id != 0)) {
+            DBG_PRINTF("%s", "Read cursor not set on the first group");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Drop the first group while the cursor points to it. */
+        ret = quicrq_fragment_cache_learn_start_point(cache_ctx, 1, 0);
+        if (ret == 0 && quicrq_fragment_cursor_get_fragment(cache_ctx, &pub_ctx->read_cursor, 0, 0,
+            FRAGMENT_STREAM_BENCH_OBJECT_SIZE - FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE) != NULL) {
+            DBG_PRINTF("%s", "Read cursor used after the group was dropped");
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_bench_send(stream_ctx, data, 1, 0, FRAGMENT_STREAM_BENCH_FRAGMENT_SIZE, simulated_time);
+        }
+    }
+
+    if (pub_ctx != NULL) {
+        stream_ctx->media_ctx = NULL;
+        quicrq_fragment_publisher_close(pub_ctx);
+    }
+
+    if (srce_ctx != NULL) {
+        free(srce_ctx);
+    }
+
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+
+    if (qr_ctx != NULL) {
+        /* This will also delete stream_ctx and cnx_ctx */
+        quicrq_delete(qr_ctx);
+    }
+
+    if (data != NULL) {
+        free(data);
+    }
+
+    return ret;
+}
+
+/* Unit test of the stream sender.
+ * The sender predicts the size of the fragment header from the available space,
+ * encodes it in place, and copies the data from several cached fragments.
+ * Verify the messages sent when the actual header is larger than predicted,
+ * so the data is truncated and the header shrinks; when the data spans several
+ * fragments; and when a placeholder replaces an object of which some bytes
+ * were already sent.
+ */
+#define FRAGMENT_STREAM_SEND_OBJECT_SIZE 20000
+#define FRAGMENT_STREAM_SEND_FRAGMENT_SIZE 100
+#define FRAGMENT_STREAM_SEND_PARTIAL_SIZE 1000
+#define FRAGMENT_STREAM_SEND_PARTIAL_SENT 300
+#define FRAGMENT_STREAM_SEND_PACKET_SIZE 1440
+/* With 75 bytes, 64 bytes of data are predicted, but the 4 bytes object length
+ * leaves room for 61 bytes only, which are encoded with a 1 byte length. */
+#define FRAGMENT_STREAM_SEND_SHRINK_SPACE 75
+#define FRAGMENT_STREAM_SEND_SHRINK_LENGTH 61
+
+static int quicrq_fragment_stream_send_one(quicrq_stream_ctx_t* stream_ctx, size_t space, uint64_t current_time,
+    quicrq_message_t* msg, size_t* length)
+{
+    int ret = 0;
+    uint8_t packet[FRAGMENT_STREAM_SEND_PACKET_SIZE + 3];
+    quicrq_test_stream_buffer_argument_t s_context;
+
+    memset(msg, 0, sizeof(quicrq_message_t));
+    *length = 0;
+    quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+    s_context.allowed_space = space;
+    ret = quicrq_prepare_to_send_media_to_stream(stream_ctx, &s_context, space, current_time);
+    if (ret == 0 && s_context.app_buffer != NULL && s_context.length > 0) {
+        const uint8_t* bytes_max = s_context.app_buffer + s_context.length;
+
+        *length = s_context.length;
+        if (s_context.length > space || s_context.length < 2 ||
+            (((size_t)s_context.app_buffer[0] << 8) | s_context.app_buffer[1]) != s_context.length - 2 ||
+            quicrq_msg_decode(s_context.app_buffer + 2, bytes_max, msg) != bytes_max ||
+            msg->message_type != QUICRQ_ACTION_FRAGMENT) {
+            DBG_PRINTF("Cannot decode the %zu bytes sent in %zu bytes of space", s_context.length, space);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int quicrq_fragment_stream_send_check(const quicrq_message_t* msg, uint64_t object_id, uint64_t offset,
+    uint64_t object_length, const uint8_t* data)
+{
+    int ret = 0;
+
+    if (msg->group_id != 0 || msg->object_id != object_id || msg->fragment_offset != offset ||
+        msg->object_length != object_length || msg->fragment_offset + msg->fragment_length > object_length ||
+        (msg->fragment_length > 0 && memcmp(msg->data, data + offset, msg->fragment_length) != 0)) {
+        DBG_PRINTF("Unexpected fragment %" PRIu64 "/%" PRIu64 " at offset %" PRIu64 ", length %zu",
+            msg->group_id, msg->object_id, msg->fragment_offset, msg->fragment_length);
+        ret = -1;
+    }
+    return ret;
+}
+
+int quicrq_fragment_stream_send_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_STREAM_SEND_OBJECT_SIZE];
+    uint8_t placeholder = 0;
+    quicrq_test_publisher_t publisher;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_stream_ctx_t* stream_ctx = NULL;
+    quicrq_message_t msg;
+    size_t length = 0;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    if (quicrq_test_publisher_init(&publisher, 1, quicrq_transport_mode_single_stream) != 0) {
+        ret = -1;
+    }
+    else {
+        cache_ctx = publisher.cache_ctx[0];
+        stream_ctx = publisher.stream_ctx[0];
+        /* A large object, and the first bytes of a second object */
+        for (size_t offset = 0; ret == 0 && offset < FRAGMENT_STREAM_SEND_OBJECT_SIZE; offset += FRAGMENT_STREAM_SEND_FRAGMENT_SIZE) {
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, 0, 0, offset, 0, 0, 0,
+                FRAGMENT_STREAM_SEND_OBJECT_SIZE, FRAGMENT_STREAM_SEND_FRAGMENT_SIZE, publisher.simulated_time);
+        }
+        for (size_t offset = 0; ret == 0 && offset < FRAGMENT_STREAM_SEND_PARTIAL_SENT; offset += FRAGMENT_STREAM_SEND_FRAGMENT_SIZE) {
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, 0, 1, offset, 0, 0, 0,
+                FRAGMENT_STREAM_SEND_PARTIAL_SIZE, FRAGMENT_STREAM_SEND_FRAGMENT_SIZE, publisher.simulated_time);
+        }
+    }
+
+    if (ret == 0) {
+        /* The header is larger than predicted, the data is truncated, and the header shrinks */
+        ret = quicrq_fragment_stream_send_one(stream_ctx, FRAGMENT_STREAM_SEND_SHRINK_SPACE, publisher.simulated_time, &msg, &length);
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_send_check(&msg, 0, 0, FRAGMENT_STREAM_SEND_OBJECT_SIZE, data);
+        }
+        if (ret == 0 && (msg.fragment_length != FRAGMENT_STREAM_SEND_SHRINK_LENGTH || length >= FRAGMENT_STREAM_SEND_SHRINK_SPACE ||
+            stream_ctx->next_object_offset != FRAGMENT_STREAM_SEND_SHRINK_LENGTH)) {
+            DBG_PRINTF("Sent %zu bytes of data in %zu bytes", msg.fragment_length, length);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* The rest of the object is sent in full packets, each spanning several fragments */
+        uint64_t offset = FRAGMENT_STREAM_SEND_SHRINK_LENGTH;
+
+        while (ret == 0 && offset < FRAGMENT_STREAM_SEND_OBJECT_SIZE) {
+            ret = quicrq_fragment_stream_send_one(stream_ctx, FRAGMENT_STREAM_SEND_PACKET_SIZE, publisher.simulated_time, &msg, &length);
+            if (ret == 0) {
+                ret = quicrq_fragment_stream_send_check(&msg, 0, offset, FRAGMENT_STREAM_SEND_OBJECT_SIZE, data);
+            }
+            if (ret == 0 && msg.fragment_offset + msg.fragment_length < FRAGMENT_STREAM_SEND_OBJECT_SIZE &&
+                (msg.fragment_length <= 2 * FRAGMENT_STREAM_SEND_FRAGMENT_SIZE || length != FRAGMENT_STREAM_SEND_PACKET_SIZE)) {
+                DBG_PRINTF("Sent %zu bytes of data in %zu bytes", msg.fragment_length, length);
+                ret = -1;
+            }
+            offset += msg.fragment_length;
+        }
+        if (ret == 0 && (stream_ctx->next_object_id != 1 || stream_ctx->next_object_offset != 0)) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Send the available part of the second object, then nothing until more data arrives */
+        ret = quicrq_fragment_stream_send_one(stream_ctx, FRAGMENT_STREAM_SEND_PACKET_SIZE, publisher.simulated_time, &msg, &length);
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_send_check(&msg, 1, 0, FRAGMENT_STREAM_SEND_PARTIAL_SIZE, data);
+        }
+        if (ret == 0 && (msg.fragment_length != FRAGMENT_STREAM_SEND_PARTIAL_SENT ||
+            (ret = quicrq_fragment_stream_send_one(stream_ctx, FRAGMENT_STREAM_SEND_PACKET_SIZE,
+                publisher.simulated_time, &msg, &length)) != 0 || length != 0)) {
+            DBG_PRINTF("Sent %zu bytes of the partial object, then %zu bytes", msg.fragment_length, length);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* A placeholder replaces the partial object, and is sent from offset 0 */
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, &placeholder, 0, 1, 0, 0, 0xff, 0, 0, 0, publisher.simulated_time);
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_send_one(stream_ctx, FRAGMENT_STREAM_SEND_PACKET_SIZE, publisher.simulated_time, &msg, &length);
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_send_check(&msg, 1, 0, 0, data);
+        }
+        if (ret == 0 && (msg.flags != 0xff || msg.fragment_length != 0 ||
+            stream_ctx->next_object_id != 2 || stream_ctx->next_object_offset != 0)) {
+            DBG_PRINTF("Placeholder sent with flags 0x%x, length %zu", msg.flags, msg.fragment_length);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* The next object is sent normally */
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 0, 2, 0, 0, 0, 0,
+            FRAGMENT_STREAM_SEND_FRAGMENT_SIZE, FRAGMENT_STREAM_SEND_FRAGMENT_SIZE, publisher.simulated_time);
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_send_one(stream_ctx, FRAGMENT_STREAM_SEND_PACKET_SIZE, publisher.simulated_time, &msg, &length);
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_stream_send_check(&msg, 2, 0, FRAGMENT_STREAM_SEND_FRAGMENT_SIZE, data);
+        }
+        if (ret == 0 && msg.fragment_length != FRAGMENT_STREAM_SEND_FRAGMENT_SIZE) {
+            ret = -1;
+        }
+    }
+
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+/* Add fragments received in order to the cache, as when receiving a loss-free
+ * datagram feed, and verify the progress and completeness counters. Then verify
+ * that duplicate and overlapping fragments, which are not appended, are handled.
+ */
+#define FRAGMENT_APPEND_NB_GROUPS 100
+#define FRAGMENT_APPEND_OBJECTS_PER_GROUP 100
+#define FRAGMENT_APPEND_FRAGMENTS_PER_OBJECT 10
+#define FRAGMENT_APPEND_FRAGMENT_SIZE 100
+
+int quicrq_fragment_cache_append_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_APPEND_FRAGMENT_SIZE * FRAGMENT_APPEND_FRAGMENTS_PER_OBJECT];
+    quicrq_media_source_ctx_t* srce_ctx = (quicrq_media_source_ctx_t*)malloc(sizeof(quicrq_media_source_ctx_t));
+    quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(NULL);
+    const size_t nb_fragments = FRAGMENT_APPEND_NB_GROUPS * FRAGMENT_APPEND_OBJECTS_PER_GROUP * FRAGMENT_APPEND_FRAGMENTS_PER_OBJECT;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+
+    if (cache_ctx == NULL || srce_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(srce_ctx, 0, sizeof(quicrq_media_source_ctx_t));
+        cache_ctx->srce_ctx = srce_ctx;
+        for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_APPEND_NB_GROUPS; group_id++) {
+            for (uint64_t object_id = 0; ret == 0 && object_id < FRAGMENT_APPEND_OBJECTS_PER_GROUP; object_id++) {
+                uint64_t nb_objects_previous_group = (object_id == 0 && group_id > 0) ? FRAGMENT_APPEND_OBJECTS_PER_GROUP : 0;
+                for (size_t f_id = 0; ret == 0 && f_id < FRAGMENT_APPEND_FRAGMENTS_PER_OBJECT; f_id++) {
+                    size_t offset = f_id * FRAGMENT_APPEND_FRAGMENT_SIZE;
+                    ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, group_id, object_id, offset, 0, 0,
+                        (offset == 0) ? nb_objects_previous_group : 0, sizeof(data), FRAGMENT_APPEND_FRAGMENT_SIZE, 0);
+                }
+            }
+        }
+        if (ret == 0 && (cache_ctx->nb_cached_fragments != nb_fragments ||
+            cache_ctx->nb_object_received != FRAGMENT_APPEND_NB_GROUPS * FRAGMENT_APPEND_OBJECTS_PER_GROUP ||
+            cache_ctx->next_group_id != FRAGMENT_APPEND_NB_GROUPS - 1 ||
+            cache_ctx->next_object_id != FRAGMENT_APPEND_OBJECTS_PER_GROUP || cache_ctx->next_offset != 0)) {
+            DBG_PRINTF("Unexpected cache state, %zu fragments, %" PRIu64 " objects, next %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+                cache_ctx->nb_cached_fragments, cache_ctx->nb_object_received,
+                cache_ctx->next_group_id, cache_ctx->next_object_id, cache_ctx->next_offset);
+            ret = -1;
+        }
+        if (ret == 0) {
+            /* Duplicates and overlapping data are handled by the slow path */
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data + FRAGMENT_APPEND_FRAGMENT_SIZE / 2,
+                FRAGMENT_APPEND_NB_GROUPS - 1, FRAGMENT_APPEND_OBJECTS_PER_GROUP - 1, FRAGMENT_APPEND_FRAGMENT_SIZE / 2, 0, 0, 0,
+                sizeof(data), FRAGMENT_APPEND_FRAGMENT_SIZE, 0);
+            if (ret == 0 && (cache_ctx->nb_cached_fragments != nb_fragments ||
+                cache_ctx->nb_object_received != FRAGMENT_APPEND_NB_GROUPS * FRAGMENT_APPEND_OBJECTS_PER_GROUP)) {
+                DBG_PRINTF("Overlapping fragment changed the cache, %zu fragments", cache_ctx->nb_cached_fragments);
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            /* Data extending past a cached fragment is added after it */
+            quicrq_cached_fragment_t* fragment;
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data, FRAGMENT_APPEND_NB_GROUPS, 0, 0, 0, 0,
+                FRAGMENT_APPEND_OBJECTS_PER_GROUP, sizeof(data), FRAGMENT_APPEND_FRAGMENT_SIZE, 0);
+            if (ret == 0) {
+                ret = quicrq_fragment_propose_to_cache(cache_ctx, data + FRAGMENT_APPEND_FRAGMENT_SIZE / 2, FRAGMENT_APPEND_NB_GROUPS, 0,
+                    FRAGMENT_APPEND_FRAGMENT_SIZE / 2, 0, 0, 0, sizeof(data), FRAGMENT_APPEND_FRAGMENT_SIZE, 0);
+            }
+            fragment = quicrq_fragment_cache_get_fragment(cache_ctx, FRAGMENT_APPEND_NB_GROUPS, 0, FRAGMENT_APPEND_FRAGMENT_SIZE);
+            if (ret == 0 && (fragment == NULL || fragment->data_length != FRAGMENT_APPEND_FRAGMENT_SIZE / 2 ||
+                memcmp(fragment->data, data + FRAGMENT_APPEND_FRAGMENT_SIZE, FRAGMENT_APPEND_FRAGMENT_SIZE / 2) != 0 ||
+                cache_ctx->next_offset != FRAGMENT_APPEND_FRAGMENT_SIZE + FRAGMENT_APPEND_FRAGMENT_SIZE / 2)) {
+                DBG_PRINTF("%s", "Overlapping fragment not added at the expected offset");
+                ret = -1;
+            }
+        }
+    }
+
+    if (srce_ctx != NULL) {
+        free(srce_ctx);
+    }
+
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+
+    return ret;
+}
+
+/* Test of the object reception ranges.
+ * Add the fragments of an object in a scrambled order, with duplicates, and
+ * verify that the received ranges are merged, and that the object is
+ * counted as received exactly when the last missing fragment arrives.
+ * Then verify that the fragments of an object can be found even if the
+ * first fragment of the object was not received.
+ */
+#define FRAGMENT_RANGES_NB_FRAGMENTS 64
+#define FRAGMENT_RANGES_FRAGMENT_SIZE 50
+
+int quicrq_fragment_cache_ranges_test()
+{
+    int ret = 0;
+    uint8_t data[FRAGMENT_RANGES_FRAGMENT_SIZE * FRAGMENT_RANGES_NB_FRAGMENTS];
+    quicrq_media_source_ctx_t* srce_ctx = (quicrq_media_source_ctx_t*)malloc(sizeof(quicrq_media_source_ctx_t));
+    quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(NULL);
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+
+    if (cache_ctx == NULL || srce_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(srce_ctx, 0, sizeof(quicrq_media_source_ctx_t));
+        cache_ctx->srce_ctx = srce_ctx;
+        for (size_t i = 0; ret == 0 && i < 2 * FRAGMENT_RANGES_NB_FRAGMENTS; i++) {
+            /* Visit the fragments in a scrambled order, then visit them all again as duplicates */
+            size_t f_id = ((i % FRAGMENT_RANGES_NB_FRAGMENTS) * 37) % FRAGMENT_RANGES_NB_FRAGMENTS;
+            size_t offset = f_id * FRAGMENT_RANGES_FRAGMENT_SIZE;
+            quicrq_cached_object_ranges_t* object_ranges;
+
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data + offset, 0, 0, offset, 0, 0, 0,
+                sizeof(data), FRAGMENT_RANGES_FRAGMENT_SIZE, 0);
+            object_ranges = quicrq_fragment_cache_get_object_ranges(cache_ctx, 0, 0);
+            if (ret == 0 && object_ranges == NULL) {
+                DBG_PRINTF("No reception state after fragment %zu", i);
+                ret = -1;
+            }
+            else if (ret == 0) {
+                size_t nb_received = (i < FRAGMENT_RANGES_NB_FRAGMENTS) ? i + 1 : FRAGMENT_RANGES_NB_FRAGMENTS;
+                uint64_t expected_count = (nb_received == FRAGMENT_RANGES_NB_FRAGMENTS) ? 1 : 0;
+                uint64_t bytes_in_ranges = 0;
+
+                for (size_t r = 0; r < object_ranges->nb_ranges; r++) {
+                    if (object_ranges->ranges[r].end <= object_ranges->ranges[r].start ||
+                        (r > 0 && object_ranges->ranges[r].start <= object_ranges->ranges[r - 1].end)) {
+                        DBG_PRINTF("Ranges not sorted and merged after fragment %zu", i);
+                        ret = -1;
+                    }
+                    bytes_in_ranges += object_ranges->ranges[r].end - object_ranges->ranges[r].start;
+                }
+                if (ret == 0 && (object_ranges->bytes_received != nb_received * FRAGMENT_RANGES_FRAGMENT_SIZE ||
+                    bytes_in_ranges != object_ranges->bytes_received ||
+                    cache_ctx->nb_object_received != expected_count)) {
+                    DBG_PRINTF("After fragment %zu, %" PRIu64 " bytes, %zu ranges, %" PRIu64 " objects received",
+                        i, object_ranges->bytes_received, object_ranges->nb_ranges, cache_ctx->nb_object_received);
+                    ret = -1;
+                }
+            }
+        }
+        if (ret == 0) {
+            quicrq_cached_object_ranges_t* object_ranges = quicrq_fragment_cache_get_object_ranges(cache_ctx, 0, 0);
+            if (!object_ranges->is_complete || object_ranges->nb_ranges != 1 ||
+                object_ranges->ranges[0].start != 0 || object_ranges->ranges[0].end != sizeof(data)) {
+                DBG_PRINTF("%s", "Object not complete after all fragments");
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            /* A fragment can be found even if the first fragment of its object is missing */
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data + FRAGMENT_RANGES_FRAGMENT_SIZE, 0, 1,
+                FRAGMENT_RANGES_FRAGMENT_SIZE, 0, 0, 0, sizeof(data), FRAGMENT_RANGES_FRAGMENT_SIZE, 0);
+            if (ret == 0 && (quicrq_fragment_cache_get_fragment(cache_ctx, 0, 1, FRAGMENT_RANGES_FRAGMENT_SIZE) == NULL ||
+                quicrq_fragment_cache_get_fragment(cache_ctx, 0, 1, 0) != NULL ||
+                quicrq_fragment_cache_get_fragment(cache_ctx, 0, 1, FRAGMENT_RANGES_FRAGMENT_SIZE / 2) != NULL)) {
+                DBG_PRINTF("%s", "Unexpected lookup of fragments of an object without its first fragment");
+                ret = -1;
+            }
+        }
+    }
+
+    if (srce_ctx != NULL) {
+        free(srce_ctx);
+    }
+
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+
+    return ret;
+}
+
+/* Test the tracking of reader positions.
+ * Many subscribers are registered on the same cache, each with a publisher
+ * object tree starting at a different group. The subscribers then advance,
+ * or close, and the lowest position read from the reader heap is compared
+ * to the value found by scanning all the subscribers.
+ */
+#define FRAGMENT_READERS_NB_READERS 1024
+#define FRAGMENT_READERS_NB_GROUPS 8
+#define FRAGMENT_READERS_NB_PURGES 10000
+
+static uint64_t quicrq_fragment_readers_scan(quicrq_fragment_publisher_context_t** readers)
+{
+    uint64_t lowest_group_id = UINT64_MAX;
+
+    for (size_t i = 0; i < FRAGMENT_READERS_NB_READERS; i++) {
+        if (readers[i] != NULL) {
+            quicrq_fragment_publisher_object_state_t* first_object = (quicrq_fragment_publisher_object_state_t*)
+                quicrq_fragment_cache_node_value(picosplay_first(&readers[i]->publisher_object_tree));
+            if (first_object != NULL && first_object->group_id < lowest_group_id) {
+                lowest_group_id = first_object->group_id;
+            }
+        }
+    }
+    return lowest_group_id;
+}
+
+static int quicrq_fragment_readers_check(quicrq_fragment_cache_t* cache_ctx,
+    quicrq_fragment_publisher_context_t** readers, int step)
+{
+    int ret = 0;
+    uint64_t expected = quicrq_fragment_readers_scan(readers);
+    uint64_t lowest = quicrq_fragment_cache_lowest_reader_group(cache_ctx);
+
+    if (lowest != expected) {
+        DBG_PRINTF("Step %d, lowest reader group %" PRIu64 ", expected %" PRIu64, step, lowest, expected);
+        ret = -1;
+    }
+    return ret;
+}
+
+int quicrq_fragment_cache_readers_test()
+{
+    int ret = 0;
+    uint8_t data[100];
+    quicrq_ctx_t* qr_ctx = (quicrq_ctx_t*)malloc(sizeof(quicrq_ctx_t));
+    quicrq_cnx_ctx_t* cnx_ctx = (quicrq_cnx_ctx_t*)malloc(sizeof(quicrq_cnx_ctx_t));
+    quicrq_stream_ctx_t* stream_ctx = (quicrq_stream_ctx_t*)malloc(FRAGMENT_READERS_NB_READERS * sizeof(quicrq_stream_ctx_t));
+    quicrq_fragment_publisher_context_t* readers[FRAGMENT_READERS_NB_READERS];
+    quicrq_media_source_ctx_t srce_ctx;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+
+    memset(data, 0x77, sizeof(data));
+    memset(readers, 0, sizeof(readers));
+    memset(&srce_ctx, 0, sizeof(srce_ctx));
+
+    if (qr_ctx == NULL || cnx_ctx == NULL || stream_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(qr_ctx, 0, sizeof(quicrq_ctx_t));
+        memset(cnx_ctx, 0, sizeof(quicrq_cnx_ctx_t));
+        memset(stream_ctx, 0, FRAGMENT_READERS_NB_READERS * sizeof(quicrq_stream_ctx_t));
+        cnx_ctx->qr_ctx = qr_ctx;
+        if ((cache_ctx = quicrq_fragment_cache_create_ctx(qr_ctx)) == NULL) {
+            ret = -1;
+        }
+        else {
+            cache_ctx->srce_ctx = &srce_ctx;
+            srce_ctx.cache_ctx = cache_ctx;
+        }
+    }
+
+    /* Fill the cache with one object per group */
+    for (uint64_t group_id = 0; ret == 0 && group_id <= FRAGMENT_READERS_NB_GROUPS; group_id++) {
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, group_id, 0, 0, 0, 0,
+            (group_id > 0) ? 1 : 0, sizeof(data), sizeof(data), 0);
+    }
+
+    /* Register the readers, each with two objects in sequence */
+    for (size_t i = 0; ret == 0 && i < FRAGMENT_READERS_NB_READERS; i++) {
+        uint64_t group_id = (uint64_t)((i * 5) % FRAGMENT_READERS_NB_GROUPS);
+
+        stream_ctx[i].cnx_ctx = cnx_ctx;
+        if ((readers[i] = (quicrq_fragment_publisher_context_t*)quicrq_fragment_publisher_subscribe(cache_ctx, &stream_ctx[i])) == NULL ||
+            quicrq_fragment_publisher_object_add(readers[i], group_id + 1, 0, sizeof(data)) == NULL ||
+            quicrq_fragment_publisher_object_add(readers[i], group_id, 0, sizeof(data)) == NULL) {
+            ret = -1;
+        }
+        else {
+            ret = quicrq_fragment_readers_check(cache_ctx, readers, (int)i);
+        }
+    }
+
+    /* Advance the readers one group at a time, by pruning the first object after it is sent */
+    for (uint64_t group_id = 0; ret == 0 && group_id < FRAGMENT_READERS_NB_GROUPS; group_id++) {
+        for (size_t i = 0; ret == 0 && i < FRAGMENT_READERS_NB_READERS; i++) {
+            quicrq_fragment_publisher_object_state_t* first_object = (quicrq_fragment_publisher_object_state_t*)
+                quicrq_fragment_cache_node_value(picosplay_first(&readers[i]->publisher_object_tree));
+            if ((uint64_t)((i * 5) % FRAGMENT_READERS_NB_GROUPS) == group_id) {
+                quicrq_fragment_publisher_object_state_t* next_object = quicrq_fragment_publisher_object_get(readers[i], group_id + 1, 0);
+                next_object->nb_objects_previous_group = 1;
+                first_object->is_sent = 1;
+                ret = quicrq_fragment_datagram_publisher_object_prune(readers[i]);
+                if (ret == 0 && readers[i]->reader_group_id != group_id + 1) {
+                    DBG_PRINTF("Reader %zu at group %" PRIu64 " after prune, expected %" PRIu64, i, readers[i]->reader_group_id, group_id + 1);
+                    ret = -1;
+                }
+            }
+        }
+        if (ret == 0) {
+            ret = quicrq_fragment_readers_check(cache_ctx, readers, (int)(FRAGMENT_READERS_NB_READERS + group_id));
+        }
+    }
+
+    /* Purge the cache repeatedly, as the cache management would */
+    if (ret == 0) {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+
+        for (int i = 0; i < FRAGMENT_READERS_NB_PURGES; i++) {
+            quicrq_fragment_cache_media_purge_to_gob(&srce_ctx);
+        }
+        duration = picoquic_current_time() - start_time;
+        DBG_PRINTF("%d purges with %d readers in %" PRIu64 " us", FRAGMENT_READERS_NB_PURGES, FRAGMENT_READERS_NB_READERS, duration);
+        if (cache_ctx->ring_first_group_id != 1 || cache_ctx->first_group_id != 1) {
+            DBG_PRINTF("After purge, first group %" PRIu64 ", expected 1", cache_ctx->ring_first_group_id);
+            ret = -1;
+        }
+    }
+
+    /* Close the readers in a scrambled order */
+    for (size_t j = 0; ret == 0 && j < FRAGMENT_READERS_NB_READERS; j++) {
+        size_t i = (j * 37) % FRAGMENT_READERS_NB_READERS;
+        quicrq_fragment_publisher_close(readers[i]);
+        readers[i] = NULL;
+        ret = quicrq_fragment_readers_check(cache_ctx, readers, (int)(2 * FRAGMENT_READERS_NB_READERS + j));
+    }
+    if (ret == 0 && cache_ctx->nb_readers != 0) {
+        ret = -1;
+    }
+
+    for (size_t i = 0; i < FRAGMENT_READERS_NB_READERS; i++) {
+        if (readers[i] != NULL) {
+            quicrq_fragment_publisher_close(readers[i]);
+        }
+    }
+    if (cache_ctx != NULL) {
+        quicrq_fragment_cache_delete_ctx(cache_ctx);
+    }
+    if (stream_ctx != NULL) {
+        free(stream_ctx);
+    }
+    if (cnx_ctx != NULL) {
+        free(cnx_ctx);
+    }
+    if (qr_ctx != NULL) {
+        free(qr_ctx);
+    }
+
+    return ret;
+}
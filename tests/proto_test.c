@@ -1,8 +1,10 @@
 /* Tests of message coding and decoding */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "quicrq.h"
 #include "quicrq_internal.h"
+#include "quicrq_fragment.h"
 #include "quicrq_tests.h"
 #include "quicrq_test_internal.h"
 #include "picoquic_utils.h"
@@ -34,7 +36,10 @@ static quicrq_message_t stream_rq = {
     NULL,
     quicrq_transport_mode_single_stream,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t stream_rq_bytes[] = {
@@ -43,9 +48,41 @@ static uint8_t stream_rq_bytes[] = {
     URL1_BYTES,
     0x00,
     quicrq_transport_mode_single_stream,
+    0x00,
     0x00
 };
 
+static quicrq_message_t stream_rq_budget = {
+    QUICRQ_ACTION_REQUEST,
+    sizeof(url1),
+    url1,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    quicrq_transport_mode_single_stream,
+    0,
+    quicrq_subscribe_intent_current_group,
+    0,
+    150,
+    0
+};
+
+static uint8_t stream_rq_budget_bytes[] = {
+    QUICRQ_ACTION_REQUEST,
+    sizeof(url1),
+    URL1_BYTES,
+    0x00,
+    quicrq_transport_mode_single_stream,
+    0x00,
+    0x40, 0x96
+};
+
 static quicrq_message_t datagram_rq = {
     QUICRQ_ACTION_REQUEST,
     sizeof(url1),
@@ -61,7 +98,10 @@ static quicrq_message_t datagram_rq = {
     NULL,
     quicrq_transport_mode_datagram,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t datagram_rq_bytes[] = {
@@ -70,6 +110,40 @@ static uint8_t datagram_rq_bytes[] = {
     URL1_BYTES,
     0x44, 0xd2,
     quicrq_transport_mode_datagram,
+    0x00,
+    0x00,
+    0x00
+};
+
+static quicrq_message_t datagram_rq_compact = {
+    QUICRQ_ACTION_REQUEST,
+    sizeof(url1),
+    url1,
+    1234,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    quicrq_transport_mode_datagram,
+    0,
+    quicrq_subscribe_intent_current_group,
+    QUICRQ_DATAGRAM_HEADER_COMPACT,
+    0,
+    0
+};
+
+static uint8_t datagram_rq_compact_bytes[] = {
+    QUICRQ_ACTION_REQUEST,
+    sizeof(url1),
+    URL1_BYTES,
+    0x44, 0xd2,
+    quicrq_transport_mode_datagram,
+    0x00,
+    QUICRQ_DATAGRAM_HEADER_COMPACT,
     0x00
 };
 
@@ -88,7 +162,10 @@ static quicrq_message_t datagram_rq_next_group = {
     NULL,
     quicrq_transport_mode_datagram,
     0,
-    quicrq_subscribe_intent_next_group
+    quicrq_subscribe_intent_next_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t datagram_rq_next_group_bytes[] = {
@@ -97,7 +174,9 @@ static uint8_t datagram_rq_next_group_bytes[] = {
     URL1_BYTES,
     0x44, 0xd2,
     quicrq_transport_mode_datagram,
-    0x01
+    0x01,
+    0x00,
+    0x00
 };
 
 static quicrq_message_t datagram_rq_start_point = {
@@ -115,7 +194,10 @@ static quicrq_message_t datagram_rq_start_point = {
     NULL,
     quicrq_transport_mode_datagram,
     0,
-    quicrq_subscribe_intent_start_point
+    quicrq_subscribe_intent_start_point,
+    0,
+    0,
+    0
 };
 
 static uint8_t datagram_rq_start_point_bytes[] = {
@@ -127,6 +209,8 @@ static uint8_t datagram_rq_start_point_bytes[] = {
     0x02,
     0x04,
     0x09,
+    0x00,
+    0x00
 };
 
 static quicrq_message_t fin_msg = {
@@ -144,7 +228,10 @@ static quicrq_message_t fin_msg = {
     NULL,
     0,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t fin_msg_bytes[] = {
@@ -153,6 +240,43 @@ static uint8_t fin_msg_bytes[] = {
     0x80, 0x01, 0xe2, 0x40
 };
 
+/* Ranges 5/3 (whole object), 5/7 at 1200 for 600 bytes, 6/0 from 100 to end of object */
+#define REPAIR_RANGES_BYTES 0x05, 0x03, 0x00, 0x00, 0x00, 0x04, 0x44, 0xb0, 0x42, 0x58, 0x01, 0x00, 0x40, 0x64, 0x00
+static uint8_t repair_ranges_bytes[] = { REPAIR_RANGES_BYTES };
+
+static const quicrq_repair_range_t repair_ranges[] = {
+    { 5, 3, 0, 0 },
+    { 5, 7, 1200, 600 },
+    { 6, 0, 100, 0 }
+};
+
+static quicrq_message_t repair_request_msg = {
+    QUICRQ_ACTION_REPAIR_REQUEST,
+    0,
+    NULL,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    sizeof(repair_ranges_bytes),
+    repair_ranges_bytes,
+    0,
+    0,
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    sizeof(repair_ranges) / sizeof(quicrq_repair_range_t)
+};
+
+static uint8_t repair_request_msg_bytes[] = {
+    QUICRQ_ACTION_REPAIR_REQUEST,
+    (uint8_t)(sizeof(repair_ranges) / sizeof(quicrq_repair_range_t)),
+    REPAIR_RANGES_BYTES
+};
+
 #define FRAGMENT_BYTES 1,2,3,4,5,6,7,8,9,10,11,12,13
 static uint8_t fragment_bytes[] = { FRAGMENT_BYTES };
 
@@ -171,7 +295,10 @@ static quicrq_message_t fragment_msg = {
     fragment_bytes,
     0,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t fragment_msg_bytes[] = {
@@ -200,7 +327,10 @@ static quicrq_message_t fragment_msg2 = {
     fragment_bytes,
     0,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t fragment_msg2_bytes[] = {
@@ -230,7 +360,10 @@ static quicrq_message_t post_msg = {
     NULL,
     3,
     1,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t post_msg_bytes[] = {
@@ -258,13 +391,45 @@ static quicrq_message_t accept_dg = {
     NULL,
     quicrq_transport_mode_datagram,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t accept_dg_bytes[] = {
     QUICRQ_ACTION_ACCEPT,
     quicrq_transport_mode_datagram,
-    17
+    17,
+    0x00
+};
+
+static quicrq_message_t accept_dg_compact = {
+    QUICRQ_ACTION_ACCEPT,
+    0,
+    NULL,
+    17,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    quicrq_transport_mode_datagram,
+    0,
+    quicrq_subscribe_intent_current_group,
+    QUICRQ_DATAGRAM_HEADER_COMPACT,
+    0,
+    0
+};
+
+static uint8_t accept_dg_compact_bytes[] = {
+    QUICRQ_ACTION_ACCEPT,
+    quicrq_transport_mode_datagram,
+    17,
+    QUICRQ_DATAGRAM_HEADER_COMPACT
 };
 
 
@@ -283,7 +448,10 @@ static quicrq_message_t accept_st = {
     NULL,
     quicrq_transport_mode_single_stream,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t accept_st_bytes[] = {
@@ -306,7 +474,10 @@ static quicrq_message_t start_msg = {
     NULL,
     0,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t start_msg_bytes[] = {
@@ -330,7 +501,10 @@ static quicrq_message_t subscribe_msg = {
     NULL,
     0,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t subscribe_msg_bytes[] = {
@@ -354,7 +528,10 @@ static quicrq_message_t notify_msg = {
     NULL,
     0,
     0,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t notify_msg_bytes[] = {
@@ -379,7 +556,10 @@ static quicrq_message_t cache_policy_msg = {
     NULL,
     0,
     1,
-    quicrq_subscribe_intent_current_group
+    quicrq_subscribe_intent_current_group,
+    0,
+    0,
+    0
 };
 
 static uint8_t cache_policy_bytes[] = {
@@ -387,6 +567,32 @@ static uint8_t cache_policy_bytes[] = {
     1
 };
 
+static quicrq_message_t latency_budget_msg = {
+    QUICRQ_ACTION_LATENCY_BUDGET,
+    0,
+    NULL,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    0,
+    0,
+    quicrq_subscribe_intent_current_group,
+    0,
+    250,
+    0
+};
+
+static uint8_t latency_budget_bytes[] = {
+    QUICRQ_ACTION_LATENCY_BUDGET,
+    0x40, 0xfa
+};
+
 static quicrq_message_t warp_header = {
     QUICRQ_ACTION_WARP_HEADER,
     0,
@@ -402,6 +608,9 @@ static quicrq_message_t warp_header = {
     NULL,
     0,
     0,
+    0,
+    0,
+    0,
     0
 };
 
@@ -426,6 +635,9 @@ static quicrq_message_t warp_object = {
     NULL,
     0,
     0,
+    0,
+    0,
+    0,
     0
 };
 
@@ -452,6 +664,9 @@ static quicrq_message_t warp_object0 = {
     NULL,
     0,
     0,
+    0,
+    0,
+    0,
     0
 };
 
@@ -473,19 +688,24 @@ typedef struct st_proto_test_case_t {
 #define PROTO_TEST_ITEM(case_name, case_bytes) { case_bytes, sizeof(case_bytes), &case_name }
 static proto_test_case_t proto_cases[] = {
     PROTO_TEST_ITEM(stream_rq, stream_rq_bytes),
+    PROTO_TEST_ITEM(stream_rq_budget, stream_rq_budget_bytes),
     PROTO_TEST_ITEM(datagram_rq, datagram_rq_bytes),
+    PROTO_TEST_ITEM(datagram_rq_compact, datagram_rq_compact_bytes),
     PROTO_TEST_ITEM(datagram_rq_next_group, datagram_rq_next_group_bytes),
     PROTO_TEST_ITEM(datagram_rq_start_point, datagram_rq_start_point_bytes),
     PROTO_TEST_ITEM(fin_msg, fin_msg_bytes),
+    PROTO_TEST_ITEM(repair_request_msg, repair_request_msg_bytes),
     PROTO_TEST_ITEM(fragment_msg, fragment_msg_bytes),
     PROTO_TEST_ITEM(fragment_msg2, fragment_msg2_bytes),
     PROTO_TEST_ITEM(post_msg, post_msg_bytes),
     PROTO_TEST_ITEM(accept_dg, accept_dg_bytes),
+    PROTO_TEST_ITEM(accept_dg_compact, accept_dg_compact_bytes),
     PROTO_TEST_ITEM(accept_st, accept_st_bytes),
     PROTO_TEST_ITEM(start_msg, start_msg_bytes),
     PROTO_TEST_ITEM(subscribe_msg, subscribe_msg_bytes),
     PROTO_TEST_ITEM(notify_msg, notify_msg_bytes),
     PROTO_TEST_ITEM(cache_policy_msg, cache_policy_bytes),
+    PROTO_TEST_ITEM(latency_budget_msg, latency_budget_bytes),
     PROTO_TEST_ITEM(warp_header, warp_header_bytes),
     PROTO_TEST_ITEM(warp_object, warp_object_bytes),
     PROTO_TEST_ITEM(warp_object0, warp_object0_bytes)
@@ -685,6 +905,22 @@ static uint8_t bad_bytes25[] = {
     (uint8_t)sizeof(fragment_bytes),
 };
 
+static uint8_t bad_bytes26[] = {
+    QUICRQ_ACTION_REPAIR_REQUEST,
+    0
+};
+
+static uint8_t bad_bytes27[] = {
+    QUICRQ_ACTION_REPAIR_REQUEST,
+    4,
+    REPAIR_RANGES_BYTES
+};
+
+static uint8_t bad_bytes28[] = {
+    QUICRQ_ACTION_LATENCY_BUDGET,
+    0x40
+};
+
 typedef struct st_proto_test_bad_case_t {
     uint8_t* const data;
     size_t data_length;
@@ -719,7 +955,10 @@ static proto_test_bad_case_t proto_bad_cases[] = {
     PROTO_TEST_BAD_ITEM(bad_bytes22),
     PROTO_TEST_BAD_ITEM(bad_bytes23),
     PROTO_TEST_BAD_ITEM(bad_bytes24),
-    PROTO_TEST_BAD_ITEM(bad_bytes25)
+    PROTO_TEST_BAD_ITEM(bad_bytes25),
+    PROTO_TEST_BAD_ITEM(bad_bytes26),
+    PROTO_TEST_BAD_ITEM(bad_bytes27),
+    PROTO_TEST_BAD_ITEM(bad_bytes28)
 };
 
 int proto_msg_test()
@@ -782,6 +1021,15 @@ int proto_msg_test()
         else if (result.fragment_length != proto_cases[i].result->fragment_length) {
             ret = -1;
         }
+        else if (result.datagram_header_mode != proto_cases[i].result->datagram_header_mode) {
+            ret = -1;
+        }
+        else if (result.latency_budget != proto_cases[i].result->latency_budget) {
+            ret = -1;
+        }
+        else if (result.nb_ranges != proto_cases[i].result->nb_ranges) {
+            ret = -1;
+        }
     }
 
     /* Encoding tests */
@@ -826,5 +1074,586 @@ int proto_msg_test()
         }
     }
 
+    /* Repair request ranges, encoded from and decoded to a list */
+    if (ret == 0) {
+        uint8_t msg[256];
+        size_t nb_ranges = sizeof(repair_ranges) / sizeof(quicrq_repair_range_t);
+        uint8_t* bytes = quicrq_repair_request_msg_encode(msg, msg + sizeof(msg), QUICRQ_ACTION_REPAIR_REQUEST,
+            nb_ranges, repair_ranges);
+
+        if (bytes == NULL || (size_t)(bytes - msg) != sizeof(repair_request_msg_bytes) ||
+            (size_t)(bytes - msg) > quicrq_repair_request_msg_reserve(nb_ranges) ||
+            memcmp(msg, repair_request_msg_bytes, sizeof(repair_request_msg_bytes)) != 0) {
+            ret = -1;
+        }
+        else {
+            const uint8_t* range_bytes = repair_ranges_bytes;
+            quicrq_repair_range_t range = { 0 };
+
+            for (size_t i = 0; ret == 0 && i < nb_ranges; i++) {
+                range_bytes = quicrq_repair_range_decode(range_bytes, repair_ranges_bytes + sizeof(repair_ranges_bytes), &range);
+                if (range_bytes == NULL || memcmp(&range, &repair_ranges[i], sizeof(quicrq_repair_range_t)) != 0) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Test the compact datagram header.
+ * Encode each fragment with both the full and the compact header, verify that the
+ * compact header is decoded correctly given the receiver's largest group, which is
+ * at least the acknowledged group and at most the largest group sent, and that
+ * it is never longer than the full header.
+ */
+typedef struct st_proto_datagram_header_case_t {
+    uint64_t group_id;
+    uint64_t group_acked;
+    uint64_t group_max;
+    uint64_t group_reference;
+    uint64_t object_id;
+    uint64_t object_offset;
+    uint64_t nb_objects_previous_group;
+    uint64_t object_length;
+    size_t data_length;
+    uint8_t flags;
+    uint64_t fec_sequence;
+} proto_datagram_header_case_t;
+
+static proto_datagram_header_case_t proto_datagram_header_cases[] = {
+    /* Whole object */
+    { 1000, 998, 1000, 999, 5, 0, 0, 800, 800, 0, UINT64_MAX },
+    /* First, middle and last fragment */
+    { 1000, 998, 1000, 1000, 0, 0, 30, 3000, 1200, 0, UINT64_MAX },
+    { 1000, 998, 1000, 1000, 0, 1200, 0, 3000, 1200, 0, UINT64_MAX },
+    { 1000, 998, 1000, 1000, 0, 2400, 0, 3000, 600, 0, UINT64_MAX },
+    /* Skipped object placeholder */
+    { 1000, 998, 1000, 1000, 7, 0, 0, 0, 0, 0xff, UINT64_MAX },
+    /* FEC protected fragment */
+    { 1000, 998, 1000, 1000, 3, 0, 0, 500, 500, 0, 77 },
+    /* Nothing acknowledged yet */
+    { 1000, UINT64_MAX, 1000, 0, 3, 0, 0, 500, 500, 0, UINT64_MAX },
+    /* Receiver behind the sender, or ahead of it, across a truncation boundary */
+    { 0x100, 0xf0, 0x100, 0xfe, 1, 0, 0, 200, 200, 0, UINT64_MAX },
+    { 0x1ff, 0x1f0, 0x205, 0x205, 1, 0, 0, 200, 200, 0, UINT64_MAX },
+    /* 16 and 32 bits truncation */
+    { 0x12345, 0x12245, 0x12345, 0x122c5, 1, 0, 0, 200, 200, 0, UINT64_MAX },
+    { 0x123456789ull, 0x123356789ull, 0x123456789ull, 0x123356789ull, 1, 0, 0, 200, 200, 0, UINT64_MAX },
+    /* Old group sent after a newer one, e.g., a late repeat: the window covers the largest group sent */
+    { 0x101, 0x100, 0x1c0, 0x1c0, 2, 0, 0, 200, 200, 0, UINT64_MAX }
+};
+
+int proto_datagram_header_test()
+{
+    int ret = 0;
+    size_t nb_cases = sizeof(proto_datagram_header_cases) / sizeof(proto_datagram_header_case_t);
+    size_t full_total = 0;
+    size_t compact_total = 0;
+
+    for (size_t i = 0; ret == 0 && i < nb_cases; i++) {
+        proto_datagram_header_case_t* c = &proto_datagram_header_cases[i];
+        uint8_t full[QUICRQ_DATAGRAM_HEADER_MAX];
+        uint8_t datagram[QUICRQ_DATAGRAM_HEADER_MAX + 3000];
+        uint8_t* full_end = quicrq_datagram_header_encode(full, full + sizeof(full), 17, c->group_id, c->object_id,
+            c->object_offset, 12, c->flags, c->nb_objects_previous_group, c->object_length, c->fec_sequence);
+        uint8_t* h_end = quicrq_datagram_compact_header_encode(datagram, datagram + QUICRQ_DATAGRAM_HEADER_MAX, 17,
+            c->group_id, c->group_acked, c->group_max, c->object_id, c->object_offset, 12, c->flags, c->nb_objects_previous_group,
+            c->object_length, c->data_length, c->fec_sequence);
+
+        if (full_end == NULL || h_end == NULL) {
+            DBG_PRINTF("Cannot encode header case %zu", i);
+            ret = -1;
+        }
+        else if (h_end - datagram > full_end - full) {
+            DBG_PRINTF("Compact header case %zu: %zu bytes, full %zu", i, (size_t)(h_end - datagram), (size_t)(full_end - full));
+            ret = -1;
+        }
+        else {
+            uint64_t media_id = 0;
+            uint64_t group_id = 0;
+            uint64_t object_id = 0;
+            uint64_t object_offset = 0;
+            uint64_t queue_delay = 0;
+            uint8_t flags = 0;
+            uint64_t nb_objects_previous_group = 0;
+            uint64_t object_length = 0;
+            uint64_t fec_sequence = 0;
+            const uint8_t* bytes;
+
+            memset(h_end, 0xaa, c->data_length);
+            bytes = quicrq_datagram_header_decode(datagram, h_end + c->data_length, &media_id, &group_id, &object_id,
+                &object_offset, &queue_delay, &flags, &nb_objects_previous_group, &object_length, &fec_sequence,
+                c->group_reference);
+            full_total += full_end - full;
+            compact_total += h_end - datagram;
+
+            if (bytes != h_end || media_id != 17 || group_id != c->group_id || object_id != c->object_id ||
+                object_offset != c->object_offset || queue_delay != 12 || flags != c->flags ||
+                nb_objects_previous_group != c->nb_objects_previous_group || object_length != c->object_length ||
+                fec_sequence != c->fec_sequence) {
+                DBG_PRINTF("Compact header case %zu does not decode, group %" PRIu64 " vs %" PRIu64,
+                    i, group_id, c->group_id);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        DBG_PRINTF("Header bytes for %zu fragments: full %zu, compact %zu", nb_cases, full_total, compact_total);
+        if (compact_total >= full_total) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Test the lookup of local media sources by URL.
+ * Publish increasing numbers of sources, measure the rate of lookups,
+ * then delete half of the sources and verify that they are not found.
+ */
+#define SOURCE_LOOKUP_NB_LOOKUPS 100000
+
+static size_t proto_source_lookup_url(uint8_t* url, size_t url_max, size_t source_id)
+{
+    return (size_t)snprintf((char*)url, url_max, "example.com/media/%zu", source_id);
+}
+
+static int proto_source_lookup_one(size_t nb_sources)
+{
+    int ret = 0;
+    uint8_t url[64];
+    size_t url_length;
+    quicrq_ctx_t* qr_ctx = quicrq_create_empty();
+
+    if (qr_ctx == NULL) {
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_sources; i++) {
+        quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(qr_ctx);
+        url_length = proto_source_lookup_url(url, sizeof(url), i);
+        if (cache_ctx == NULL) {
+            ret = -1;
+        }
+        else if ((ret = quicrq_publish_fragment_cached_media(qr_ctx, cache_ctx, url, url_length, 0, 1)) != 0) {
+            quicrq_fragment_cache_delete_ctx(cache_ctx);
+        }
+    }
+
+    if (ret == 0) {
+        uint64_t start_time = picoquic_current_time();
+        uint64_t duration;
+
+        for (size_t i = 0; ret == 0 && i < SOURCE_LOOKUP_NB_LOOKUPS; i++) {
+            quicrq_media_source_ctx_t* srce_ctx;
+            url_length = proto_source_lookup_url(url, sizeof(url), (i * 7919) % nb_sources);
+            srce_ctx = quicrq_find_local_media_source(qr_ctx, url, url_length);
+            if (srce_ctx == NULL || srce_ctx->media_url_length != url_length ||
+                memcmp(srce_ctx->media_url, url, url_length) != 0) {
+                DBG_PRINTF("Source %zu not found among %zu", (i * 7919) % nb_sources, nb_sources);
+                ret = -1;
+            }
+        }
+        duration = picoquic_current_time() - start_time;
+        DBG_PRINTF("%zu sources, %d lookups in %" PRIu64 " us", nb_sources, SOURCE_LOOKUP_NB_LOOKUPS, duration);
+    }
+
+    if (ret == 0) {
+        /* Delete the sources with an even number */
+        quicrq_media_source_ctx_t* srce_ctx = qr_ctx->first_source;
+        size_t source_id = 0;
+
+        while (srce_ctx != NULL) {
+            quicrq_media_source_ctx_t* next_source = srce_ctx->next_source;
+            if ((source_id % 2) == 0) {
+                quicrq_delete_source(srce_ctx, qr_ctx);
+            }
+            source_id++;
+            srce_ctx = next_source;
+        }
+        if (qr_ctx->nb_sources != nb_sources / 2) {
+            ret = -1;
+        }
+        for (size_t i = 0; ret == 0 && i < nb_sources + 1; i++) {
+            url_length = proto_source_lookup_url(url, sizeof(url), i);
+            srce_ctx = quicrq_find_local_media_source(qr_ctx, url, url_length);
+            if ((srce_ctx == NULL) != ((i % 2) == 0 || i == nb_sources)) {
+                DBG_PRINTF("Unexpected lookup result for source %zu after delete", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+int proto_source_lookup_test()
+{
+    int ret = 0;
+
+    for (size_t nb_sources = 16; ret == 0 && nb_sources <= 16384; nb_sources *= 4) {
+        ret = proto_source_lookup_one(nb_sources);
+    }
+
+    return ret;
+}
+
+/* Datagram FEC test.
+ * Publish a media as datagrams with FEC enabled, drop one source fragment
+ * in each FEC window, and verify that the receiver recovers all the
+ * missing fragments from the repair datagrams. The test runs with full
+ * and with compact datagram headers.
+ */
+#define DATAGRAM_FEC_NB_OBJECTS 60
+#define DATAGRAM_FEC_OBJECTS_PER_GROUP 10
+#define DATAGRAM_FEC_OBJECT_SIZE 3000
+#define DATAGRAM_FEC_WINDOW 4
+#define DATAGRAM_FEC_MAX_DATAGRAMS 1024
+
+typedef struct st_datagram_fec_test_consumer_t {
+    size_t bytes_received[DATAGRAM_FEC_NB_OBJECTS];
+    int data_mismatch;
+} datagram_fec_test_consumer_t;
+
+static int datagram_fec_test_consumer_fn(quicrq_media_consumer_enum action, void* media_ctx, uint64_t current_time,
+    const uint8_t* data, uint64_t group_id, uint64_t object_id, uint64_t offset, uint64_t queue_delay, uint8_t flags,
+    uint64_t nb_objects_previous_group, uint64_t object_length, size_t data_length)
+{
+    int ret = 0;
+    datagram_fec_test_consumer_t* consumer = (datagram_fec_test_consumer_t*)media_ctx;
+    (void)current_time;
+    (void)queue_delay;
+    (void)flags;
+    (void)nb_objects_previous_group;
+
+    if (action == quicrq_media_datagram_ready) {
+        uint64_t object_rank = group_id * DATAGRAM_FEC_OBJECTS_PER_GROUP + object_id;
+
+        if (object_rank >= DATAGRAM_FEC_NB_OBJECTS || object_length != DATAGRAM_FEC_OBJECT_SIZE ||
+            offset + data_length > object_length) {
+            ret = -1;
+        }
+        else {
+            for (size_t i = 0; i < data_length; i++) {
+                if (data[i] != (uint8_t)(object_rank + offset + i)) {
+                    consumer->data_mismatch = 1;
+                    break;
+                }
+            }
+            consumer->bytes_received[object_rank] += data_length;
+        }
+    }
+    return ret;
+}
+
+static int quicrq_datagram_fec_test_one(int use_compact_header)
+{
+    int ret = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t data[DATAGRAM_FEC_OBJECT_SIZE];
+    uint8_t packet[1200];
+    uint8_t* datagrams[DATAGRAM_FEC_MAX_DATAGRAMS];
+    size_t datagram_length[DATAGRAM_FEC_MAX_DATAGRAMS];
+    size_t nb_datagrams = 0;
+    size_t nb_sources = 0;
+    size_t nb_repairs = 0;
+    size_t nb_dropped = 0;
+    size_t bytes_sent = 0;
+    datagram_fec_test_consumer_t consumer;
+    quicrq_test_publisher_t publisher;
+    quicrq_cnx_ctx_t* receiver_cnx = NULL;
+    quicrq_stream_ctx_t* receiver_stream = NULL;
+
+    memset(datagrams, 0, sizeof(datagrams));
+    memset(&consumer, 0, sizeof(consumer));
+    if (quicrq_test_publisher_init(&publisher, 1, quicrq_transport_mode_datagram) != 0 ||
+        (receiver_cnx = quicrq_create_client_cnx(publisher.qr_ctx, NULL, (struct sockaddr*)&addr)) == NULL ||
+        (receiver_stream = quicrq_create_stream_context(receiver_cnx, 0)) == NULL) {
+        ret = -1;
+    }
+    else {
+        quicrq_set_datagram_fec(publisher.qr_ctx, DATAGRAM_FEC_WINDOW);
+        publisher.stream_ctx[0]->use_compact_datagram_header = use_compact_header;
+        receiver_stream->media_id = 0;
+        receiver_stream->transport_mode = quicrq_transport_mode_datagram;
+        receiver_stream->consumer_fn = datagram_fec_test_consumer_fn;
+        receiver_stream->media_ctx = (void*)&consumer;
+        ret = quicrq_datagram_index_stream(receiver_stream);
+    }
+
+    /* Fill the cache. Each object is sent in several fragments. */
+    for (uint64_t rank = 0; ret == 0 && rank < DATAGRAM_FEC_NB_OBJECTS; rank++) {
+        uint64_t group_id = rank / DATAGRAM_FEC_OBJECTS_PER_GROUP;
+        uint64_t object_id = rank % DATAGRAM_FEC_OBJECTS_PER_GROUP;
+        for (size_t i = 0; i < sizeof(data); i++) {
+            data[i] = (uint8_t)(rank + i);
+        }
+        ret = quicrq_fragment_propose_to_cache(publisher.cache_ctx[0], data, group_id, object_id, 0, 0, 0x80,
+            (object_id == 0 && group_id > 0) ? DATAGRAM_FEC_OBJECTS_PER_GROUP : 0, sizeof(data), sizeof(data), publisher.simulated_time);
+    }
+
+    /* Collect the datagrams until the media has nothing more to send */
+    while (ret == 0 && nb_datagrams < DATAGRAM_FEC_MAX_DATAGRAMS) {
+        quicrq_test_datagram_buffer_argument_t d_context;
+        const uint8_t* bytes;
+        quicrq_test_datagram_buffer_init(&d_context, packet, sizeof(packet));
+
+        ret = quicrq_prepare_to_send_datagram(publisher.cnx_ctx, &d_context, d_context.allowed_space, publisher.simulated_time);
+        if (ret != 0 || d_context.after_data <= d_context.bytes0) {
+            break;
+        }
+        bytes = d_context.bytes0;
+        while (bytes < d_context.bytes_max && *bytes == 0) {
+            bytes++;
+        }
+        if (bytes >= d_context.bytes_max || *bytes != 0x30) {
+            ret = -1;
+        }
+        else {
+            bytes++;
+            datagram_length[nb_datagrams] = d_context.bytes_max - bytes;
+            if ((datagrams[nb_datagrams] = (uint8_t*)malloc(datagram_length[nb_datagrams])) == NULL) {
+                ret = -1;
+            }
+            else {
+                memcpy(datagrams[nb_datagrams], bytes, datagram_length[nb_datagrams]);
+                bytes_sent += datagram_length[nb_datagrams];
+                nb_datagrams++;
+            }
+        }
+    }
+
+    /* Deliver the datagrams, dropping the second source of each FEC window */
+    for (size_t n = 0, rank_in_window = 0; ret == 0 && n < nb_datagrams; n++) {
+        uint64_t media_id;
+        uint64_t group_id;
+        uint64_t first_fec_sequence;
+        uint64_t nb_window_sources;
+
+        if (quicrq_datagram_repair_header_decode(datagrams[n], datagrams[n] + datagram_length[n], &media_id, &group_id,
+            &first_fec_sequence, &nb_window_sources) != NULL) {
+            nb_repairs++;
+            rank_in_window = 0;
+        }
+        else {
+            nb_sources++;
+            rank_in_window++;
+            if (rank_in_window == 2) {
+                nb_dropped++;
+                continue;
+            }
+        }
+        ret = quicrq_receive_datagram(receiver_cnx, datagrams[n], datagram_length[n], publisher.simulated_time);
+    }
+
+    if (ret == 0) {
+        DBG_PRINTF("Compact %d: %zu sources, %zu repairs, %zu dropped, %" PRIu64 " recovered, %zu bytes",
+            use_compact_header, nb_sources, nb_repairs, nb_dropped,
+            (receiver_stream->fec_receiver == NULL) ? 0 : receiver_stream->fec_receiver->nb_recovered, bytes_sent);
+        if (nb_datagrams >= DATAGRAM_FEC_MAX_DATAGRAMS || nb_dropped == 0 ||
+            nb_repairs < nb_sources / DATAGRAM_FEC_WINDOW || nb_repairs > nb_sources / 2 ||
+            receiver_stream->fec_receiver == NULL || receiver_stream->fec_receiver->nb_recovered != nb_dropped) {
+            ret = -1;
+        }
+    }
+    for (size_t i = 0; ret == 0 && i < DATAGRAM_FEC_NB_OBJECTS; i++) {
+        if (consumer.bytes_received[i] != DATAGRAM_FEC_OBJECT_SIZE) {
+            DBG_PRINTF("Object %zu, received %zu bytes instead of %d", i, consumer.bytes_received[i], DATAGRAM_FEC_OBJECT_SIZE);
+            ret = -1;
+        }
+    }
+    if (ret == 0 && consumer.data_mismatch) {
+        DBG_PRINTF("%s", "Recovered data does not match");
+        ret = -1;
+    }
+
+    for (size_t n = 0; n < nb_datagrams; n++) {
+        free(datagrams[n]);
+    }
+    if (receiver_cnx != NULL) {
+        quicrq_delete_cnx_context(receiver_cnx, quicrq_media_close_delete_context, 0);
+    }
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+int quicrq_datagram_fec_test()
+{
+    int ret = quicrq_datagram_fec_test_one(0);
+
+    if (ret == 0) {
+        ret = quicrq_datagram_fec_test_one(1);
+    }
+
+    return ret;
+}
+
+/* Datagram bundle test.
+ * Publish three media of small objects as datagrams with bundling enabled,
+ * verify that several fragments are packed in each datagram, that the
+ * receiver gets all the objects of all media, and that the acknowledgement
+ * or loss of a bundle is applied to each of its records.
+ */
+#define DATAGRAM_BUNDLE_NB_MEDIA 3
+#define DATAGRAM_BUNDLE_NB_OBJECTS 40
+#define DATAGRAM_BUNDLE_OBJECT_SIZE 120
+#define DATAGRAM_BUNDLE_MAX_DATAGRAMS 256
+
+typedef struct st_datagram_bundle_test_consumer_t {
+    size_t bytes_received[DATAGRAM_BUNDLE_NB_OBJECTS];
+} datagram_bundle_test_consumer_t;
+
+static int datagram_bundle_test_consumer_fn(quicrq_media_consumer_enum action, void* media_ctx, uint64_t current_time,
+    const uint8_t* data, uint64_t group_id, uint64_t object_id, uint64_t offset, uint64_t queue_delay, uint8_t flags,
+    uint64_t nb_objects_previous_group, uint64_t object_length, size_t data_length)
+{
+    int ret = 0;
+    datagram_bundle_test_consumer_t* consumer = (datagram_bundle_test_consumer_t*)media_ctx;
+    (void)current_time;
+    (void)data;
+    (void)offset;
+    (void)queue_delay;
+    (void)flags;
+    (void)nb_objects_previous_group;
+
+    if (action == quicrq_media_datagram_ready) {
+        if (group_id != 0 || object_id >= DATAGRAM_BUNDLE_NB_OBJECTS || object_length != DATAGRAM_BUNDLE_OBJECT_SIZE) {
+            ret = -1;
+        }
+        else {
+            consumer->bytes_received[object_id] += data_length;
+        }
+    }
+    return ret;
+}
+
+int quicrq_datagram_bundle_test()
+{
+    int ret = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t data[DATAGRAM_BUNDLE_OBJECT_SIZE];
+    uint8_t packet[1200];
+    uint8_t* datagrams[DATAGRAM_BUNDLE_MAX_DATAGRAMS];
+    size_t datagram_length[DATAGRAM_BUNDLE_MAX_DATAGRAMS];
+    size_t nb_datagrams = 0;
+    size_t nb_bundles = 0;
+    datagram_bundle_test_consumer_t consumer[DATAGRAM_BUNDLE_NB_MEDIA];
+    quicrq_test_publisher_t publisher;
+    quicrq_cnx_ctx_t* receiver_cnx = NULL;
+
+    memset(data, 0x77, sizeof(data));
+    memset(datagrams, 0, sizeof(datagrams));
+    memset(consumer, 0, sizeof(consumer));
+    if (quicrq_test_publisher_init(&publisher, DATAGRAM_BUNDLE_NB_MEDIA, quicrq_transport_mode_datagram) != 0 ||
+        (receiver_cnx = quicrq_create_client_cnx(publisher.qr_ctx, NULL, (struct sockaddr*)&addr)) == NULL) {
+        ret = -1;
+    }
+    else {
+        quicrq_set_datagram_bundling(publisher.qr_ctx, 1);
+    }
+
+    /* Index the sending streams, and create the receiving streams */
+    for (uint64_t i = 0; ret == 0 && i < DATAGRAM_BUNDLE_NB_MEDIA; i++) {
+        quicrq_stream_ctx_t* receiver_stream = quicrq_create_stream_context(receiver_cnx, 4 * i);
+        if (receiver_stream == NULL) {
+            ret = -1;
+        }
+        else {
+            receiver_stream->media_id = i;
+            receiver_stream->transport_mode = quicrq_transport_mode_datagram;
+            receiver_stream->consumer_fn = datagram_bundle_test_consumer_fn;
+            receiver_stream->media_ctx = (void*)&consumer[i];
+            if (quicrq_datagram_index_stream(publisher.stream_ctx[i]) != 0 || quicrq_datagram_index_stream(receiver_stream) != 0) {
+                ret = -1;
+            }
+        }
+    }
+
+    for (uint64_t object_id = 0; ret == 0 && object_id < DATAGRAM_BUNDLE_NB_OBJECTS; object_id++) {
+        for (size_t i = 0; ret == 0 && i < DATAGRAM_BUNDLE_NB_MEDIA; i++) {
+            ret = quicrq_fragment_propose_to_cache(publisher.cache_ctx[i], data, 0, object_id, 0, 0, 0x80, 0,
+                sizeof(data), sizeof(data), publisher.simulated_time);
+        }
+    }
+
+    /* Collect the datagrams until the media have nothing more to send */
+    while (ret == 0 && nb_datagrams < DATAGRAM_BUNDLE_MAX_DATAGRAMS) {
+        quicrq_test_datagram_buffer_argument_t d_context;
+        const uint8_t* bytes;
+        quicrq_test_datagram_buffer_init(&d_context, packet, sizeof(packet));
+
+        ret = quicrq_prepare_to_send_datagram(publisher.cnx_ctx, &d_context, d_context.allowed_space, publisher.simulated_time);
+        if (ret != 0 || d_context.after_data <= d_context.bytes0) {
+            break;
+        }
+        bytes = d_context.bytes0;
+        while (bytes < d_context.bytes_max && *bytes == 0) {
+            bytes++;
+        }
+        if (bytes >= d_context.bytes_max || *bytes != 0x30) {
+            ret = -1;
+        }
+        else {
+            bytes++;
+            datagram_length[nb_datagrams] = d_context.bytes_max - bytes;
+            if ((datagrams[nb_datagrams] = (uint8_t*)malloc(datagram_length[nb_datagrams])) == NULL) {
+                ret = -1;
+            }
+            else {
+                memcpy(datagrams[nb_datagrams], bytes, datagram_length[nb_datagrams]);
+                if (quicrq_datagram_bundle_header_decode(bytes, d_context.bytes_max) != NULL) {
+                    nb_bundles++;
+                }
+                nb_datagrams++;
+            }
+        }
+    }
+
+    /* Deliver the datagrams, then acknowledge them all except the first one, which is lost */
+    for (size_t n = 0; ret == 0 && n < nb_datagrams; n++) {
+        ret = quicrq_receive_datagram(receiver_cnx, datagrams[n], datagram_length[n], publisher.simulated_time);
+    }
+    for (size_t n = 0; ret == 0 && n < nb_datagrams; n++) {
+        ret = quicrq_handle_datagram_ack_nack(publisher.cnx_ctx, (n == 0) ? picoquic_callback_datagram_lost : picoquic_callback_datagram_acked,
+            0, datagrams[n], datagram_length[n], publisher.simulated_time);
+    }
+
+    if (ret == 0) {
+        uint64_t nb_lost = 0;
+        for (size_t i = 0; i < DATAGRAM_BUNDLE_NB_MEDIA; i++) {
+            nb_lost += publisher.stream_ctx[i]->nb_fragment_lost;
+        }
+        DBG_PRINTF("%d objects sent in %zu datagrams, %zu bundles, %" PRIu64 " fragments lost",
+            DATAGRAM_BUNDLE_NB_MEDIA * DATAGRAM_BUNDLE_NB_OBJECTS, nb_datagrams, nb_bundles, nb_lost);
+        if (nb_datagrams >= DATAGRAM_BUNDLE_MAX_DATAGRAMS || nb_bundles == 0 ||
+            4 * nb_datagrams > DATAGRAM_BUNDLE_NB_MEDIA * DATAGRAM_BUNDLE_NB_OBJECTS || nb_lost < 2) {
+            ret = -1;
+        }
+    }
+    for (size_t i = 0; ret == 0 && i < DATAGRAM_BUNDLE_NB_MEDIA; i++) {
+        for (size_t j = 0; ret == 0 && j < DATAGRAM_BUNDLE_NB_OBJECTS; j++) {
+            if (consumer[i].bytes_received[j] != DATAGRAM_BUNDLE_OBJECT_SIZE) {
+                DBG_PRINTF("Media %zu, object %zu, received %zu bytes", i, j, consumer[i].bytes_received[j]);
+                ret = -1;
+            }
+        }
+    }
+
+    for (size_t n = 0; n < nb_datagrams; n++) {
+        free(datagrams[n]);
+    }
+    if (receiver_cnx != NULL) {
+        quicrq_delete_cnx_context(receiver_cnx, quicrq_media_close_delete_context, 0);
+    }
+    quicrq_test_publisher_release(&publisher);
+
     return ret;
 }
@@ -192,6 +192,54 @@ test_media_object_source_context_t* test_media_object_source_publish_ex(quicrq_c
 int test_media_derive_file_names(const uint8_t* url, size_t url_length, quicrq_transport_mode_enum transport_mode, int is_real_time, int is_post,
     char* result_file_name, char* result_log_name, size_t result_name_size);
 
+/* For the purpose of simulating the picoquic API, we copy here
+ * the definition of the contexts used by the APIs
+ * `picoquic_provide_datagram_buffer` and `picoquic_provide_stream_data_buffer` */
+typedef struct st_quicrq_test_datagram_buffer_argument_t {
+    uint8_t* bytes0; /* Points to the beginning of the encoding of the datagram object */
+    uint8_t* bytes; /* Position after encoding the datagram object type */
+    uint8_t* bytes_max; /* Pointer to the end of the packet */
+    uint8_t* after_data; /* Pointer to end of data written by app */
+    size_t allowed_space; /* Data size from bytes to end of packet */
+} quicrq_test_datagram_buffer_argument_t;
+
+typedef struct st_quicrq_test_stream_buffer_argument_t {
+    uint8_t* bytes; /* Points to the beginning of the encoding of the stream frame */
+    size_t byte_index; /* Current index position after encoding type, stream-id and offset */
+    size_t byte_space; /* Number of bytes available in the packet after the current index */
+    size_t allowed_space; /* Maximum number of bytes that the application is authorized to write */
+    size_t length; /* number of bytes that the application commits to write */
+    int is_fin; /* Whether this is the end of the stream */
+    int is_still_active; /* whether the stream is still considered active after this call */
+    uint8_t* app_buffer; /* buffer provided to the application. */
+} quicrq_test_stream_buffer_argument_t;
+
+/* Prepare the buffer contexts as picoquic would, for a packet of the given size */
+void quicrq_test_datagram_buffer_init(quicrq_test_datagram_buffer_argument_t* d_context, uint8_t* packet, size_t packet_size);
+void quicrq_test_stream_buffer_init(quicrq_test_stream_buffer_argument_t* s_context, uint8_t* packet, size_t packet_size);
+
+/* Local publisher, used by unit tests that exercise the sender without
+ * simulating the network: a quicrq context without congestion control,
+ * one client connection, and a set of media caches, each read by one
+ * sending stream of that connection. Stream i has stream id 4*i and
+ * media id i.
+ */
+#define QUICRQ_TEST_PUBLISHER_MEDIA_MAX 4
+
+typedef struct st_quicrq_test_publisher_t {
+    uint64_t simulated_time;
+    quicrq_ctx_t* qr_ctx;
+    quicrq_cnx_ctx_t* cnx_ctx;
+    size_t nb_media;
+    quicrq_media_source_ctx_t srce_ctx[QUICRQ_TEST_PUBLISHER_MEDIA_MAX];
+    struct st_quicrq_fragment_cache_t* cache_ctx[QUICRQ_TEST_PUBLISHER_MEDIA_MAX];
+    quicrq_stream_ctx_t* stream_ctx[QUICRQ_TEST_PUBLISHER_MEDIA_MAX];
+} quicrq_test_publisher_t;
+
+int quicrq_test_publisher_init(quicrq_test_publisher_t* publisher, size_t nb_media, quicrq_transport_mode_enum transport_mode);
+/* Delete the connection, then the caches, then the quicrq context */
+void quicrq_test_publisher_release(quicrq_test_publisher_t* publisher);
+
 #ifdef __cplusplus
 }
 #endif
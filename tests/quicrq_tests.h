@@ -10,6 +10,8 @@ extern "C" {
 
     int quicrq_basic_test();
     int proto_msg_test();
+    int proto_datagram_header_test();
+    int proto_source_lookup_test();
     int quicrq_media_video1_test();
     int quicrq_media_video1_rt_test();
     int quicrq_media_audio1_test();
@@ -34,6 +36,8 @@ extern "C" {
     int quicrq_datagram_client_test();
     int quicrq_datagram_limit_test();
     int quicrq_datagram_unsubscribe_test();
+    int quicrq_datagram_index_test();
+    int quicrq_stream_index_test();
     int quicrq_twomedia_test();
     int quicrq_twomedia_datagram_test();
     int quicrq_twomedia_datagram_loss_test();
@@ -53,6 +57,8 @@ extern "C" {
     int quicrq_subscribe_relay3_test();
     int quicrq_subscribe_datagram_test();
     int quicrq_subscribe_client_test();
+    int quicrq_subscribe_prefix_trie_test();
+    int quicrq_subscribe_relay_unsubscribe_test();
     int quicrq_triangle_basic_test();
     int quicrq_triangle_basic_loss_test();
     int quicrq_triangle_datagram_test();
@@ -86,6 +92,10 @@ extern "C" {
     int quicrq_twoways_basic_test();
     int quicrq_twoways_datagram_test();
     int quicrq_twoways_datagram_loss_test();
+    int quicrq_twoways_warp_test();
+    int quicrq_twoways_warp_loss_test();
+    int quicrq_twoways_rush_test();
+    int quicrq_twoways_rush_loss_test();
     int quicrq_twomedia_tri_stream_test();
     int quicrq_twomedia_tri_datagram_test();
     int quicrq_twomedia_tri_later_test();
@@ -98,6 +108,26 @@ extern "C" {
     int quicrq_fourlegs_datagram_last_test();
     int quicrq_fourlegs_datagram_loss_test();
     int quicrq_fragment_cache_fill_test();
+    int quicrq_fragment_cache_bench_test();
+    int quicrq_fragment_cache_slab_test();
+    int quicrq_fragment_cache_purge_test();
+    int quicrq_fragment_cache_deferred_release_test();
+    int quicrq_fragment_cache_memory_limit_test();
+    int quicrq_fragment_cache_source_delete_test();
+    int quicrq_fragment_stream_send_bench_test();
+    int quicrq_fragment_stream_send_test();
+    int quicrq_fragment_cache_append_test();
+    int quicrq_fragment_cache_ranges_test();
+    int quicrq_fragment_cache_readers_test();
+    int quicrq_datagram_scheduler_test();
+    int quicrq_datagram_fec_test();
+    int quicrq_datagram_bundle_test();
+    int quicrq_extra_repeat_heap_test();
+    int quicrq_track_set_test();
+    int quicrq_latency_budget_test();
+    int quicrq_group_truncated_test();
+    int quicrq_object_ttl_test();
+    int quicrq_repair_request_test();
     int quicrq_get_addr_test();
     int quicrq_warp_basic_test();
     int quicrq_warp_basic_client_test();
@@ -110,12 +140,15 @@ extern "C" {
     int quicrq_congestion_rush_g_test();
     int quicrq_congestion_rush_gs_test();
     int quicrq_congestion_rush_zero_s_test();
+    int quicrq_congestion_epoch_test();
     int quicrq_warp_relay_test();
     int quicrq_warp_basic_loss_test();
     int quicrq_warp_relay_loss_test();
     int quicrq_rush_basic_test();
     int quicrq_rush_basic_client_test();
     int quicrq_rush_basic_loss_test();
+    int quicrq_rush_relay_test();
+    int quicrq_rush_relay_loss_test();
     int quicrq_triangle_rush_test();
     int quicrq_triangle_intent_rush_test();
     int quicrq_triangle_intent_rush_nc_test();
@@ -6,6 +6,8 @@
 #include "quicrq_relay.h"
 #include "quicrq_internal.h"
 #include "quicrq_relay_internal.h"
+#include "quicrq_fragment.h"
+#include "quicrq_reassembly.h"
 #include "quicrq_test_internal.h"
 
 /* Create a test network */
@@ -249,3 +251,803 @@ int quicrq_warp_relay_loss_test()
 
     return ret;
 }
+
+/* Same as basic relay test, for rush mode */
+int quicrq_rush_relay_test()
+{
+    int ret = quicrq_relay_test_one(1, quicrq_transport_mode_rush, 0, 0);
+
+    return ret;
+}
+
+int quicrq_rush_relay_loss_test()
+{
+    int ret = quicrq_relay_test_one(1, quicrq_transport_mode_rush, 0x7080, 0);
+
+    return ret;
+}
+
+/* Group truncation test.
+ * Objects 0 and 1 of group 0 are received, object 2 only partially, and then
+ * the sender resets the warp stream of the group. Verify that the reassembly
+ * drops the partial object and delivers placeholders for objects 2 and 3 in
+ * sequence once the first object of group 1 tells that group 0 had 4 objects,
+ * and that the relay cache replaces the partial object 2 and the missing object 3
+ * by placeholders. A stream publisher of the relay that already sent half of
+ * object 2 restarts it as a placeholder, and moves to the next group.
+ */
+#define GROUP_TRUNCATED_OBJECT_SIZE 100
+#define GROUP_TRUNCATED_NB_DELIVERED 5
+
+typedef struct st_group_truncated_test_delivered_t {
+    uint64_t group_id;
+    uint64_t object_id;
+    uint8_t flags;
+    size_t data_length;
+} group_truncated_test_delivered_t;
+
+typedef struct st_group_truncated_test_ctx_t {
+    size_t nb_delivered;
+    group_truncated_test_delivered_t delivered[GROUP_TRUNCATED_NB_DELIVERED + 1];
+} group_truncated_test_ctx_t;
+
+static int group_truncated_test_ready_fn(void* media_ctx, uint64_t current_time, uint64_t group_id, uint64_t object_id,
+    uint8_t flags, const uint8_t* data, size_t data_length, quicrq_reassembly_object_mode_enum object_mode)
+{
+    int ret = 0;
+    group_truncated_test_ctx_t* test_ctx = (group_truncated_test_ctx_t*)media_ctx;
+    (void)current_time;
+    (void)data;
+
+    if (object_mode != quicrq_reassembly_object_peek) {
+        /* Objects are delivered in order either in sequence, or as repair after being peeked */
+        if (test_ctx->nb_delivered >= GROUP_TRUNCATED_NB_DELIVERED + 1) {
+            ret = -1;
+        }
+        else {
+            test_ctx->delivered[test_ctx->nb_delivered].group_id = group_id;
+            test_ctx->delivered[test_ctx->nb_delivered].object_id = object_id;
+            test_ctx->delivered[test_ctx->nb_delivered].flags = flags;
+            test_ctx->delivered[test_ctx->nb_delivered].data_length = data_length;
+            test_ctx->nb_delivered++;
+        }
+    }
+    return ret;
+}
+
+static int quicrq_group_truncated_reassembly_test()
+{
+    int ret = 0;
+    uint8_t data[GROUP_TRUNCATED_OBJECT_SIZE];
+    quicrq_reassembly_context_t reassembly_ctx;
+    group_truncated_test_ctx_t test_ctx;
+    const group_truncated_test_delivered_t expected[GROUP_TRUNCATED_NB_DELIVERED] = {
+        { 0, 0, 0, GROUP_TRUNCATED_OBJECT_SIZE },
+        { 0, 1, 0, GROUP_TRUNCATED_OBJECT_SIZE },
+        { 0, 2, 0xff, 0 },
+        { 0, 3, 0xff, 0 },
+        { 1, 0, 0, GROUP_TRUNCATED_OBJECT_SIZE }
+    };
+
+    memset(data, 0x5a, sizeof(data));
+    memset(&test_ctx, 0, sizeof(test_ctx));
+    memset(&reassembly_ctx, 0, sizeof(reassembly_ctx));
+    quicrq_reassembly_init(&reassembly_ctx);
+
+    for (uint64_t object_id = 0; ret == 0 && object_id < 2; object_id++) {
+        ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 0, object_id, 0, 0, 0, 0,
+            sizeof(data), sizeof(data), group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0) {
+        ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 0, 2, 0, 0, 0, 0,
+            sizeof(data), sizeof(data) / 2, group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0) {
+        ret = quicrq_reassembly_learn_group_truncated(&reassembly_ctx, 0, 2, 0, 0, group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0 && test_ctx.nb_delivered != 3) {
+        DBG_PRINTF("Delivered %zu objects before the next group", test_ctx.nb_delivered);
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 1, 0, 0, 0, 0, 4,
+            sizeof(data), sizeof(data), group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0 && test_ctx.nb_delivered != GROUP_TRUNCATED_NB_DELIVERED) {
+        DBG_PRINTF("Delivered %zu objects", test_ctx.nb_delivered);
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < GROUP_TRUNCATED_NB_DELIVERED; i++) {
+        if (test_ctx.delivered[i].group_id != expected[i].group_id ||
+            test_ctx.delivered[i].object_id != expected[i].object_id ||
+            test_ctx.delivered[i].flags != expected[i].flags ||
+            test_ctx.delivered[i].data_length != expected[i].data_length) {
+            DBG_PRINTF("Delivery %zu: object %" PRIu64 "/%" PRIu64 ", flags 0x%x", i,
+                test_ctx.delivered[i].group_id, test_ctx.delivered[i].object_id, test_ctx.delivered[i].flags);
+            ret = -1;
+        }
+    }
+    quicrq_reassembly_release(&reassembly_ctx);
+
+    return ret;
+}
+
+/* Send the messages available on a single stream, and record the fragments sent */
+static int quicrq_group_truncated_cache_send(quicrq_stream_ctx_t* stream_ctx,
+    group_truncated_test_delivered_t* sent, size_t* nb_sent, uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t packet[1200];
+
+    while (ret == 0) {
+        quicrq_test_stream_buffer_argument_t s_context;
+        quicrq_message_t incoming;
+
+        quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+        ret = quicrq_prepare_to_send_media_to_stream(stream_ctx, &s_context, s_context.allowed_space, current_time);
+        if (ret != 0 || s_context.app_buffer == NULL || s_context.length == 0) {
+            break;
+        }
+        if (quicrq_msg_decode(s_context.app_buffer + 2, s_context.app_buffer + s_context.length, &incoming) == NULL ||
+            incoming.message_type != QUICRQ_ACTION_FRAGMENT || *nb_sent >= GROUP_TRUNCATED_NB_DELIVERED + 1) {
+            ret = -1;
+        }
+        else {
+            sent[*nb_sent].group_id = incoming.group_id;
+            sent[*nb_sent].object_id = incoming.object_id;
+            sent[*nb_sent].flags = incoming.flags;
+            sent[*nb_sent].data_length = (incoming.fragment_offset == 0) ? incoming.fragment_length : 0;
+            *nb_sent += 1;
+        }
+    }
+    return ret;
+}
+
+static int quicrq_group_truncated_cache_test()
+{
+    int ret = 0;
+    uint8_t data[GROUP_TRUNCATED_OBJECT_SIZE];
+    quicrq_test_publisher_t publisher;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_stream_ctx_t* stream_ctx = NULL;
+    group_truncated_test_delivered_t sent[GROUP_TRUNCATED_NB_DELIVERED + 1];
+    size_t nb_sent = 0;
+    const group_truncated_test_delivered_t expected[GROUP_TRUNCATED_NB_DELIVERED + 1] = {
+        { 0, 0, 0, GROUP_TRUNCATED_OBJECT_SIZE },
+        { 0, 1, 0, GROUP_TRUNCATED_OBJECT_SIZE },
+        { 0, 2, 0, GROUP_TRUNCATED_OBJECT_SIZE / 2 },
+        { 0, 2, 0xff, 0 },
+        { 0, 3, 0xff, 0 },
+        { 1, 0, 0, GROUP_TRUNCATED_OBJECT_SIZE }
+    };
+
+    memset(data, 0x5a, sizeof(data));
+    memset(sent, 0, sizeof(sent));
+    if (quicrq_test_publisher_init(&publisher, 1, quicrq_transport_mode_single_stream) != 0) {
+        ret = -1;
+    }
+    else {
+        cache_ctx = publisher.cache_ctx[0];
+        stream_ctx = publisher.stream_ctx[0];
+    }
+    for (uint64_t object_id = 0; ret == 0 && object_id < 2; object_id++) {
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 0, object_id, 0, 0, 0, 0,
+            sizeof(data), sizeof(data), 0);
+    }
+    if (ret == 0) {
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 0, 2, 0, 0, 0, 0,
+            sizeof(data), sizeof(data) / 2, 0);
+    }
+    /* The publisher sends the first half of object 2 before the truncation is learned */
+    if (ret == 0) {
+        ret = quicrq_group_truncated_cache_send(stream_ctx, sent, &nb_sent, 0);
+    }
+    if (ret == 0 && (nb_sent != 3 || stream_ctx->next_object_id != 2 || stream_ctx->next_object_offset == 0)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = quicrq_fragment_cache_learn_group_truncated(cache_ctx, 0, 2, 0, 0);
+    }
+    /* The size of the group is not known yet, so nothing is filled */
+    if (ret == 0 && (cache_ctx->first_truncated_group == NULL ||
+        quicrq_fragment_cache_get_object_ranges(cache_ctx, 0, 3) != NULL)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 1, 0, 0, 0, 0, 4,
+            sizeof(data), sizeof(data), 0);
+    }
+    /* The partial object 2 is replaced by a placeholder, so the cache progresses to the next group */
+    if (ret == 0) {
+        quicrq_cached_fragment_t* fragment = quicrq_fragment_cache_get_fragment(cache_ctx, 0, 3, 0);
+        quicrq_cached_fragment_t* partial = quicrq_fragment_cache_get_fragment(cache_ctx, 0, 2, 0);
+
+        if (cache_ctx->first_truncated_group != NULL || fragment == NULL || fragment->flags != 0xff ||
+            fragment->data_length != 0 || partial == NULL || partial->flags != 0xff ||
+            partial->data_length != 0 || cache_ctx->nb_cached_fragments != 5 ||
+            cache_ctx->next_group_id != 1 || cache_ctx->next_object_id != 1) {
+            ret = -1;
+        }
+    }
+    /* The publisher restarts object 2 as a placeholder, then moves on */
+    if (ret == 0) {
+        ret = quicrq_group_truncated_cache_send(stream_ctx, sent, &nb_sent, 0);
+    }
+    if (ret == 0 && nb_sent != GROUP_TRUNCATED_NB_DELIVERED + 1) {
+        DBG_PRINTF("Sent %zu fragments", nb_sent);
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < nb_sent; i++) {
+        if (sent[i].group_id != expected[i].group_id || sent[i].object_id != expected[i].object_id ||
+            sent[i].flags != expected[i].flags || sent[i].data_length != expected[i].data_length) {
+            DBG_PRINTF("Sent %zu: object %" PRIu64 "/%" PRIu64 ", flags 0x%x", i,
+                sent[i].group_id, sent[i].object_id, sent[i].flags);
+            ret = -1;
+        }
+    }
+
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+/* Record the truncations signalled to the consumer of a control stream */
+static int group_truncated_test_consumer_fn(quicrq_media_consumer_enum action, void* media_ctx, uint64_t current_time,
+    const uint8_t* data, uint64_t group_id, uint64_t object_id, uint64_t offset, uint64_t queue_delay, uint8_t flags,
+    uint64_t nb_objects_previous_group, uint64_t object_length, size_t data_length)
+{
+    int ret = 0;
+    group_truncated_test_ctx_t* test_ctx = (group_truncated_test_ctx_t*)media_ctx;
+    (void)current_time;
+    (void)data;
+    (void)offset;
+    (void)queue_delay;
+    (void)flags;
+    (void)object_length;
+    (void)data_length;
+
+    if (action == quicrq_media_group_truncated) {
+        if (test_ctx->nb_delivered >= GROUP_TRUNCATED_NB_DELIVERED + 1) {
+            ret = -1;
+        }
+        else {
+            test_ctx->delivered[test_ctx->nb_delivered].group_id = group_id;
+            test_ctx->delivered[test_ctx->nb_delivered].object_id = object_id;
+            test_ctx->delivered[test_ctx->nb_delivered].data_length = (size_t)nb_objects_previous_group;
+            test_ctx->nb_delivered++;
+        }
+    }
+    return ret;
+}
+
+/* A reset received after the warp header signals the truncation from the current
+ * object, even if no object of the group was received. A reset received before
+ * the warp header cannot be attributed to a group, and is ignored.
+ */
+static int quicrq_group_truncated_reset_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+    quicrq_stream_ctx_t* stream_ctx = NULL;
+    quicrq_uni_stream_ctx_t* uni_stream_ctx[3] = { NULL, NULL, NULL };
+    group_truncated_test_ctx_t test_ctx;
+
+    memset(&test_ctx, 0, sizeof(test_ctx));
+    if (cnx_ctx == NULL || (stream_ctx = quicrq_create_stream_context(cnx_ctx, 0)) == NULL) {
+        ret = -1;
+    }
+    else {
+        stream_ctx->transport_mode = quicrq_transport_mode_warp;
+        stream_ctx->consumer_fn = group_truncated_test_consumer_fn;
+        stream_ctx->media_ctx = (quicrq_fragment_publisher_context_t*)&test_ctx;
+        for (int i = 0; ret == 0 && i < 3; i++) {
+            if ((uni_stream_ctx[i] = quicrq_find_or_create_uni_stream(2 + 4 * i, cnx_ctx, (i < 2) ? stream_ctx : NULL, 1)) == NULL) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret == 0) {
+        /* Group 3: warp header received, but no object */
+        uni_stream_ctx[0]->receive_state = quicrq_receive_warp_header;
+        uni_stream_ctx[0]->current_group_id = 3;
+        /* Group 4: object 0 header received, with the number of objects in group 3 */
+        uni_stream_ctx[1]->receive_state = quicrq_receive_object_data;
+        uni_stream_ctx[1]->current_group_id = 4;
+        uni_stream_ctx[1]->nb_objects_previous_group = 7;
+        for (int i = 0; ret == 0 && i < 3; i++) {
+            ret = quicrq_receive_warp_stream_reset(cnx_ctx, uni_stream_ctx[i], QUICRQ_ERROR_GROUP_TRUNCATED, 0);
+        }
+    }
+    if (ret == 0 && (test_ctx.nb_delivered != 2 ||
+        test_ctx.delivered[0].group_id != 3 || test_ctx.delivered[0].object_id != 0 ||
+        test_ctx.delivered[1].group_id != 4 || test_ctx.delivered[1].object_id != 0 ||
+        test_ctx.delivered[1].data_length != 7)) {
+        DBG_PRINTF("Signalled %zu truncations", test_ctx.nb_delivered);
+        ret = -1;
+    }
+    if (stream_ctx != NULL) {
+        stream_ctx->media_ctx = NULL;
+    }
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+int quicrq_group_truncated_test()
+{
+    int ret = quicrq_group_truncated_reassembly_test();
+
+    if (ret == 0) {
+        ret = quicrq_group_truncated_cache_test();
+    }
+
+    if (ret == 0) {
+        ret = quicrq_group_truncated_reset_test();
+    }
+
+    return ret;
+}
+
+/* Object TTL test.
+ * Publish three objects in a cache at time 0: object 0 without TTL, object 1
+ * with a TTL of 50 ms, and object 2 with a TTL of 150 ms of which only half
+ * is available. Send them on rush streams at 100 ms, and verify that object 0
+ * is sent, object 1 is replaced by a placeholder, and object 2 is started.
+ * At 200 ms, verify that the stream of object 2 is reset. Then verify that a
+ * relay cache and a receiver reassembly treat the expired object as skipped.
+ */
+#define OBJECT_TTL_NB_OBJECTS 3
+#define OBJECT_TTL_OBJECT_SIZE 100
+
+typedef struct st_object_ttl_test_sent_t {
+    int nb_headers;
+    uint8_t flags;
+    size_t bytes_sent;
+    int is_fin;
+} object_ttl_test_sent_t;
+
+static int quicrq_object_ttl_test_send(quicrq_cnx_ctx_t* cnx_ctx, quicrq_stream_ctx_t* stream_ctx,
+    object_ttl_test_sent_t* sent, uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t packet[1200];
+    quicrq_uni_stream_ctx_t* uni_stream_ctx = stream_ctx->first_uni_stream;
+
+    while (ret == 0 && uni_stream_ctx != NULL) {
+        quicrq_uni_stream_ctx_t* next_uni_stream_ctx = uni_stream_ctx->next_uni_stream_for_control_stream;
+        uint64_t object_id = uni_stream_ctx->current_object_id;
+        int is_active = 1;
+
+        if (uni_stream_ctx->current_group_id != 0 || object_id >= OBJECT_TTL_NB_OBJECTS) {
+            ret = -1;
+        }
+        while (ret == 0 && is_active) {
+            quicrq_test_stream_buffer_argument_t s_context;
+            int is_data = uni_stream_ctx->send_state == quicrq_sending_object_data &&
+                uni_stream_ctx->message_buffer.message_size == 0;
+
+            quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+            ret = quicrq_prepare_to_send_on_unistream(cnx_ctx, uni_stream_ctx, &s_context, s_context.allowed_space, current_time);
+            if (ret != 0 || s_context.length == 0) {
+                /* Waiting for data, or the stream was closed or reset and its context deleted */
+                sent[object_id].is_fin |= s_context.is_fin;
+                is_active = 0;
+            }
+            else if (is_data) {
+                sent[object_id].bytes_sent += s_context.length;
+            }
+            else {
+                quicrq_message_t incoming;
+
+                if (quicrq_msg_decode(s_context.app_buffer + 2, s_context.app_buffer + s_context.length, &incoming) == NULL) {
+                    ret = -1;
+                }
+                else if (incoming.message_type == QUICRQ_ACTION_OBJECT_HEADER) {
+                    sent[object_id].nb_headers++;
+                    sent[object_id].flags = incoming.flags;
+                }
+            }
+        }
+        uni_stream_ctx = next_uni_stream_ctx;
+    }
+    return ret;
+}
+
+static int quicrq_object_ttl_sender_test()
+{
+    int ret = 0;
+    uint8_t data[OBJECT_TTL_OBJECT_SIZE];
+    const uint64_t expire_times[OBJECT_TTL_NB_OBJECTS] = { 0, 50000, 150000 };
+    const size_t available[OBJECT_TTL_NB_OBJECTS] = { OBJECT_TTL_OBJECT_SIZE, OBJECT_TTL_OBJECT_SIZE, OBJECT_TTL_OBJECT_SIZE / 2 };
+    const object_ttl_test_sent_t expected[OBJECT_TTL_NB_OBJECTS] = {
+        { 1, 0, OBJECT_TTL_OBJECT_SIZE, 1 },
+        { 1, 0xff, 0, 1 },
+        { 1, 0, OBJECT_TTL_OBJECT_SIZE / 2, 0 } };
+    object_ttl_test_sent_t sent[OBJECT_TTL_NB_OBJECTS];
+    quicrq_test_publisher_t publisher;
+    quicrq_cnx_ctx_t* cnx_ctx = NULL;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_stream_ctx_t* stream_ctx = NULL;
+
+    memset(sent, 0, sizeof(sent));
+    memset(data, 0x5a, sizeof(data));
+    if (quicrq_test_publisher_init(&publisher, 1, quicrq_transport_mode_rush) != 0) {
+        ret = -1;
+    }
+    else {
+        cnx_ctx = publisher.cnx_ctx;
+        cache_ctx = publisher.cache_ctx[0];
+        stream_ctx = publisher.stream_ctx[0];
+    }
+    /* Caching the objects creates the rush streams */
+    for (uint64_t object_id = 0; ret == 0 && object_id < OBJECT_TTL_NB_OBJECTS; object_id++) {
+        ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 0, object_id, 0, 0, 0, 0,
+            sizeof(data), available[object_id], 0);
+        if (ret == 0 && expire_times[object_id] != 0) {
+            ret = quicrq_fragment_cache_set_object_expire_time(cache_ctx, 0, object_id, expire_times[object_id]);
+        }
+    }
+    if (ret == 0) {
+        ret = quicrq_object_ttl_test_send(cnx_ctx, stream_ctx, sent, 100000);
+    }
+    for (size_t i = 0; ret == 0 && i < OBJECT_TTL_NB_OBJECTS; i++) {
+        if (sent[i].nb_headers != expected[i].nb_headers || sent[i].flags != expected[i].flags ||
+            sent[i].bytes_sent != expected[i].bytes_sent || sent[i].is_fin != expected[i].is_fin) {
+            DBG_PRINTF("Object %zu: %d headers, flags 0x%x, %zu bytes, fin %d", i, sent[i].nb_headers,
+                sent[i].flags, sent[i].bytes_sent, sent[i].is_fin);
+            ret = -1;
+        }
+    }
+    /* Only the stream of object 2 remains, and it is reset after its deadline */
+    if (ret == 0 && (stream_ctx->first_uni_stream == NULL || stream_ctx->first_uni_stream->next_uni_stream_for_control_stream != NULL)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = quicrq_object_ttl_test_send(cnx_ctx, stream_ctx, sent, 200000);
+    }
+    if (ret == 0 && (stream_ctx->first_uni_stream != NULL || sent[2].is_fin || sent[2].bytes_sent != OBJECT_TTL_OBJECT_SIZE / 2)) {
+        ret = -1;
+    }
+
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+/* A relay learns that objects 0 and 1 expired upstream, after forwarding half of
+ * object 0 on a rush stream. Verify that the partial object 0 and the missing
+ * object 1 are replaced by placeholders, that the complete object 2 is kept,
+ * and that the rush stream of object 0 is reset.
+ */
+static int quicrq_object_ttl_relay_test()
+{
+    int ret = 0;
+    uint8_t data[OBJECT_TTL_OBJECT_SIZE];
+    const size_t available[OBJECT_TTL_NB_OBJECTS] = { OBJECT_TTL_OBJECT_SIZE / 2, 0, OBJECT_TTL_OBJECT_SIZE };
+    const object_ttl_test_sent_t expected[OBJECT_TTL_NB_OBJECTS] = {
+        { 1, 0, OBJECT_TTL_OBJECT_SIZE / 2, 0 },
+        { 1, 0xff, 0, 1 },
+        { 1, 0, OBJECT_TTL_OBJECT_SIZE, 1 } };
+    object_ttl_test_sent_t sent[OBJECT_TTL_NB_OBJECTS];
+    quicrq_test_publisher_t publisher;
+    quicrq_cnx_ctx_t* cnx_ctx = NULL;
+    quicrq_fragment_cache_t* cache_ctx = NULL;
+    quicrq_stream_ctx_t* stream_ctx = NULL;
+
+    memset(data, 0x5a, sizeof(data));
+    memset(sent, 0, sizeof(sent));
+    if (quicrq_test_publisher_init(&publisher, 1, quicrq_transport_mode_rush) != 0) {
+        ret = -1;
+    }
+    else {
+        cnx_ctx = publisher.cnx_ctx;
+        cache_ctx = publisher.cache_ctx[0];
+        stream_ctx = publisher.stream_ctx[0];
+    }
+    for (uint64_t object_id = 0; ret == 0 && object_id < OBJECT_TTL_NB_OBJECTS; object_id++) {
+        if (available[object_id] > 0) {
+            ret = quicrq_fragment_propose_to_cache(cache_ctx, data, 0, object_id, 0, 0, 0, 0,
+                sizeof(data), available[object_id], 0);
+        }
+    }
+    if (ret == 0) {
+        ret = quicrq_object_ttl_test_send(cnx_ctx, stream_ctx, sent, 0);
+    }
+    for (uint64_t object_id = 0; ret == 0 && object_id < OBJECT_TTL_NB_OBJECTS; object_id++) {
+        ret = quicrq_fragment_cache_learn_object_expired(cache_ctx, 0, object_id, 0, 1000);
+    }
+    if (ret == 0) {
+        quicrq_cached_fragment_t* fragment[OBJECT_TTL_NB_OBJECTS];
+
+        for (uint64_t object_id = 0; object_id < OBJECT_TTL_NB_OBJECTS; object_id++) {
+            fragment[object_id] = quicrq_fragment_cache_get_fragment(cache_ctx, 0, object_id, 0);
+        }
+        if (fragment[0] == NULL || fragment[0]->flags != 0xff || fragment[0]->data_length != 0 ||
+            fragment[1] == NULL || fragment[1]->flags != 0xff || fragment[1]->data_length != 0 ||
+            fragment[2] == NULL || fragment[2]->flags != 0 || fragment[2]->data_length != OBJECT_TTL_OBJECT_SIZE ||
+            cache_ctx->next_group_id != 0 || cache_ctx->next_object_id != OBJECT_TTL_NB_OBJECTS) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = quicrq_object_ttl_test_send(cnx_ctx, stream_ctx, sent, 1000);
+    }
+    for (size_t i = 0; ret == 0 && i < OBJECT_TTL_NB_OBJECTS; i++) {
+        if (sent[i].nb_headers != expected[i].nb_headers || sent[i].flags != expected[i].flags ||
+            sent[i].bytes_sent != expected[i].bytes_sent || sent[i].is_fin != expected[i].is_fin) {
+            DBG_PRINTF("Object %zu: %d headers, flags 0x%x, %zu bytes, fin %d", i, sent[i].nb_headers,
+                sent[i].flags, sent[i].bytes_sent, sent[i].is_fin);
+            ret = -1;
+        }
+    }
+    /* All the streams are closed, the one of object 0 by a reset */
+    if (ret == 0 && stream_ctx->first_uni_stream != NULL) {
+        ret = -1;
+    }
+
+    quicrq_test_publisher_release(&publisher);
+
+    return ret;
+}
+
+static int quicrq_object_ttl_reassembly_test()
+{
+    int ret = 0;
+    uint8_t data[OBJECT_TTL_OBJECT_SIZE];
+    quicrq_reassembly_context_t reassembly_ctx;
+    group_truncated_test_ctx_t test_ctx;
+    const group_truncated_test_delivered_t expected[GROUP_TRUNCATED_NB_DELIVERED] = {
+        { 0, 0, 0, OBJECT_TTL_OBJECT_SIZE },
+        { 0, 1, 0xff, 0 },
+        { 0, 2, 0, OBJECT_TTL_OBJECT_SIZE },
+        { 1, 0, 0xff, 0 },
+        { 1, 1, 0, OBJECT_TTL_OBJECT_SIZE }
+    };
+
+    memset(data, 0x5a, sizeof(data));
+    memset(&test_ctx, 0, sizeof(test_ctx));
+    memset(&reassembly_ctx, 0, sizeof(reassembly_ctx));
+    quicrq_reassembly_init(&reassembly_ctx);
+
+    /* Object 1 is partially received, then expires after object 2 was received */
+    ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 0, 0, 0, 0, 0, 0,
+        sizeof(data), sizeof(data), group_truncated_test_ready_fn, &test_ctx);
+    if (ret == 0) {
+        ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 0, 1, 0, 0, 0, 0,
+            sizeof(data), sizeof(data) / 2, group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0) {
+        ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 0, 2, 0, 0, 0, 0,
+            sizeof(data), sizeof(data), group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0) {
+        ret = quicrq_reassembly_learn_object_expired(&reassembly_ctx, 0, 1, 0, 0, group_truncated_test_ready_fn, &test_ctx);
+    }
+    /* The first object of group 1 expires before any of its data is received */
+    if (ret == 0) {
+        ret = quicrq_reassembly_input(&reassembly_ctx, 0, data, 1, 1, 0, 0, 0, 0,
+            sizeof(data), sizeof(data), group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0) {
+        ret = quicrq_reassembly_learn_object_expired(&reassembly_ctx, 1, 0, 3, 0, group_truncated_test_ready_fn, &test_ctx);
+    }
+    if (ret == 0 && test_ctx.nb_delivered != GROUP_TRUNCATED_NB_DELIVERED) {
+        DBG_PRINTF("Delivered %zu objects", test_ctx.nb_delivered);
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < GROUP_TRUNCATED_NB_DELIVERED; i++) {
+        if (test_ctx.delivered[i].group_id != expected[i].group_id ||
+            test_ctx.delivered[i].object_id != expected[i].object_id ||
+            test_ctx.delivered[i].flags != expected[i].flags ||
+            test_ctx.delivered[i].data_length != expected[i].data_length) {
+            DBG_PRINTF("Delivery %zu: object %" PRIu64 "/%" PRIu64 ", flags 0x%x", i,
+                test_ctx.delivered[i].group_id, test_ctx.delivered[i].object_id, test_ctx.delivered[i].flags);
+            ret = -1;
+        }
+    }
+    quicrq_reassembly_release(&reassembly_ctx);
+
+    return ret;
+}
+
+int quicrq_object_ttl_test()
+{
+    int ret = quicrq_object_ttl_sender_test();
+
+    if (ret == 0) {
+        ret = quicrq_object_ttl_relay_test();
+    }
+    if (ret == 0) {
+        ret = quicrq_object_ttl_reassembly_test();
+    }
+
+    return ret;
+}
+
+/* Test of receiver driven repair.
+ * A relay cache misses some fragments of the media received as datagrams from an
+ * origin. The relay checks its cache, and queues repair requests on its upstream
+ * stream. The request is sent, and received on the sender stream of the origin. The
+ * origin repeats the fragments that it holds, and asks its own upstream for the
+ * fragment that it did not receive either. Missing data that may still be in flight,
+ * or that the upstream does not send as datagrams, is not requested.
+ */
+#define REPAIR_REQUEST_NB_OBJECTS 8
+#define REPAIR_REQUEST_OBJECT_SIZE 3000
+#define REPAIR_REQUEST_FRAGMENT_SIZE 1000
+
+typedef struct st_repair_request_test_loss_t {
+    uint64_t object_id;
+    uint64_t offset;
+} repair_request_test_loss_t;
+
+static int repair_request_test_is_lost(const repair_request_test_loss_t* losses, size_t nb_losses,
+    uint64_t group_id, uint64_t object_id, uint64_t offset)
+{
+    int is_lost = 0;
+
+    for (size_t i = 0; !is_lost && i < nb_losses; i++) {
+        is_lost = (group_id == 0 && losses[i].object_id == object_id && losses[i].offset == offset);
+    }
+    return is_lost;
+}
+
+/* Fill the cache with the objects of group 0 and the first object of group 1, except for the lost fragments */
+static int repair_request_test_fill(quicrq_fragment_cache_t* cache_ctx, const repair_request_test_loss_t* losses, size_t nb_losses,
+    uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t data[REPAIR_REQUEST_FRAGMENT_SIZE];
+
+    for (uint64_t rank = 0; ret == 0 && rank <= REPAIR_REQUEST_NB_OBJECTS; rank++) {
+        uint64_t group_id = rank / REPAIR_REQUEST_NB_OBJECTS;
+        uint64_t object_id = rank % REPAIR_REQUEST_NB_OBJECTS;
+        for (uint64_t offset = 0; ret == 0 && offset < REPAIR_REQUEST_OBJECT_SIZE; offset += REPAIR_REQUEST_FRAGMENT_SIZE) {
+            if (!repair_request_test_is_lost(losses, nb_losses, group_id, object_id, offset)) {
+                memset(data, (int)(rank + offset), sizeof(data));
+                ret = quicrq_fragment_propose_to_cache(cache_ctx, data, group_id, object_id, offset, 0, 0x80,
+                    (group_id > 0 && object_id == 0) ? REPAIR_REQUEST_NB_OBJECTS : 0, REPAIR_REQUEST_OBJECT_SIZE,
+                    sizeof(data), current_time);
+            }
+        }
+    }
+    return ret;
+}
+
+int quicrq_repair_request_test()
+{
+    int ret = 0;
+    struct sockaddr_storage addr = { 0 };
+    uint8_t packet[1200];
+    const repair_request_test_loss_t origin_losses[] = { { 5, 1000 } };
+    const repair_request_test_loss_t relay_losses[] = { { 2, 0 }, { 2, 1000 }, { 2, 2000 }, { 4, 2000 }, { 5, 1000 } };
+    const quicrq_repair_range_t expected_ranges[] = { { 0, 2, 0, 0 }, { 0, 4, 2000, 0 }, { 0, 5, 1000, 1000 } };
+    const size_t nb_expected_ranges = sizeof(expected_ranges) / sizeof(quicrq_repair_range_t);
+    quicrq_test_publisher_t origin;
+    quicrq_media_source_ctx_t relay_srce_ctx;
+    quicrq_fragment_cache_t* origin_cache = NULL;
+    quicrq_stream_ctx_t* sender_stream = NULL;
+    quicrq_stream_ctx_t* origin_upstream = NULL;
+    quicrq_cnx_ctx_t* relay_cnx = NULL;
+    quicrq_fragment_cache_t* relay_cache = NULL;
+    quicrq_stream_ctx_t* relay_upstream = NULL;
+
+    memset(&relay_srce_ctx, 0, sizeof(relay_srce_ctx));
+    if (quicrq_test_publisher_init(&origin, 1, quicrq_transport_mode_datagram) != 0 ||
+        (origin_upstream = quicrq_create_stream_context(origin.cnx_ctx, 4)) == NULL ||
+        (relay_cnx = quicrq_create_client_cnx(origin.qr_ctx, NULL, (struct sockaddr*)&addr)) == NULL ||
+        (relay_upstream = quicrq_create_stream_context(relay_cnx, 0)) == NULL ||
+        (relay_cache = quicrq_fragment_cache_create_ctx(origin.qr_ctx)) == NULL) {
+        ret = -1;
+    }
+    else {
+        origin_cache = origin.cache_ctx[0];
+        sender_stream = origin.stream_ctx[0];
+        relay_cache->srce_ctx = &relay_srce_ctx;
+        relay_srce_ctx.cache_ctx = relay_cache;
+        sender_stream->receive_state = quicrq_receive_repair;
+        origin_upstream->transport_mode = quicrq_transport_mode_datagram;
+        relay_upstream->transport_mode = quicrq_transport_mode_datagram;
+        origin_cache->upstream_stream_ctx = origin_upstream;
+        relay_cache->upstream_stream_ctx = relay_upstream;
+    }
+
+    if (ret == 0) {
+        ret = repair_request_test_fill(origin_cache, origin_losses, sizeof(origin_losses) / sizeof(repair_request_test_loss_t),
+            origin.simulated_time);
+    }
+    if (ret == 0) {
+        ret = repair_request_test_fill(relay_cache, relay_losses, sizeof(relay_losses) / sizeof(repair_request_test_loss_t),
+            origin.simulated_time);
+    }
+
+    /* The first check only records the horizon. The gaps below it are requested at the next check. */
+    if (ret == 0) {
+        ret = quicrq_fragment_cache_check_repair(origin_cache, origin.simulated_time);
+    }
+    if (ret == 0) {
+        ret = quicrq_fragment_cache_check_repair(relay_cache, origin.simulated_time);
+        if (ret == 0 && relay_upstream->nb_repair_ranges != 0) {
+            DBG_PRINTF("Expected no repair request at first check, got %zu", relay_upstream->nb_repair_ranges);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        origin.simulated_time = relay_cache->repair_check_time;
+        ret = quicrq_fragment_cache_check_repair(relay_cache, origin.simulated_time);
+        if (ret == 0 && relay_upstream->nb_repair_ranges != nb_expected_ranges) {
+            DBG_PRINTF("Expected %zu repair ranges, got %zu", nb_expected_ranges, relay_upstream->nb_repair_ranges);
+            ret = -1;
+        }
+        for (size_t i = 0; ret == 0 && i < nb_expected_ranges; i++) {
+            if (memcmp(&relay_upstream->repair_ranges[i], &expected_ranges[i], sizeof(quicrq_repair_range_t)) != 0) {
+                DBG_PRINTF("Unexpected repair range %zu: %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64, i,
+                    relay_upstream->repair_ranges[i].group_id, relay_upstream->repair_ranges[i].object_id,
+                    relay_upstream->repair_ranges[i].offset, relay_upstream->repair_ranges[i].length);
+                ret = -1;
+            }
+        }
+    }
+
+    /* Send the request on the relay stream, and receive it on the origin sender stream */
+    if (ret == 0) {
+        quicrq_test_stream_buffer_argument_t s_context;
+
+        quicrq_test_stream_buffer_init(&s_context, packet, sizeof(packet));
+        ret = quicrq_prepare_to_send_on_stream(relay_upstream, &s_context, s_context.allowed_space, origin.simulated_time);
+        if (ret != 0 || s_context.app_buffer == NULL || s_context.length == 0 ||
+            relay_upstream->nb_repair_ranges != 0 || relay_upstream->send_state != quicrq_sending_ready) {
+            DBG_PRINTF("%s", "Repair request not sent");
+            ret = -1;
+        }
+        else {
+            ret = quicrq_receive_stream_data(sender_stream, s_context.app_buffer, s_context.length, 0);
+        }
+    }
+
+    /* Check that the origin repeated 4 fragments, and forwarded the missing one upstream */
+    if (ret == 0 && sender_stream->nb_repair_fragments_sent != 4) {
+        DBG_PRINTF("Expected 4 fragments repaired, got %" PRIu64, sender_stream->nb_repair_fragments_sent);
+        ret = -1;
+    }
+    if (ret == 0 && (origin_upstream->nb_repair_ranges != 1 ||
+        memcmp(&origin_upstream->repair_ranges[0], &expected_ranges[2], sizeof(quicrq_repair_range_t)) != 0)) {
+        DBG_PRINTF("Expected 1 range forwarded upstream, got %zu", origin_upstream->nb_repair_ranges);
+        ret = -1;
+    }
+
+    /* Data above the horizon may still be in flight, and is not requested upstream */
+    if (ret == 0) {
+        quicrq_repair_range_t in_flight = { 1, 1, 0, 0 };
+        origin_upstream->nb_repair_ranges = 0;
+        ret = quicrq_fragment_cache_serve_repair(sender_stream, &in_flight, origin.simulated_time);
+        if (ret == 0 && origin_upstream->nb_repair_ranges != 0) {
+            DBG_PRINTF("%s", "Repair of data in flight forwarded upstream");
+            ret = -1;
+        }
+    }
+    /* Repair is only requested from an upstream that sends datagrams */
+    if (ret == 0) {
+        origin_upstream->transport_mode = quicrq_transport_mode_single_stream;
+        ret = quicrq_fragment_cache_serve_repair(sender_stream, &expected_ranges[2], origin.simulated_time);
+        if (ret == 0 && origin_upstream->nb_repair_ranges != 0) {
+            DBG_PRINTF("%s", "Repair forwarded to a stream upstream");
+            ret = -1;
+        }
+    }
+
+    if (relay_cnx != NULL) {
+        quicrq_delete_cnx_context(relay_cnx, quicrq_media_close_delete_context, 0);
+    }
+    if (relay_cache != NULL) {
+        quicrq_fragment_cache_delete_ctx(relay_cache);
+    }
+    quicrq_test_publisher_release(&origin);
+
+    return ret;
+}
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "picoquic_set_textlog.h"
@@ -5,6 +6,8 @@
 #include "quicrq.h"
 #include "quicrq_relay.h"
 #include "quicrq_internal.h"
+#include "quicrq_relay_internal.h"
+#include "quicrq_fragment.h"
 #include "quicrq_test_internal.h"
 
 /* Subscribe test
@@ -446,3 +449,237 @@ int quicrq_subscribe_relay3_test()
 
     return ret;
 }
+
+/* Prefix trie test.
+ * Register many subscribe patterns, with nested and duplicate prefixes,
+ * then publish sources and verify that each pattern stream was notified
+ * of exactly the URLs that match its prefix. Then remove half of the
+ * patterns, publish more sources, and verify again.
+ */
+#define SUBSCRIBE_TRIE_NB_PATTERNS 512
+#define SUBSCRIBE_TRIE_NB_SOURCES 2048
+
+static size_t quicrq_subscribe_trie_prefix(uint8_t* prefix, size_t prefix_max, size_t pattern_id)
+{
+    /* Patterns 2*k and 2*k+1 share the same prefix */
+    return (size_t)snprintf((char*)prefix, prefix_max, "media/%zu", pattern_id / 2);
+}
+
+static size_t quicrq_subscribe_trie_url(uint8_t* url, size_t url_max, size_t source_id)
+{
+    return (size_t)snprintf((char*)url, url_max, "media/%zu/video", source_id);
+}
+
+static int quicrq_subscribe_trie_check(quicrq_stream_ctx_t* stream_ctx, size_t nb_sources, int step)
+{
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < SUBSCRIBE_TRIE_NB_PATTERNS; i++) {
+        size_t expected = 0;
+        size_t notified = 0;
+        quicrq_notify_url_t* notify_url = stream_ctx[i].first_notify_url;
+
+        if (stream_ctx[i].subscribe_prefix == NULL) {
+            continue;
+        }
+        for (size_t j = 0; j < nb_sources; j++) {
+            uint8_t url[64];
+            size_t url_length = quicrq_subscribe_trie_url(url, sizeof(url), j);
+            if (url_length >= stream_ctx[i].subscribe_prefix_length &&
+                memcmp(url, stream_ctx[i].subscribe_prefix, stream_ctx[i].subscribe_prefix_length) == 0) {
+                expected++;
+            }
+        }
+        while (notify_url != NULL) {
+            if (notify_url->url_len < stream_ctx[i].subscribe_prefix_length ||
+                memcmp(notify_url->url, stream_ctx[i].subscribe_prefix, stream_ctx[i].subscribe_prefix_length) != 0) {
+                DBG_PRINTF("Step %d, pattern %zu notified of a non matching URL", step, i);
+                ret = -1;
+            }
+            notified++;
+            notify_url = notify_url->next_notify_url;
+        }
+        if (ret == 0 && notified != expected) {
+            DBG_PRINTF("Step %d, pattern %zu notified %zu URLs, expected %zu", step, i, notified, expected);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void quicrq_subscribe_trie_release(quicrq_stream_ctx_t* stream_ctx)
+{
+    quicrq_prefix_trie_remove_stream(stream_ctx);
+    while (stream_ctx->first_notify_url != NULL) {
+        quicrq_notify_url_t* next = stream_ctx->first_notify_url->next_notify_url;
+        free(stream_ctx->first_notify_url);
+        stream_ctx->first_notify_url = next;
+    }
+    if (stream_ctx->subscribe_prefix != NULL) {
+        free(stream_ctx->subscribe_prefix);
+        stream_ctx->subscribe_prefix = NULL;
+    }
+}
+
+static int quicrq_subscribe_trie_publish(quicrq_ctx_t* qr_ctx, size_t first_source, size_t nb_sources)
+{
+    int ret = 0;
+    uint64_t start_time = picoquic_current_time();
+
+    for (size_t j = first_source; ret == 0 && j < first_source + nb_sources; j++) {
+        uint8_t url[64];
+        size_t url_length = quicrq_subscribe_trie_url(url, sizeof(url), j);
+        quicrq_fragment_cache_t* cache_ctx = quicrq_fragment_cache_create_ctx(qr_ctx);
+        if (cache_ctx == NULL) {
+            ret = -1;
+        }
+        else if ((ret = quicrq_publish_fragment_cached_media(qr_ctx, cache_ctx, url, url_length, 0, 1)) != 0) {
+            quicrq_fragment_cache_delete_ctx(cache_ctx);
+        }
+    }
+    DBG_PRINTF("Published %zu sources to %d patterns in %" PRIu64 " us", nb_sources, SUBSCRIBE_TRIE_NB_PATTERNS,
+        picoquic_current_time() - start_time);
+    return ret;
+}
+
+int quicrq_subscribe_prefix_trie_test()
+{
+    int ret = 0;
+    quicrq_ctx_t* qr_ctx = quicrq_create_empty();
+    quicrq_cnx_ctx_t* cnx_ctx = (quicrq_cnx_ctx_t*)malloc(sizeof(quicrq_cnx_ctx_t));
+    quicrq_stream_ctx_t* stream_ctx = (quicrq_stream_ctx_t*)malloc(SUBSCRIBE_TRIE_NB_PATTERNS * sizeof(quicrq_stream_ctx_t));
+
+    if (qr_ctx == NULL || cnx_ctx == NULL || stream_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(cnx_ctx, 0, sizeof(quicrq_cnx_ctx_t));
+        memset(stream_ctx, 0, SUBSCRIBE_TRIE_NB_PATTERNS * sizeof(quicrq_stream_ctx_t));
+        cnx_ctx->qr_ctx = qr_ctx;
+        cnx_ctx->is_server = 1;
+    }
+
+    /* Register the patterns, in a scrambled order */
+    for (size_t j = 0; ret == 0 && j < SUBSCRIBE_TRIE_NB_PATTERNS; j++) {
+        size_t i = (j * 97) % SUBSCRIBE_TRIE_NB_PATTERNS;
+        uint8_t prefix[64];
+        size_t prefix_length = quicrq_subscribe_trie_prefix(prefix, sizeof(prefix), i);
+
+        stream_ctx[i].cnx_ctx = cnx_ctx;
+        ret = quicrq_process_incoming_subscribe(&stream_ctx[i], prefix_length, prefix);
+    }
+
+    if (ret == 0) {
+        ret = quicrq_subscribe_trie_publish(qr_ctx, 0, SUBSCRIBE_TRIE_NB_SOURCES / 2);
+    }
+    if (ret == 0) {
+        ret = quicrq_subscribe_trie_check(stream_ctx, SUBSCRIBE_TRIE_NB_SOURCES / 2, 1);
+    }
+
+    if (ret == 0) {
+        /* Remove one of each pair of duplicate patterns, and all patterns of the form "media/1..." */
+        for (size_t i = 0; i < SUBSCRIBE_TRIE_NB_PATTERNS; i++) {
+            uint8_t prefix[64];
+            (void)quicrq_subscribe_trie_prefix(prefix, sizeof(prefix), i);
+            if ((i % 2) == 0 || prefix[6] == '1') {
+                quicrq_subscribe_trie_release(&stream_ctx[i]);
+            }
+        }
+        if (quicrq_prefix_trie_find(qr_ctx, (const uint8_t*)"media/1", 7) != NULL) {
+            DBG_PRINTF("%s", "Prefix node media/1 not deleted");
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = quicrq_subscribe_trie_publish(qr_ctx, SUBSCRIBE_TRIE_NB_SOURCES / 2, SUBSCRIBE_TRIE_NB_SOURCES / 2);
+    }
+    if (ret == 0) {
+        ret = quicrq_subscribe_trie_check(stream_ctx, SUBSCRIBE_TRIE_NB_SOURCES, 2);
+    }
+
+    if (stream_ctx != NULL) {
+        for (size_t i = 0; i < SUBSCRIBE_TRIE_NB_PATTERNS; i++) {
+            quicrq_subscribe_trie_release(&stream_ctx[i]);
+        }
+        free(stream_ctx);
+    }
+    if (ret == 0 && qr_ctx->prefix_root.first_child != NULL) {
+        DBG_PRINTF("%s", "Prefix trie not empty after all patterns removed");
+        ret = -1;
+    }
+    if (cnx_ctx != NULL) {
+        free(cnx_ctx);
+    }
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
+
+/* Relay unsubscribe test.
+ * Two client streams of a relay subscribe to the same pattern, and the relay
+ * subscribes to that pattern at the origin. Verify that the subscription
+ * to the origin is only closed when the last client stream is deleted.
+ */
+int quicrq_subscribe_relay_unsubscribe_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage addr = { 0 };
+    const uint8_t* pattern = (const uint8_t*)QUICRQ_TEST_BASIC_SOURCE;
+    size_t pattern_length = strlen(QUICRQ_TEST_BASIC_SOURCE);
+    quicrq_stream_ctx_t* client_stream[2] = { NULL, NULL };
+    quicrq_stream_ctx_t* origin_stream = NULL;
+    quicrq_ctx_t* qr_ctx = quicrq_create(QUICRQ_ALPN, NULL, NULL, NULL, NULL, NULL, NULL, 0, &simulated_time);
+    quicrq_cnx_ctx_t* cnx_ctx = (qr_ctx == NULL) ? NULL : quicrq_create_client_cnx(qr_ctx, NULL, (struct sockaddr*)&addr);
+
+    if (cnx_ctx == NULL || quicrq_enable_relay(qr_ctx, NULL, (struct sockaddr*)&addr, quicrq_transport_mode_single_stream) != 0) {
+        ret = -1;
+    }
+    else {
+        /* The connection is accepted by the relay */
+        cnx_ctx->is_server = 1;
+    }
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        /* Process the subscribe pattern request, as done when it is received */
+        if ((client_stream[i] = quicrq_create_stream_context(cnx_ctx, 4 * (uint64_t)i)) == NULL ||
+            quicrq_process_incoming_subscribe(client_stream[i], pattern_length, pattern) != 0) {
+            ret = -1;
+        }
+        else {
+            qr_ctx->manage_relay_subscribe_fn(qr_ctx, quicrq_subscribe_action_subscribe, pattern, pattern_length);
+        }
+    }
+    if (ret == 0) {
+        /* A single subscription to the origin, with the request already sent */
+        if (qr_ctx->relay_ctx->cnx_ctx == NULL || (origin_stream = qr_ctx->relay_ctx->cnx_ctx->first_stream) == NULL ||
+            origin_stream != qr_ctx->relay_ctx->cnx_ctx->last_stream) {
+            DBG_PRINTF("%s", "Expected a single subscription to the origin");
+            ret = -1;
+        }
+        else {
+            origin_stream->send_state = quicrq_waiting_notify;
+        }
+    }
+    if (ret == 0) {
+        quicrq_delete_stream_ctx(cnx_ctx, client_stream[0]);
+        if (origin_stream->send_state != quicrq_waiting_notify) {
+            DBG_PRINTF("%s", "Subscription to the origin closed while a client is subscribed");
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        quicrq_delete_stream_ctx(cnx_ctx, client_stream[1]);
+        if (origin_stream->send_state != quicrq_sending_fin) {
+            DBG_PRINTF("Subscription to the origin not closed, state %d", origin_stream->send_state);
+            ret = -1;
+        }
+    }
+
+    if (qr_ctx != NULL) {
+        quicrq_delete(qr_ctx);
+    }
+
+    return ret;
+}
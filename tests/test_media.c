@@ -862,10 +862,25 @@ int test_media_object_consumer_cb(
             ret = quicrq_consumer_finished;
         }
         break;
+    case quicrq_media_group_truncated:
+        ret = quicrq_reassembly_learn_group_truncated(&cons_ctx->reassembly_ctx, group_id, object_id, nb_objects_previous_group,
+            current_time, test_media_consumer_object_ready, cons_ctx);
+        if (ret == 0 && cons_ctx->reassembly_ctx.is_finished) {
+            ret = quicrq_consumer_finished;
+        }
+        break;
+    case quicrq_media_object_expired:
+        ret = quicrq_reassembly_learn_object_expired(&cons_ctx->reassembly_ctx, group_id, object_id, nb_objects_previous_group,
+            current_time, test_media_consumer_object_ready, cons_ctx);
+        if (ret == 0 && cons_ctx->reassembly_ctx.is_finished) {
+            ret = quicrq_consumer_finished;
+        }
+        break;
     case quicrq_media_close:
         ret = test_media_consumer_close(media_ctx);
         break;
     case quicrq_media_real_time_cache:
+    case quicrq_media_latency_budget:
         /* Ignore that for now */
         break;
     default:
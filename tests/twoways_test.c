@@ -189,7 +189,7 @@ int quicrq_twoways_test_one(int is_real_time, quicrq_transport_mode_enum transpo
                             for (int source_id = 0; ret == 0 && source_id < 2; source_id++) {
                                 /* Create a subscription to the test source on client*/
                                 test_object_stream_ctx_t* object_stream_ctx = NULL;
-                                quicrq_subscribe_intent_t intent = { quicrq_subscribe_intent_current_group, 0, 0 };
+                                quicrq_subscribe_intent_t intent = { quicrq_subscribe_intent_current_group, 0, 0, 0 };
                                 object_stream_ctx = test_object_stream_subscribe_ex(cnx_ctx[i], (const uint8_t*)target[source_id]->url,
                                     target[source_id]->url_length, transport_mode, quicrq_subscribe_in_order,
                                     &intent, target[source_id]->target_bin, target[source_id]->target_csv);
@@ -203,7 +203,7 @@ int quicrq_twoways_test_one(int is_real_time, quicrq_transport_mode_enum transpo
                             for (int source_id = 0; ret == 0 && source_id < 2; source_id++) {
                                 /* Create a source on the publisher */
                                 int publish_node = 2;
-                                quicrq_media_object_source_properties_t properties = { 1, 0, 0 };
+                                quicrq_media_object_source_properties_t properties = { 1, 0, 0, 0 };
                                 config->object_sources[source_id] = test_media_object_source_publish_ex(config->nodes[publish_node], (uint8_t*)url[source_id],
                                     strlen(url[source_id]), media_source_path, NULL, is_real_time, config->simulated_time, &properties);
                                 if (config->object_sources[source_id] == NULL) {
@@ -336,6 +336,38 @@ int quicrq_twoways_datagram_loss_test()
     return ret;
 }
 
+/* Same as the twoways tests, for warp mode. With losses, the group streams
+ * that lose their tail exercise the truncation of groups.
+ */
+int quicrq_twoways_warp_test()
+{
+    int ret = quicrq_twoways_test_one(1, quicrq_transport_mode_warp, 0, 0);
+
+    return ret;
+}
+
+int quicrq_twoways_warp_loss_test()
+{
+    int ret = quicrq_twoways_test_one(1, quicrq_transport_mode_warp, 0x7080, 0);
+
+    return ret;
+}
+
+/* Same as the twoways tests, for rush mode */
+int quicrq_twoways_rush_test()
+{
+    int ret = quicrq_twoways_test_one(1, quicrq_transport_mode_rush, 0, 0);
+
+    return ret;
+}
+
+int quicrq_twoways_rush_loss_test()
+{
+    int ret = quicrq_twoways_test_one(1, quicrq_transport_mode_rush, 0x7080, 0);
+
+    return ret;
+}
+
 int quicrq_twomedia_tri_stream_test()
 {
     int ret = quicrq_twoways_test_one(1, quicrq_transport_mode_single_stream, 0, 1);